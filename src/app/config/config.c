@@ -68,6 +68,7 @@
 #include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
+#include "core/mainloop/relayworker.h"
 #include "core/or/channel.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
@@ -109,6 +110,7 @@
 #include "feature/stats/predict_ports.h"
 #include "feature/stats/rephist.h"
 #include "lib/compress/compress.h"
+#include "lib/container/buffers.h"
 #include "lib/crypt_ops/crypto_init.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
@@ -377,6 +379,7 @@ static config_var_t option_vars_[] = {
   VAR("DirReqStatistics",        BOOL,     DirReqStatistics_option, "1"),
   VAR("DirAuthority",            LINELIST, DirAuthorities, NULL),
   V(DirCache,                    BOOL,     "1"),
+  V(DirCacheZeroCopy,            BOOL,     "1"),
   /* A DirAuthorityFallbackRate of 0.1 means that 0.5% of clients try an
    * authority when all fallbacks are up, and 2% try an authority when 25% of
    * fallbacks are down. (We rebuild the list when 25% of fallbacks are down).
@@ -403,11 +406,15 @@ static config_var_t option_vars_[] = {
   V(DoSConnectionEnabled,        AUTOBOOL, "auto"),
   V(DoSConnectionMaxConcurrentCount,       UINT, "0"),
   V(DoSConnectionDefenseType,    INT,      "0"),
+  /* DoS per-address accounting options. */
+  V(DoSSketchEnabled,            AUTOBOOL, "auto"),
   /* DoS single hop client options. */
   V(DoSRefuseSingleHopClientRendezvous,    AUTOBOOL, "auto"),
   V(DownloadExtraInfo,           BOOL,     "0"),
   V(TestingEnableConnBwEvent,    BOOL,     "0"),
   V(TestingEnableCellStatsEvent, BOOL,     "0"),
+  V(TestingORConnBWBurst,        MEMUNIT,  "0"),
+  V(TestingORConnBWRate,         MEMUNIT,  "0"),
   OBSOLETE("TestingEnableTbEmptyEvent"),
   V(EnforceDistinctSubnets,      BOOL,     "1"),
   V(EntryNodes,                  ROUTERSET,   NULL),
@@ -463,6 +470,7 @@ static config_var_t option_vars_[] = {
   V(GuardLifetime,               INTERVAL, "0 minutes"),
   V(HardwareAccel,               BOOL,     "0"),
   V(HeartbeatPeriod,             INTERVAL, "6 hours"),
+  V(HugePageBuffers,             BOOL,     "0"),
   V(MainloopStats,               BOOL,     "0"),
   V(AccelName,                   STRING,   NULL),
   V(AccelDir,                    FILENAME, NULL),
@@ -506,6 +514,7 @@ static config_var_t option_vars_[] = {
   VAR("HSLayer3Nodes",           ROUTERSET,  HSLayer3Nodes,  NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
   V(KeepBindCapabilities,            AUTOBOOL, "auto"),
+  V(KernelTLS,                   BOOL,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
@@ -561,6 +570,7 @@ static config_var_t option_vars_[] = {
   V(PathBiasExtremeUseRate,         DOUBLE,   "-1"),
   V(PathBiasScaleUseThreshold,      INT,      "-1"),
 
+  V(ParallelConsensusParsing,    BOOL,     "0"),
   V(PathsNeededToBuildCircuits,  DOUBLE,   "-1"),
   V(PerConnBWBurst,              MEMUNIT,  "0"),
   V(PerConnBWRate,               MEMUNIT,  "0"),
@@ -595,6 +605,7 @@ static config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoThreads,          UINT,     "0"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V(RunAsDaemon,                 BOOL,     "0"),
@@ -616,6 +627,8 @@ static config_var_t option_vars_[] = {
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
+  V(KISTSockDiag,                BOOL,     "0"),
+  V(KISTSockInfoMaxAge,          MSEC_INTERVAL, "0 msec"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
@@ -643,6 +656,7 @@ static config_var_t option_vars_[] = {
   VAR("UseEntryGuards",          BOOL,     UseEntryGuards_option, "1"),
   OBSOLETE("UseEntryGuardsAsDirGuards"),
   V(UseGuardFraction,            AUTOBOOL, "auto"),
+  V(UseIOUring,                  BOOL,     "0"),
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
   OBSOLETE("UseNTorHandshake"),
   V(User,                        STRING,   NULL),
@@ -1929,6 +1943,11 @@ options_act(const or_options_t *old_options)
     set_protocol_warning_severity_level(warning_severity);
   }
 
+  if (buf_set_chunk_arenas(options->HugePageBuffers) < 0) {
+    log_warn(LD_CONFIG, "HugePageBuffers is not supported on this platform; "
+             "ignoring.");
+  }
+
   if (consider_adding_dir_servers(options, old_options) < 0) {
     // XXXX This should get validated earlier, and committed here, to
     // XXXX lower opportunities for reaching an error case.
@@ -2064,6 +2083,15 @@ options_act(const or_options_t *old_options)
   /* See whether we need to enable/disable our once-a-second timer. */
   reschedule_per_second_timer();
 
+  /* Connection housekeeping deadlines and padding decisions depend on
+   * these. */
+  if (old_options &&
+      (old_options->KeepalivePeriod != options->KeepalivePeriod ||
+       old_options->TestingDirConnectionMaxStall !=
+         options->TestingDirConnectionMaxStall ||
+       old_options->ConnectionPadding != options->ConnectionPadding))
+    connection_reschedule_all_housekeeping();
+
   /* We want to reinit keys as needed before we do much of anything else:
      keys are important, and other things can depend on them. */
   if (transition_affects_workers ||
@@ -2295,8 +2323,14 @@ options_act(const or_options_t *old_options)
         return -1;
     }
 
+    if (options->ParallelConsensusParsing &&
+        !old_options->ParallelConsensusParsing)
+      cpu_init();
+
     if (options->PerConnBWRate != old_options->PerConnBWRate ||
-        options->PerConnBWBurst != old_options->PerConnBWBurst)
+        options->PerConnBWBurst != old_options->PerConnBWBurst ||
+        options->TestingORConnBWRate != old_options->TestingORConnBWRate ||
+        options->TestingORConnBWBurst != old_options->TestingORConnBWBurst)
       connection_or_update_token_buckets(get_connection_array(), options);
 
     if (options->BandwidthRate != old_options->BandwidthRate ||
@@ -2305,6 +2339,9 @@ options_act(const or_options_t *old_options)
         options->RelayBandwidthBurst != old_options->RelayBandwidthBurst)
       connection_bucket_adjust(options);
 
+    if (options->RelayCryptoThreads != old_options->RelayCryptoThreads)
+      relay_worker_init();
+
     if (options->MainloopStats != old_options->MainloopStats) {
       reset_main_loop_counters();
     }
@@ -3326,6 +3363,17 @@ options_validate_scheduler(or_options_t *options, char **msg)
     return -1;
   }
 
+  if (options->KISTSockInfoMaxAge < 0 ||
+      options->KISTSockInfoMaxAge > KIST_SOCK_INFO_MAX_AGE_MAX) {
+    tor_asprintf(msg, "KISTSockInfoMaxAge must be between 0 and %d (ms)",
+                 KIST_SOCK_INFO_MAX_AGE_MAX);
+    return -1;
+  }
+
+  if (options->KISTSockDiag && options->Sandbox) {
+    REJECT("KISTSockDiag is not compatible with Sandbox");
+  }
+
   return 0;
 }
 
@@ -4006,6 +4054,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (ensure_bandwidth_cap(&options->PerConnBWBurst,
                            "PerConnBWBurst", msg) < 0)
     return -1;
+  if (ensure_bandwidth_cap(&options->TestingORConnBWRate,
+                           "TestingORConnBWRate", msg) < 0)
+    return -1;
+  if (ensure_bandwidth_cap(&options->TestingORConnBWBurst,
+                           "TestingORConnBWBurst", msg) < 0)
+    return -1;
   if (ensure_bandwidth_cap(&options->AuthDirFastGuarantee,
                            "AuthDirFastGuarantee", msg) < 0)
     return -1;
@@ -4352,6 +4406,17 @@ options_validate(or_options_t *old_options, or_options_t *options,
     }
   }
 
+  if (options->KernelTLS && options->Sandbox) {
+    /* Setting up kernel TLS needs setsockopt() calls that the sandbox
+     * doesn't allow. */
+    REJECT("KernelTLS is not compatible with Sandbox");
+  }
+
+  if (options->UseIOUring && options->Sandbox) {
+    /* The sandbox doesn't allow the io_uring system calls. */
+    REJECT("UseIOUring is not compatible with Sandbox");
+  }
+
   if (options->V3AuthVoteDelay + options->V3AuthDistDelay >=
       options->V3AuthVotingInterval/2) {
     /*
@@ -4564,6 +4629,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
            "Tor networks!");
   }
 
+  if ((options->TestingORConnBWRate || options->TestingORConnBWBurst) &&
+      !options->TestingTorNetwork && !options->UsingTestNetworkDefaults_) {
+    REJECT("TestingORConnBWRate and TestingORConnBWBurst may only be changed "
+           "in testing Tor networks!");
+  }
+
   if (options->TestingTorNetwork) {
     log_warn(LD_CONFIG, "TestingTorNetwork is set. This will make your node "
                         "almost unusable in the public Tor network, and is "
@@ -4834,6 +4905,8 @@ options_transition_affects_workers(const or_options_t *old_options,
   YES_IF_CHANGED_BOOL(ClientOnly);
   YES_IF_CHANGED_BOOL(LogMessageDomains);
   YES_IF_CHANGED_LINELIST(Logs);
+  /* We need new TLS contexts. */
+  YES_IF_CHANGED_BOOL(KernelTLS);
 
   if (server_mode(old_options) != server_mode(new_options) ||
       public_server_mode(old_options) != public_server_mode(new_options) ||
@@ -390,6 +390,9 @@ struct or_options_t {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** How many threads should en/decrypt relay cells? (0 for none: do it on
+   * the main thread.) */
+  int RelayCryptoThreads;
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   struct config_line_t *HidServAuth; /**< List of configuration lines for
@@ -580,6 +583,10 @@ struct or_options_t {
                  * tunnelled dir conns from clients. If 1, enabled (default);
                  * If 0, disabled. */
 
+  /** Bool (default: 1): If true, send cached consensus documents to
+   * DirPort clients with sendfile() where we can. */
+  int DirCacheZeroCopy;
+
   char *VirtualAddrNetworkIPv4; /**< Address and mask to hand out for virtual
                                  * MAPADDRESS requests for IPv4 addresses */
   char *VirtualAddrNetworkIPv6; /**< Address and mask to hand out for virtual
@@ -834,6 +841,14 @@ struct or_options_t {
   /** Enable CELL_STATS events.  Only altered on testing networks. */
   int TestingEnableCellStatsEvent;
 
+  /** If set, rate limit every OR connection (including connections to known
+   * relays) to this many bytes per second.  Only altered on testing
+   * networks. */
+  uint64_t TestingORConnBWRate;
+  /** Allowed burst on a single OR connection if TestingORConnBWRate is
+   * set. */
+  uint64_t TestingORConnBWBurst;
+
   /** If true, and we have GeoIP data, and we're a bridge, keep a per-country
    * count of how many client addresses have contacted us so that we can help
    * the bridge authority guess which countries have blocked access to us. */
@@ -1001,6 +1016,22 @@ struct or_options_t {
   /** Autobool: Do we try to retain capabilities if we can? */
   int KeepBindCapabilities;
 
+  /** Bool (default: 0): If true, let the kernel do the TLS record crypto of
+   * our OR connections where it can. */
+  int KernelTLS;
+
+  /** Bool (default: 0): If true, do the socket I/O of our non-TLS
+   * connections through an io_uring, where the kernel supports it. */
+  int UseIOUring;
+
+  /** Bool (default: 0): If true, allocate buffer chunks from 2 MB arenas
+   * that the kernel can back with transparent huge pages. */
+  int HugePageBuffers;
+
+  /** Bool (default: 0): If true, start the cpuworkers even as a client, and
+   * parse the entries of large consensus documents on them. */
+  int ParallelConsensusParsing;
+
   /** Maximum total size of unparseable descriptors to log during the
    * lifetime of this Tor process.
    */
@@ -1045,6 +1076,15 @@ struct or_options_t {
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** If positive, the KIST scheduler may estimate the per-socket limits from
+   * kernel information that is up to this many milliseconds old, instead of
+   * asking the kernel about every socket on every run. */
+  int KISTSockInfoMaxAge;
+
+  /** Bool (default: 0). If true, the KIST scheduler asks the kernel about
+   * many sockets at once through netlink sock_diag. */
+  int KISTSockDiag;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   struct smartlist_t *Schedulers;
@@ -1085,6 +1125,10 @@ struct or_options_t {
    * used against it. See the dos_conn_defense_type_t enum. */
   int DoSConnectionDefenseType;
 
+  /** Autobool: Do the DoS mitigation subsystems count per-address statistics
+   * in fixed-size sketches instead of the geoip client cache? */
+  int DoSSketchEnabled;
+
   /** Autobool: Do we refuse single hop client rendezvous? */
   int DoSRefuseSingleHopClientRendezvous;
 
@@ -78,6 +78,14 @@ struct or_state_t {
   int TotalBuildTimes;
   int CircuitBuildAbandonedCount;
 
+  /** Build time histogram of split join circuits */
+  struct config_line_t * SplitJoinBuildtimeHistogram;
+  int TotalSplitJoinBuildTimes;
+  int SplitJoinBuildAbandonedCount;
+
+  /** Performance history of the entries of split sub-circuits */
+  struct config_line_t *SplitPathPerf;
+
   /** What version of Tor wrote this state file? */
   char *TorVersion;
 
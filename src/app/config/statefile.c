@@ -41,6 +41,7 @@
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routermode.h"
+#include "feature/split/splitperf.h"
 #include "lib/sandbox/sandbox.h"
 #include "app/config/statefile.h"
 #include "lib/encoding/confline.h"
@@ -131,6 +132,15 @@ static config_var_t state_vars_[] = {
   VAR("CircuitBuildTimeBin",          LINELIST_S, BuildtimeHistogram, NULL),
   VAR("BuildtimeHistogram",           LINELIST_V, BuildtimeHistogram, NULL),
 
+  V(TotalSplitJoinBuildTimes,         UINT,     "0"),
+  V(SplitJoinBuildAbandonedCount,     UINT,     "0"),
+  VAR("SplitJoinBuildTimeBin",        LINELIST_S,
+      SplitJoinBuildtimeHistogram, NULL),
+  VAR("SplitJoinBuildtimeHistogram",  LINELIST_V,
+      SplitJoinBuildtimeHistogram, NULL),
+
+  V(SplitPathPerf,                    LINELIST, NULL),
+
   END_OF_CONFIG_VARS
 };
 
@@ -308,6 +318,12 @@ or_state_set(or_state_t *new_state)
       get_circuit_build_times_mutable(),global_state) < 0) {
     ret = -1;
   }
+  if (circuit_build_times_parse_split_join_state(global_state) < 0) {
+    ret = -1;
+  }
+  if (split_perf_parse_state(global_state) < 0) {
+    ret = -1;
+  }
   return ret;
 }
 
@@ -499,6 +515,8 @@ or_state_save(time_t now)
   entry_guards_update_state(global_state);
   rep_hist_update_state(global_state);
   circuit_build_times_update_state(get_circuit_build_times(), global_state);
+  circuit_build_times_update_split_join_state(global_state);
+  split_perf_update_state(global_state);
   if (accounting_is_enabled(get_options()))
     accounting_run_housekeeping(now);
 
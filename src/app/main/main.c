@@ -19,6 +19,7 @@
 #include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
+#include "core/mainloop/relayworker.h"
 #include "core/or/channel.h"
 #include "core/or/channelpadding.h"
 #include "core/or/channeltls.h"
@@ -61,8 +62,10 @@
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendclient.h"
 #include "feature/rend/rendservice.h"
+#include "feature/split/cell_buffer.h"
 #include "feature/split/spliteval.h"
 #include "feature/split/demo.h"
+#include "feature/split/splitperf.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/predict_ports.h"
 #include "feature/stats/rephist.h"
@@ -317,6 +320,7 @@ dumpmemusage(int severity)
       (rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
+  buf_dump_freelist_sizes(severity);
   dump_dns_mem_usage(severity);
   tor_log_mallinfo(severity);
 }
@@ -781,6 +785,7 @@ tor_free_all(int postfork)
   rend_cache_free_all();
   rend_service_authorization_free_all();
   rep_hist_free_all();
+  split_perf_free_all();
   dns_free_all();
   clear_pending_onions();
   circuit_free_all();
@@ -803,6 +808,8 @@ tor_free_all(int postfork)
   hs_free_all();
   dos_free_all();
   circuitmux_ewma_free_all();
+  split_cell_buffer_free_all();
+  cell_pools_free_all();
   accounting_free_all();
 
   if (!postfork) {
@@ -822,6 +829,7 @@ tor_free_all(int postfork)
   /* stuff in main.c */
 
   tor_mainloop_free_all();
+  buf_shrink_freelists(1);
 
   if (!postfork) {
     release_lockfile();
@@ -1338,6 +1346,11 @@ run_tor_main_loop(void)
     log_warn(LD_DIR,
              "Couldn't load all cached v3 certificates. Starting anyway.");
   }
+  if (get_options()->ParallelConsensusParsing) {
+    /* Start the cpuworkers before we load the cached consensus, so that we
+     * can parse it on them. */
+    cpu_init();
+  }
   if (router_reload_consensus_networkstatus()) {
     return -1;
   }
@@ -1355,6 +1368,7 @@ run_tor_main_loop(void)
     /* launch cpuworkers. Need to do this *after* we've read the onion key. */
     cpu_init();
   }
+  relay_worker_init();
   consdiffmgr_enable_background_compression();
 
   /* Setup shared random protocol subsystem. */
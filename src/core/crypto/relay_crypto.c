@@ -199,7 +199,7 @@ relay_decrypt_cell(circuit_t **circ, cell_t *cell,
                       TO_ORIGIN_CIRCUIT(*circ), (*circ)->n_circ_id,
                       TO_ORIGIN_CIRCUIT(split_expected_circ),
                       split_expected_circ->n_circ_id);
-            split_buffer_cell(thishop->subcirc, cell);
+            split_buffer_cell(split_data, thishop->subcirc, cell);
             return 1;
           } /* circ was expected */
 
@@ -229,26 +229,46 @@ relay_decrypt_cell(circuit_t **circ, cell_t *cell,
              "Incoming cell at client not recognized. Closing.");
       return -1;
     } else {
-      relay_crypto_t *crypto = &TO_OR_CIRCUIT(*circ)->crypto;
       /* We're in the middle. Encrypt one layer. */
-      relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+      relay_crypt_relayed_cell(&TO_OR_CIRCUIT(*circ)->crypto, cell,
+                               cell_direction, recognized);
     }
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* We're in the middle. Decrypt one layer. */
-    relay_crypto_t *crypto = &TO_OR_CIRCUIT(*circ)->crypto;
+    relay_crypt_relayed_cell(&TO_OR_CIRCUIT(*circ)->crypto, cell,
+                             cell_direction, recognized);
+  }
+  return 0;
+}
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
+/** Do the en/decryption for <b>cell</b>, which we are relaying in direction
+ * <b>cell_direction</b> on an or_circuit with the crypto state
+ * <b>crypto</b>: encrypt one layer of inbound cells, and decrypt one layer of
+ * outbound cells and set *<b>recognized</b> to 1 if they are for us.
+ *
+ * This touches nothing but <b>crypto</b> and <b>cell</b>, so the relay crypto
+ * workers may call it outside the main thread.
+ */
+void
+relay_crypt_relayed_cell(relay_crypto_t *crypto, cell_t *cell,
+                         cell_direction_t cell_direction, char *recognized)
+{
+  relay_header_t rh;
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
+  if (cell_direction == CELL_DIRECTION_IN) {
+    relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+    return;
+  }
+
+  relay_crypt_one_payload(crypto->f_crypto, cell->payload);
+
+  relay_header_unpack(&rh, cell->payload);
+  if (rh.recognized == 0) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_digest_matches(crypto->f_digest, cell)) {
+      *recognized = 1;
     }
   }
-  return 0;
 }
 
 /**
@@ -289,9 +309,35 @@ void
 relay_encrypt_cell_inbound(cell_t *cell,
                            or_circuit_t *or_circ)
 {
-  relay_set_digest(or_circ->crypto.b_digest, cell);
+  relay_crypto_encrypt_cell_inbound(&or_circ->crypto, cell);
+}
+
+/**
+ * As relay_encrypt_cell_inbound(), but use the crypto state <b>crypto</b> of
+ * the circuit.  Like relay_crypt_relayed_cell(), this may be called outside
+ * the main thread.
+ */
+void
+relay_crypto_encrypt_cell_inbound(relay_crypto_t *crypto, cell_t *cell)
+{
+  relay_set_digest(crypto->b_digest, cell);
   /* encrypt one layer */
-  relay_crypt_one_payload(or_circ->crypto.b_crypto, cell->payload);
+  relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+}
+
+/**
+ * As relay_encrypt_cell_inbound(), for each of the <b>n_cells</b> cells in
+ * <b>cells</b>, which we are sending to the origin on <b>or_circ</b> in this
+ * order.  The cipher work is the same as one call per cell.
+ */
+void
+relay_encrypt_cells_inbound(cell_t **cells, int n_cells,
+                            or_circuit_t *or_circ)
+{
+  int i;
+
+  for (i = 0; i < n_cells; ++i)
+    relay_encrypt_cell_inbound(cells[i], or_circ);
 }
 
 /**
@@ -23,6 +23,16 @@ int relay_decrypt_cell(circuit_t **circ, cell_t *cell,
 void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
+void relay_encrypt_cells_inbound(cell_t **cells, int n_cells,
+                                 or_circuit_t *or_circ);
+void relay_crypt_relayed_cell(relay_crypto_t *crypto, cell_t *cell,
+                              cell_direction_t cell_direction,
+                              char *recognized);
+void relay_crypto_encrypt_cell_inbound(relay_crypto_t *crypto, cell_t *cell);
+
+/** Largest number of data cells that we package from a stream in one
+ * pass. */
+#define RELAY_CRYPT_MAX_BATCH 8
 
 void relay_crypto_clear(relay_crypto_t *crypto);
 
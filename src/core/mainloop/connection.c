@@ -69,6 +69,7 @@
 #define CONNECTION_PRIVATE
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/or/channel.h"
@@ -109,6 +110,7 @@
 #include "lib/net/buffers_net.h"
 #include "lib/tls/tortls.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 #include "lib/compress/compress.h"
 
 #ifdef HAVE_PWD_H
@@ -614,6 +616,9 @@ connection_free_minimal(connection_t *conn)
       break;
   }
 
+  connection_uring_detach(conn);
+  timer_free(conn->housekeeping_timer);
+
   if (conn->linked) {
     log_info(LD_GENERAL, "Freeing linked %s connection [%s] with %d "
              "bytes on inbuf, %d on outbuf.",
@@ -3230,18 +3235,30 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
                                      global_bucket_val, conn_bucket);
 }
 
+/** Return the number of bytes that <b>conn</b> still wants to write: the
+ * ones in its outbuf, and, for a directory connection, the ones that it
+ * will send straight from the directory cache. */
+static size_t
+connection_get_bytes_to_flush(connection_t *conn)
+{
+  size_t n = conn->outbuf_flushlen;
+  if (conn->type == CONN_TYPE_DIR)
+    n += connection_dirserv_sendfile_pending(TO_DIR_CONN(conn));
+  return n;
+}
+
 /** How many bytes at most can we write onto this connection? */
 ssize_t
 connection_bucket_write_limit(connection_t *conn, time_t now)
 {
   int base = RELAY_PAYLOAD_SIZE;
   int priority = conn->type != CONN_TYPE_DIR;
-  size_t conn_bucket = conn->outbuf_flushlen;
+  size_t conn_bucket = connection_get_bytes_to_flush(conn);
   size_t global_bucket_val = token_bucket_rw_get_write(&global_bucket);
 
   if (!connection_is_rate_limited(conn)) {
     /* be willing to write to local conns even if our buckets are empty */
-    return conn->outbuf_flushlen;
+    return conn_bucket;
   }
 
   if (connection_speaks_cells(conn)) {
@@ -3768,6 +3785,22 @@ connection_handle_read(connection_t *conn)
   return res;
 }
 
+/** Return true iff we read <b>conn</b> with buf_read_from_socket(), and it
+ * fills the slack of the inbuf and new chunks with a single system call, so
+ * that there's no point in reading into the slack on its own first. */
+static inline int
+connection_reads_vectored(const connection_t *conn)
+{
+#ifdef BUF_SOCKET_IO_VECTORED
+  return !conn->linked &&
+    !(connection_speaks_cells(conn) &&
+      conn->state > OR_CONN_STATE_PROXY_HANDSHAKING);
+#else
+  (void)conn;
+  return 0;
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
+}
+
 /** Pull in new bytes from conn-\>s or conn-\>linked_conn onto conn-\>inbuf,
  * either directly or via TLS. Reduce the token buckets by the number of bytes
  * read.
@@ -3794,7 +3827,8 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
 
   slack_in_buf = buf_slack(conn->inbuf);
  again:
-  if ((size_t)at_most > slack_in_buf && slack_in_buf >= 1024) {
+  if ((size_t)at_most > slack_in_buf && slack_in_buf >= 1024 &&
+      !connection_reads_vectored(conn)) {
     more_to_read = at_most - slack_in_buf;
     at_most = slack_in_buf;
   } else {
@@ -3901,11 +3935,16 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
   } else {
     /* !connection_speaks_cells, !conn->linked_conn. */
     int reached_eof = 0;
-    CONN_LOG_PROTECT(conn,
-                     result = buf_read_from_socket(conn->inbuf, conn->s,
-                                                   at_most,
-                                                   &reached_eof,
-                                                   socket_error));
+    if (conn->uring) {
+      result = connection_uring_read(conn, at_most, &reached_eof,
+                                     socket_error);
+    } else {
+      CONN_LOG_PROTECT(conn,
+                       result = buf_read_from_socket(conn->inbuf, conn->s,
+                                                     at_most,
+                                                     &reached_eof,
+                                                     socket_error));
+    }
     if (reached_eof)
       conn->inbuf_reached_eof = 1;
 
@@ -4225,9 +4264,26 @@ connection_handle_write_impl(connection_t *conn, int force)
      * or something. */
     result = (int)(initial_size-buf_datalen(conn->outbuf));
   } else {
-    CONN_LOG_PROTECT(conn,
-                     result = buf_flush_to_socket(conn->outbuf, conn->s,
-                                        max_to_write, &conn->outbuf_flushlen));
+    /* max_to_write may include bytes that we send with sendfile() below,
+     * after the outbuf. */
+    const ssize_t max_from_buf = MIN(max_to_write,
+                                     (ssize_t)conn->outbuf_flushlen);
+    if (conn->uring) {
+      result = connection_uring_flush(conn, max_from_buf,
+                                      &conn->outbuf_flushlen);
+    } else {
+      CONN_LOG_PROTECT(conn,
+                       result = buf_flush_to_socket(conn->outbuf, conn->s,
+                                        max_from_buf, &conn->outbuf_flushlen));
+    }
+    if (result >= 0 && result < max_to_write &&
+        conn->type == CONN_TYPE_DIR && buf_datalen(conn->outbuf) == 0) {
+      /* The outbuf is empty: send whatever the directory server is sending
+       * straight from its cache, if anything. */
+      ssize_t r = connection_dirserv_sendfile(TO_DIR_CONN(conn),
+                                              max_to_write - result);
+      result = (r < 0) ? -1 : result + (int)r;
+    }
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -4287,6 +4343,11 @@ connection_handle_write_impl(connection_t *conn, int force)
     }
   }
 
+  if (connection_get_bytes_to_flush(conn) > conn->outbuf_flushlen) {
+    /* We have more to send with sendfile(), even if the outbuf is empty. */
+    dont_stop_writing = 1;
+  }
+
   if (!connection_wants_to_flush(conn) &&
       !dont_stop_writing) { /* it's done flushing */
     if (connection_finished_flushing(conn) < 0) {
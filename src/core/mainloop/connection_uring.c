@@ -0,0 +1,729 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file connection_uring.c
+ * \brief Do the socket I/O of connections through an io_uring.
+ *
+ * When the UseIOUring option is set, the exit, directory, and SOCKS
+ * connections that have a socket of their own don't wait for libevent to
+ * tell them that their socket is readable or writable.  Instead:
+ *
+ * <ul><li>While a connection wants to read, we keep a receive request
+ *   posted on its socket, into a buffer of its own.  When the request
+ *   completes, we hand the buffer's chunks to the connection's inbuf
+ *   (without copying them) from connection_buf_read_from_socket(), and post
+ *   the next request once they are all gone.
+ *   <li>When a connection flushes its outbuf, we post a sendmsg() request
+ *   that points at the outbuf's chunks, and only remove the data from the
+ *   outbuf once the request completes.
+ *   <li>A connection that is still connecting waits for its socket to
+ *   become writable with a poll request.
+ * </ul>
+ *
+ * We don't tell the kernel about each request as we make it: a postloop
+ * event hands all the requests of one pass of the main loop to the kernel
+ * with a single system call.  The kernel signals an eventfd when requests
+ * complete; libevent watches that eventfd like any other, and we then call
+ * the connections' usual read and write callbacks.
+ *
+ * OR connections don't use this, since their socket I/O happens inside the
+ * TLS library.
+ **/
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
+#include "core/mainloop/mainloop.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/uring.h"
+#include "lib/net/alertsock.h"
+#include "lib/net/buffers_net.h"
+
+#include "core/or/connection_st.h"
+
+#ifdef BUF_SOCKET_IO_VECTORED
+
+#include <event2/event.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/** How many requests we can prepare before we have to submit them. */
+#define URING_N_ENTRIES 256
+/** How many bytes we ask for with each receive request. */
+#define URING_RECV_LEN 32768
+
+/** Kinds of requests, kept in the low bits of their user data.  The rest
+ * of the user data is a pointer to the connection_uring_t; requests whose
+ * results we don't care about have no pointer. */
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_POLL 3
+#define URING_OP_MASK 3
+
+/** The io_uring state of a connection.  Since the kernel may still use its
+ * buffers after the connection is gone, this lives until its last request
+ * has completed. */
+typedef struct connection_uring_t {
+  /** The connection we belong to, or NULL once it has let go of us. */
+  connection_t *conn;
+  /** The connection's socket. */
+  tor_socket_t s;
+
+  /** True iff the connection wants read events. */
+  unsigned int want_read:1;
+  /** True iff the connection wants write events. */
+  unsigned int want_write:1;
+  /** True iff we have a receive request in flight. */
+  unsigned int recv_in_flight:1;
+  /** True iff we have a sendmsg request in flight. */
+  unsigned int send_in_flight:1;
+  /** True iff we have a poll request in flight. */
+  unsigned int poll_in_flight:1;
+  /** True iff the last receive request got an EOF. */
+  unsigned int reached_eof:1;
+  /** True iff a sendmsg request completed, and connection_uring_flush()
+   * didn't look at its result yet. */
+  unsigned int send_done:1;
+  /** True iff a poll request completed, and we didn't tell the connection
+   * yet. */
+  unsigned int poll_done:1;
+  /** True iff the connection wants a write event although no request
+   * completed. */
+  unsigned int kicked:1;
+  /** True iff we are on the ready list. */
+  unsigned int on_ready_list:1;
+  /** True iff we are calling the callbacks of our connection. */
+  unsigned int dispatching:1;
+
+  /** The errno from the last receive request, or 0. */
+  int read_error;
+  /** The result of the last sendmsg request: a byte count or a negative
+   * errno value. */
+  int send_result;
+  /** Number of our requests that the kernel didn't complete yet. */
+  int n_in_flight;
+
+  /** Buffer that our receive requests put data into. */
+  buf_t *rbuf;
+  /** Chunks of the outbuf that a sendmsg request still points at, after the
+   * connection let go of us or dropped them. */
+  buf_t *held;
+  /** The message and vectors of our sendmsg request. */
+  struct msghdr msg;
+  struct iovec iov[BUF_MAX_IOVECS];
+} connection_uring_t;
+
+/** Our io_uring, or NULL if we didn't set one up yet. */
+static tor_uring_t *the_uring = NULL;
+/** True iff we tried to set up an io_uring, and failed. */
+static int uring_unavailable = 0;
+/** The eventfd that the kernel signals when requests complete. */
+static alert_sockets_t uring_eventfd;
+/** Libevent event that watches <b>uring_eventfd</b>. */
+static struct event *uring_eventfd_event = NULL;
+/** Postloop event that submits our requests and handles the ready list. */
+static mainloop_event_t *uring_submit_event = NULL;
+/** Connections whose requests completed, and that we have to tell about
+ * it. */
+static smartlist_t *uring_ready_list = NULL;
+/** connection_uring_t objects whose connection is gone, but which have
+ * requests in flight. */
+static smartlist_t *uring_detached_list = NULL;
+
+static void uring_process_events(void);
+
+/** Return the user data for a request of kind <b>op</b> for <b>u</b>. */
+static inline uint64_t
+uring_user_data(connection_uring_t *u, int op)
+{
+  return (uint64_t)(uintptr_t)u | op;
+}
+
+/** Libevent callback: some of our requests completed. */
+static void
+uring_eventfd_cb(evutil_socket_t fd, short what, void *arg)
+{
+  (void)fd;
+  (void)what;
+  (void)arg;
+  uring_eventfd.drain_fn(uring_eventfd.read_fd);
+  uring_process_events();
+}
+
+/** Postloop callback: submit the requests that we prepared during this pass
+ * of the main loop. */
+static void
+uring_submit_cb(mainloop_event_t *event, void *arg)
+{
+  (void)event;
+  (void)arg;
+  tor_uring_submit(the_uring);
+  /* Requests that the kernel could finish at once already completed. */
+  uring_process_events();
+}
+
+/** Return our io_uring, setting it up if we didn't yet.  Return NULL if
+ * io_uring is unavailable. */
+static tor_uring_t *
+get_uring(void)
+{
+  if (the_uring || uring_unavailable)
+    return the_uring;
+
+  memset(&uring_eventfd, 0, sizeof(uring_eventfd));
+  uring_eventfd.read_fd = uring_eventfd.write_fd = TOR_INVALID_SOCKET;
+  the_uring = tor_uring_new(URING_N_ENTRIES);
+  if (!the_uring)
+    goto err;
+  if (alert_sockets_create(&uring_eventfd, ASOCKS_NOPIPE2|ASOCKS_NOPIPE|
+                           ASOCKS_NOSOCKETPAIR) < 0)
+    goto err;
+  if (tor_uring_set_eventfd(the_uring, uring_eventfd.read_fd) < 0)
+    goto err;
+  uring_eventfd_event = tor_event_new(tor_libevent_get_base(),
+                                      uring_eventfd.read_fd,
+                                      EV_READ|EV_PERSIST,
+                                      uring_eventfd_cb, NULL);
+  if (!uring_eventfd_event || event_add(uring_eventfd_event, NULL) < 0)
+    goto err;
+  uring_submit_event = mainloop_event_postloop_new(uring_submit_cb, NULL);
+  uring_ready_list = smartlist_new();
+  uring_detached_list = smartlist_new();
+  log_notice(LD_NET, "Doing the socket I/O of non-TLS connections through "
+             "an io_uring.");
+  return the_uring;
+
+ err:
+  log_notice(LD_NET, "UseIOUring is set, but this system can't give us a "
+             "usable io_uring. Using ordinary socket I/O.");
+  tor_event_free(uring_eventfd_event);
+  if (SOCKET_OK(uring_eventfd.read_fd))
+    alert_sockets_close(&uring_eventfd);
+  tor_uring_free(the_uring);
+  uring_unavailable = 1;
+  return NULL;
+}
+
+/** Note that we prepared a request that the kernel has to hear about. */
+static void
+uring_note_prepared(void)
+{
+  mainloop_event_activate(uring_submit_event);
+}
+
+/** Put <b>u</b> on the list of connections that we have to tell about a
+ * completed request, if it isn't there yet. */
+static void
+uring_make_ready(connection_uring_t *u)
+{
+  if (u->on_ready_list)
+    return;
+  u->on_ready_list = 1;
+  smartlist_add(uring_ready_list, u);
+  mainloop_event_activate(uring_submit_event);
+}
+
+/** Release <b>u</b> if its connection is gone and nothing refers to it any
+ * more. */
+static void
+uring_maybe_free(connection_uring_t *u)
+{
+  if (u->conn || u->n_in_flight || u->on_ready_list || u->dispatching)
+    return;
+  if (uring_detached_list)
+    smartlist_remove(uring_detached_list, u);
+  buf_free(u->rbuf);
+  buf_free(u->held);
+  tor_free(u);
+}
+
+/** Post a receive request for <b>u</b>, if it has none and could get more
+ * data. */
+static void
+uring_submit_recv(connection_uring_t *u)
+{
+  char *space;
+  size_t len;
+
+  if (u->recv_in_flight || u->reached_eof || u->read_error)
+    return;
+  space = buf_reserve_space(u->rbuf, URING_RECV_LEN, &len);
+  if (tor_uring_prep_recv(the_uring, u->s, space, len,
+                          uring_user_data(u, URING_OP_RECV)) < 0) {
+    buf_commit_space(u->rbuf, 0);
+    u->read_error = ENOBUFS;
+    uring_make_ready(u);
+    return;
+  }
+  u->recv_in_flight = 1;
+  ++u->n_in_flight;
+  uring_note_prepared();
+}
+
+/** Post a sendmsg request for up to the first <b>sz</b> bytes of the outbuf
+ * of the connection of <b>u</b>.  Return 0 on success, -1 on failure. */
+static int
+uring_submit_send(connection_uring_t *u, size_t sz)
+{
+  size_t len;
+
+  memset(&u->msg, 0, sizeof(u->msg));
+  u->msg.msg_iov = u->iov;
+  u->msg.msg_iovlen = buf_get_iovecs(u->conn->outbuf, sz, u->iov,
+                                     BUF_MAX_IOVECS, &len);
+  if (tor_uring_prep_sendmsg(the_uring, u->s, &u->msg,
+                             uring_user_data(u, URING_OP_SEND)) < 0)
+    return -1;
+  u->send_in_flight = 1;
+  ++u->n_in_flight;
+  uring_note_prepared();
+  return 0;
+}
+
+/** Handle the completion of the request with user data <b>user_data</b>,
+ * whose result was <b>res</b>. */
+static void
+uring_handle_completion(uint64_t user_data, int res)
+{
+  connection_uring_t *u =
+    (connection_uring_t *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+  if (!u)
+    return; /* A cancellation request; we don't care how it went. */
+  --u->n_in_flight;
+  switch (user_data & URING_OP_MASK) {
+    case URING_OP_RECV:
+      u->recv_in_flight = 0;
+      buf_commit_space(u->rbuf, res > 0 ? (size_t)res : 0);
+      if (res == 0)
+        u->reached_eof = 1;
+      else if (res < 0 && res != -ECANCELED && res != -EAGAIN &&
+               res != -EINTR)
+        u->read_error = -res;
+      break;
+    case URING_OP_SEND:
+      u->send_in_flight = 0;
+      u->send_done = 1;
+      u->send_result = res;
+      if (u->held) {
+        /* What we sent is no longer on the outbuf, so there is nothing to
+         * remove from it. */
+        buf_free(u->held);
+        u->held = NULL;
+        if (res > 0)
+          u->send_result = 0;
+      }
+      break;
+    case URING_OP_POLL:
+      u->poll_in_flight = 0;
+      if (res != -ECANCELED)
+        u->poll_done = 1;
+      break;
+    default:
+      tor_assert_nonfatal_unreached();
+      break;
+  }
+  if (u->conn)
+    uring_make_ready(u);
+  else
+    uring_maybe_free(u);
+}
+
+/** Take all completed requests off our io_uring, and tell the connections
+ * that were waiting for them. */
+static void
+uring_process_events(void)
+{
+  uint64_t user_data;
+  int res;
+  smartlist_t *ready;
+
+  while (tor_uring_get_completion(the_uring, &user_data, &res))
+    uring_handle_completion(user_data, res);
+
+  /* The callbacks can put connections back on the ready list; handle those
+   * on the next pass of the main loop. */
+  ready = uring_ready_list;
+  uring_ready_list = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(ready, connection_uring_t *, u) {
+    u->on_ready_list = 0;
+    /* The callbacks can free the connection, which lets go of us. */
+    u->dispatching = 1;
+    if (u->conn && u->want_read) {
+      if (buf_datalen(u->rbuf) || u->reached_eof || u->read_error)
+        connection_handle_read_event(u->conn);
+      else
+        uring_submit_recv(u);
+    }
+    /* Also tell connections that are flushing before they close, since
+     * that's how they get closed. */
+    if (u->conn && (u->want_write || u->conn->marked_for_close) &&
+        (u->send_done || u->poll_done || u->kicked)) {
+      u->poll_done = u->kicked = 0;
+      connection_handle_write_event(u->conn);
+    }
+    u->dispatching = 0;
+    uring_maybe_free(u);
+  } SMARTLIST_FOREACH_END(u);
+  smartlist_free(ready);
+}
+
+/** Return true iff we should do the socket I/O of <b>conn</b>, which we are
+ * about to add to the connection array, through our io_uring. */
+int
+connection_uring_should_manage(const connection_t *conn)
+{
+  if (!get_options()->UseIOUring)
+    return 0;
+  if (conn->linked || !SOCKET_OK(conn->s))
+    return 0;
+  if (conn->type != CONN_TYPE_EXIT && conn->type != CONN_TYPE_AP &&
+      conn->type != CONN_TYPE_DIR)
+    return 0;
+  return get_uring() != NULL;
+}
+
+/** Start doing the socket I/O of <b>conn</b> through our io_uring. */
+void
+connection_uring_attach(connection_t *conn)
+{
+  connection_uring_t *u;
+
+  tor_assert(!conn->uring);
+  u = tor_malloc_zero(sizeof(connection_uring_t));
+  u->conn = conn;
+  u->s = conn->s;
+  u->rbuf = buf_new();
+  conn->uring = u;
+}
+
+/** Stop doing the socket I/O of <b>conn</b> through our io_uring, and
+ * cancel its requests.  This must happen before the socket is closed. */
+void
+connection_uring_detach(connection_t *conn)
+{
+  connection_uring_t *u = conn->uring;
+
+  if (!u)
+    return;
+  conn->uring = NULL;
+  u->conn = NULL;
+  u->want_read = u->want_write = 0;
+
+  if (u->send_in_flight) {
+    /* The kernel may still read these chunks. */
+    if (!u->held)
+      u->held = buf_new();
+    buf_move_all(u->held, conn->outbuf);
+    conn->outbuf_flushlen = 0;
+  }
+  if (the_uring) {
+    if (u->recv_in_flight)
+      tor_uring_prep_cancel(the_uring, uring_user_data(u, URING_OP_RECV), 0);
+    if (u->send_in_flight)
+      tor_uring_prep_cancel(the_uring, uring_user_data(u, URING_OP_SEND), 0);
+    if (u->poll_in_flight)
+      tor_uring_prep_cancel(the_uring, uring_user_data(u, URING_OP_POLL), 0);
+    /* Once the socket is closed, its number can belong to a new socket, so
+     * the kernel has to see every request for it now. */
+    tor_uring_submit(the_uring);
+  } else {
+    u->n_in_flight = 0;
+  }
+  if (u->n_in_flight || u->on_ready_list || u->dispatching)
+    smartlist_add(uring_detached_list, u);
+  uring_maybe_free(u);
+}
+
+/** Start telling <b>conn</b> when it has data to read. */
+void
+connection_uring_start_reading(connection_t *conn)
+{
+  connection_uring_t *u = conn->uring;
+
+  u->want_read = 1;
+  if (buf_datalen(u->rbuf) || u->reached_eof || u->read_error)
+    uring_make_ready(u);
+  else
+    uring_submit_recv(u);
+}
+
+/** Stop telling <b>conn</b> when it has data to read.  A receive request
+ * that is in flight stays there, so the data is ready when <b>conn</b>
+ * wants it again. */
+void
+connection_uring_stop_reading(connection_t *conn)
+{
+  conn->uring->want_read = 0;
+}
+
+/** Return true iff <b>conn</b> wants to hear when it has data to read. */
+int
+connection_uring_is_reading(const connection_t *conn)
+{
+  return conn->uring->want_read;
+}
+
+/** Start telling <b>conn</b> when it can write. */
+void
+connection_uring_start_writing(connection_t *conn)
+{
+  connection_uring_t *u = conn->uring;
+
+  u->want_write = 1;
+  if (connection_state_is_connecting(conn)) {
+    /* "Writable" means "connected". */
+    if (!u->poll_in_flight) {
+      if (tor_uring_prep_poll(the_uring, u->s, POLLOUT,
+                              uring_user_data(u, URING_OP_POLL)) < 0) {
+        u->kicked = 1;
+        uring_make_ready(u);
+        return;
+      }
+      u->poll_in_flight = 1;
+      ++u->n_in_flight;
+      uring_note_prepared();
+    }
+  } else if (!u->send_in_flight) {
+    /* We hear about it when the request completes otherwise. */
+    u->kicked = 1;
+    uring_make_ready(u);
+  }
+}
+
+/** Stop telling <b>conn</b> when it can write. */
+void
+connection_uring_stop_writing(connection_t *conn)
+{
+  conn->uring->want_write = 0;
+}
+
+/** Return true iff <b>conn</b> wants to hear when it can write. */
+int
+connection_uring_is_writing(const connection_t *conn)
+{
+  return conn->uring->want_write;
+}
+
+/** As buf_read_from_socket(), but for a connection whose socket I/O we do
+ * through our io_uring: move up to <b>at_most</b> bytes that our receive
+ * requests got onto the inbuf of <b>conn</b>.  Return -1 on error; else
+ * return the number of bytes moved. */
+int
+connection_uring_read(connection_t *conn, size_t at_most,
+                      int *reached_eof, int *socket_error)
+{
+  connection_uring_t *u = conn->uring;
+  size_t n = buf_datalen(u->rbuf);
+
+  if (n > at_most) {
+    n = at_most;
+    buf_move_to_buf(conn->inbuf, u->rbuf, &at_most);
+  } else if (n) {
+    buf_move_all(conn->inbuf, u->rbuf);
+  }
+
+  if (buf_datalen(u->rbuf) == 0) {
+    if (u->read_error && !n) {
+      *socket_error = u->read_error;
+      return -1;
+    }
+    if (u->reached_eof)
+      *reached_eof = 1;
+    else if (u->want_read)
+      uring_submit_recv(u);
+  } else if (u->want_read) {
+    /* Come back for the rest once we may read again. */
+    uring_make_ready(u);
+  }
+  return (int)n;
+}
+
+/** As buf_flush_to_socket(), but for a connection whose socket I/O we do
+ * through our io_uring: if a sendmsg request for <b>conn</b> completed,
+ * remove the data it sent from the outbuf and deduct it from
+ * *<b>buf_flushlen</b>; then, unless one is still in flight, post a
+ * sendmsg request for up to <b>sz</b> more bytes.  Return -1 on failure,
+ * with errno set; else return the number of bytes that were sent. */
+int
+connection_uring_flush(connection_t *conn, size_t sz, size_t *buf_flushlen)
+{
+  connection_uring_t *u = conn->uring;
+  int r = 0;
+
+  tor_assert(buf_flushlen);
+  if (BUG(*buf_flushlen > buf_datalen(conn->outbuf))) {
+    *buf_flushlen = buf_datalen(conn->outbuf);
+  }
+  if (BUG(sz > *buf_flushlen)) {
+    sz = *buf_flushlen;
+  }
+
+  if (u->send_done) {
+    u->send_done = 0;
+    if (u->send_result < 0 && u->send_result != -EINTR) {
+      errno = -u->send_result;
+      return -1;
+    }
+    if (u->send_result > 0) {
+      r = u->send_result;
+      tor_assert((size_t)r <= buf_datalen(conn->outbuf));
+      buf_drain(conn->outbuf, r);
+      *buf_flushlen -= MIN((size_t)r, *buf_flushlen);
+      sz = MIN(sz, *buf_flushlen);
+    }
+  }
+
+  if (!u->send_in_flight && sz) {
+    if (uring_submit_send(u, sz) < 0) {
+      errno = ENOBUFS;
+      return -1;
+    }
+  }
+  return r;
+}
+
+/** As buf_clear() on the outbuf of <b>conn</b>, for a connection whose
+ * socket I/O we do through our io_uring.  Return the number of bytes of
+ * memory that this freed.  Chunks that a sendmsg request in flight still
+ * points at stay around until the request completes, and don't count. */
+size_t
+connection_uring_clear_outbuf(connection_t *conn)
+{
+  connection_uring_t *u = conn->uring;
+  size_t freed = 0;
+
+  if (u->send_in_flight) {
+    /* The kernel may still read these chunks. */
+    if (!u->held)
+      u->held = buf_new();
+    buf_move_all(u->held, conn->outbuf);
+  } else {
+    freed = buf_allocation(conn->outbuf);
+    buf_clear(conn->outbuf);
+    /* A completed request may have sent some of it. */
+    if (u->send_result > 0)
+      u->send_result = 0;
+  }
+  conn->outbuf_flushlen = 0;
+  return freed;
+}
+
+/** Release our io_uring, and all storage held by this module. */
+void
+connection_uring_free_all(void)
+{
+  if (uring_detached_list) {
+    SMARTLIST_FOREACH_BEGIN(uring_detached_list, connection_uring_t *, u) {
+      buf_free(u->rbuf);
+      buf_free(u->held);
+      tor_free(u);
+    } SMARTLIST_FOREACH_END(u);
+    smartlist_free(uring_detached_list);
+  }
+  smartlist_free(uring_ready_list);
+  mainloop_event_free(uring_submit_event);
+  tor_event_free(uring_eventfd_event);
+  if (the_uring)
+    alert_sockets_close(&uring_eventfd);
+  tor_uring_free(the_uring);
+  uring_unavailable = 0;
+}
+
+#else /* !defined(BUF_SOCKET_IO_VECTORED) */
+
+int
+connection_uring_should_manage(const connection_t *conn)
+{
+  (void)conn;
+  return 0;
+}
+
+void
+connection_uring_attach(connection_t *conn)
+{
+  (void)conn;
+  tor_assert_nonfatal_unreached();
+}
+
+void
+connection_uring_detach(connection_t *conn)
+{
+  (void)conn;
+}
+
+void
+connection_uring_start_reading(connection_t *conn)
+{
+  (void)conn;
+}
+
+void
+connection_uring_stop_reading(connection_t *conn)
+{
+  (void)conn;
+}
+
+int
+connection_uring_is_reading(const connection_t *conn)
+{
+  (void)conn;
+  return 0;
+}
+
+void
+connection_uring_start_writing(connection_t *conn)
+{
+  (void)conn;
+}
+
+void
+connection_uring_stop_writing(connection_t *conn)
+{
+  (void)conn;
+}
+
+int
+connection_uring_is_writing(const connection_t *conn)
+{
+  (void)conn;
+  return 0;
+}
+
+int
+connection_uring_read(connection_t *conn, size_t at_most,
+                      int *reached_eof, int *socket_error)
+{
+  (void)conn;
+  (void)at_most;
+  (void)reached_eof;
+  (void)socket_error;
+  return -1;
+}
+
+int
+connection_uring_flush(connection_t *conn, size_t sz, size_t *buf_flushlen)
+{
+  (void)conn;
+  (void)sz;
+  (void)buf_flushlen;
+  return -1;
+}
+
+size_t
+connection_uring_clear_outbuf(connection_t *conn)
+{
+  (void)conn;
+  tor_assert_nonfatal_unreached();
+  return 0;
+}
+
+void
+connection_uring_free_all(void)
+{
+}
+
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
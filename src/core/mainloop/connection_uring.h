@@ -0,0 +1,31 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file connection_uring.h
+ * \brief Header file for connection_uring.c.
+ **/
+
+#ifndef TOR_CONNECTION_URING_H
+#define TOR_CONNECTION_URING_H
+
+int connection_uring_should_manage(const connection_t *conn);
+void connection_uring_attach(connection_t *conn);
+void connection_uring_detach(connection_t *conn);
+
+void connection_uring_start_reading(connection_t *conn);
+void connection_uring_stop_reading(connection_t *conn);
+int connection_uring_is_reading(const connection_t *conn);
+void connection_uring_start_writing(connection_t *conn);
+void connection_uring_stop_writing(connection_t *conn);
+int connection_uring_is_writing(const connection_t *conn);
+
+int connection_uring_read(connection_t *conn, size_t at_most,
+                          int *reached_eof, int *socket_error);
+int connection_uring_flush(connection_t *conn, size_t sz,
+                           size_t *buf_flushlen);
+size_t connection_uring_clear_outbuf(connection_t *conn);
+
+void connection_uring_free_all(void);
+
+#endif /* !defined(TOR_CONNECTION_URING_H) */
@@ -73,6 +73,8 @@ worker_state_free_void(void *arg)
 
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
+/** How many threads does <b>threadpool</b> have? */
+static int n_cpuworker_threads = 0;
 
 static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
@@ -101,6 +103,7 @@ cpu_init(void)
                                 worker_state_new,
                                 worker_state_free_void,
                                 NULL);
+    n_cpuworker_threads = n_threads;
 
     int r = threadpool_register_reply_event(threadpool, NULL);
 
@@ -491,6 +494,14 @@ queue_pending_tasks(void)
   }
 }
 
+/** Return the number of threads in the cpuworker threadpool, or 0 if
+ * cpu_init() hasn't started it yet. */
+MOCK_IMPL(int,
+cpuworker_get_n_threads,(void))
+{
+  return threadpool ? n_cpuworker_threads : 0;
+}
+
 /** DOCDOC */
 MOCK_IMPL(workqueue_entry_t *,
 cpuworker_queue_work,(workqueue_priority_t priority,
@@ -14,6 +14,7 @@
 
 void cpu_init(void);
 void cpuworkers_rotate_keyinfo(void);
+MOCK_DECL(int, cpuworker_get_n_threads, (void));
 struct workqueue_entry_s;
 enum workqueue_reply_t;
 enum workqueue_priority_t;
@@ -53,6 +53,7 @@
 #include "app/config/statefile.h"
 #include "app/main/ntmain.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
@@ -102,6 +103,7 @@
 
 #include "lib/net/buffers_net.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 
 #include <event2/event.h>
 
@@ -192,6 +194,11 @@ static int main_loop_exit_value = 0;
  */
 static int can_complete_circuits = 0;
 
+/** True iff connection housekeeping is driven by per-connection timers.
+ * We set this once the main loop (and with it the timer wheel) is running;
+ * until then, connection_schedule_housekeeping() does nothing. */
+STATIC int connection_housekeeping_enabled = 0;
+
 /** How often do we check for router descriptors that we should download
  * when we have too little directory info? */
 #define GREEDY_DESCRIPTOR_RETRY_INTERVAL (10)
@@ -206,6 +213,8 @@ static int connection_should_read_from_linked_conn(connection_t *conn);
 static void conn_read_callback(evutil_socket_t fd, short event, void *_conn);
 static void conn_write_callback(evutil_socket_t fd, short event, void *_conn);
 static void second_elapsed_callback(periodic_timer_t *timer, void *args);
+static void connection_housekeeping_callback(tor_timer_t *timer, void *arg,
+                                             const struct monotime_t *now);
 static void shutdown_did_not_work_callback(evutil_socket_t fd, short event,
                                            void *arg) ATTR_NORETURN;
 
@@ -267,6 +276,11 @@ connection_add_impl(connection_t *conn, int is_connecting)
          conn->s, EV_WRITE|EV_PERSIST, conn_write_callback, conn);
     /* XXXX CHECK FOR NULL RETURN! */
   }
+  /* A connection whose socket I/O goes through the io_uring keeps its
+   * libevent events, but never adds them. */
+  if (connection_uring_should_manage(conn))
+    connection_uring_attach(conn);
+  connection_schedule_housekeeping(conn, 1);
 
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
@@ -279,6 +293,7 @@ connection_add_impl(connection_t *conn, int is_connecting)
 void
 connection_unregister_events(connection_t *conn)
 {
+  connection_uring_detach(conn);
   if (conn->read_event) {
     if (event_del(conn->read_event))
       log_warn(LD_BUG, "Error removing read event for %d", (int)conn->s);
@@ -514,6 +529,9 @@ connection_is_reading(connection_t *conn)
 {
   tor_assert(conn);
 
+  if (conn->uring)
+    return connection_uring_is_reading(conn);
+
   return conn->reading_from_linked_conn ||
     (conn->read_event && event_pending(conn->read_event, EV_READ, NULL));
 }
@@ -619,6 +637,11 @@ connection_stop_reading,(connection_t *conn))
     return;
   }
 
+  if (conn->uring) {
+    connection_uring_stop_reading(conn);
+    return;
+  }
+
   if (conn->linked) {
     conn->reading_from_linked_conn = 0;
     connection_stop_reading_from_linked_conn(conn);
@@ -641,6 +664,11 @@ connection_start_reading,(connection_t *conn))
     return;
   }
 
+  if (conn->uring) {
+    connection_uring_start_reading(conn);
+    return;
+  }
+
   if (conn->linked) {
     conn->reading_from_linked_conn = 1;
     if (connection_should_read_from_linked_conn(conn))
@@ -660,6 +688,9 @@ connection_is_writing(connection_t *conn)
 {
   tor_assert(conn);
 
+  if (conn->uring)
+    return connection_uring_is_writing(conn);
+
   return conn->writing_to_linked_conn ||
     (conn->write_event && event_pending(conn->write_event, EV_WRITE, NULL));
 }
@@ -674,6 +705,11 @@ connection_stop_writing,(connection_t *conn))
     return;
   }
 
+  if (conn->uring) {
+    connection_uring_stop_writing(conn);
+    return;
+  }
+
   if (conn->linked) {
     conn->writing_to_linked_conn = 0;
     if (conn->linked_conn)
@@ -697,6 +733,11 @@ connection_start_writing,(connection_t *conn))
     return;
   }
 
+  if (conn->uring) {
+    connection_uring_start_writing(conn);
+    return;
+  }
+
   if (conn->linked) {
     conn->writing_to_linked_conn = 1;
     if (conn->linked_conn &&
@@ -950,6 +991,22 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
     close_closeable_connections();
 }
 
+/** Tell <b>conn</b> that it has data to read, as if libevent had told us.
+ * Used when something other than libevent watches its socket. */
+void
+connection_handle_read_event(connection_t *conn)
+{
+  conn_read_callback(conn->s, EV_READ, conn);
+}
+
+/** Tell <b>conn</b> that it can write, as if libevent had told us.  Used
+ * when something other than libevent watches its socket. */
+void
+connection_handle_write_event(connection_t *conn)
+{
+  conn_write_callback(conn->s, EV_WRITE, conn);
+}
+
 /** If the connection at connection_array[i] is marked for close, then:
  *    - If it has data that it wants to flush, try to flush it.
  *    - If it _still_ has data to flush, and conn->hold_open_until_flushed is
@@ -1013,6 +1070,8 @@ conn_close_if_marked(int i)
                                &conn->outbuf_flushlen);
       } else
         retval = -1; /* never flush non-open broken tls connections */
+    } else if (conn->uring) {
+      retval = connection_uring_flush(conn, sz, &conn->outbuf_flushlen);
     } else {
       retval = buf_flush_to_socket(conn->outbuf, conn->s, sz,
                                    &conn->outbuf_flushlen);
@@ -1159,20 +1218,35 @@ directory_info_has_arrived(time_t now, int from_cache, int suppress_logs)
    router_do_reachability_checks(1, 1);
 }
 
+/** Return the number of seconds from <b>now</b> until <b>when</b>, for use
+ * as a housekeeping delay: never less than one second. */
+static int
+housekeeping_delay_until(time_t now, time_t when)
+{
+  if (when <= now)
+    return 1;
+  if (when - now > INT_MAX)
+    return INT_MAX;
+  return (int)(when - now);
+}
+
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run from the connection's housekeeping timer whenever one
+ * of its deadlines may have arrived.  Return the number of seconds until
+ * it needs to run again, or 0 if it never does.
  */
-static void
-run_connection_housekeeping(int i, time_t now)
+STATIC int
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
   int have_any_circuits;
   int past_keepalive =
     now >= conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+  time_t next;
+  int padding_delay;
 
   if (conn->outbuf && !connection_get_outbuf_len(conn) &&
       conn->type == CONN_TYPE_OR)
@@ -1180,18 +1254,17 @@ run_connection_housekeeping(int i, time_t now)
 
   if (conn->marked_for_close) {
     /* nothing to do here */
-    return;
+    return 0;
   }
 
   /* Expire any directory connections that haven't been active (sent
    * if a server or received if a client) for 5 min */
-  if (conn->type == CONN_TYPE_DIR &&
-      ((DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_last_write_allowed
-            + options->TestingDirConnectionMaxStall < now) ||
-       (!DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_last_read_allowed
-            + options->TestingDirConnectionMaxStall < now))) {
+  if (conn->type == CONN_TYPE_DIR) {
+    time_t stall_deadline = options->TestingDirConnectionMaxStall +
+      (DIR_CONN_IS_SERVER(conn) ?
+       conn->timestamp_last_write_allowed : conn->timestamp_last_read_allowed);
+    if (stall_deadline >= now)
+      return housekeeping_delay_until(now, stall_deadline + 1);
     log_info(LD_DIR,"Expiring wedged directory conn (fd %d, purpose %d)",
              (int)conn->s, conn->purpose);
     /* This check is temporary; it's to let us know whether we should consider
@@ -1204,11 +1277,11 @@ run_connection_housekeeping(int i, time_t now)
     } else {
       connection_mark_for_close(conn);
     }
-    return;
+    return 0;
   }
 
   if (!connection_speaks_cells(conn))
-    return; /* we're all done here, the rest is just for OR conns */
+    return 0; /* we're all done here, the rest is just for OR conns */
 
   /* If we haven't flushed to an OR connection for a while, then either nuke
      the connection or send a keepalive, depending. */
@@ -1238,13 +1311,17 @@ run_connection_housekeeping(int i, time_t now)
                                    END_OR_CONN_REASON_TIMEOUT,
                                    "Tor gave up on the connection");
     connection_or_close_normally(TO_OR_CONN(conn), 1);
+    return 0;
   } else if (!connection_state_is_open(conn)) {
     if (past_keepalive) {
       /* We never managed to actually get this connection open and happy. */
       log_info(LD_OR,"Expiring non-open OR connection to fd %d (%s:%d).",
                (int)conn->s,conn->address, conn->port);
       connection_or_close_normally(TO_OR_CONN(conn), 0);
+      return 0;
     }
+    return housekeeping_delay_until(now, conn->timestamp_last_write_allowed +
+                                    options->KeepalivePeriod);
   } else if (we_are_hibernating() &&
              ! have_any_circuits &&
              !connection_get_outbuf_len(conn)) {
@@ -1254,6 +1331,7 @@ run_connection_housekeeping(int i, time_t now)
              "[Hibernating or exiting].",
              (int)conn->s,conn->address, conn->port);
     connection_or_close_normally(TO_OR_CONN(conn), 1);
+    return 0;
   } else if (!have_any_circuits &&
              now - or_conn->idle_timeout >=
                                          chan->timestamp_last_had_circuits) {
@@ -1265,6 +1343,7 @@ run_connection_housekeeping(int i, time_t now)
              or_conn->idle_timeout,
              or_conn->is_canonical ? "" : "non");
     connection_or_close_normally(TO_OR_CONN(conn), 0);
+    return 0;
   } else if (
       now >= or_conn->timestamp_lastempty + options->KeepalivePeriod*10 &&
       now >=
@@ -1276,6 +1355,7 @@ run_connection_housekeeping(int i, time_t now)
            (int)connection_get_outbuf_len(conn),
            (int)(now-conn->timestamp_last_write_allowed));
     connection_or_close_normally(TO_OR_CONN(conn), 0);
+    return 0;
   } else if (past_keepalive && !connection_get_outbuf_len(conn)) {
     /* send a padding cell */
     log_fn(LOG_DEBUG,LD_OR,"Sending keepalive to (%s:%d)",
@@ -1283,9 +1363,87 @@ run_connection_housekeeping(int i, time_t now)
     memset(&cell,0,sizeof(cell_t));
     cell.command = CELL_PADDING;
     connection_or_write_cell_to_buf(&cell, or_conn);
+    padding_delay = -1;
   } else {
-    channelpadding_decide_to_pad_channel(chan);
-  }
+    padding_delay = channelpadding_get_decision_delay(chan,
+                               channelpadding_decide_to_pad_channel(chan));
+  }
+
+  /* Nothing was due: work out when the earliest check above could next
+   * come out differently. */
+  next = MIN(conn->timestamp_last_write_allowed + options->KeepalivePeriod,
+             MAX(or_conn->timestamp_lastempty,
+                 conn->timestamp_last_write_allowed) +
+             options->KeepalivePeriod*10);
+  /* If the channel still has circuits, the idle timeout can't start
+   * before now.  When the last one goes away, channel_note_circuit_detached()
+   * records the time, and reschedules us if the channel is bad for new
+   * circuits. */
+  next = MIN(next, or_conn->idle_timeout +
+             (have_any_circuits ? now : chan->timestamp_last_had_circuits));
+  if (we_are_hibernating())
+    next = now + 1;
+  if (padding_delay >= 0)
+    next = MIN(next, now + padding_delay);
+  return housekeeping_delay_until(now, next);
+}
+
+/** Make sure that run_connection_housekeeping() runs on <b>conn</b> no
+ * more than <b>delay</b> seconds from now.  Does nothing for connections
+ * that have no housekeeping, or before the main loop has started. */
+void
+connection_schedule_housekeeping(connection_t *conn, int delay)
+{
+  struct timeval tv;
+  time_t due;
+
+  if (!connection_housekeeping_enabled || conn->marked_for_close ||
+      (conn->type != CONN_TYPE_OR && conn->type != CONN_TYPE_DIR))
+    return;
+
+  due = approx_time() + delay;
+  if (conn->housekeeping_due && conn->housekeeping_due <= due)
+    return; /* Already due soon enough. */
+
+  if (!conn->housekeeping_timer)
+    conn->housekeeping_timer =
+      timer_new(connection_housekeeping_callback, conn);
+  conn->housekeeping_due = due;
+  tv.tv_sec = delay;
+  tv.tv_usec = 0;
+  timer_schedule(conn->housekeeping_timer, &tv);
+}
+
+/** Run housekeeping on every connection as soon as possible, so that each
+ * picks a new deadline.  Called when something that every deadline
+ * depends on has changed. */
+void
+connection_reschedule_all_housekeeping(void)
+{
+  if (!connection_housekeeping_enabled)
+    return;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn,
+                    connection_schedule_housekeeping(conn, 0));
+}
+
+/** Timer callback: run housekeeping on the connection in <b>arg</b>, and
+ * schedule the next run. */
+static void
+connection_housekeeping_callback(tor_timer_t *timer, void *arg,
+                                 const struct monotime_t *now_mono)
+{
+  connection_t *conn = arg;
+  int delay;
+  (void)timer;
+  (void)now_mono;
+
+  /* approx_time() is only refreshed when the main loop does something, and
+   * we may be the first thing it does in a while. */
+  update_approx_time(time(NULL));
+  conn->housekeeping_due = 0;
+  delay = run_connection_housekeeping(conn, approx_time());
+  if (delay > 0)
+    connection_schedule_housekeeping(conn, delay);
 }
 
 /** Honor a NEWNYM request: make future requests unlinkable to past
@@ -1389,6 +1547,7 @@ CALLBACK(rotate_onion_key);
 CALLBACK(rotate_x509_certificate);
 CALLBACK(save_stability);
 CALLBACK(save_state);
+CALLBACK(shrink_buffer_freelists);
 CALLBACK(write_bridge_ns);
 CALLBACK(write_stats_file);
 
@@ -1411,6 +1570,7 @@ STATIC periodic_event_item_t periodic_events[] = {
   CALLBACK(retry_listeners, PERIODIC_EVENT_ROLE_ALL,
            PERIODIC_EVENT_FLAG_NEED_NET),
   CALLBACK(save_state, PERIODIC_EVENT_ROLE_ALL, 0),
+  CALLBACK(shrink_buffer_freelists, PERIODIC_EVENT_ROLE_ALL, 0),
   CALLBACK(rotate_x509_certificate, PERIODIC_EVENT_ROLE_ALL, 0),
   CALLBACK(write_stats_file, PERIODIC_EVENT_ROLE_ALL, 0),
 
@@ -1791,12 +1951,10 @@ run_scheduled_events(time_t now)
     circuit_expire_old_circs_as_needed(now);
   }
 
-  /* 5. We do housekeeping for each connection... */
+  /* 5. We mark old and duplicate channels as bad for new circuits.  Each
+   *    connection's own housekeeping runs from its own timer; see
+   *    connection_schedule_housekeeping(). */
   channel_update_bad_for_new_circs(NULL, 0);
-  int i;
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
 
   /* 11b. check pending unconfigured managed proxies */
   if (!net_is_disabled() && pt_proxies_configuration_pending())
@@ -2211,6 +2369,20 @@ clean_caches_callback(time_t now, const or_options_t *options)
   return CLEAN_CACHES_INTERVAL;
 }
 
+/**
+ * Periodic callback: Free the buffer chunks that have sat unused on their
+ * freelists since we last looked.
+ */
+static int
+shrink_buffer_freelists_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  buf_shrink_freelists(0);
+#define SHRINK_BUFFER_FREELISTS_INTERVAL 60
+  return SHRINK_BUFFER_FREELISTS_INTERVAL;
+}
+
 /**
  * Periodic callback: Clean the cache of failed hidden service lookups
  * frequently.
@@ -2360,9 +2532,8 @@ static int
 expire_old_ciruits_serverside_callback(time_t now, const or_options_t *options)
 {
   (void)options;
-  /* every 11 seconds, so not usually the same second as other such events */
-  circuit_expire_old_circuits_serverside(now);
-  return 11;
+  /* come back when the next circuit is due for a look */
+  return circuit_expire_old_circuits_serverside(now);
 }
 
 /**
@@ -2737,6 +2908,11 @@ do_main_loop(void)
   /* set up once-a-second callback. */
   reschedule_per_second_timer();
 
+  /* The timer wheel is running now: start housekeeping on the connections
+   * we already have. */
+  connection_housekeeping_enabled = 1;
+  connection_reschedule_all_housekeeping();
+
 #ifdef HAVE_SYSTEMD_209
   uint64_t watchdog_delay;
   /* set up systemd watchdog notification. */
@@ -2928,6 +3104,7 @@ tor_mainloop_free_all(void)
   mainloop_event_free(directory_all_unreachable_cb_event);
   mainloop_event_free(schedule_active_linked_connections_event);
   mainloop_event_free(postloop_cleanup_ev);
+  connection_uring_free_all();
   mainloop_event_free(handle_deferred_signewnym_ev);
 
 #ifdef HAVE_SYSTEMD_209
@@ -2946,6 +3123,7 @@ tor_mainloop_free_all(void)
   main_loop_should_exit = 0;
   main_loop_exit_value = 0;
   can_complete_circuits = 0;
+  connection_housekeeping_enabled = 0;
   quiet_level = 0;
   should_init_bridge_stats = 1;
   dns_honesty_first_time = 1;
@@ -24,6 +24,8 @@ void connection_unregister_events(connection_t *conn);
 int connection_in_array(connection_t *conn);
 void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
+void connection_schedule_housekeeping(connection_t *conn, int delay);
+void connection_reschedule_all_housekeeping(void);
 
 MOCK_DECL(smartlist_t *, get_connection_array, (void));
 MOCK_DECL(uint64_t,get_bytes_read,(void));
@@ -38,6 +40,8 @@ typedef enum watchable_events {
   WRITE_EVENT=0x04 /**< We want to know when a connection is writable */
 } watchable_events_t;
 void connection_watch_events(connection_t *conn, watchable_events_t events);
+void connection_handle_read_event(connection_t *conn);
+void connection_handle_write_event(connection_t *conn);
 int connection_is_reading(connection_t *conn);
 MOCK_DECL(void,connection_stop_reading,(connection_t *conn));
 MOCK_DECL(void,connection_start_reading,(connection_t *conn));
@@ -102,8 +106,10 @@ STATIC void close_closeable_connections(void);
 STATIC void initialize_periodic_events(void);
 STATIC void teardown_periodic_events(void);
 STATIC int get_my_roles(const or_options_t *);
+STATIC int run_connection_housekeeping(connection_t *conn, time_t now);
 #ifdef TOR_UNIT_TESTS
 extern smartlist_t *connection_array;
+extern int connection_housekeeping_enabled;
 
 /* We need the periodic_event_item_t definition. */
 #include "core/mainloop/periodic.h"
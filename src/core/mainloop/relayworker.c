@@ -0,0 +1,351 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relayworker.c
+ * \brief Uses the workqueue/threadpool code to farm the crypto of relay cells
+ * out to worker threads.
+ *
+ * Normally, we en/decrypt every relay cell on an or_circuit_t on the main
+ * thread as soon as it arrives (see relay.c).  With RelayCryptoThreads, we
+ * collect the cells of each circuit into batches (relay_job_t) instead.  We
+ * hand the oldest batch of a circuit to a worker thread, which crypts its
+ * cells in order using the circuit's crypto state.  Once the worker replies,
+ * we handle the crypted cells on the main thread in the same order, just as
+ * circuit_receive_relay_cell() would have done (that is, deliver the
+ * recognized ones and pass on the others), and hand the next batch to the
+ * workers.
+ *
+ * A circuit has at most one batch with the workers at a time, and while it
+ * has any batches, all cells that need its crypto state go through them,
+ * including the ones we create ourselves (see circuit_package_relay_cell()).
+ * So the cells of each circuit are crypted and queued in the same order as
+ * without workers, and only different circuits are crypted in parallel.
+ **/
+#define RELAYWORKER_PRIVATE
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/mainloop/relayworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/relay.h"
+#include "lib/evloop/workqueue.h"
+
+#include "core/or/or_circuit_st.h"
+
+static void relay_worker_dispatch(or_circuit_t *circ);
+
+static replyqueue_t *replyqueue = NULL;
+static threadpool_t *threadpool = NULL;
+/** Number of threads in <b>threadpool</b>. */
+static int n_threads = 0;
+
+/** The relay crypto workers don't need any state of their own. */
+static void *
+relay_worker_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+static void
+relay_worker_state_free(void *state)
+{
+  (void)state;
+}
+
+/** Start the relay crypto workers if RelayCryptoThreads is set. It is OK to
+ * call this more than once during Tor's lifetime.
+ */
+void
+relay_worker_init(void)
+{
+  const int n = get_options()->RelayCryptoThreads;
+
+  if (threadpool) {
+    /* Our threadpools can't shrink, so we keep the workers we have. */
+    if (n && n != n_threads) {
+      log_notice(LD_GENERAL, "We are already using %d threads for relay "
+                 "crypto. Setting RelayCryptoThreads to %d takes effect "
+                 "after a restart.", n_threads, n);
+    }
+    return;
+  }
+  if (n <= 0)
+    return;
+
+  replyqueue = replyqueue_new(0);
+  threadpool = threadpool_new(n,
+                              replyqueue,
+                              relay_worker_state_new,
+                              relay_worker_state_free,
+                              NULL);
+
+  int r = threadpool_register_reply_event(threadpool, NULL);
+
+  tor_assert(r == 0);
+  n_threads = n;
+  log_notice(LD_GENERAL, "Using %d threads for relay crypto.", n);
+}
+
+/** Return true iff the crypto of the relay cells on <b>circ</b> has to go
+ * through the relay crypto workers: either because we use them, or because
+ * they still have cells of <b>circ</b>. */
+int
+relay_worker_handles_circ(const or_circuit_t *circ)
+{
+  if (circ->relay_jobs_head)
+    return 1;
+  return threadpool && get_options()->RelayCryptoThreads > 0;
+}
+
+#define relay_job_free(job) \
+  FREE_AND_NULL(relay_job_t, relay_job_free_, (job))
+
+/** Release all storage held by <b>job</b>. */
+static void
+relay_job_free_(relay_job_t *job)
+{
+  if (!job)
+    return;
+  if (job->owns_crypto)
+    relay_crypto_clear(&job->crypto);
+  tor_free(job);
+}
+
+/** Return a free slot for a cell in the newest batch of <b>circ</b>, and
+ * start a new batch if that one is full or no longer open for new cells.
+ * Return NULL if <b>circ</b> has too many cells waiting already. */
+static relay_job_cell_t *
+relay_worker_add_cell(or_circuit_t *circ)
+{
+  relay_job_t *job = circ->relay_jobs_tail;
+
+  if (circ->n_relay_job_cells >= RELAY_WORKER_MAX_QUEUED_CELLS)
+    return NULL;
+
+  if (!job || job->work || job->processing ||
+      job->n_cells == RELAY_WORKER_MAX_BATCH) {
+    job = tor_malloc_zero(sizeof(relay_job_t));
+    job->circ = circ;
+    if (circ->relay_jobs_tail)
+      circ->relay_jobs_tail->next = job;
+    else
+      circ->relay_jobs_head = job;
+    circ->relay_jobs_tail = job;
+  }
+
+  ++circ->n_relay_job_cells;
+  return &job->cells[job->n_cells++];
+}
+
+/** If the relay crypto workers handle <b>circ</b>, queue the relay
+ * <b>cell</b> that arrived on it in direction <b>cell_direction</b> for them
+ * and return 1; once they have crypted it, we continue with
+ * circuit_receive_relay_cell_crypted().  Else return 0.
+ */
+int
+relay_worker_queue_relayed_cell(or_circuit_t *circ, const cell_t *cell,
+                                cell_direction_t cell_direction)
+{
+  relay_job_cell_t *job_cell;
+
+  if (!relay_worker_handles_circ(circ))
+    return 0;
+
+  if (!(job_cell = relay_worker_add_cell(circ))) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Too many relay cells waiting for the relay crypto workers on "
+           "circuit %u. Closing.", (unsigned)circ->p_circ_id);
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+    return 1;
+  }
+
+  memcpy(&job_cell->cell, cell, sizeof(cell_t));
+  job_cell->type = (cell_direction == CELL_DIRECTION_OUT) ?
+    RELAY_JOB_CELL_FORWARD : RELAY_JOB_CELL_BACKWARD;
+  relay_worker_dispatch(circ);
+  return 1;
+}
+
+/** Queue the relay <b>cell</b> for the stream <b>on_stream</b>, which we
+ * created and are sending to the origin of <b>circ</b>, for the relay
+ * crypto workers.  Once they have encrypted it, we append it to the cell
+ * queue of <b>circ</b>.  Only call this if relay_worker_handles_circ().
+ */
+void
+relay_worker_queue_originated_cell(or_circuit_t *circ, const cell_t *cell,
+                                   streamid_t on_stream)
+{
+  relay_job_cell_t *job_cell;
+
+  tor_assert(relay_worker_handles_circ(circ));
+
+  if (!(job_cell = relay_worker_add_cell(circ))) {
+    log_info(LD_OR, "Too many relay cells waiting for the relay crypto "
+             "workers on circuit %u. Closing.", (unsigned)circ->p_circ_id);
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+    return;
+  }
+
+  memcpy(&job_cell->cell, cell, sizeof(cell_t));
+  job_cell->type = RELAY_JOB_CELL_ORIGINATED;
+  job_cell->on_stream = on_stream;
+  relay_worker_dispatch(circ);
+}
+
+/** Crypt the cells of the relay_job_t <b>job_</b> in order. Runs in a worker
+ * thread, so it must not touch anything but the batch. */
+STATIC workqueue_reply_t
+relay_job_threadfn(void *state_, void *job_)
+{
+  relay_job_t *job = job_;
+  int i;
+  (void)state_;
+
+  for (i = 0; i < job->n_cells; ++i) {
+    relay_job_cell_t *job_cell = &job->cells[i];
+
+    switch (job_cell->type) {
+      case RELAY_JOB_CELL_FORWARD:
+        relay_crypt_relayed_cell(&job->crypto, &job_cell->cell,
+                                 CELL_DIRECTION_OUT, &job_cell->recognized);
+        break;
+      case RELAY_JOB_CELL_BACKWARD:
+        relay_crypt_relayed_cell(&job->crypto, &job_cell->cell,
+                                 CELL_DIRECTION_IN, &job_cell->recognized);
+        break;
+      case RELAY_JOB_CELL_ORIGINATED:
+        relay_crypto_encrypt_cell_inbound(&job->crypto, &job_cell->cell);
+        break;
+      default:
+        tor_assert_unreached();
+    }
+  }
+
+  return WQ_RPL_REPLY;
+}
+
+/** Handle the crypted cell <b>job_cell</b> of <b>circ</b> on the main
+ * thread. */
+static void
+relay_job_handle_cell(or_circuit_t *circ, relay_job_cell_t *job_cell)
+{
+  cell_direction_t direction;
+  int reason;
+
+  if (job_cell->type == RELAY_JOB_CELL_ORIGINATED) {
+    if (! TO_CIRCUIT(circ)->marked_for_close) {
+      append_cell_to_circuit_queue(TO_CIRCUIT(circ), circ->p_chan,
+                                   &job_cell->cell, CELL_DIRECTION_IN,
+                                   job_cell->on_stream);
+    }
+    return;
+  }
+
+  direction = (job_cell->type == RELAY_JOB_CELL_FORWARD) ?
+    CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
+  if ((reason = circuit_receive_relay_cell_crypted(&job_cell->cell, circ,
+                             direction, job_cell->recognized)) < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL, "circuit_receive_relay_cell "
+           "(%s) failed. Closing.",
+           direction == CELL_DIRECTION_OUT ? "forward" : "backward");
+    circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
+  }
+}
+
+/** Called on the main thread when a worker has crypted the relay_job_t
+ * <b>job_</b>. */
+static void
+relay_job_reply(void *job_)
+{
+  relay_job_t *job = job_;
+  or_circuit_t *circ = job->circ;
+  int i;
+
+  job->work = NULL;
+  if (!circ) {
+    /* The circuit is gone. */
+    relay_job_free(job);
+    return;
+  }
+
+  tor_assert(circ->relay_jobs_head == job);
+  job->processing = 1;
+
+  /* The next batch can be crypted while we handle this one. */
+  relay_worker_dispatch(circ);
+
+  for (i = 0; i < job->n_cells && job->circ; ++i)
+    relay_job_handle_cell(circ, &job->cells[i]);
+
+  if (job->circ) {
+    circ->relay_jobs_head = job->next;
+    if (!circ->relay_jobs_head)
+      circ->relay_jobs_tail = NULL;
+    circ->n_relay_job_cells -= job->n_cells;
+    relay_worker_dispatch(circ);
+  }
+  relay_job_free(job);
+}
+
+/** Hand the oldest batch of <b>circ</b> that we don't handle yet to the
+ * workers, unless one of them has it already. */
+static void
+relay_worker_dispatch(or_circuit_t *circ)
+{
+  relay_job_t *job = circ->relay_jobs_head;
+
+  if (job && job->processing)
+    job = job->next;
+  if (!job || job->work)
+    return;
+
+  job->crypto = circ->crypto;
+  job->work = threadpool_queue_work(threadpool, relay_job_threadfn,
+                                    relay_job_reply, job);
+  if (BUG(!job->work)) {
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+  }
+}
+
+/** We are about to free <b>circ</b>: forget about its batches of relay
+ * cells.  We free the ones that no worker has, and let the one that a worker
+ * is busy with free itself, together with the crypto state of <b>circ</b>,
+ * when the worker is done.
+ */
+void
+relay_worker_circ_free(or_circuit_t *circ)
+{
+  relay_job_t *job, *next;
+
+  for (job = circ->relay_jobs_head; job; job = next) {
+    next = job->next;
+    job->next = NULL;
+    job->circ = NULL;
+
+    if (job->processing) {
+      /* relay_job_reply() frees it */
+      continue;
+    }
+    if (job->work && !workqueue_entry_cancel(job->work)) {
+      /* The worker is using the crypto state, so the batch takes it over. */
+      job->owns_crypto = 1;
+      memset(&circ->crypto, 0, sizeof(circ->crypto));
+      continue;
+    }
+    relay_job_free(job);
+  }
+
+  circ->relay_jobs_head = circ->relay_jobs_tail = NULL;
+  circ->n_relay_job_cells = 0;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the queue on which the relay crypto workers reply. */
+STATIC replyqueue_t *
+relay_worker_get_replyqueue(void)
+{
+  return replyqueue;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
@@ -0,0 +1,87 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relayworker.h
+ * \brief Header file for relayworker.c.
+ **/
+
+#ifndef TOR_RELAYWORKER_H
+#define TOR_RELAYWORKER_H
+
+/** Largest number of cells that we hand to a relay crypto worker at once. */
+#define RELAY_WORKER_MAX_BATCH 32
+
+/** Largest number of cells of a circuit that may wait for the relay crypto
+ * workers. Honest peers stay well below this because of the circuit-level
+ * flow control; we close circuits that exceed it. */
+#define RELAY_WORKER_MAX_QUEUED_CELLS 2048
+
+void relay_worker_init(void);
+int relay_worker_handles_circ(const or_circuit_t *circ);
+int relay_worker_queue_relayed_cell(or_circuit_t *circ, const cell_t *cell,
+                                    cell_direction_t cell_direction);
+void relay_worker_queue_originated_cell(or_circuit_t *circ,
+                                        const cell_t *cell,
+                                        streamid_t on_stream);
+void relay_worker_circ_free(or_circuit_t *circ);
+
+#ifdef RELAYWORKER_PRIVATE
+
+#include "core/or/cell_st.h"
+#include "core/or/relay_crypto_st.h"
+#include "lib/evloop/workqueue.h"
+
+/** What a relay crypto worker has to do with a cell of a relay_job_t. */
+typedef enum relay_job_cell_type_t {
+  /** A cell we are relaying toward the exit: decrypt one layer and check
+   * whether it is recognized. */
+  RELAY_JOB_CELL_FORWARD = 0,
+  /** A cell we are relaying toward the origin: encrypt one layer. */
+  RELAY_JOB_CELL_BACKWARD = 1,
+  /** A cell we created and are sending toward the origin: set its digest and
+   * encrypt it. */
+  RELAY_JOB_CELL_ORIGINATED = 2,
+} relay_job_cell_type_t;
+
+/** A cell of a relay_job_t. */
+typedef struct relay_job_cell_t {
+  cell_t cell;
+  /** One of relay_job_cell_type_t. */
+  uint8_t type;
+  /** Set by the worker for forward cells that are for us. */
+  char recognized;
+  /** For originated cells: the stream the cell belongs to, if any. */
+  streamid_t on_stream;
+} relay_job_cell_t;
+
+/** A batch of relay cells of one circuit, which a relay crypto worker
+ * crypts in order. */
+typedef struct relay_job_t {
+  /** The circuit the cells belong to; NULL once it is freed. */
+  or_circuit_t *circ;
+  /** The next (newer) batch of <b>circ</b>. */
+  struct relay_job_t *next;
+  /** The work entry while the batch is with the workers; else NULL. */
+  workqueue_entry_t *work;
+  /** A copy of the crypto state of <b>circ</b>, taken when the batch was
+   * handed to the workers. */
+  relay_crypto_t crypto;
+  /** True iff the batch owns the objects in <b>crypto</b>, because its
+   * circuit was freed while a worker was busy with it. */
+  unsigned int owns_crypto : 1;
+  /** True while we are handling the crypted cells of the batch. */
+  unsigned int processing : 1;
+  /** Number of cells in <b>cells</b>. */
+  int n_cells;
+  relay_job_cell_t cells[RELAY_WORKER_MAX_BATCH];
+} relay_job_t;
+
+STATIC workqueue_reply_t relay_job_threadfn(void *state_, void *job_);
+#ifdef TOR_UNIT_TESTS
+STATIC replyqueue_t *relay_worker_get_replyqueue(void);
+#endif
+
+#endif /* defined(RELAYWORKER_PRIVATE) */
+
+#endif /* !defined(TOR_RELAYWORKER_H) */
@@ -83,6 +83,7 @@
 #include "lib/time/compat_time.h"
 
 #include "core/or/cell_queue_st.h"
+#include "core/or/or_connection_st.h"
 
 /* Global lists of channels */
 
@@ -2917,6 +2918,7 @@ channel_mark_bad_for_new_circs(channel_t *chan)
   tor_assert(chan);
 
   chan->is_bad_for_new_circs = 1;
+  channel_schedule_housekeeping(chan);
 }
 
 /**
@@ -3357,6 +3359,52 @@ channel_num_circuits(channel_t *chan)
          chan->num_p_circuits;
 }
 
+/**
+ * Note that a circuit has just stopped using <b>chan</b>.
+ *
+ * If that leaves a channel that is bad for new circuits with no circuits at
+ * all, it can be closed now, so have its housekeeping run soon.
+ */
+void
+channel_note_circuit_detached(channel_t *chan)
+{
+  tor_assert(chan);
+
+  chan->timestamp_last_had_circuits = approx_time();
+  if (channel_num_circuits(chan) == 0 && chan->is_bad_for_new_circs)
+    channel_schedule_housekeeping(chan);
+}
+
+/**
+ * Make sure that the connection under <b>chan</b>, if there is one, gets
+ * its housekeeping run soon.
+ */
+void
+channel_schedule_housekeeping(channel_t *chan)
+{
+  if (chan->magic == TLS_CHAN_MAGIC && BASE_CHAN_TO_TLS(chan)->conn)
+    connection_schedule_housekeeping(TO_CONN(BASE_CHAN_TO_TLS(chan)->conn),
+                                     0);
+}
+
+/**
+ * Set the usage of <b>chan</b> to <b>usage</b>.
+ *
+ * Whether we pad a channel depends on its usage, and housekeeping doesn't
+ * look at channels that it decided not to pad again until something
+ * changes; so have it run soon when the usage does.
+ */
+void
+channel_set_usage(channel_t *chan, channel_usage_info_t usage)
+{
+  tor_assert(chan);
+
+  if (chan->channel_usage == usage)
+    return;
+  chan->channel_usage = usage;
+  channel_schedule_housekeeping(chan);
+}
+
 /**
  * Set up circuit ID generation.
  *
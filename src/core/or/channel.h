@@ -749,6 +749,9 @@ int channel_matches_extend_info(channel_t *chan, extend_info_t *extend_info);
 int channel_matches_target_addr_for_extend(channel_t *chan,
                                            const tor_addr_t *target);
 unsigned int channel_num_circuits(channel_t *chan);
+void channel_note_circuit_detached(channel_t *chan);
+void channel_schedule_housekeeping(channel_t *chan);
+void channel_set_usage(channel_t *chan, channel_usage_info_t usage);
 MOCK_DECL(void,channel_set_circid_type,(channel_t *chan,
                                         crypto_pk_t *identity_rcvd,
                                         int consider_identity));
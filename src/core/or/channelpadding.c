@@ -144,6 +144,12 @@ channelpadding_new_consensus_params(networkstatus_t *ns)
     networkstatus_get_param(ns,
                             CHANNELPADDING_SOS_PARAM,
                             CHANNELPADDING_SOS_DEFAULT, 0, 1);
+
+  /* These can change whether we pad each channel, and housekeeping doesn't
+   * look at channels that it decided not to pad again until something
+   * changes.  A new consensus is rare enough for a pass over all
+   * connections. */
+  connection_reschedule_all_housekeeping();
 }
 
 /**
@@ -265,7 +271,11 @@ channelpadding_update_padding_for_channel(channel_t *chan,
     return -1;
   }
 
+  const unsigned int padding_was_enabled = chan->padding_enabled;
   chan->padding_enabled = (pad_vars->command == CHANNELPADDING_COMMAND_START);
+  /* Housekeeping decides whether to pad the channel; have it decide again. */
+  if (chan->padding_enabled != padding_was_enabled)
+    channel_schedule_housekeeping(chan);
 
   /* Min must not be lower than the current consensus parameter
      nf_ito_low. */
@@ -703,8 +713,9 @@ channelpadding_reduce_padding_on_channel(channel_t *chan)
 }
 
 /**
- * This function is called once per second by run_connection_housekeeping(),
- * but only if the channel is still open, valid, and non-wedged.
+ * This function is called by run_connection_housekeeping() at least as
+ * often as channelpadding_get_decision_delay() asks, but only if the
+ * channel is still open, valid, and non-wedged.
  *
  * It decides if and when we should send a padding cell, and if needed,
  * schedules a callback to send that cell at the appropriate time.
@@ -792,3 +803,42 @@ channelpadding_decide_to_pad_channel(channel_t *chan)
     return CHANNELPADDING_PADLATER;
   }
 }
+
+/**
+ * Return the number of seconds that may pass before
+ * channelpadding_decide_to_pad_channel() must be called again on
+ * <b>chan</b>, given that it just returned <b>decision</b>.  Return -1 if
+ * it need not be called again until something else about the channel
+ * changes.
+ */
+int
+channelpadding_get_decision_delay(const channel_t *chan,
+                                  channelpadding_decision_t decision)
+{
+  monotime_coarse_t now;
+  int64_t ms_till_decision;
+
+  switch (decision) {
+    case CHANNELPADDING_WONTPAD:
+      return -1;
+    case CHANNELPADDING_PADLATER:
+      if (monotime_coarse_is_zero(&chan->next_padding_time))
+        return 1;
+      /* We have to decide again once we're within one housekeeping call
+       * (plus slack) of the padding time, so that we can schedule the
+       * padding callback. */
+      monotime_coarse_get(&now);
+      ms_till_decision =
+        monotime_coarse_diff_msec(&now, &chan->next_padding_time) -
+        (TOR_HOUSEKEEPING_CALLBACK_MSEC +
+         TOR_HOUSEKEEPING_CALLBACK_SLACK_MSEC);
+      if (ms_till_decision < 1000)
+        return 1;
+      return (int)MIN(ms_till_decision / 1000, INT_MAX);
+    case CHANNELPADDING_PADDING_SCHEDULED:
+    case CHANNELPADDING_PADDING_ALREADY_SCHEDULED:
+    case CHANNELPADDING_PADDING_SENT:
+    default:
+      return 1;
+  }
+}
@@ -26,6 +26,8 @@ typedef enum {
 
 channelpadding_decision_t channelpadding_decide_to_pad_channel(channel_t
                                                                *chan);
+int channelpadding_get_decision_delay(const channel_t *chan,
+                                     channelpadding_decision_t decision);
 int channelpadding_update_padding_for_channel(channel_t *,
                                               const channelpadding_negotiate_t
                                               *chan);
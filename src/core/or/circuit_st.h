@@ -109,6 +109,9 @@ struct circuit_t {
 
   /** Temporary field used during circuits_handle_oom. */
   uint32_t age_tmp;
+  /** Temporary field used during circuits_handle_oom: the next circuit in
+   * the same age bucket. */
+  struct circuit_t *oom_bucket_next;
 
   /** For storage while n_chan is pending (state CIRCUIT_STATE_CHAN_WAIT). */
   struct create_cell_t *n_chan_create_cell;
@@ -1038,7 +1038,7 @@ circuit_send_first_onion_skin(origin_circuit_t *circ)
      * to pad it.
      */
     if (circ->base_.n_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS)
-      circ->base_.n_chan->channel_usage = CHANNEL_USED_FOR_FULL_CIRCS;
+      channel_set_usage(circ->base_.n_chan, CHANNEL_USED_FOR_FULL_CIRCS);
   }
 
   node = node_get_by_id(circ->base_.n_chan->identity_digest);
@@ -62,6 +62,7 @@
 #include "core/or/circuituse.h"
 #include "core/or/circuitstats.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "app/config/config.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
@@ -72,6 +73,7 @@
 #include "feature/dircommon/directory.h"
 #include "feature/client/entrynodes.h"
 #include "core/mainloop/mainloop.h"
+#include "core/mainloop/relayworker.h"
 #include "feature/hs/hs_circuit.h"
 #include "feature/hs/hs_circuitmap.h"
 #include "feature/hs/hs_ident.h"
@@ -131,6 +133,15 @@ static smartlist_t *circuits_pending_other_guards = NULL;
  * circuit_mark_for_close and which are waiting for circuit_about_to_free. */
 static smartlist_t *circuits_pending_close = NULL;
 
+/** A list of the origin circuits that circuit_expire_building() may have to
+ * act on; see circuit_may_expire_building().  Circuits that stop being
+ * candidates stay here until circuit_expire_building() drops them. */
+static smartlist_t *circuits_pending_build_expiry = NULL;
+
+/** A heap of the circuits that clients have built to us, ordered by
+ * idle_expiry_deadline. */
+static smartlist_t *circuits_pending_idle_expiry = NULL;
+
 static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
 static void circuit_about_to_free_atexit(circuit_t *circ);
 static void circuit_about_to_free(circuit_t *circ);
@@ -287,6 +298,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
         /* One fewer circuits use old_chan as p_chan */
         --(old_chan->num_p_circuits);
       }
+      channel_note_circuit_detached(old_chan);
     }
   }
 
@@ -513,6 +525,7 @@ circuit_set_state(circuit_t *circ, uint8_t state)
   if (state == CIRCUIT_STATE_GUARD_WAIT || state == CIRCUIT_STATE_OPEN)
     tor_assert(!circ->n_chan_create_cell);
   circ->state = state;
+  circuit_update_build_expiry_list(circ);
 }
 
 /** Append to <b>out</b> all circuits in state CHAN_WAIT waiting for
@@ -598,6 +611,122 @@ circuit_add_to_origin_circuit_list(origin_circuit_t *origin_circ)
   origin_circ->global_origin_circuit_list_idx = smartlist_len(lst) - 1;
 }
 
+/** Return the list of origin circuits that circuit_expire_building() should
+ * look at.  It may hold circuits that are no longer candidates. */
+smartlist_t *
+circuit_get_build_expiry_list(void)
+{
+  if (NULL == circuits_pending_build_expiry)
+    circuits_pending_build_expiry = smartlist_new();
+  return circuits_pending_build_expiry;
+}
+
+/** Add <b>origin_circ</b> to the list of circuits that
+ * circuit_expire_building() looks at. */
+static void
+circuit_add_to_build_expiry_list(origin_circuit_t *origin_circ)
+{
+  tor_assert(origin_circ->build_expiry_list_idx == -1);
+  smartlist_t *lst = circuit_get_build_expiry_list();
+  smartlist_add(lst, origin_circ);
+  origin_circ->build_expiry_list_idx = smartlist_len(lst) - 1;
+}
+
+/** If <b>circ</b> is an origin circuit that circuit_expire_building() may
+ * have to act on, make sure it is on the list of circuits that function
+ * looks at.  Called whenever the state or purpose of a circuit changes. */
+void
+circuit_update_build_expiry_list(circuit_t *circ)
+{
+  if (!CIRCUIT_IS_ORIGIN(circ) ||
+      TO_ORIGIN_CIRCUIT(circ)->build_expiry_list_idx >= 0 ||
+      !circuit_may_expire_building(circ))
+    return;
+  circuit_add_to_build_expiry_list(TO_ORIGIN_CIRCUIT(circ));
+}
+
+/** Remove <b>origin_circ</b> from the list of circuits that
+ * circuit_expire_building() looks at, if it is there. */
+void
+circuit_remove_from_build_expiry_list(origin_circuit_t *origin_circ)
+{
+  int idx = origin_circ->build_expiry_list_idx;
+  if (idx < 0)
+    return;
+  tor_assert(idx < smartlist_len(circuits_pending_build_expiry));
+  tor_assert(origin_circ == smartlist_get(circuits_pending_build_expiry,
+                                          idx));
+  smartlist_del(circuits_pending_build_expiry, idx);
+  if (idx < smartlist_len(circuits_pending_build_expiry)) {
+    origin_circuit_t *replacement =
+      smartlist_get(circuits_pending_build_expiry, idx);
+    replacement->build_expiry_list_idx = idx;
+  }
+  origin_circ->build_expiry_list_idx = -1;
+}
+
+/** Helper for the idle-expiry heap: compare two or_circuit_t by
+ * idle_expiry_deadline. */
+static int
+compare_idle_expiry_deadlines_(const void *a_, const void *b_)
+{
+  const or_circuit_t *a = a_, *b = b_;
+  if (a->idle_expiry_deadline < b->idle_expiry_deadline)
+    return -1;
+  else if (a->idle_expiry_deadline > b->idle_expiry_deadline)
+    return 1;
+  else
+    return 0;
+}
+
+/** Tell circuit_expire_old_circuits_serverside() to look at <b>circ</b>
+ * again once <b>when</b> has passed. */
+void
+circuit_set_idle_expiry_deadline(or_circuit_t *circ, time_t when)
+{
+  if (PREDICT_UNLIKELY(!circuits_pending_idle_expiry))
+    circuits_pending_idle_expiry = smartlist_new();
+  if (circ->idle_expiry_idx >= 0)
+    smartlist_pqueue_remove(circuits_pending_idle_expiry,
+                            compare_idle_expiry_deadlines_,
+                            offsetof(or_circuit_t, idle_expiry_idx), circ);
+  circ->idle_expiry_deadline = when;
+  smartlist_pqueue_add(circuits_pending_idle_expiry,
+                       compare_idle_expiry_deadlines_,
+                       offsetof(or_circuit_t, idle_expiry_idx), circ);
+}
+
+/** If the circuit with the earliest idle-expiry deadline is due at
+ * <b>now</b>, take it off the idle-expiry heap and return it.  Otherwise
+ * return NULL. */
+or_circuit_t *
+circuit_pop_idle_expiry(time_t now)
+{
+  or_circuit_t *circ;
+  if (!circuits_pending_idle_expiry ||
+      !smartlist_len(circuits_pending_idle_expiry))
+    return NULL;
+  circ = smartlist_get(circuits_pending_idle_expiry, 0);
+  if (circ->idle_expiry_deadline > now)
+    return NULL;
+  return smartlist_pqueue_pop(circuits_pending_idle_expiry,
+                              compare_idle_expiry_deadlines_,
+                              offsetof(or_circuit_t, idle_expiry_idx));
+}
+
+/** Return the earliest idle-expiry deadline of any circuit, or 0 if no
+ * circuit has one. */
+time_t
+circuit_get_next_idle_expiry(void)
+{
+  const or_circuit_t *circ;
+  if (!circuits_pending_idle_expiry ||
+      !smartlist_len(circuits_pending_idle_expiry))
+    return 0;
+  circ = smartlist_get(circuits_pending_idle_expiry, 0);
+  return circ->idle_expiry_deadline;
+}
+
 /** Detach from the global circuit list, and deallocate, all
  * circuits that have been marked for close.
  */
@@ -979,6 +1108,10 @@ origin_circuit_new(void)
   circ->global_origin_circuit_list_idx = -1;
   circuit_add_to_origin_circuit_list(circ);
 
+  /* Until it is built, circuit_expire_building() has to look at it. */
+  circ->build_expiry_list_idx = -1;
+  circuit_add_to_build_expiry_list(circ);
+
   circuit_build_times_update_last_circ(get_circuit_build_times_mutable());
 
   if (! circuit_build_times_disabled(get_options()) &&
@@ -1037,6 +1170,7 @@ or_circuit_new(circid_t p_circ_id, channel_t *p_chan)
 
   circ = tor_malloc_zero(sizeof(or_circuit_t));
   circ->base_.magic = OR_CIRCUIT_MAGIC;
+  circ->idle_expiry_idx = -1;
 
   if (p_chan)
     circuit_set_p_circid_chan(circ, p_circ_id, p_chan);
@@ -1046,6 +1180,11 @@ or_circuit_new(circid_t p_circ_id, channel_t *p_chan)
 
   init_circuit_base(TO_CIRCUIT(circ));
 
+  /* Clients' circuits that end here get closed once they have been idle
+   * for a while; see circuit_expire_old_circuits_serverside(). */
+  if (p_chan && channel_is_client(p_chan))
+    circuit_set_idle_expiry_deadline(circ, approx_time());
+
   return circ;
 }
 
@@ -1091,6 +1230,7 @@ circuit_free_(circuit_t *circ)
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
 
     circuit_remove_from_origin_circuit_list(ocirc);
+    circuit_remove_from_build_expiry_list(ocirc);
 
     if (ocirc->half_streams) {
       SMARTLIST_FOREACH_BEGIN(ocirc->half_streams, half_edge_t *,
@@ -1145,6 +1285,12 @@ circuit_free_(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
+    if (ocirc->idle_expiry_idx >= 0)
+      smartlist_pqueue_remove(circuits_pending_idle_expiry,
+                              compare_idle_expiry_deadlines_,
+                              offsetof(or_circuit_t, idle_expiry_idx), ocirc);
+
+    relay_worker_circ_free(ocirc);
     relay_crypto_clear(&ocirc->crypto);
 
     if (ocirc->rend_splice) {
@@ -1265,6 +1411,12 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_close);
   circuits_pending_close = NULL;
 
+  smartlist_free(circuits_pending_build_expiry);
+  circuits_pending_build_expiry = NULL;
+
+  smartlist_free(circuits_pending_idle_expiry);
+  circuits_pending_idle_expiry = NULL;
+
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
 
@@ -2415,7 +2567,9 @@ marked_circuit_free_cells(circuit_t *circ)
   }
 }
 
-static size_t
+/** Aggressively free the buffer contents of <b>conn</b>. Return the number
+ * of bytes recovered. */
+STATIC size_t
 single_conn_free_bytes(connection_t *conn)
 {
   size_t result = 0;
@@ -2423,7 +2577,10 @@ single_conn_free_bytes(connection_t *conn)
     result += buf_allocation(conn->inbuf);
     buf_clear(conn->inbuf);
   }
-  if (conn->outbuf) {
+  if (conn->outbuf && conn->uring) {
+    /* The kernel may be sending from the outbuf right now. */
+    result += connection_uring_clear_outbuf(conn);
+  } else if (conn->outbuf) {
     result += buf_allocation(conn->outbuf);
     buf_clear(conn->outbuf);
     conn->outbuf_flushlen = 0;
@@ -2619,10 +2776,23 @@ circuits_compare_by_oldest_queued_item_(const void **a_, const void **b_)
     return -1;
 }
 
+/** Return the index of the bucket that circuits_handle_oom() puts circuits
+ * whose oldest item is <b>age</b> timestamp units old into.  There are two
+ * buckets per power of two, and older circuits go into higher buckets. */
+STATIC int
+oom_age_bucket(uint32_t age)
+{
+  int lg;
+  if (age < 2)
+    return (int)age;
+  lg = tor_log2(age);
+  return 2*lg + (int)((age >> (lg - 1)) & 1);
+}
+
 static uint32_t now_ts_for_buf_cmp;
 
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
+/** Helper to sort a list of connection_t by age of oldest buffer chunk, in
+ * descending order. */
 static int
 conns_compare_by_buffer_age_(const void **a_, const void **b_)
 {
@@ -2641,15 +2811,21 @@ conns_compare_by_buffer_age_(const void **a_, const void **b_)
 
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
 
+/** How many age buckets does circuits_handle_oom() use?  Enough for any
+ * value that oom_age_bucket() returns. */
+#define N_OOM_AGE_BUCKETS 64
+
 /** We're out of memory for cells, having allocated <b>current_allocation</b>
- * bytes' worth.  Kill the 'worst' circuits until we're under
+ * bytes' worth, and having just freed <b>pool_slack_freed</b> bytes of empty
+ * memory pool and buffer freelist chunks.  Kill the 'worst' circuits until we're under
  * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage. */
 void
-circuits_handle_oom(size_t current_allocation)
+circuits_handle_oom(size_t current_allocation, size_t pool_slack_freed)
 {
   smartlist_t *circlist;
-  smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
+  circuit_t *buckets[N_OOM_AGE_BUCKETS];
+  smartlist_t *bucket, *dirconns;
+  int b, conn_idx;
   size_t mem_to_recover;
   size_t mem_recovered=0;
   int n_circuits_killed=0;
@@ -2661,9 +2837,10 @@ circuits_handle_oom(size_t current_allocation)
              " tor compress total alloc: %" TOR_PRIuSZ
              " (zlib: %" TOR_PRIuSZ ", zstd: %" TOR_PRIuSZ ","
              " lzma: %" TOR_PRIuSZ "),"
-             " rendezvous cache total alloc: %" TOR_PRIuSZ "). Killing"
-             " circuits withover-long queues. (This behavior is controlled by"
-             " MaxMemInQueues.)",
+             " rendezvous cache total alloc: %" TOR_PRIuSZ ";"
+             " freed %" TOR_PRIuSZ " bytes of empty pool chunks)."
+             " Killing circuits withover-long queues. (This behavior is"
+             " controlled by MaxMemInQueues.)",
              cell_queues_get_total_allocation(),
              buf_get_total_allocation(),
              split_cell_buffer_get_total_allocation(),
@@ -2671,7 +2848,8 @@ circuits_handle_oom(size_t current_allocation)
              tor_zlib_get_total_allocation(),
              tor_zstd_get_total_allocation(),
              tor_lzma_get_total_allocation(),
-             rend_cache_get_total_allocation());
+             rend_cache_get_total_allocation(),
+             pool_slack_freed);
 
   {
     size_t mem_target = (size_t)(get_options()->MaxMemInQueues *
@@ -2683,47 +2861,52 @@ circuits_handle_oom(size_t current_allocation)
 
   now_ts = monotime_coarse_get_stamp();
 
+  /* Put the circuits into buckets by the age of their oldest item, so that
+   * we only have to sort the few buckets that we take victims from. */
+  memset(buckets, 0, sizeof(buckets));
   circlist = circuit_get_global_list();
   SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+    int idx;
     circ->age_tmp = circuit_max_queued_item_age(circ, now_ts);
+    idx = oom_age_bucket(circ->age_tmp);
+    circ->oom_bucket_next = buckets[idx];
+    buckets[idx] = circ;
   } SMARTLIST_FOREACH_END(circ);
 
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
-
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* Now sort the connection array ... */
+  /* Of the connections, we only kill the non-linked directory connections
+   * for their own sake: the others get killed along with their circuits. */
+  dirconns = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL)
+      smartlist_add(dirconns, conn);
+  } SMARTLIST_FOREACH_END(conn);
   now_ts_for_buf_cmp = now_ts;
-  smartlist_sort(connection_array, conns_compare_by_buffer_age_);
+  smartlist_sort(dirconns, conns_compare_by_buffer_age_);
   now_ts_for_buf_cmp = 0;
 
-  /* Fix up the connection array to its new order. */
-  SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
-    conn->conn_array_index = conn_sl_idx;
-  } SMARTLIST_FOREACH_END(conn);
-
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
+  /* Okay, now take the worst circuits and connections, oldest bucket
+   * first. Let's mark them, and reclaim their storage aggressively. */
   conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    size_t n;
-    size_t freed;
-
-    /* Free storage in any non-linked directory connections that have buffered
-     * data older than this circuit. */
-    while (conn_idx < smartlist_len(connection_array)) {
-      connection_t *conn = smartlist_get(connection_array, conn_idx);
-      uint32_t conn_age = conn_get_buffer_age(conn, now_ts);
-      if (conn_age < circ->age_tmp) {
-        break;
-      }
-      if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
+  bucket = smartlist_new();
+  for (b = N_OOM_AGE_BUCKETS - 1; b >= 0; --b) {
+    circuit_t *circ;
+    smartlist_clear(bucket);
+    for (circ = buckets[b]; circ; circ = circ->oom_bucket_next)
+      smartlist_add(bucket, circ);
+    smartlist_sort(bucket, circuits_compare_by_oldest_queued_item_);
+
+    SMARTLIST_FOREACH_BEGIN(bucket, circuit_t *, victim) {
+      size_t n;
+      size_t freed;
+
+      /* Free storage in any non-linked directory connections that have
+       * buffered data older than this circuit. */
+      while (conn_idx < smartlist_len(dirconns)) {
+        connection_t *conn = smartlist_get(dirconns, conn_idx);
+        uint32_t conn_age = conn_get_buffer_age(conn, now_ts);
+        if (conn_age < victim->age_tmp) {
+          break;
+        }
         if (!conn->marked_for_close)
           connection_mark_for_close(conn);
         mem_recovered += single_conn_free_bytes(conn);
@@ -2732,31 +2915,33 @@ circuits_handle_oom(size_t current_allocation)
 
         if (mem_recovered >= mem_to_recover)
           goto done_recovering_mem;
+        ++conn_idx;
       }
-      ++conn_idx;
-    }
 
-    /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
-    const size_t half_stream_alloc = circuit_alloc_in_half_streams(circ);
-    if (! circ->marked_for_close) {
-      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
-    }
-    marked_circuit_free_cells(circ);
-    freed = marked_circuit_free_stream_bytes(circ);
-    freed += split_marked_circuit_free_buffer(circ);
+      /* Now, kill the circuit. */
+      n = n_cells_in_circ_queues(victim);
+      const size_t half_stream_alloc = circuit_alloc_in_half_streams(victim);
+      if (! victim->marked_for_close) {
+        circuit_mark_for_close(victim, END_CIRC_REASON_RESOURCELIMIT);
+      }
+      marked_circuit_free_cells(victim);
+      freed = marked_circuit_free_stream_bytes(victim);
+      freed += split_marked_circuit_free_buffer(victim);
 
-    ++n_circuits_killed;
+      ++n_circuits_killed;
 
-    mem_recovered += n * packed_cell_mem_cost();
-    mem_recovered += half_stream_alloc;
-    mem_recovered += freed;
+      mem_recovered += n * packed_cell_mem_cost();
+      mem_recovered += half_stream_alloc;
+      mem_recovered += freed;
 
-    if (mem_recovered >= mem_to_recover)
-      goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+      if (mem_recovered >= mem_to_recover)
+        goto done_recovering_mem;
+    } SMARTLIST_FOREACH_END(victim);
+  }
 
  done_recovering_mem:
+  smartlist_free(bucket);
+  smartlist_free(dirconns);
 
   log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
@@ -170,6 +170,12 @@ const origin_circuit_t *CONST_TO_ORIGIN_CIRCUIT(const circuit_t *);
 
 MOCK_DECL(smartlist_t *, circuit_get_global_list, (void));
 smartlist_t *circuit_get_global_origin_circuit_list(void);
+smartlist_t *circuit_get_build_expiry_list(void);
+void circuit_update_build_expiry_list(circuit_t *circ);
+void circuit_remove_from_build_expiry_list(origin_circuit_t *origin_circ);
+void circuit_set_idle_expiry_deadline(or_circuit_t *circ, time_t when);
+or_circuit_t *circuit_pop_idle_expiry(time_t now);
+time_t circuit_get_next_idle_expiry(void);
 int circuit_any_opened_circuits(void);
 int circuit_any_opened_circuits_cached(void);
 void circuit_cache_opened_circuit_state(int circuits_are_opened);
@@ -232,7 +238,8 @@ void assert_cpath_layer_ok(const crypt_path_t *cp);
 MOCK_DECL(void, assert_circuit_ok,(const circuit_t *c));
 void circuit_free_all(void);
 void circuit_free_cpath_node(crypt_path_t *victim);
-void circuits_handle_oom(size_t current_allocation);
+void circuits_handle_oom(size_t current_allocation,
+                         size_t pool_slack_freed);
 
 void circuit_clear_testing_cell_stats(circuit_t *circ);
 
@@ -249,6 +256,8 @@ STATIC size_t n_cells_in_circ_queues(const circuit_t *c);
 STATIC uint32_t circuit_max_queued_data_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_cell_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_item_age(const circuit_t *c, uint32_t now);
+STATIC int oom_age_bucket(uint32_t age);
+STATIC size_t single_conn_free_bytes(connection_t *conn);
 #endif /* defined(CIRCUITLIST_PRIVATE) */
 
 #endif /* !defined(TOR_CIRCUITLIST_H) */
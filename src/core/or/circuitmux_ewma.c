@@ -12,15 +12,16 @@
  * more than older ones.
  *
  * Specifically, a cell sent at time "now" has weight 1, but a time X ticks
- * before now has weight ewma_scale_factor ^ X , where ewma_scale_factor is
+ * before now has weight F ^ X , where the scale factor F is
  * between 0.0 and 1.0.
  *
- * For efficiency, we do not re-scale these averages every time we send a
- * cell: that would be horribly inefficient.  Instead, we we keep the cell
- * count on all circuits on the same circuitmux scaled relative to a single
- * tick.  When we add a new cell, we scale its weight depending on the time
- * that has elapsed since the tick.  We do re-scale the circuits on the
- * circuitmux periodically, so that we don't overflow double.
+ * For efficiency, we do not re-scale these averages as time passes: that
+ * would be horribly inefficient.  Instead, we keep the logarithm of each
+ * cell count measured against a single global clock, which makes the
+ * weight of a new cell grow over time instead of making the old cells
+ * shrink.  Since all circuits share the clock, their order never changes
+ * unless they send cells, so we keep the active circuits in a heap that we
+ * never need to rebuild.
  *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
@@ -32,6 +33,7 @@
 
 #include "orconfig.h"
 
+#include <float.h>
 #include <math.h>
 
 #include "core/or/or.h"
@@ -58,73 +60,14 @@
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
 
-/*** EWMA structures ***/
+/** The log_count of a cell_ewma_t that hasn't sent any cells: the logarithm
+ * of (almost) zero. */
+#define EWMA_LOG_COUNT_NONE (-DBL_MAX)
 
-typedef struct cell_ewma_s cell_ewma_t;
-typedef struct ewma_policy_data_s ewma_policy_data_t;
-typedef struct ewma_policy_circ_data_s ewma_policy_circ_data_t;
-
-/**
- * The cell_ewma_t structure keeps track of how many cells a circuit has
- * transferred recently.  It keeps an EWMA (exponentially weighted moving
- * average) of the number of cells flushed from the circuit queue onto a
- * connection in channel_flush_from_first_active_circuit().
- */
-
-struct cell_ewma_s {
-  /** The last 'tick' at which we recalibrated cell_count.
-   *
-   * A cell sent at exactly the start of this tick has weight 1.0. Cells sent
-   * since the start of this tick have weight greater than 1.0; ones sent
-   * earlier have less weight. */
-  unsigned int last_adjusted_tick;
-  /** The EWMA of the cell count. */
-  double cell_count;
-  /** True iff this is the cell count for a circuit's previous
-   * channel. */
-  unsigned int is_for_p_chan : 1;
-  /** The position of the circuit within the OR connection's priority
-   * queue. */
-  int heap_index;
-};
-
-struct ewma_policy_data_s {
-  circuitmux_policy_data_t base_;
-
-  /**
-   * Priority queue of cell_ewma_t for circuits with queued cells waiting
-   * for room to free up on the channel that owns this circuitmux.  Kept
-   * in heap order according to EWMA.  This was formerly in channel_t, and
-   * in or_connection_t before that.
-   */
-  smartlist_t *active_circuit_pqueue;
-
-  /**
-   * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
-   * or_connection_t before that.
-   */
-  unsigned int active_circuit_pqueue_last_recalibrated;
-};
-
-struct ewma_policy_circ_data_s {
-  circuitmux_policy_circ_data_t base_;
-
-  /**
-   * The EWMA count for the number of cells flushed from this circuit
-   * onto this circuitmux.  Used to determine which circuit to flush
-   * from next.  This was formerly in circuit_t and or_circuit_t.
-   */
-  cell_ewma_t cell_ewma;
-
-  /**
-   * Pointer back to the circuit_t this is for; since we're separating
-   * out circuit selection policy like this, we can't attach cell_ewma_t
-   * to the circuit_t any more, so we can't use SUBTYPE_P directly to a
-   * circuit_t like before; instead get it here.
-   */
-  circuit_t *circ;
-};
+/** Each entry in an active circuit priority queue has up to this many
+ * children.  A 4-ary heap is half as deep as a binary one, and the children
+ * of an entry share a cache line or two. */
+#define EWMA_HEAP_ARITY 4
 
 #define EWMA_POL_DATA_MAGIC 0x2fd8b16aU
 #define EWMA_POL_CIRC_DATA_MAGIC 0x761e7747U
@@ -170,14 +113,13 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static int compare_cell_ewma_counts(const void *p1, const void *p2);
+static int compare_cell_ewma_counts(const ewma_heap_entry_t *e1,
+                                    const ewma_heap_entry_t *e2);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
-static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
-static void scale_active_circuits(ewma_policy_data_t *pol,
-                                  unsigned cur_tick);
+static void update_first_cell_ewma(ewma_policy_data_t *pol,
+                                   cell_ewma_t *ewma);
+static inline double log_add_exp(double a, double b);
 
 /*** Circuitmux policy methods ***/
 
@@ -218,11 +160,12 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
 /*** EWMA global variables ***/
 
-/** The per-tick scale factor to be used when computing cell-count EWMA
- * values.  (A cell sent N ticks before the start of the current tick
- * has value ewma_scale_factor ** N.)
+/** The negated natural logarithm of the per-tick scale factor to be used
+ * when computing cell-count EWMA values.  (A cell sent N ticks before the
+ * start of the current tick has value exp(-ewma_decay_per_tick * N).)  The
+ * default corresponds to a scale factor of 0.1.
  */
-static double ewma_scale_factor = 0.1;
+static double ewma_decay_per_tick = 2.302585092994045684;
 
 /*** EWMA circuitmux_policy_t method table ***/
 
@@ -245,20 +188,15 @@ static int ewma_ticks_initialized = 0;
 static monotime_coarse_t start_of_current_tick;
 /** What is the number of the current tick? */
 static unsigned current_tick_num;
+/** The value of the EWMA clock at the start of tick number
+ * <b>ewma_clock_base_tick</b>; see cell_ewma_get_clock(). */
+static double ewma_clock_base;
+/** The tick since which the EWMA clock has been advancing by
+ * <b>ewma_decay_per_tick</b> per tick. */
+static unsigned ewma_clock_base_tick;
 
 /*** EWMA method implementations using the below EWMA helper functions ***/
 
-/** Compute and return the current cell_ewma tick. */
-static inline unsigned int
-cell_ewma_get_tick(void)
-{
-  monotime_coarse_t now;
-  monotime_coarse_get(&now);
-  int32_t msec_diff = monotime_coarse_diff_msec32(&start_of_current_tick,
-                                                  &now);
-  return current_tick_num + msec_diff / (1000*EWMA_TICK_LEN);
-}
-
 /**
  * Allocate an ewma_policy_data_t and upcast it to a circuitmux_policy_data_t;
  * this is called when setting the policy on a circuitmux_t to ewma_policy.
@@ -273,8 +211,6 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
-  pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
 
   return TO_CMUX_POL_DATA(pol);
 }
@@ -294,7 +230,7 @@ ewma_free_cmux_data(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->active_circuit_pqueue);
   tor_free(pol);
 }
 
@@ -329,8 +265,7 @@ ewma_alloc_circ_data(circuitmux_t *cmux,
    * Initialize the cell_ewma_t structure (formerly in
    * init_circuit_base())
    */
-  cdata->cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
-  cdata->cell_ewma.cell_count = 0.0;
+  cdata->cell_ewma.log_count = EWMA_LOG_COUNT_NONE;
   cdata->cell_ewma.heap_index = -1;
   if (direction == CELL_DIRECTION_IN) {
     cdata->cell_ewma.is_for_p_chan = 1;
@@ -417,7 +352,7 @@ ewma_notify_circ_inactive(circuitmux_t *cmux,
 
 /**
  * Update cell_ewma for this circuit after we've sent some cells, and
- * remove/reinsert it in the queue.  This used to be done (brokenly,
+ * move it to its new place in the queue.  This used to be done (brokenly,
  * see bug 6816) in channel_flush_from_first_active_circuit().
  */
 
@@ -430,9 +365,8 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 {
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
-  unsigned int tick;
-  double fractional_tick, ewma_increment;
-  cell_ewma_t *cell_ewma, *tmp;
+  double log_increment;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -443,28 +377,19 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
-  tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
-
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
-    scale_active_circuits(pol, tick);
-  }
-
-  /* How much do we adjust the cell count in cell_ewma by? */
-  ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
+  /* How much do we adjust the cell count in cell_ewma by?  The cells we
+   * just sent have a weight of exp(clock) each. */
+  log_increment = log((double)n_cells) + cell_ewma_get_clock();
 
   /* Do the adjustment */
   cell_ewma = &(cdata->cell_ewma);
-  cell_ewma->cell_count += ewma_increment;
+  cell_ewma->log_count = log_add_exp(cell_ewma->log_count, log_increment);
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * the queue.  Move it down to where it belongs now.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  update_first_cell_ewma(pol, cell_ewma);
 }
 
 /**
@@ -486,9 +411,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
+  if (pol->active_circuit_pqueue_len > 0) {
     /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+    cell_ewma = pol->active_circuit_pqueue[0].ewma;
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -505,7 +430,7 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
 {
   ewma_policy_data_t *p1 = NULL, *p2 = NULL;
-  cell_ewma_t *ce1 = NULL, *ce2 = NULL;
+  ewma_heap_entry_t *ce1 = NULL, *ce2 = NULL;
 
   tor_assert(cmux_1);
   tor_assert(pol_data_1);
@@ -516,13 +441,14 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   p2 = TO_EWMA_POL_DATA(pol_data_2);
 
   if (p1 != p2) {
-    /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
+    /* Get the head entry from each queue.  All cell_ewma_t share the EWMA
+     * clock, so we can compare them across circuitmuxes. */
+    if (p1->active_circuit_pqueue_len > 0) {
+      ce1 = &p1->active_circuit_pqueue[0];
     }
 
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
+    if (p2->active_circuit_pqueue_len > 0) {
+      ce2 = &p2->active_circuit_pqueue[0];
     }
 
     /* Got both of them? */
@@ -549,13 +475,12 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
 /** Helper for sorting cell_ewma_t values in their priority queue. */
 static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
+compare_cell_ewma_counts(const ewma_heap_entry_t *e1,
+                         const ewma_heap_entry_t *e2)
 {
-  const cell_ewma_t *e1 = p1, *e2 = p2;
-
-  if (e1->cell_count < e2->cell_count)
+  if (e1->log_count < e2->log_count)
     return -1;
-  else if (e1->cell_count > e2->cell_count)
+  else if (e1->log_count > e2->log_count)
     return 1;
   else
     return 0;
@@ -597,12 +522,18 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    This, however, would mean we'd need to re-scale *ALL* old circuits every
    time we wanted to send a cell.
 
-   So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   But we don't need 'double' to hold the weights themselves: we can keep
+   their logarithm instead.  The logarithm of F^-N is N * -ln(F), which only
+   grows linearly with time, so it doesn't overflow for as long as Tor runs.
+   We call it the "EWMA clock".  We count a cell sent at clock value C as
+   having weight exp(C), and keep the logarithm of the sum of these weights
+   for each circuit (see log_add_exp()).  Comparing these sums compares the
+   EWMAs, without ever re-scaling any already-sent cells.
+
+   We still divide time into 'ticks' (currently, 10-second increments) to
+   keep track of the clock.  When F changes, the clock advances at the new
+   rate from the current tick on, so cells sent before the change keep their
+   weight.
  */
 
 /**
@@ -615,6 +546,8 @@ cell_ewma_initialize_ticks(void)
     return;
   monotime_coarse_get(&start_of_current_tick);
   crypto_rand((char*)&current_tick_num, sizeof(current_tick_num));
+  ewma_clock_base = 0.0;
+  ewma_clock_base_tick = current_tick_num;
   ewma_ticks_initialized = 1;
 }
 
@@ -646,6 +579,35 @@ cell_ewma_get_current_tick_and_fraction(double *remainder_out)
   return current_tick_num;
 }
 
+/** Return the current value of the EWMA clock: the natural logarithm of the
+ * weight that a cell sent now has, relative to the cells that were sent
+ * when we initialized the ticks.  It advances by <b>ewma_decay_per_tick</b>
+ * per tick. */
+STATIC double
+cell_ewma_get_clock(void)
+{
+  double fractional_tick;
+  unsigned tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+
+  /* This math can wrap around, but that's okay: unsigned overflow is
+     well-defined */
+  return ewma_clock_base +
+    ((double)(tick - ewma_clock_base_tick) + fractional_tick) *
+    ewma_decay_per_tick;
+}
+
+/** Return ln(exp(<b>a</b>) + exp(<b>b</b>)), without overflowing. */
+static inline double
+log_add_exp(double a, double b)
+{
+  if (a < b) {
+    double tmp = a;
+    a = b;
+    b = tmp;
+  }
+  return a + log1p(exp(b - a));
+}
+
 /* Default value for the CircuitPriorityHalflifeMsec consensus parameter in
  * msec. */
 #define CMUX_PRIORITY_HALFLIFE_MSEC_DEFAULT 30000
@@ -704,8 +666,9 @@ void
 cmux_ewma_set_options(const or_options_t *options,
                       const networkstatus_t *consensus)
 {
-  double halflife;
+  double halflife, fractional_tick;
   const char *source;
+  unsigned tick;
 
   cell_ewma_initialize_ticks();
 
@@ -713,110 +676,141 @@ cmux_ewma_set_options(const or_options_t *options,
    * valid configured value or the default one. */
   halflife = get_circuit_priority_halflife(options, consensus, &source);
 
+  /* Advance the EWMA clock at the old rate up to the current tick, and at
+   * the new rate from there on. */
+  tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+  ewma_clock_base += (double)(tick - ewma_clock_base_tick) *
+    ewma_decay_per_tick;
+  ewma_clock_base_tick = tick;
+
   /* convert halflife into halflife-per-tick. */
   halflife /= EWMA_TICK_LEN;
-  /* compute per-tick scale factor. */
-  ewma_scale_factor = exp( LOG_ONEHALF / halflife );
+  /* compute the logarithm of the per-tick scale factor. */
+  ewma_decay_per_tick = -LOG_ONEHALF / halflife;
   log_info(LD_OR,
            "Enabled cell_ewma algorithm because of value in %s; "
            "scale factor is %f per %d seconds",
-           source, ewma_scale_factor, EWMA_TICK_LEN);
+           source, exp(-ewma_decay_per_tick), EWMA_TICK_LEN);
 }
 
-/** Return the multiplier necessary to convert the value of a cell sent in
- * 'from_tick' to one sent in 'to_tick'. */
-static inline double
-get_scale_factor(unsigned from_tick, unsigned to_tick)
+/** Put <b>entry</b> at position <b>idx</b> of <b>pol</b>'s priority queue
+ * of active circuits. */
+static inline void
+ewma_heap_set(ewma_policy_data_t *pol, int idx, ewma_heap_entry_t entry)
 {
-  /* This math can wrap around, but that's okay: unsigned overflow is
-     well-defined */
-  int diff = (int)(to_tick - from_tick);
-  return pow(ewma_scale_factor, diff);
+  pol->active_circuit_pqueue[idx] = entry;
+  entry.ewma->heap_index = idx;
 }
 
-/** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
- * <b>cur_tick</b> */
+/** Move the entry at position <b>idx</b> of <b>pol</b>'s priority queue of
+ * active circuits toward the head until the heap property holds. */
 static void
-scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
+ewma_heap_sift_up(ewma_policy_data_t *pol, int idx)
 {
-  double factor = get_scale_factor(ewma->last_adjusted_tick, cur_tick);
-  ewma->cell_count *= factor;
-  ewma->last_adjusted_tick = cur_tick;
+  ewma_heap_entry_t *heap = pol->active_circuit_pqueue;
+  ewma_heap_entry_t entry = heap[idx];
+
+  while (idx > 0) {
+    int parent = (idx - 1) / EWMA_HEAP_ARITY;
+    if (compare_cell_ewma_counts(&heap[parent], &entry) <= 0)
+      break;
+    ewma_heap_set(pol, idx, heap[parent]);
+    idx = parent;
+  }
+  ewma_heap_set(pol, idx, entry);
 }
 
-/** Adjust the cell count of every active circuit on <b>chan</b> so
- * that they are scaled with respect to <b>cur_tick</b> */
+/** Move the entry at position <b>idx</b> of <b>pol</b>'s priority queue of
+ * active circuits away from the head until the heap property holds. */
 static void
-scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
+ewma_heap_sift_down(ewma_policy_data_t *pol, int idx)
 {
-  double factor;
-
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
-
-  factor =
-    get_scale_factor(
-      pol->active_circuit_pqueue_last_recalibrated,
-      cur_tick);
-  /** Ordinarily it isn't okay to change the value of an element in a heap,
-   * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
-               pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
-  pol->active_circuit_pqueue_last_recalibrated = cur_tick;
+  ewma_heap_entry_t *heap = pol->active_circuit_pqueue;
+  const int len = pol->active_circuit_pqueue_len;
+  ewma_heap_entry_t entry = heap[idx];
+
+  while (1) {
+    int child = idx * EWMA_HEAP_ARITY + 1, best = -1, i;
+    for (i = 0; i < EWMA_HEAP_ARITY && child + i < len; ++i) {
+      if (best < 0 ||
+          compare_cell_ewma_counts(&heap[child + i], &heap[best]) < 0)
+        best = child + i;
+    }
+    if (best < 0 || compare_cell_ewma_counts(&entry, &heap[best]) <= 0)
+      break;
+    ewma_heap_set(pol, idx, heap[best]);
+    idx = best;
+  }
+  ewma_heap_set(pol, idx, entry);
 }
 
-/** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
- * <b>pol</b>'s priority queue of active circuits */
+/** Add <b>ewma</b> to <b>pol</b>'s priority queue of active circuits */
 static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_heap_entry_t entry;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
-  scale_single_cell_ewma(
-      ewma,
-      pol->active_circuit_pqueue_last_recalibrated);
+  if (pol->active_circuit_pqueue_len == pol->active_circuit_pqueue_capacity) {
+    pol->active_circuit_pqueue_capacity =
+      pol->active_circuit_pqueue_capacity ?
+      pol->active_circuit_pqueue_capacity * 2 : 16;
+    pol->active_circuit_pqueue =
+      tor_reallocarray(pol->active_circuit_pqueue,
+                       pol->active_circuit_pqueue_capacity,
+                       sizeof(ewma_heap_entry_t));
+  }
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       offsetof(cell_ewma_t, heap_index),
-                       ewma);
+  entry.log_count = ewma->log_count;
+  entry.ewma = ewma;
+  ewma_heap_set(pol, pol->active_circuit_pqueue_len++, entry);
+  ewma_heap_sift_up(pol, pol->active_circuit_pqueue_len - 1);
 }
 
 /** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  int idx;
+
   tor_assert(pol);
   tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          offsetof(cell_ewma_t, heap_index),
-                          ewma);
+  idx = ewma->heap_index;
+  tor_assert(idx < pol->active_circuit_pqueue_len);
+  tor_assert(pol->active_circuit_pqueue[idx].ewma == ewma);
+  ewma->heap_index = -1;
+
+  if (idx != --pol->active_circuit_pqueue_len) {
+    /* Fill the hole with the last entry, and move that one to where it
+     * belongs. */
+    cell_ewma_t *moved =
+      pol->active_circuit_pqueue[pol->active_circuit_pqueue_len].ewma;
+    ewma_heap_set(pol, idx,
+                  pol->active_circuit_pqueue[pol->active_circuit_pqueue_len]);
+    ewma_heap_sift_up(pol, idx);
+    if (moved->heap_index == idx)
+      ewma_heap_sift_down(pol, idx);
+  }
 }
 
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
+/** We have just sent cells on <b>ewma</b>, the first cell_ewma_t in
+ * <b>pol</b>'s priority queue of active circuits, and updated its
+ * log_count: move it to its new place in the queue. */
+static void
+update_first_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  tor_assert(pol->active_circuit_pqueue_len > 0);
+  tor_assert(pol->active_circuit_pqueue[0].ewma == ewma);
 
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              offsetof(cell_ewma_t, heap_index));
+  pol->active_circuit_pqueue[0].log_count = ewma->log_count;
+  ewma_heap_sift_down(pol, 0);
 }
 
 /**
@@ -22,9 +22,82 @@ void cmux_ewma_set_options(const or_options_t *options,
 void circuitmux_ewma_free_all(void);
 
 #ifdef CIRCUITMUX_EWMA_PRIVATE
+
+/*** EWMA structures ***/
+
+typedef struct cell_ewma_s cell_ewma_t;
+typedef struct ewma_heap_entry_s ewma_heap_entry_t;
+typedef struct ewma_policy_data_s ewma_policy_data_t;
+typedef struct ewma_policy_circ_data_s ewma_policy_circ_data_t;
+
+/**
+ * The cell_ewma_t structure keeps track of how many cells a circuit has
+ * transferred recently.  It keeps an EWMA (exponentially weighted moving
+ * average) of the number of cells flushed from the circuit queue onto a
+ * connection in channel_flush_from_first_active_circuit().
+ */
+
+struct cell_ewma_s {
+  /** The natural logarithm of the EWMA of the cell count, measured against
+   * the EWMA clock rather than against the current time (see
+   * cell_ewma_get_clock()), so that it doesn't change while no cells are
+   * sent.  EWMA_LOG_COUNT_NONE if no cells were sent yet. */
+  double log_count;
+  /** True iff this is the cell count for a circuit's previous
+   * channel. */
+  unsigned int is_for_p_chan : 1;
+  /** The position of the circuit within the OR connection's priority
+   * queue, or -1 if it isn't in it. */
+  int heap_index;
+};
+
+/** An entry of the priority queue of active circuits of an
+ * ewma_policy_data_t.  The entry has its own copy of the log_count of its
+ * cell_ewma_t, so that we don't need to chase pointers to compare
+ * entries. */
+struct ewma_heap_entry_s {
+  double log_count;
+  cell_ewma_t *ewma;
+};
+
+struct ewma_policy_data_s {
+  circuitmux_policy_data_t base_;
+
+  /**
+   * Priority queue of cell_ewma_t for circuits with queued cells waiting
+   * for room to free up on the channel that owns this circuitmux.  Kept
+   * as a 4-ary min-heap on log_count.  This was formerly in channel_t, and
+   * in or_connection_t before that.
+   */
+  ewma_heap_entry_t *active_circuit_pqueue;
+  /** Number of entries in <b>active_circuit_pqueue</b>. */
+  int active_circuit_pqueue_len;
+  /** Number of entries that <b>active_circuit_pqueue</b> has room for. */
+  int active_circuit_pqueue_capacity;
+};
+
+struct ewma_policy_circ_data_s {
+  circuitmux_policy_circ_data_t base_;
+
+  /**
+   * The EWMA count for the number of cells flushed from this circuit
+   * onto this circuitmux.  Used to determine which circuit to flush
+   * from next.  This was formerly in circuit_t and or_circuit_t.
+   */
+  cell_ewma_t cell_ewma;
+
+  /**
+   * Pointer back to the circuit_t this is for; since we're separating
+   * out circuit selection policy like this, we can't attach cell_ewma_t
+   * to the circuit_t any more, so we can't use SUBTYPE_P directly to a
+   * circuit_t like before; instead get it here.
+   */
+  circuit_t *circ;
+};
+
 STATIC unsigned cell_ewma_get_current_tick_and_fraction(double *remainder_out);
 STATIC void cell_ewma_initialize_ticks(void);
-#endif
+STATIC double cell_ewma_get_clock(void);
+#endif /* defined(CIRCUITMUX_EWMA_PRIVATE) */
 
 #endif /* !defined(TOR_CIRCUITMUX_EWMA_H) */
-
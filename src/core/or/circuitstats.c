@@ -45,6 +45,7 @@
 #include "lib/encoding/confline.h"
 #include "feature/dirauth/authmode.h"
 
+#include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_st.h"
 #include "core/or/origin_circuit_st.h"
 #include "app/config/or_state_st.h"
@@ -56,6 +57,8 @@ static void cbt_control_event_buildtimeout_set(
                                   const circuit_build_times_t *cbt,
                                   buildtimeout_set_event_t type);
 static void circuit_build_times_scale_circ_counts(circuit_build_times_t *cbt);
+static void circuit_build_times_handle_completed_split_join(
+                                  origin_circuit_t *circ);
 
 #define CBT_BIN_TO_MS(bin) ((bin)*CBT_BIN_WIDTH + (CBT_BIN_WIDTH/2))
 
@@ -67,6 +70,12 @@ static void circuit_build_times_scale_circ_counts(circuit_build_times_t *cbt);
 // most likely.
 static circuit_build_times_t circ_times;
 
+/** Build time history of split join circuits. Join circuits are two hops
+ * long and end at a middle that the base circuit has already chosen, so
+ * their build times are learned separately from the three-hop history in
+ * circ_times. Only the build time fields of this structure are used. */
+static circuit_build_times_t split_join_times;
+
 #ifdef TOR_UNIT_TESTS
 /** If set, we're running the unit tests: we should avoid clobbering
  * our state file or accessing get_options() or get_or_state() */
@@ -690,6 +699,12 @@ circuit_build_times_handle_completed_hop(origin_circuit_t *circ)
     return;
   }
 
+  /* Split join circuits have a build time history of their own. */
+  if (circ->base_.purpose == CIRCUIT_PURPOSE_SPLIT_JOIN) {
+    circuit_build_times_handle_completed_split_join(circ);
+    return;
+  }
+
   /* Is this a circuit for which the timeout applies in a straight-forward
    * way? If so, handle it below. If not, just return (and let
    * circuit_expire_building() eventually take care of it).
@@ -924,48 +939,62 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
 }
 
 /**
- * Output a histogram of current circuit build times to
- * the or_state_t state structure.
+ * Replace *<b>lines_out</b> with a histogram of the build times in
+ * <b>cbt</b>, one <b>key</b> line per non-empty bin. Return the number of
+ * abandoned circuits in <b>cbt</b>, which are not part of the histogram.
  */
-void
-circuit_build_times_update_state(const circuit_build_times_t *cbt,
-                                 or_state_t *state)
+static int
+circuit_build_times_histogram_to_lines(const circuit_build_times_t *cbt,
+                                       const char *key,
+                                       config_line_t **lines_out)
 {
   uint32_t *histogram;
   build_time_t i = 0;
   build_time_t nbins = 0;
   config_line_t **next, *line;
+  int abandoned = 0;
 
   histogram = circuit_build_times_create_histogram(cbt, &nbins);
-  // write to state
-  config_free_lines(state->BuildtimeHistogram);
-  next = &state->BuildtimeHistogram;
+  config_free_lines(*lines_out);
+  next = lines_out;
   *next = NULL;
 
-  state->TotalBuildTimes = cbt->total_build_times;
-  state->CircuitBuildAbandonedCount = 0;
-
   for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
     if (cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-      state->CircuitBuildAbandonedCount++;
+      abandoned++;
   }
 
   for (i = 0; i < nbins; i++) {
     // compress the histogram by skipping the blanks
     if (histogram[i] == 0) continue;
     *next = line = tor_malloc_zero(sizeof(config_line_t));
-    line->key = tor_strdup("CircuitBuildTimeBin");
+    line->key = tor_strdup(key);
     tor_asprintf(&line->value, "%d %d",
             CBT_BIN_TO_MS(i), histogram[i]);
     next = &(line->next);
   }
 
+  tor_free(histogram);
+  return abandoned;
+}
+
+/**
+ * Output a histogram of current circuit build times to
+ * the or_state_t state structure.
+ */
+void
+circuit_build_times_update_state(const circuit_build_times_t *cbt,
+                                 or_state_t *state)
+{
+  state->TotalBuildTimes = cbt->total_build_times;
+  state->CircuitBuildAbandonedCount =
+    circuit_build_times_histogram_to_lines(cbt, "CircuitBuildTimeBin",
+                                           &state->BuildtimeHistogram);
+
   if (!unit_tests) {
     if (!get_options()->AvoidDiskWrites)
       or_state_mark_dirty(get_or_state(), 0);
   }
-
-  tor_free(histogram);
 }
 
 /**
@@ -1047,32 +1076,36 @@ circuit_build_times_filter_timeouts(circuit_build_times_t *cbt)
 }
 
 /**
- * Load histogram from <b>state</b>, shuffling the resulting array
- * after we do so. Use this result to estimate parameters and
- * calculate the timeout.
+ * Load <b>total</b> build times into <b>cbt</b>: <b>abandoned</b> of them
+ * are abandoned circuits, the others come from the histogram in
+ * <b>lines</b>. The loaded times are shuffled before they are stored.
  *
- * Return -1 on error.
+ * Return -1 on error, after resetting <b>cbt</b>.
  */
-int
-circuit_build_times_parse_state(circuit_build_times_t *cbt,
-                                or_state_t *state)
+static int
+circuit_build_times_load_histogram(circuit_build_times_t *cbt,
+                                   const config_line_t *lines,
+                                   int total, int abandoned)
 {
   int tot_values = 0;
   uint32_t loaded_cnt = 0, N = 0;
-  config_line_t *line;
+  const config_line_t *line;
   int i;
   build_time_t *loaded_times;
   int err = 0;
-  circuit_build_times_init(cbt);
 
-  if (circuit_build_times_disabled(get_options())) {
-    return 0;
+  if (abandoned > total) {
+    log_warn(LD_CIRC,
+             "Corrupt state file? %d abandoned circuits, but only %d "
+             "build times.", abandoned, total);
+    circuit_build_times_reset(cbt);
+    return -1;
   }
 
   /* build_time_t 0 means uninitialized */
-  loaded_times = tor_calloc(state->TotalBuildTimes, sizeof(build_time_t));
+  loaded_times = tor_calloc(total, sizeof(build_time_t));
 
-  for (line = state->BuildtimeHistogram; line; line = line->next) {
+  for (line = lines; line; line = line->next) {
     smartlist_t *args = smartlist_new();
     smartlist_split_string(args, line->value, " ",
                            SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
@@ -1110,8 +1143,8 @@ circuit_build_times_parse_state(circuit_build_times_t *cbt,
         break;
       }
 
-      if (loaded_cnt+count+ (unsigned)state->CircuitBuildAbandonedCount
-          > (unsigned) state->TotalBuildTimes) {
+      if (loaded_cnt+count+ (unsigned)abandoned
+          > (unsigned) total) {
         log_warn(LD_CIRC,
                  "Too many build times in state file. "
                  "Stopping short before %d",
@@ -1131,16 +1164,16 @@ circuit_build_times_parse_state(circuit_build_times_t *cbt,
   }
 
   log_info(LD_CIRC,
-           "Adding %d timeouts.", state->CircuitBuildAbandonedCount);
-  for (i=0; i < state->CircuitBuildAbandonedCount; i++) {
+           "Adding %d timeouts.", abandoned);
+  for (i=0; i < abandoned; i++) {
     loaded_times[loaded_cnt++] = CBT_BUILD_ABANDONED;
   }
 
-  if (loaded_cnt != (unsigned)state->TotalBuildTimes) {
+  if (loaded_cnt != (unsigned)total) {
     log_warn(LD_CIRC,
             "Corrupt state file? Build times count mismatch. "
             "Read %d times, but file says %d", loaded_cnt,
-            state->TotalBuildTimes);
+            total);
     err = 1;
     circuit_build_times_reset(cbt);
     goto done;
@@ -1163,20 +1196,48 @@ circuit_build_times_parse_state(circuit_build_times_t *cbt,
     log_warn(LD_CIRC,
             "Corrupt state file? Shuffled build times mismatch. "
             "Read %d times, but file says %d", tot_values,
-            state->TotalBuildTimes);
+            total);
     err = 1;
     circuit_build_times_reset(cbt);
     goto done;
   }
 
+ done:
+  tor_free(loaded_times);
+  return err ? -1 : 0;
+}
+
+/**
+ * Load histogram from <b>state</b>, shuffling the resulting array
+ * after we do so. Use this result to estimate parameters and
+ * calculate the timeout.
+ *
+ * Return -1 on error.
+ */
+int
+circuit_build_times_parse_state(circuit_build_times_t *cbt,
+                                or_state_t *state)
+{
+  int err = 0;
+  circuit_build_times_init(cbt);
+
+  if (circuit_build_times_disabled(get_options())) {
+    return 0;
+  }
+
+  if (circuit_build_times_load_histogram(cbt, state->BuildtimeHistogram,
+                                         state->TotalBuildTimes,
+                                         state->CircuitBuildAbandonedCount)
+      < 0) {
+    err = 1;
+  }
+
   circuit_build_times_set_timeout(cbt);
 
   if (!state->CircuitBuildAbandonedCount && cbt->total_build_times) {
     circuit_build_times_filter_timeouts(cbt);
   }
 
- done:
-  tor_free(loaded_times);
   return err ? -1 : 0;
 }
 
@@ -1876,6 +1937,151 @@ circuit_build_times_set_timeout(circuit_build_times_t *cbt)
   }
 }
 
+/** Return the time to wait before giving up on an under-construction split
+ * join circuit, in milliseconds.
+ *
+ * Until we have learned a timeout from enough join circuits, scale the
+ * general timeout: a two-hop circuit needs 3 of the 6 link traversals of a
+ * three-hop circuit (see circuit_expire_building()). */
+double
+get_split_join_build_timeout_ms(void)
+{
+  if (circuit_build_times_disabled(get_options()) ||
+      !split_join_times.have_computed_timeout)
+    return get_circuit_build_timeout_ms() * (3/6.0);
+
+  return MAX(split_join_times.timeout_ms,
+             circuit_build_times_min_timeout() * (3/6.0));
+}
+
+/**
+ * Estimate a new split join circuit timeout from the history in
+ * split_join_times, once we have observed enough join circuits.
+ */
+static void
+circuit_build_times_set_split_join_timeout(void)
+{
+  circuit_build_times_t *cbt = &split_join_times;
+  build_time_t max_time;
+
+  if (cbt->total_build_times < CBT_SPLIT_JOIN_MIN_CIRCUITS_TO_OBSERVE)
+    return;
+
+  if (!circuit_build_times_update_alpha(cbt))
+    return;
+
+  cbt->timeout_ms = circuit_build_times_calculate_timeout(cbt,
+                                circuit_build_times_quantile_cutoff());
+
+  max_time = circuit_build_times_max(cbt);
+  if (cbt->timeout_ms > max_time)
+    cbt->timeout_ms = max_time;
+
+  cbt->have_computed_timeout = 1;
+
+  log_info(LD_CIRC,
+           "Set split join circuit build timeout to %fms (Xm: %d, a: %f) "
+           "based on %d join circuit times",
+           cbt->timeout_ms, cbt->Xm, cbt->alpha, cbt->total_build_times);
+}
+
+/**
+ * Add the split join circuit build time <b>btime</b> (which may be
+ * CBT_BUILD_ABANDONED) to our join history, and update the join timeout.
+ */
+STATIC void
+circuit_build_times_add_split_join_time(build_time_t btime)
+{
+  if (circuit_build_times_add_time(&split_join_times, btime) < 0)
+    return;
+
+  circuit_build_times_set_split_join_timeout();
+}
+
+/**
+ * Record the build time of the split join circuit <b>circ</b>, if it has
+ * just completed its last hop.
+ */
+static void
+circuit_build_times_handle_completed_split_join(origin_circuit_t *circ)
+{
+  struct timeval end;
+  long timediff;
+
+  if (circ->has_opened ||
+      circuit_get_cpath_opened_len(circ) !=
+        circ->build_state->desired_path_len)
+    return;
+
+  tor_gettimeofday(&end);
+  timediff = tv_mdiff(&circ->base_.timestamp_began, &end);
+
+  if (timediff <= 0 ||
+      timediff > 2*get_circuit_build_close_time_ms()+1000) {
+    log_notice(LD_CIRC, "Strange value for split join circuit build time: "
+               "%ldmsec. Assuming clock jump.", timediff);
+    return;
+  }
+
+  /* Only count circuit times if the network is live */
+  if (circuit_build_times_network_check_live(get_circuit_build_times()))
+    circuit_build_times_add_split_join_time((build_time_t)timediff);
+}
+
+/**
+ * Count a split join circuit that timed out before it was built. It is
+ * recorded as abandoned (right-censored), so that a learned join timeout
+ * that is too short grows again.
+ */
+void
+circuit_build_times_count_split_join_timeout(void)
+{
+  if (circuit_build_times_disabled(get_options()))
+    return;
+
+  if (circuit_build_times_network_check_live(get_circuit_build_times()))
+    circuit_build_times_add_split_join_time(CBT_BUILD_ABANDONED);
+}
+
+/**
+ * Output a histogram of split join circuit build times to the or_state_t
+ * state structure.
+ */
+void
+circuit_build_times_update_split_join_state(or_state_t *state)
+{
+  state->TotalSplitJoinBuildTimes = split_join_times.total_build_times;
+  state->SplitJoinBuildAbandonedCount =
+    circuit_build_times_histogram_to_lines(&split_join_times,
+                                     "SplitJoinBuildTimeBin",
+                                     &state->SplitJoinBuildtimeHistogram);
+}
+
+/**
+ * Load the split join circuit build time histogram from <b>state</b> and
+ * use it to compute the join timeout.
+ *
+ * Return -1 on error.
+ */
+int
+circuit_build_times_parse_split_join_state(or_state_t *state)
+{
+  memset(&split_join_times, 0, sizeof(split_join_times));
+
+  if (circuit_build_times_disabled(get_options()))
+    return 0;
+
+  if (circuit_build_times_load_histogram(&split_join_times,
+                                         state->SplitJoinBuildtimeHistogram,
+                                         state->TotalSplitJoinBuildTimes,
+                                         state->SplitJoinBuildAbandonedCount)
+      < 0)
+    return -1;
+
+  circuit_build_times_set_split_join_timeout();
+  return 0;
+}
+
 #ifdef TOR_UNIT_TESTS
 /** Make a note that we're running unit tests (rather than running Tor
  * itself), so we avoid clobbering our state file. */
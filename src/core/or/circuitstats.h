@@ -16,6 +16,7 @@ const circuit_build_times_t *get_circuit_build_times(void);
 circuit_build_times_t *get_circuit_build_times_mutable(void);
 double get_circuit_build_close_time_ms(void);
 double get_circuit_build_timeout_ms(void);
+double get_split_join_build_timeout_ms(void);
 
 int circuit_build_times_disabled(const or_options_t *options);
 int circuit_build_times_disabled_(const or_options_t *options,
@@ -50,6 +51,10 @@ double circuit_build_times_close_rate(const circuit_build_times_t *cbt);
 void circuit_build_times_update_last_circ(circuit_build_times_t *cbt);
 void circuit_build_times_mark_circ_as_measurement_only(origin_circuit_t *circ);
 
+void circuit_build_times_count_split_join_timeout(void);
+void circuit_build_times_update_split_join_state(or_state_t *state);
+int circuit_build_times_parse_split_join_state(or_state_t *state);
+
 /** Total size of the circuit timeout history to accumulate.
  * 1000 is approx 2.5 days worth of continual-use circuits. */
 #define CBT_NCIRCUITS_TO_OBSERVE 1000
@@ -69,6 +74,9 @@ void circuit_build_times_mark_circ_as_measurement_only(origin_circuit_t *circ);
 #define CBT_BUILD_ABANDONED ((build_time_t)(INT32_MAX-1))
 #define CBT_BUILD_TIME_MAX ((build_time_t)(INT32_MAX))
 
+/** Minimum split join circuits before estimating a join circuit timeout */
+#define CBT_SPLIT_JOIN_MIN_CIRCUITS_TO_OBSERVE 20
+
 /** Save state every 10 circuits */
 #define CBT_SAVE_STATE_EVERY 10
 
@@ -138,6 +146,7 @@ STATIC double circuit_build_times_calculate_timeout(circuit_build_times_t *cbt,
                                              double quantile);
 STATIC int circuit_build_times_update_alpha(circuit_build_times_t *cbt);
 STATIC void circuit_build_times_reset(circuit_build_times_t *cbt);
+STATIC void circuit_build_times_add_split_join_time(build_time_t btime);
 
 /* Network liveness functions */
 STATIC int circuit_build_times_network_check_changed(
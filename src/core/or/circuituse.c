@@ -456,6 +456,29 @@ circuit_conforms_to_options(const origin_circuit_t *circ,
 }
 #endif /* 0 */
 
+/** Return true iff circuit_expire_building() may have to act on
+ * <b>circ</b>: that is, iff it is an unmarked origin circuit that is still
+ * being built, or that is open but whose purpose still has a deadline. */
+int
+circuit_may_expire_building(const circuit_t *circ)
+{
+  if (!CIRCUIT_IS_ORIGIN(circ) || circ->marked_for_close)
+    return 0;
+  if (circ->state != CIRCUIT_STATE_OPEN)
+    return 1;
+  switch (circ->purpose) {
+    case CIRCUIT_PURPOSE_S_ESTABLISH_INTRO:
+    case CIRCUIT_PURPOSE_C_REND_READY:
+    case CIRCUIT_PURPOSE_PATH_BIAS_TESTING:
+    case CIRCUIT_PURPOSE_C_ESTABLISH_REND:
+    case CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED:
+    case CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
 /**
  * Close all circuits that start at us, aren't open, and were born
  * at least CircuitBuildTimeout seconds ago.
@@ -482,6 +505,8 @@ circuit_expire_building(void)
   struct timeval now;
   cpath_build_state_t *build_state;
   int any_opened_circs = 0;
+  smartlist_t *candidates;
+  int i;
 
   tor_gettimeofday(&now);
 
@@ -532,6 +557,9 @@ circuit_expire_building(void)
    * Two hops (SPLIT_JOIN circuit)
    *   RTTs = 2a + b
    *   RTTs = 3h
+   *
+   * SPLIT_JOIN circuits only use this scaling until they have learned a
+   * timeout of their own; see get_split_join_build_timeout_ms().
    */
   SET_CUTOFF(general_cutoff, get_circuit_build_timeout_ms());
   SET_CUTOFF(begindir_cutoff, get_circuit_build_timeout_ms());
@@ -567,14 +595,23 @@ circuit_expire_building(void)
              MAX(get_circuit_build_close_time_ms()*2 + 1000,
                  options->SocksTimeout * 1000));
 
-  SET_CUTOFF(split_join_cutoff, get_circuit_build_timeout_ms() * (3/6.0));
+  SET_CUTOFF(split_join_cutoff, get_split_join_build_timeout_ms());
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *,victim) {
+  /* Drop the circuits that have opened or been marked since we last looked,
+   * so that we only walk the ones we may have to act on. */
+  candidates = circuit_get_build_expiry_list();
+  for (i = smartlist_len(candidates) - 1; i >= 0; --i) {
+    origin_circuit_t *ocirc = smartlist_get(candidates, i);
+    if (!circuit_may_expire_building(TO_CIRCUIT(ocirc)))
+      circuit_remove_from_build_expiry_list(ocirc);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(candidates, origin_circuit_t *, ocirc) {
+    circuit_t *victim = TO_CIRCUIT(ocirc);
     struct timeval cutoff;
     bool fixed_time = circuit_build_times_disabled(get_options());
 
-    if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
-        victim->marked_for_close)     /* don't mess with marked circs */
+    if (victim->marked_for_close)     /* don't mess with marked circs */
       continue;
 
     /* If we haven't yet started the first hop, it means we don't have
@@ -751,6 +788,9 @@ circuit_expire_building(void)
         continue;
       }
 
+      if (victim->purpose == CIRCUIT_PURPOSE_SPLIT_JOIN)
+        circuit_build_times_count_split_join_timeout();
+
       if (circuit_timeout_want_to_count_circ(TO_ORIGIN_CIRCUIT(victim)) &&
           circuit_build_times_enough_to_compute(get_circuit_build_times())) {
 
@@ -870,7 +910,7 @@ circuit_expire_building(void)
       circuit_mark_for_close(victim, END_CIRC_REASON_TIMEOUT);
 
     pathbias_count_timeout(TO_ORIGIN_CIRCUIT(victim));
-  } SMARTLIST_FOREACH_END(victim);
+  } SMARTLIST_FOREACH_END(ocirc);
 }
 
 /**
@@ -1506,8 +1546,10 @@ circuit_expire_old_circuits_clientside(void)
   tor_gettimeofday(&now);
   last_expired_clientside_circuits = now.tv_sec;
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close || !CIRCUIT_IS_ORIGIN(circ))
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, ocirc) {
+    circuit_t *circ = TO_CIRCUIT(ocirc);
+    if (circ->marked_for_close)
       continue;
 
     cutoff = now;
@@ -1572,7 +1614,7 @@ circuit_expire_old_circuits_clientside(void)
         }
       }
     }
-  } SMARTLIST_FOREACH_END(circ);
+  } SMARTLIST_FOREACH_END(ocirc);
 }
 
 /** How long do we wait before killing circuits with the properties
@@ -1595,35 +1637,48 @@ circuit_expire_old_circuits_clientside(void)
 /** Find each non-origin circuit that has been unused for too long,
  * has no streams on it, came from a client, and ends here: mark it
  * for close.
- */
-void
+ *
+ * Only the circuits whose idle-expiry deadline has passed get looked at;
+ * the others get a new deadline.  Return the number of seconds until the
+ * next deadline. */
+int
 circuit_expire_old_circuits_serverside(time_t now)
 {
   or_circuit_t *or_circ;
-  time_t cutoff = now - IDLE_ONE_HOP_CIRC_TIMEOUT;
-
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close || CIRCUIT_IS_ORIGIN(circ))
+  time_t next;
+
+  while ((or_circ = circuit_pop_idle_expiry(now))) {
+    circuit_t *circ = TO_CIRCUIT(or_circ);
+    time_t last_xmit;
+    /* Circuits that can never qualify don't go back on the heap. */
+    if (circ->marked_for_close || !or_circ->p_chan ||
+        !channel_is_client(or_circ->p_chan) || circ->n_chan)
+      continue;
+    /* If there are streams on it, or if there is a rend_splice on it (a
+     * single onion service circuit), we should not close it yet. */
+    if (or_circ->n_streams || or_circ->resolving_streams ||
+        or_circ->rend_splice) {
+      circuit_set_idle_expiry_deadline(or_circ,
+                                       now + IDLE_ONE_HOP_CIRC_TIMEOUT);
       continue;
-    or_circ = TO_OR_CIRCUIT(circ);
-    /* If the circuit has been idle for too long, and there are no streams
-     * on it, and it ends here, and it used a create_fast, mark it for close.
-     *
-     * Also if there is a rend_splice on it, it's a single onion service
-     * circuit and we should not close it.
-     */
-    if (or_circ->p_chan && channel_is_client(or_circ->p_chan) &&
-        !circ->n_chan &&
-        !or_circ->n_streams && !or_circ->resolving_streams &&
-        !or_circ->rend_splice &&
-        channel_when_last_xmit(or_circ->p_chan) <= cutoff) {
-      log_info(LD_CIRC, "Closing circ_id %u (empty %d secs ago)",
-               (unsigned)or_circ->p_circ_id,
-               (int)(now - channel_when_last_xmit(or_circ->p_chan)));
-      circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
     }
+    /* If the circuit has been idle for too long, and it ends here, and it
+     * used a create_fast, mark it for close. */
+    last_xmit = channel_when_last_xmit(or_circ->p_chan);
+    if (last_xmit + IDLE_ONE_HOP_CIRC_TIMEOUT > now) {
+      circuit_set_idle_expiry_deadline(or_circ,
+                                       last_xmit + IDLE_ONE_HOP_CIRC_TIMEOUT);
+      continue;
+    }
+    log_info(LD_CIRC, "Closing circ_id %u (empty %d secs ago)",
+             (unsigned)or_circ->p_circ_id, (int)(now - last_xmit));
+    circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
   }
-  SMARTLIST_FOREACH_END(circ);
+
+  next = circuit_get_next_idle_expiry();
+  if (!next || next - now > IDLE_ONE_HOP_CIRC_TIMEOUT)
+    return IDLE_ONE_HOP_CIRC_TIMEOUT;
+  return (int)(next - now);
 }
 
 /** Number of testing circuits we want open before testing our bandwidth. */
@@ -3176,6 +3231,7 @@ circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
 
   old_purpose = circ->purpose;
   circ->purpose = new_purpose;
+  circuit_update_build_expiry_list(circ);
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
     control_event_circuit_purpose_changed(TO_ORIGIN_CIRCUIT(circ),
@@ -12,6 +12,7 @@
 #ifndef TOR_CIRCUITUSE_H
 #define TOR_CIRCUITUSE_H
 
+int circuit_may_expire_building(const circuit_t *circ);
 void circuit_expire_building(void);
 void circuit_expire_waiting_for_better_guard(void);
 void circuit_remove_handled_ports(smartlist_t *needed_ports);
@@ -26,7 +27,7 @@ void circuit_build_needed_circs(time_t now);
 void circuit_expire_old_circs_as_needed(time_t now);
 void circuit_detach_stream(circuit_t *circ, edge_connection_t *conn);
 
-void circuit_expire_old_circuits_serverside(time_t now);
+int circuit_expire_old_circuits_serverside(time_t now);
 
 void reset_bandwidth_test(void);
 int circuit_enough_testing_circs(void);
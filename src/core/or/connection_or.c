@@ -687,6 +687,10 @@ connection_or_finished_flushing(or_connection_t *conn)
       return -1;
   }
 
+  /* Housekeeping measures how long the outbuf has been nonempty from
+   * here. */
+  conn->timestamp_lastempty = approx_time();
+
   /* Update the channel's active timestamp if there is one */
   if (conn->chan)
     channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
@@ -796,6 +800,7 @@ connection_or_digest_is_known_relay(const char *id_digest)
  * per-conn limits that are big enough they'll never matter. But if it's
  * not a known relay, first check if we set PerConnBwRate/Burst, then
  * check if the consensus sets them, else default to 'big enough'.
+ * On testing networks, TestingORConnBWRate/Burst override all of this.
  *
  * If <b>reset</b> is true, set the bucket to be full.  Otherwise, just
  * clip the bucket if it happens to be <em>too</em> full.
@@ -805,7 +810,13 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
                                           const or_options_t *options)
 {
   int rate, burst; /* per-connection rate limiting params */
-  if (connection_or_digest_is_known_relay(conn->identity_digest)) {
+  if ((options->TestingTorNetwork || options->UsingTestNetworkDefaults_) &&
+      options->TestingORConnBWRate) {
+    /* Shaping every link of a testing network, e.g. for benchmarks. */
+    rate = (int)options->TestingORConnBWRate;
+    burst = options->TestingORConnBWBurst ?
+      (int)options->TestingORConnBWBurst : rate;
+  } else if (connection_or_digest_is_known_relay(conn->identity_digest)) {
     /* It's in the consensus, or we have a descriptor for it meaning it
      * was probably in a recent consensus. It's a recognized relay:
      * give it full bandwidth. */
@@ -866,6 +877,8 @@ connection_or_set_canonical(or_connection_t *or_conn,
           or_conn->chan ?
           (TLS_CHAN_TO_BASE(or_conn->chan)->global_identifier):0,
           or_conn->idle_timeout);
+  /* The new idle timeout may be due sooner than housekeeping expects. */
+  connection_schedule_housekeeping(TO_CONN(or_conn), 0);
 }
 
 /** If we don't necessarily know the router we're connecting to, but we
@@ -2255,6 +2268,8 @@ connection_or_set_state_open(or_connection_t *conn)
   or_handshake_state_free(conn->handshake_state);
   conn->handshake_state = NULL;
   connection_start_reading(TO_CONN(conn));
+  /* Open connections have different deadlines, and may need padding. */
+  connection_schedule_housekeeping(TO_CONN(conn), 0);
 
   return 0;
 }
@@ -10,6 +10,8 @@
 #include <net/if.h>
 
 struct buf_t;
+struct connection_uring_t;
+struct timeout;
 
 /* Values for connection_t.magic: used to make sure that downcasts (casts from
 * connection_t to foo_connection_t) are safe. */
@@ -100,6 +102,15 @@ struct connection_t {
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
+  /** If we do this connection's socket I/O through an io_uring, the state
+   * of its requests.  See connection_uring.c. */
+  struct connection_uring_t *uring;
+  /** Timer that runs run_connection_housekeeping() on this connection, if
+   * it is an OR or directory connection. */
+  struct timeout *housekeeping_timer;
+  /** When <b>housekeeping_timer</b> is next due to fire, or 0 if it is not
+   * scheduled. */
+  time_t housekeeping_due;
   struct buf_t *inbuf; /**< Buffer holding data read over this connection. */
   struct buf_t *outbuf; /**< Buffer holding data to write over this
                          * connection. */
@@ -22,6 +22,7 @@
 #include "lib/crypt_ops/crypto_rand.h"
 
 #include "core/or/dos.h"
+#include "core/or/dos_sketch.h"
 
 #include "core/or/or_connection_st.h"
 
@@ -71,6 +72,10 @@ static uint64_t conn_num_addr_rejected;
 /* Keep stats for the heartbeat. */
 static uint64_t num_single_hop_client_refused;
 
+/* Do we count per-address statistics in the sketches of dos_sketch.c instead
+ * of the geoip client cache? */
+static unsigned int dos_sketch_enabled = 0;
+
 /* Return true iff the circuit creation mitigation is enabled. We look at the
  * consensus for this else a default value is returned. */
 MOCK_IMPL(STATIC unsigned int,
@@ -187,6 +192,18 @@ get_param_conn_defense_type(const networkstatus_t *ns)
                                  DOS_CONN_DEFENSE_NONE, DOS_CONN_DEFENSE_MAX);
 }
 
+/* Return true iff per-address statistics should be counted in sketches. We
+ * look at the consensus for this else a default value is returned. */
+MOCK_IMPL(STATIC unsigned int,
+get_param_sketch_enabled, (const networkstatus_t *ns))
+{
+  if (get_options()->DoSSketchEnabled != -1) {
+    return get_options()->DoSSketchEnabled;
+  }
+  return !!networkstatus_get_param(ns, "DoSSketchEnabled",
+                                   DOS_SKETCH_ENABLED_DEFAULT, 0, 1);
+}
+
 /* Set circuit creation parameters located in the consensus or their default
  * if none are present. Called at initialization or when the consensus
  * changes. */
@@ -205,6 +222,9 @@ set_dos_parameters(const networkstatus_t *ns)
   dos_conn_enabled = get_param_conn_enabled(ns);
   dos_conn_max_concurrent_count = get_param_conn_max_concurrent_count(ns);
   dos_conn_defense_type = get_param_conn_defense_type(ns);
+
+  /* Per-address accounting. */
+  dos_sketch_enabled = get_param_sketch_enabled(ns);
 }
 
 /* Free everything for the circuit creation DoS mitigation subsystem. */
@@ -385,6 +405,14 @@ cc_channel_addr_is_marked(channel_t *chan)
     goto end;
   }
 
+  now = approx_time();
+
+  /* With sketches, only heavy hitters can be marked. */
+  if (dos_sketch_enabled) {
+    stats = dos_sketch_heavy_hitter_get(&addr, now);
+    goto end;
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
   if (entry == NULL) {
@@ -393,7 +421,6 @@ cc_channel_addr_is_marked(channel_t *chan)
      * entry for the channel. */
     goto end;
   }
-  now = approx_time();
   stats = &entry->dos_stats.cc_stats;
 
  end:
@@ -421,6 +448,53 @@ conn_consensus_has_changed(const networkstatus_t *ns)
   }
 }
 
+/* Sketch private API. */
+
+/* Handle a CREATE cell from client address <b>addr</b> when per-address
+ * statistics are counted in sketches. The circuit sketch tells us roughly
+ * how far into its burst the address is; once that is at least half the
+ * burst, we track the address exactly as a heavy hitter, starting its
+ * bucket from the sketch estimate, and only then can it get marked. */
+static void
+cc_sketch_new_create_cell(const tor_addr_t *addr)
+{
+  cc_client_stats_t *stats;
+  uint32_t level;
+  const time_t now = approx_time();
+
+  level = dos_sketch_circ_note(addr, dos_cc_circuit_rate, now);
+
+  stats = dos_sketch_heavy_hitter_get(addr, now);
+  if (stats == NULL) {
+    if (level < dos_cc_circuit_burst / 2) {
+      goto end;
+    }
+    stats = dos_sketch_heavy_hitter_add(addr, now);
+    /* The estimate counts this cell, which we take a token for below. */
+    stats->circuit_bucket = dos_cc_circuit_burst -
+      MIN(level - 1, dos_cc_circuit_burst);
+    stats->last_circ_bucket_refill_ts = now;
+  }
+
+  /* From here on, this is the same as for a geoip cache entry. */
+  cc_stats_refill_bucket(stats, addr);
+  if (stats->circuit_bucket > 0) {
+    stats->circuit_bucket--;
+  }
+  if (stats->circuit_bucket == 0 &&
+      dos_sketch_conn_estimate(addr) >= dos_cc_min_concurrent_conn) {
+    if (stats->marked_until_ts == 0) {
+      log_debug(LD_DOS, "Detected circuit creation DoS by address: %s",
+                fmt_addr(addr));
+      cc_num_marked_addrs++;
+    }
+    cc_mark_client(stats);
+  }
+
+ end:
+  return;
+}
+
 /* General private API */
 
 /* Return true iff we have at least one DoS detection enabled. This is used to
@@ -456,6 +530,11 @@ dos_cc_new_create_cell(channel_t *chan)
     goto end;
   }
 
+  if (dos_sketch_enabled) {
+    cc_sketch_new_create_cell(&addr);
+    goto end;
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
   if (entry == NULL) {
@@ -532,6 +611,7 @@ dos_conn_defense_type_t
 dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 {
   clientmap_entry_t *entry;
+  uint32_t concurrent_count;
 
   tor_assert(addr);
 
@@ -540,15 +620,20 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    goto end;
+  if (dos_sketch_enabled) {
+    concurrent_count = dos_sketch_conn_estimate(addr);
+  } else {
+    /* We are only interested in client connection from the geoip cache. */
+    entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
+    if (entry == NULL) {
+      goto end;
+    }
+    concurrent_count = entry->dos_stats.concurrent_count;
   }
 
   /* Need to be above the maximum concurrent connection count to trigger a
    * defense. */
-  if (entry->dos_stats.concurrent_count > dos_conn_max_concurrent_count) {
+  if (concurrent_count > dos_conn_max_concurrent_count) {
     conn_num_addr_rejected++;
     return dos_conn_defense_type;
   }
@@ -691,6 +776,12 @@ dos_new_client_conn(or_connection_t *or_conn, const char *transport_name)
     goto end;
   }
 
+  if (dos_sketch_enabled) {
+    dos_sketch_conn_add(&or_conn->real_addr);
+    or_conn->tracked_in_dos_sketch = 1;
+    goto end;
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(&or_conn->real_addr, transport_name,
                               GEOIP_CLIENT_CONNECT);
@@ -718,6 +809,13 @@ dos_close_client_conn(const or_connection_t *or_conn)
 
   tor_assert(or_conn);
 
+  /* A connection is counted wherever it was counted when it opened, even if
+   * we have switched between sketches and the geoip cache since. */
+  if (or_conn->tracked_in_dos_sketch) {
+    dos_sketch_conn_remove(&or_conn->real_addr);
+    goto end;
+  }
+
   /* We have to decrement the count on tracked connection only even if the
    * subsystem has been disabled at runtime because it might be re-enabled
    * after and we need to keep a synchronized counter at all time. */
@@ -790,6 +888,19 @@ dos_free_all(void)
   /* Free the connection mitigation subsystem. It is safe to do this even if
    * it wasn't initialized. */
   conn_free_all();
+
+  /* Free the sketches. The connections counted in them aren't anymore, so
+   * clear their flag: closing them must not decrement the counters of
+   * sketches that we allocate later. */
+  dos_sketch_enabled = 0;
+  dos_sketch_free_all();
+  if (get_connection_array()) {
+    SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+      if (conn->type == CONN_TYPE_OR) {
+        TO_OR_CONN(conn)->tracked_in_dos_sketch = 0;
+      }
+    } SMARTLIST_FOREACH_END(conn);
+  }
 }
 
 /* Initialize the Denial of Service subsystem. */
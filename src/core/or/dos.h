@@ -118,6 +118,13 @@ typedef enum dos_conn_defense_type_t {
 
 dos_conn_defense_type_t dos_conn_addr_get_defense_type(const tor_addr_t *addr);
 
+/*
+ * Per-address accounting.
+ */
+
+/* DoSSketchEnabled default. Disabled by default. */
+#define DOS_SKETCH_ENABLED_DEFAULT 0
+
 #ifdef DOS_PRIVATE
 
 STATIC uint32_t get_param_conn_max_concurrent_count(
@@ -134,6 +141,8 @@ MOCK_DECL(STATIC unsigned int, get_param_cc_enabled,
           (const networkstatus_t *ns));
 MOCK_DECL(STATIC unsigned int, get_param_conn_enabled,
           (const networkstatus_t *ns));
+MOCK_DECL(STATIC unsigned int, get_param_sketch_enabled,
+          (const networkstatus_t *ns));
 
 #endif /* TOR_DOS_PRIVATE */
 
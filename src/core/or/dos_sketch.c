@@ -0,0 +1,315 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/*
+ * \file dos_sketch.c
+ * \brief Fixed-memory per-address accounting for the DoS subsystem.
+ *
+ * The default DoS accounting keeps exact statistics for each client address
+ * in the geoip client map, which grows with the number of distinct
+ * addresses we see. When the "DoSSketchEnabled" consensus parameter is set,
+ * dos.c uses this module instead:
+ *
+ * Concurrent connections per address are counted in a count-min sketch:
+ * DOS_SKETCH_DEPTH rows of DOS_SKETCH_WIDTH counters, where each address
+ * increments one counter per row and its estimate is the smallest of them.
+ * Collisions can only make an estimate too high, never too low.
+ *
+ * Circuit creations are counted in a second sketch whose counters are leaky
+ * buckets: each one drains at the circuit rate, and we only raise the
+ * counters of an address as far as its new estimate (the "conservative
+ * update" rule), which keeps collisions from piling up.
+ *
+ * Once an address's circuit estimate gets close to the burst, dos.c promotes
+ * it to a small exact table of heavy hitters, keeping a cc_client_stats_t
+ * for it just as the geoip client map would. Only addresses in that table
+ * can be marked, so a sketch collision alone never marks an address.
+ *
+ * All the row indexes (and the heavy hitter slot) for an address come from
+ * a single keyed 64-bit hash, split into DOS_SKETCH_WIDTH_BITS-bit pieces
+ * the way bloomfilt.c splits its hashes, so each lookup hashes the address
+ * once.
+ */
+
+#include "core/or/or.h"
+#include "core/or/dos_sketch.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "siphash.h"
+
+/* A circuit creation counter: a leaky bucket holding <b>level</b> circuits
+ * as of <b>last_ts</b>, draining at the circuit rate. */
+typedef struct dos_sketch_circ_counter_t {
+  uint32_t level;
+  uint32_t last_ts;
+} dos_sketch_circ_counter_t;
+
+/* An entry in the table of heavy hitters. */
+typedef struct dos_sketch_heavy_hitter_t {
+  /* Is this slot in use? */
+  unsigned int in_use : 1;
+  /* The client address. */
+  tor_addr_t addr;
+  /* When did we last look this address up? Used to pick a victim when we
+   * need the slot for another address. */
+  time_t last_seen_ts;
+  /* Exact circuit creation statistics for this address. */
+  cc_client_stats_t stats;
+} dos_sketch_heavy_hitter_t;
+
+/* Key for the address hash. Random, so that nobody can pick addresses that
+ * collide on purpose. */
+static struct sipkey sketch_key;
+/* The concurrent connection sketch: DOS_SKETCH_DEPTH rows of
+ * DOS_SKETCH_WIDTH counters. NULL until dos_sketch_init() runs. */
+static uint32_t *conn_counters = NULL;
+/* The circuit creation sketch, laid out as conn_counters. */
+static dos_sketch_circ_counter_t *circ_counters = NULL;
+/* The table of heavy hitters, with DOS_SKETCH_HH_SIZE slots. */
+static dos_sketch_heavy_hitter_t *heavy_hitters = NULL;
+/* Number of slots in use in heavy_hitters. */
+static int n_heavy_hitters = 0;
+
+/* Return the hash of <b>addr</b> that picks its counters and slot. */
+static inline uint64_t
+sketch_hash(const tor_addr_t *addr)
+{
+  return tor_addr_keyed_hash(&sketch_key, addr);
+}
+
+/* Return the index, within the whole sketch, of the counter for hash
+ * <b>h</b> in row <b>row</b>. */
+static inline unsigned
+sketch_counter_idx(uint64_t h, int row)
+{
+  const unsigned col = (unsigned)(h >> (row * DOS_SKETCH_WIDTH_BITS)) &
+    (DOS_SKETCH_WIDTH - 1);
+  return row * DOS_SKETCH_WIDTH + col;
+}
+
+/* Return the first slot in the table of heavy hitters for hash <b>h</b>.
+ * We use the bits that the rows don't. */
+static inline unsigned
+sketch_heavy_hitter_idx(uint64_t h)
+{
+  return (unsigned)(h >> (DOS_SKETCH_DEPTH * DOS_SKETCH_WIDTH_BITS)) ^
+    (unsigned)h;
+}
+
+/* Allocate the sketches and the table of heavy hitters if we haven't yet.
+ * Their size never changes after this. */
+void
+dos_sketch_init(void)
+{
+  if (conn_counters)
+    return;
+  crypto_rand((char *)&sketch_key, sizeof(sketch_key));
+  conn_counters = tor_calloc(DOS_SKETCH_DEPTH * DOS_SKETCH_WIDTH,
+                             sizeof(uint32_t));
+  circ_counters = tor_calloc(DOS_SKETCH_DEPTH * DOS_SKETCH_WIDTH,
+                             sizeof(dos_sketch_circ_counter_t));
+  heavy_hitters = tor_calloc(DOS_SKETCH_HH_SIZE,
+                             sizeof(dos_sketch_heavy_hitter_t));
+  n_heavy_hitters = 0;
+}
+
+/* Free everything held by this module. */
+void
+dos_sketch_free_all(void)
+{
+  tor_free(conn_counters);
+  tor_free(circ_counters);
+  tor_free(heavy_hitters);
+  n_heavy_hitters = 0;
+}
+
+/* Note a new concurrent connection from <b>addr</b>. */
+void
+dos_sketch_conn_add(const tor_addr_t *addr)
+{
+  uint64_t h;
+  int row;
+
+  dos_sketch_init();
+  h = sketch_hash(addr);
+  for (row = 0; row < DOS_SKETCH_DEPTH; ++row) {
+    uint32_t *counter = &conn_counters[sketch_counter_idx(h, row)];
+    if (*counter < UINT32_MAX)
+      ++*counter;
+  }
+}
+
+/* Note that a concurrent connection from <b>addr</b>, which we passed to
+ * dos_sketch_conn_add(), has closed. */
+void
+dos_sketch_conn_remove(const tor_addr_t *addr)
+{
+  uint64_t h;
+  int row;
+
+  if (!conn_counters)
+    return;
+  h = sketch_hash(addr);
+  for (row = 0; row < DOS_SKETCH_DEPTH; ++row) {
+    uint32_t *counter = &conn_counters[sketch_counter_idx(h, row)];
+    /* Only a counter that saturated could be 0 here. */
+    if (*counter > 0)
+      --*counter;
+  }
+}
+
+/* Return an estimate of the number of concurrent connections from
+ * <b>addr</b>. It is never lower than the true count. */
+uint32_t
+dos_sketch_conn_estimate(const tor_addr_t *addr)
+{
+  uint32_t estimate = UINT32_MAX;
+  uint64_t h;
+  int row;
+
+  if (!conn_counters)
+    return 0;
+  h = sketch_hash(addr);
+  for (row = 0; row < DOS_SKETCH_DEPTH; ++row)
+    estimate = MIN(estimate, conn_counters[sketch_counter_idx(h, row)]);
+  return estimate;
+}
+
+/* Return the level of <b>counter</b> at time <b>now</b>, after it has
+ * drained at <b>rate</b> circuits per second. */
+static uint32_t
+circ_counter_level(const dos_sketch_circ_counter_t *counter, uint32_t rate,
+                   uint32_t now)
+{
+  uint64_t drained;
+
+  /* If our clock jumped backward, don't drain anything. */
+  if (now <= counter->last_ts)
+    return counter->level;
+  drained = (uint64_t)(now - counter->last_ts) * rate;
+  if (drained >= counter->level)
+    return 0;
+  return counter->level - (uint32_t)drained;
+}
+
+/* Note a new circuit creation from <b>addr</b> at time <b>now</b>, with
+ * counters draining at <b>rate</b> circuits per second. Return an estimate
+ * of how many circuits <b>addr</b> has created that the rate hasn't yet
+ * made up for. It is never lower than the true value. */
+uint32_t
+dos_sketch_circ_note(const tor_addr_t *addr, uint32_t rate, time_t now)
+{
+  dos_sketch_circ_counter_t *counters[DOS_SKETCH_DEPTH];
+  uint32_t levels[DOS_SKETCH_DEPTH];
+  uint32_t estimate = UINT32_MAX;
+  const uint32_t now32 = (uint32_t)now;
+  uint64_t h;
+  int row;
+
+  dos_sketch_init();
+  h = sketch_hash(addr);
+  for (row = 0; row < DOS_SKETCH_DEPTH; ++row) {
+    counters[row] = &circ_counters[sketch_counter_idx(h, row)];
+    levels[row] = circ_counter_level(counters[row], rate, now32);
+    estimate = MIN(estimate, levels[row]);
+  }
+  if (estimate < UINT32_MAX)
+    ++estimate;
+  /* Conservative update: raise each counter only as far as the new
+   * estimate. */
+  for (row = 0; row < DOS_SKETCH_DEPTH; ++row) {
+    counters[row]->level = MAX(levels[row], estimate);
+    counters[row]->last_ts = now32;
+  }
+  return estimate;
+}
+
+/* Return the table entry for <b>addr</b>, or NULL if it isn't a heavy
+ * hitter. */
+static dos_sketch_heavy_hitter_t *
+heavy_hitter_find(const tor_addr_t *addr, uint64_t h)
+{
+  const unsigned first = sketch_heavy_hitter_idx(h);
+  int i;
+
+  for (i = 0; i < DOS_SKETCH_HH_PROBES; ++i) {
+    dos_sketch_heavy_hitter_t *ent =
+      &heavy_hitters[(first + i) & (DOS_SKETCH_HH_SIZE - 1)];
+    if (ent->in_use && tor_addr_eq(&ent->addr, addr))
+      return ent;
+  }
+  return NULL;
+}
+
+/* Return the exact circuit creation statistics for <b>addr</b>, or NULL if
+ * it isn't a heavy hitter. If it is, note that we saw it at time
+ * <b>now</b>. */
+cc_client_stats_t *
+dos_sketch_heavy_hitter_get(const tor_addr_t *addr, time_t now)
+{
+  dos_sketch_heavy_hitter_t *ent;
+
+  if (!heavy_hitters)
+    return NULL;
+  ent = heavy_hitter_find(addr, sketch_hash(addr));
+  if (!ent)
+    return NULL;
+  ent->last_seen_ts = now;
+  return &ent->stats;
+}
+
+/* Return the exact circuit creation statistics for <b>addr</b>, making it a
+ * heavy hitter at time <b>now</b> if it isn't one yet. New statistics are
+ * zeroed.
+ *
+ * If every slot that <b>addr</b> may use is taken, we evict the address
+ * that is least worth keeping: one that isn't marked if possible, and then
+ * the one we've gone longest without seeing. */
+cc_client_stats_t *
+dos_sketch_heavy_hitter_add(const tor_addr_t *addr, time_t now)
+{
+  dos_sketch_heavy_hitter_t *ent, *victim = NULL;
+  unsigned first;
+  uint64_t h;
+  int i;
+
+  dos_sketch_init();
+  h = sketch_hash(addr);
+  if ((ent = heavy_hitter_find(addr, h))) {
+    ent->last_seen_ts = now;
+    return &ent->stats;
+  }
+
+  first = sketch_heavy_hitter_idx(h);
+  for (i = 0; i < DOS_SKETCH_HH_PROBES; ++i) {
+    ent = &heavy_hitters[(first + i) & (DOS_SKETCH_HH_SIZE - 1)];
+    if (!ent->in_use) {
+      victim = ent;
+      break;
+    }
+    if (!victim) {
+      victim = ent;
+    } else {
+      const int ent_marked = ent->stats.marked_until_ts >= now;
+      const int victim_marked = victim->stats.marked_until_ts >= now;
+      if ((victim_marked && !ent_marked) ||
+          (victim_marked == ent_marked &&
+           ent->last_seen_ts < victim->last_seen_ts))
+        victim = ent;
+    }
+  }
+
+  if (!victim->in_use)
+    ++n_heavy_hitters;
+  memset(victim, 0, sizeof(*victim));
+  victim->in_use = 1;
+  tor_addr_copy(&victim->addr, addr);
+  victim->last_seen_ts = now;
+  return &victim->stats;
+}
+
+/* Return the number of addresses in the table of heavy hitters. */
+int
+dos_sketch_heavy_hitter_count(void)
+{
+  return n_heavy_hitters;
+}
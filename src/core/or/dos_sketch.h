@@ -0,0 +1,43 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/*
+ * \file dos_sketch.h
+ * \brief Header file for dos_sketch.c
+ */
+
+#ifndef TOR_DOS_SKETCH_H
+#define TOR_DOS_SKETCH_H
+
+#include "core/or/dos.h"
+
+/* Number of rows in each count-min sketch. */
+#define DOS_SKETCH_DEPTH 4
+/* Number of bits of the address hash that pick a counter within a row. The
+ * DOS_SKETCH_DEPTH row indexes must all fit in one 64-bit hash. */
+#define DOS_SKETCH_WIDTH_BITS 14
+/* Number of counters in each row of a sketch. */
+#define DOS_SKETCH_WIDTH (1 << DOS_SKETCH_WIDTH_BITS)
+/* Number of slots in the table of heavy hitters. Must be a power of 2. */
+#define DOS_SKETCH_HH_SIZE 4096
+/* How many slots, starting at its hashed position, an address may occupy in
+ * the table of heavy hitters. */
+#define DOS_SKETCH_HH_PROBES 8
+
+void dos_sketch_init(void);
+void dos_sketch_free_all(void);
+
+void dos_sketch_conn_add(const tor_addr_t *addr);
+void dos_sketch_conn_remove(const tor_addr_t *addr);
+uint32_t dos_sketch_conn_estimate(const tor_addr_t *addr);
+
+uint32_t dos_sketch_circ_note(const tor_addr_t *addr, uint32_t rate,
+                              time_t now);
+
+cc_client_stats_t *dos_sketch_heavy_hitter_get(const tor_addr_t *addr,
+                                               time_t now);
+cc_client_stats_t *dos_sketch_heavy_hitter_add(const tor_addr_t *addr,
+                                               time_t now);
+int dos_sketch_heavy_hitter_count(void);
+
+#endif /* !defined(TOR_DOS_SKETCH_H) */
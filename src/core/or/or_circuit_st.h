@@ -28,6 +28,15 @@ struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_s *workqueue_entry;
+  /** Batches of relay cells of this circuit that wait for the relay crypto
+   * workers, or that they have crypted, oldest first; only the first one can
+   * be with the workers.  While there are any, the workers own <b>crypto</b>.
+   * Used only in relayworker.c */
+  struct relay_job_t *relay_jobs_head;
+  /** The newest batch in relay_jobs_head. */
+  struct relay_job_t *relay_jobs_tail;
+  /** Number of cells in the batches of relay_jobs_head. */
+  int n_relay_job_cells;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -54,6 +63,14 @@ struct or_circuit_t {
    * is not marked for close. */
   struct or_circuit_t *rend_splice;
 
+  /** If this is a circuit that a client built to us, when should
+   * circuit_expire_old_circuits_serverside() next check whether it has been
+   * idle for too long? */
+  time_t idle_expiry_deadline;
+  /** Index of this circuit in the heap of circuits ordered by
+   * idle_expiry_deadline. -1 if not present. */
+  int idle_expiry_idx;
+
   /** Stores KH for the handshake. */
   char rend_circ_nonce[DIGEST_LEN];/* KH in tor-spec.txt */
 
@@ -67,6 +67,9 @@ struct or_connection_t {
    * geoip cache and handled by the DoS mitigation subsystem. We use this to
    * insure we have a coherent count of concurrent connection. */
   unsigned int tracked_for_dos_mitigation : 1;
+  /** True iff this is a client connection counted in the DoS mitigation
+   * subsystem's concurrent connection sketch instead of the geoip cache. */
+  unsigned int tracked_in_dos_sketch : 1;
 
   uint16_t link_proto; /**< What protocol version are we using? 0 for
                         * "none negotiated yet." */
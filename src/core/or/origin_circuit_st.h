@@ -141,6 +141,10 @@ struct origin_circuit_t {
    * present. */
   int global_origin_circuit_list_idx;
 
+  /** Index into the list of circuits that circuit_expire_building() looks
+   * at. -1 if not present. */
+  int build_expiry_list_idx;
+
   /** How many more relay_early cells can we send on this circuit, according
    * to the specification? */
   unsigned int remaining_relay_early_cells : 4;
@@ -1533,6 +1533,566 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/*
+ * Compiled address policies.
+ *
+ * The exit policies of routers get checked for every stream we exit and for
+ * every node we consider in path selection, so instead of walking their
+ * rules each time, we compile each one into a few sorted tables once, when
+ * we parse it: a table of port ranges over which no rule changes whether it
+ * applies, and for each of those and each address family, a table of
+ * address ranges over which no applicable rule changes whether it matches.
+ * A lookup is then one or two binary searches. Since most relays share one
+ * of a handful of exit policies, compiled policies are interned.
+ */
+
+/** An address, as a key that we can sort on.  An IPv4 address takes up the
+ * top 32 bits of <b>hi</b>, so that for either family, the addresses that a
+ * rule with <b>maskbits</b> covers are the keys that share their top
+ * <b>maskbits</b> bits. */
+typedef struct policy_addr_key_t {
+  uint64_t hi;
+  uint64_t lo;
+} policy_addr_key_t;
+
+/** The result of a policy over the addresses of one family.  The addresses
+ * from <b>start</b>[i] up to, but not including, <b>start</b>[i+1] get
+ * <b>result</b>[i].  <b>start</b>[0] is always the all-zero key. */
+typedef struct policy_addr_table_t {
+  int n;
+  policy_addr_key_t *start;
+  int8_t *result;
+} policy_addr_table_t;
+
+/** Index of the IPv4 and IPv6 tables in a compiled_addr_policy_t. */
+#define POLICY_IDX_IPV4 0
+#define POLICY_IDX_IPV6 1
+#define N_POLICY_FAMILIES 2
+
+/** Give up compiling a policy whose tables would have more address ranges
+ * than this in total; we can still walk it. */
+#define MAX_COMPILED_POLICY_RANGES (1<<15)
+
+/** An address policy, compiled for fast lookups.  See
+ * addr_policy_compile(). */
+struct compiled_addr_policy_t {
+  HT_ENTRY(compiled_addr_policy_t) node;
+  /** Hash of <b>rules</b>. */
+  unsigned int hash;
+  /** Number of references to this compiled policy. */
+  int refcnt;
+  /** The policy that we compiled, as a list of canonical addr_policy_t. */
+  smartlist_t *rules;
+
+  /** Number of port ranges. */
+  int n_ports;
+  /** The first port of each port range, in ascending order.  The first one
+   * is always 1. */
+  uint16_t *port_start;
+  /** Number of port ranges for an unknown address.  These are the port
+   * ranges above, merged where they have the same result. */
+  int n_unknown_addr_ports;
+  /** The first port of each port range for an unknown address. */
+  uint16_t *unknown_addr_port_start;
+  /** For each port range for an unknown address, the result. */
+  int8_t *unknown_addr_result;
+  /** For each family and port range, the index in <b>tables</b> of the
+   * results for addresses of that family. */
+  uint16_t *port_table[N_POLICY_FAMILIES];
+  /** For each family, the results for addresses of that family on an unknown
+   * port. */
+  policy_addr_table_t noport[N_POLICY_FAMILIES];
+  /** Number of distinct tables for known ports. */
+  int n_tables;
+  /** Distinct tables for known ports, shared between port ranges. */
+  policy_addr_table_t *tables;
+};
+
+/** Set *<b>key_out</b> to the key for <b>addr</b>, which must be IPv4 or
+ * IPv6. */
+static void
+policy_addr_key_from_tor_addr(policy_addr_key_t *key_out,
+                              const tor_addr_t *addr)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    key_out->hi = ((uint64_t)tor_addr_to_ipv4h(addr)) << 32;
+    key_out->lo = 0;
+  } else {
+    const struct in6_addr *a6 = tor_addr_to_in6_assert(addr);
+    key_out->hi = tor_ntohll(get_uint64(a6->s6_addr));
+    key_out->lo = tor_ntohll(get_uint64(a6->s6_addr + 8));
+  }
+}
+
+/** Set *<b>addr_out</b> to the address of <b>family</b> for <b>key</b>. */
+static void
+policy_addr_key_to_tor_addr(tor_addr_t *addr_out, sa_family_t family,
+                            const policy_addr_key_t *key)
+{
+  if (family == AF_INET) {
+    tor_addr_from_ipv4h(addr_out, (uint32_t)(key->hi >> 32));
+  } else {
+    uint8_t bytes[16];
+    set_uint64(bytes, tor_htonll(key->hi));
+    set_uint64(bytes + 8, tor_htonll(key->lo));
+    tor_addr_from_ipv6_bytes(addr_out, (const char *)bytes);
+  }
+}
+
+/** Return -1, 0, or 1 as <b>a</b> is less than, equal to, or greater than
+ * <b>b</b>. */
+static inline int
+policy_addr_key_cmp(const policy_addr_key_t *a, const policy_addr_key_t *b)
+{
+  if (a->hi != b->hi)
+    return a->hi < b->hi ? -1 : 1;
+  if (a->lo != b->lo)
+    return a->lo < b->lo ? -1 : 1;
+  return 0;
+}
+
+/** Helper for qsort: compare two policy_addr_key_t. */
+static int
+policy_addr_key_qsort_cmp(const void *a, const void *b)
+{
+  return policy_addr_key_cmp(a, b);
+}
+
+/** Set *<b>start_out</b> to the first key that the rule <b>p</b> covers, and
+ * *<b>end_out</b> to the first key after those.  Return 0 if there is such
+ * a key, and -1 if <b>p</b> covers the keys up to the end. */
+static int
+policy_rule_key_range(const addr_policy_t *p,
+                      policy_addr_key_t *start_out,
+                      policy_addr_key_t *end_out)
+{
+  const int family_bits = tor_addr_family(&p->addr) == AF_INET ? 32 : 128;
+  const int bits = MIN((int)p->maskbits, family_bits);
+  policy_addr_key_t key, mask;
+
+  policy_addr_key_from_tor_addr(&key, &p->addr);
+  if (bits == 0) {
+    mask.hi = mask.lo = 0;
+  } else if (bits <= 64) {
+    mask.hi = UINT64_MAX << (64 - bits);
+    mask.lo = 0;
+  } else {
+    mask.hi = UINT64_MAX;
+    mask.lo = UINT64_MAX << (128 - bits);
+  }
+  start_out->hi = key.hi & mask.hi;
+  start_out->lo = key.lo & mask.lo;
+  /* The last covered key, plus one. */
+  end_out->hi = start_out->hi | ~mask.hi;
+  end_out->lo = start_out->lo | ~mask.lo;
+  if (end_out->hi == UINT64_MAX && end_out->lo == UINT64_MAX)
+    return -1;
+  if (++end_out->lo == 0)
+    ++end_out->hi;
+  return 0;
+}
+
+/** Return true iff the rule <b>p</b> covers the key <b>key</b>. */
+static int
+policy_rule_covers_key(const addr_policy_t *p, const policy_addr_key_t *key)
+{
+  policy_addr_key_t start, end;
+  if (policy_rule_key_range(p, &start, &end) < 0)
+    return policy_addr_key_cmp(key, &start) >= 0;
+  return policy_addr_key_cmp(key, &start) >= 0 &&
+    policy_addr_key_cmp(key, &end) < 0;
+}
+
+/** Return the index of the entry in <b>table</b> that covers <b>key</b>. */
+static int
+policy_addr_table_find(const policy_addr_table_t *table,
+                       const policy_addr_key_t *key)
+{
+  int lo = 0, hi = table->n - 1;
+  /* start[0] is the zero key, so the entry we want is in [lo, hi]. */
+  while (lo < hi) {
+    const int mid = lo + (hi - lo + 1) / 2;
+    if (policy_addr_key_cmp(&table->start[mid], key) <= 0)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/** Release the storage held in <b>table</b>. */
+static void
+policy_addr_table_clear(policy_addr_table_t *table)
+{
+  tor_free(table->start);
+  tor_free(table->result);
+  table->n = 0;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> hold the same results. */
+static int
+policy_addr_tables_eq(const policy_addr_table_t *a,
+                      const policy_addr_table_t *b)
+{
+  return a->n == b->n &&
+    fast_memeq(a->start, b->start, a->n * sizeof(policy_addr_key_t)) &&
+    fast_memeq(a->result, b->result, a->n);
+}
+
+/** Fill <b>table</b> with the results of the rules in <b>rules</b> that
+ * have family <b>family</b>, for addresses of that family.  If
+ * <b>port</b> is 0, use the results for an unknown port; otherwise, the
+ * rules must be exactly those that apply to <b>port</b>, and we use the
+ * first one that matches.  Return the number of entries in
+ * <b>table</b>. */
+static int
+policy_addr_table_build(policy_addr_table_t *table,
+                        const smartlist_t *rules, sa_family_t family,
+                        uint16_t port)
+{
+  policy_addr_key_t *bounds;
+  int n_bounds = 0, i, j;
+
+  /* Every address range starts at a bound of a rule, so those are the only
+   * places where the result can change. */
+  bounds = tor_calloc(2 * smartlist_len(rules) + 1, sizeof(*bounds));
+  ++n_bounds; /* The zero key. */
+  SMARTLIST_FOREACH_BEGIN(rules, const addr_policy_t *, p) {
+    if (tor_addr_family(&p->addr) != family)
+      continue;
+    if (policy_rule_key_range(p, &bounds[n_bounds], &bounds[n_bounds + 1])
+        == 0)
+      n_bounds += 2;
+    else
+      n_bounds += 1;
+  } SMARTLIST_FOREACH_END(p);
+  qsort(bounds, n_bounds, sizeof(*bounds), policy_addr_key_qsort_cmp);
+
+  table->start = tor_calloc(n_bounds, sizeof(policy_addr_key_t));
+  table->result = tor_calloc(n_bounds, sizeof(int8_t));
+  table->n = 0;
+  for (i = 0; i < n_bounds; ++i) {
+    addr_policy_result_t r = ADDR_POLICY_ACCEPTED;
+    if (i > 0 && policy_addr_key_cmp(&bounds[i], &bounds[i-1]) == 0)
+      continue;
+    if (port) {
+      for (j = 0; j < smartlist_len(rules); ++j) {
+        const addr_policy_t *p = smartlist_get(rules, j);
+        if (tor_addr_family(&p->addr) == family &&
+            policy_rule_covers_key(p, &bounds[i])) {
+          r = p->policy_type == ADDR_POLICY_ACCEPT ?
+            ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+          break;
+        }
+      }
+    } else {
+      tor_addr_t addr;
+      policy_addr_key_to_tor_addr(&addr, family, &bounds[i]);
+      r = compare_known_tor_addr_to_addr_policy_noport(&addr, rules);
+    }
+    /* Merge ranges with the same result. */
+    if (table->n && table->result[table->n - 1] == (int8_t)r)
+      continue;
+    table->start[table->n] = bounds[i];
+    table->result[table->n] = (int8_t)r;
+    ++table->n;
+  }
+  tor_free(bounds);
+  return table->n;
+}
+
+/** Helper: free all storage held by <b>cp</b>, which must not be in the
+ * interning table. */
+static void
+compiled_addr_policy_free_storage(compiled_addr_policy_t *cp)
+{
+  int i;
+  addr_policy_list_free(cp->rules);
+  tor_free(cp->port_start);
+  tor_free(cp->unknown_addr_port_start);
+  tor_free(cp->unknown_addr_result);
+  for (i = 0; i < N_POLICY_FAMILIES; ++i) {
+    tor_free(cp->port_table[i]);
+    policy_addr_table_clear(&cp->noport[i]);
+  }
+  for (i = 0; i < cp->n_tables; ++i)
+    policy_addr_table_clear(&cp->tables[i]);
+  tor_free(cp->tables);
+  tor_free(cp);
+}
+
+/** Return true iff the compiled policies <b>a</b> and <b>b</b> are for
+ * equal policies. */
+static inline int
+compiled_policy_eq(const compiled_addr_policy_t *a,
+                   const compiled_addr_policy_t *b)
+{
+  return a->hash == b->hash && addr_policies_eq(a->rules, b->rules);
+}
+
+/** Return a hashcode for <b>cp</b>. */
+static inline unsigned int
+compiled_policy_hash(const compiled_addr_policy_t *cp)
+{
+  return cp->hash;
+}
+
+/** Interning table of compiled policies. */
+static HT_HEAD(compiled_policy_map, compiled_addr_policy_t)
+  compiled_policy_root = HT_INITIALIZER();
+
+HT_PROTOTYPE(compiled_policy_map, compiled_addr_policy_t, node,
+             compiled_policy_hash, compiled_policy_eq)
+HT_GENERATE2(compiled_policy_map, compiled_addr_policy_t, node,
+             compiled_policy_hash, compiled_policy_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+/** Return a hashcode for the list of rules <b>policy</b>, consistent with
+ * addr_policies_eq(). */
+static unsigned int
+addr_policy_list_hash(const smartlist_t *policy)
+{
+  unsigned int *hashes, result;
+  policy_map_ent_t ent;
+  const int n = smartlist_len(policy);
+
+  hashes = tor_calloc(n + 1, sizeof(unsigned int));
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, p) {
+    ent.policy = p;
+    hashes[p_sl_idx] = policy_hash(&ent);
+  } SMARTLIST_FOREACH_END(p);
+  result = (unsigned) siphash24g(hashes, n * sizeof(unsigned int));
+  tor_free(hashes);
+  return result;
+}
+
+/** Return 0 iff we know how to compile <b>policy</b>: that is, if all of
+ * its rules are for IPv4 or IPv6 addresses. */
+static int
+addr_policy_check_compilable(const smartlist_t *policy)
+{
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    const sa_family_t family = tor_addr_family(&p->addr);
+    if (p->is_private || (family != AF_INET && family != AF_INET6))
+      return -1;
+  } SMARTLIST_FOREACH_END(p);
+  return 0;
+}
+
+/** Helper for qsort: compare two uint32_t. */
+static int
+port_bound_qsort_cmp(const void *a, const void *b)
+{
+  const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Compile the tables of <b>cp</b> from its rules.  Return 0 on success, or
+ * -1 if the tables would be too large. */
+static int
+compiled_addr_policy_build(compiled_addr_policy_t *cp)
+{
+  static const sa_family_t families[N_POLICY_FAMILIES] = {
+    [POLICY_IDX_IPV4] = AF_INET,
+    [POLICY_IDX_IPV6] = AF_INET6,
+  };
+  const smartlist_t *rules = cp->rules;
+  smartlist_t *port_rules = smartlist_new();
+  uint32_t *port_bounds;
+  int n_port_bounds = 0, n_ranges = 0, i, f, t;
+  int r = -1;
+
+  /* Every port range starts at a bound of a rule. */
+  port_bounds = tor_calloc(2 * smartlist_len(rules) + 1, sizeof(uint32_t));
+  port_bounds[n_port_bounds++] = 1;
+  SMARTLIST_FOREACH_BEGIN(rules, const addr_policy_t *, p) {
+    if (p->prt_min > 1)
+      port_bounds[n_port_bounds++] = p->prt_min;
+    if (p->prt_max < 65535)
+      port_bounds[n_port_bounds++] = p->prt_max + 1u;
+  } SMARTLIST_FOREACH_END(p);
+  qsort(port_bounds, n_port_bounds, sizeof(uint32_t), port_bound_qsort_cmp);
+
+  cp->port_start = tor_calloc(n_port_bounds, sizeof(uint16_t));
+  for (i = 0; i < n_port_bounds; ++i) {
+    if (i > 0 && port_bounds[i] == port_bounds[i-1])
+      continue;
+    cp->port_start[cp->n_ports++] = (uint16_t)port_bounds[i];
+  }
+  tor_free(port_bounds);
+
+  cp->unknown_addr_port_start = tor_calloc(cp->n_ports, sizeof(uint16_t));
+  cp->unknown_addr_result = tor_calloc(cp->n_ports, sizeof(int8_t));
+  for (i = 0; i < cp->n_ports; ++i) {
+    addr_policy_result_t res =
+      compare_unknown_tor_addr_to_addr_policy(cp->port_start[i], rules);
+    const int n = cp->n_unknown_addr_ports;
+    if (n && cp->unknown_addr_result[n - 1] == (int8_t)res)
+      continue;
+    cp->unknown_addr_port_start[n] = cp->port_start[i];
+    cp->unknown_addr_result[n] = (int8_t)res;
+    ++cp->n_unknown_addr_ports;
+  }
+
+  cp->tables = tor_calloc(N_POLICY_FAMILIES * cp->n_ports,
+                          sizeof(policy_addr_table_t));
+  for (f = 0; f < N_POLICY_FAMILIES; ++f) {
+    n_ranges += policy_addr_table_build(&cp->noport[f], rules,
+                                        families[f], 0);
+    cp->port_table[f] = tor_calloc(cp->n_ports, sizeof(uint16_t));
+    for (i = 0; i < cp->n_ports; ++i) {
+      const uint16_t port = cp->port_start[i];
+      policy_addr_table_t *table = &cp->tables[cp->n_tables];
+
+      smartlist_clear(port_rules);
+      SMARTLIST_FOREACH(rules, addr_policy_t *, p,
+                        if (p->prt_min <= port && port <= p->prt_max)
+                          smartlist_add(port_rules, p));
+      policy_addr_table_build(table, port_rules, families[f], port);
+
+      /* Most port ranges share a handful of tables. */
+      for (t = 0; t < cp->n_tables; ++t) {
+        if (policy_addr_tables_eq(&cp->tables[t], table))
+          break;
+      }
+      if (t < cp->n_tables) {
+        policy_addr_table_clear(table);
+      } else {
+        n_ranges += table->n;
+        ++cp->n_tables;
+      }
+      cp->port_table[f][i] = (uint16_t)t;
+
+      if (n_ranges > MAX_COMPILED_POLICY_RANGES)
+        goto done;
+    }
+  }
+  r = 0;
+
+ done:
+  smartlist_free(port_rules);
+  return r;
+}
+
+/** Return a compiled version of <b>policy</b>, which must not change while
+ * the compiled version is in use, for compare_tor_addr_to_compiled_policy().
+ * Equal policies share one compiled version.  Return NULL if <b>policy</b>
+ * is NULL or can't be compiled; callers should then use
+ * compare_tor_addr_to_addr_policy() instead.
+ *
+ * The caller must release the result with compiled_addr_policy_free(). */
+compiled_addr_policy_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  compiled_addr_policy_t search, *found;
+
+  if (!policy || addr_policy_check_compilable(policy) < 0)
+    return NULL;
+
+  memset(&search, 0, sizeof(search));
+  search.rules = (smartlist_t *) policy;
+  search.hash = addr_policy_list_hash(policy);
+  found = HT_FIND(compiled_policy_map, &compiled_policy_root, &search);
+  if (found) {
+    ++found->refcnt;
+    return found;
+  }
+
+  found = tor_malloc_zero(sizeof(compiled_addr_policy_t));
+  found->hash = search.hash;
+  found->rules = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, p) {
+    if (p->is_canonical) {
+      ++p->refcnt;
+      smartlist_add(found->rules, p);
+    } else {
+      smartlist_add(found->rules, addr_policy_get_canonical_entry(p));
+    }
+  } SMARTLIST_FOREACH_END(p);
+
+  if (compiled_addr_policy_build(found) < 0) {
+    log_info(LD_GENERAL, "Not compiling an address policy with %d rules: "
+             "it would take too much memory.", smartlist_len(policy));
+    compiled_addr_policy_free_storage(found);
+    return NULL;
+  }
+
+  found->refcnt = 1;
+  HT_INSERT(compiled_policy_map, &compiled_policy_root, found);
+  return found;
+}
+
+/** Release a reference to the compiled policy <b>cp</b>. */
+void
+compiled_addr_policy_free_(compiled_addr_policy_t *cp)
+{
+  if (!cp)
+    return;
+  if (--cp->refcnt > 0)
+    return;
+  HT_REMOVE(compiled_policy_map, &compiled_policy_root, cp);
+  compiled_addr_policy_free_storage(cp);
+}
+
+/** Return the index of the port range in the <b>n</b> port ranges starting
+ * at <b>port_start</b> that holds <b>port</b>. */
+static int
+policy_port_range_find(const uint16_t *port_start, int n, uint16_t port)
+{
+  int lo = 0, hi = n - 1;
+  /* port_start[0] is 1, so the range we want is in [lo, hi]. */
+  while (lo < hi) {
+    const int mid = lo + (hi - lo + 1) / 2;
+    if (port_start[mid] <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/** As compare_tor_addr_to_addr_policy(), but for a policy that we compiled
+ * with addr_policy_compile(). */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_addr_policy_t *cp)
+{
+  const policy_addr_table_t *table;
+  policy_addr_key_t key;
+  int f;
+
+  tor_assert(cp);
+
+  if (addr == NULL || tor_addr_is_null(addr)) {
+    if (port == 0) {
+      log_info(LD_BUG, "Rejecting null address with 0 port (family %d)",
+               addr ? tor_addr_family(addr) : -1);
+      return ADDR_POLICY_REJECTED;
+    }
+    return (addr_policy_result_t) cp->unknown_addr_result[
+      policy_port_range_find(cp->unknown_addr_port_start,
+                             cp->n_unknown_addr_ports, port)];
+  } else if (tor_addr_family(addr) == AF_INET) {
+    f = POLICY_IDX_IPV4;
+  } else if (tor_addr_family(addr) == AF_INET6) {
+    f = POLICY_IDX_IPV6;
+  } else {
+    /* No rule can match: accept all by default. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+
+  if (port) {
+    const int idx = policy_port_range_find(cp->port_start, cp->n_ports, port);
+    table = &cp->tables[cp->port_table[f][idx]];
+  } else {
+    table = &cp->noport[f];
+  }
+
+  policy_addr_key_from_tor_addr(&key, addr);
+  return (addr_policy_result_t)
+    table->result[policy_addr_table_find(table, &key)];
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -2916,6 +3476,9 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
+    if (node->ri->exit_policy_compiled)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                                          node->ri->exit_policy_compiled);
     return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
@@ -3105,6 +3668,16 @@ addr_policy_free_(addr_policy_t *p)
   }
 }
 
+/** Helper for policies_free_all(): free <b>cp</b>, whatever its reference
+ * count. */
+static int
+compiled_addr_policy_free_cb(compiled_addr_policy_t *cp, void *data)
+{
+  (void) data;
+  compiled_addr_policy_free_storage(cp);
+  return 1; /* So HT_FOREACH_FN will remove the element */
+}
+
 /** Release all storage held by policy variables. */
 void
 policies_free_all(void)
@@ -3124,6 +3697,16 @@ policies_free_all(void)
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
 
+  /* Compiled policies hold references to cached policies, so they go
+   * first. */
+  if (!HT_EMPTY(&compiled_policy_root)) {
+    log_warn(LD_MM, "Still had %d compiled address policies at shutdown.",
+             (int)HT_SIZE(&compiled_policy_root));
+  }
+  HT_FOREACH_FN(compiled_policy_map, &compiled_policy_root,
+                compiled_addr_policy_free_cb, NULL);
+  HT_CLEAR(compiled_policy_map, &compiled_policy_root);
+
   if (!HT_EMPTY(&policy_root)) {
     policy_map_ent_t **ent;
     int n = 0;
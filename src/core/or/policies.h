@@ -116,6 +116,15 @@ MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
+typedef struct compiled_addr_policy_t compiled_addr_policy_t;
+compiled_addr_policy_t *addr_policy_compile(const smartlist_t *policy);
+void compiled_addr_policy_free_(compiled_addr_policy_t *cp);
+#define compiled_addr_policy_free(cp) \
+  FREE_AND_NULL(compiled_addr_policy_t, compiled_addr_policy_free_, (cp))
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          const compiled_addr_policy_t *cp);
+
 int policies_parse_exit_policy_from_options(
                                           const or_options_t *or_options,
                                           uint32_t local_address,
@@ -54,11 +54,6 @@ static const struct {
 
 #define N_PROTOCOL_NAMES ARRAY_LENGTH(PROTOCOL_NAMES)
 
-/* Maximum allowed length of any single subprotocol name. */
-// C_RUST_COUPLED: src/rust/protover/protover.rs
-//                 `MAX_PROTOCOL_NAME_LENGTH`
-static const unsigned MAX_PROTOCOL_NAME_LENGTH = 100;
-
 /**
  * Given a protocol_type_t, return the corresponding string used in
  * descriptors.
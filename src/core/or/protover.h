@@ -22,6 +22,11 @@ struct smartlist_t;
 ///                 `FIRST_TOR_VERSION_TO_ADVERTISE_PROTOCOLS`
 #define FIRST_TOR_VERSION_TO_ADVERTISE_PROTOCOLS "0.2.9.3-alpha"
 
+/** Maximum allowed length of any single subprotocol name. */
+/// C_RUST_COUPLED: src/rust/protover/protover.rs
+///                 `MAX_PROTOCOL_NAME_LENGTH`
+#define MAX_PROTOCOL_NAME_LENGTH 100u
+
 /** The protover version number that signifies HSDir support for HSv3 */
 #define PROTOVER_HSDIR_V3 2
 /** The protover version number that signifies HSv3 intro point support */
@@ -68,6 +68,7 @@
 #include "feature/stats/geoip_stats.h"
 #include "feature/hs/hs_cache.h"
 #include "core/mainloop/mainloop.h"
+#include "core/mainloop/relayworker.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "core/or/onion.h"
@@ -100,6 +101,7 @@
 #include "core/or/socks_request_st.h"
 
 #include "lib/intmath/weakrng.h"
+#include "lib/memarea/mempool.h"
 
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
@@ -114,6 +116,10 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
                                               crypt_path_t *layer_hint);
 static int circuit_consider_stop_edge_reading(circuit_t *circ,
                                               crypt_path_t *layer_hint);
+static int relay_handle_crypted_cell(cell_t *cell, circuit_t *circ,
+                                     cell_direction_t cell_direction,
+                                     crypt_path_t *layer_hint,
+                                     char recognized);
 static int circuit_queue_streams_are_blocked(circuit_t *circ);
 static void adjust_exit_policy_from_exitpolicy_failure(origin_circuit_t *circ,
                                                   entry_connection_t *conn,
@@ -188,7 +194,7 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
 
     if (circ->n_chan->channel_usage == CHANNEL_USED_FOR_FULL_CIRCS &&
         cell->command == CELL_RELAY) {
-      circ->n_chan->channel_usage = CHANNEL_USED_FOR_USER_TRAFFIC;
+      channel_set_usage(circ->n_chan, CHANNEL_USED_FOR_USER_TRAFFIC);
     }
   } else {
     /* If we're a relay circuit, the question is more complicated. Basically:
@@ -209,10 +215,10 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
         (channel_is_client(or_circ->p_chan) && circ->n_chan)) {
       if (cell->command == CELL_RELAY_EARLY) {
         if (or_circ->p_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS) {
-          or_circ->p_chan->channel_usage = CHANNEL_USED_FOR_FULL_CIRCS;
+          channel_set_usage(or_circ->p_chan, CHANNEL_USED_FOR_FULL_CIRCS);
         }
       } else if (cell->command == CELL_RELAY) {
-        or_circ->p_chan->channel_usage = CHANNEL_USED_FOR_USER_TRAFFIC;
+        channel_set_usage(or_circ->p_chan, CHANNEL_USED_FOR_USER_TRAFFIC);
       }
     }
   }
@@ -229,21 +235,19 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
  *    cell_queue on <b>circ</b>.
  *
  * Return -<b>reason</b> on failure or return 1 to indicate that an out-of-order
- * split cell was buffered.
+ * split cell was buffered (or that the relay crypto workers will crypt the
+ * cell; see relayworker.c).
  */
 int
 circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
                                 cell_direction_t cell_direction,
                                 crypt_path_t* start_at)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   circuit_t* base = NULL;
-  circuit_t* split_expected_circ;
   circuit_t* split_actual_circ = NULL;
   int r;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -292,6 +296,14 @@ circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
     }
   }
 
+  if (! CIRCUIT_IS_ORIGIN(circ) &&
+      relay_worker_queue_relayed_cell(TO_OR_CIRCUIT(circ), cell,
+                                      cell_direction)) {
+    /* the relay crypto workers have the cell now; we will continue in
+     * circuit_receive_relay_cell_crypted() */
+    return 1;
+  }
+
   if ((r = relay_decrypt_cell(&circ, cell, cell_direction, &layer_hint,
       &recognized, start_at)) < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -302,6 +314,26 @@ circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
     return 1;
   }
 
+  return relay_handle_crypted_cell(cell, circ, cell_direction, layer_hint,
+                                   recognized);
+}
+
+/** Continue handling the relay <b>cell</b> on <b>circ</b> after it was
+ * crypted: deliver it to the right connection_edge if it was
+ * <b>recognized</b> (by the hop <b>layer_hint</b>), else pass it on.
+ *
+ * Return as circuit_receive_relay_cell_impl().
+ */
+static int
+relay_handle_crypted_cell(cell_t *cell, circuit_t *circ,
+                          cell_direction_t cell_direction,
+                          crypt_path_t *layer_hint, char recognized)
+{
+  channel_t *chan = NULL;
+  circuit_t* base = NULL;
+  circuit_t* split_expected_circ;
+  int reason;
+
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -380,7 +412,8 @@ circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
                        TO_OR_CIRCUIT(split_expected_circ) : NULL,
                   split_expected_circ ?
                        TO_OR_CIRCUIT(split_expected_circ)->p_circ_id : 0);
-        split_buffer_cell(TO_OR_CIRCUIT(circ)->subcirc, cell);
+        split_buffer_cell(TO_OR_CIRCUIT(circ)->split_data,
+                          TO_OR_CIRCUIT(circ)->subcirc, cell);
         return 1;
       }
 
@@ -497,6 +530,31 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   return retval;
 }
 
+/** Continue handling the relayed <b>cell</b> that arrived on <b>circ</b> in
+ * direction <b>cell_direction</b>, after the relay crypto workers have
+ * crypted it and set <b>recognized</b>.
+ *
+ * Return as circuit_receive_relay_cell().
+ */
+int
+circuit_receive_relay_cell_crypted(cell_t *cell, or_circuit_t *circ,
+                                   cell_direction_t cell_direction,
+                                   char recognized)
+{
+  int retval;
+
+  if (TO_CIRCUIT(circ)->marked_for_close)
+    return 0;
+
+  retval = relay_handle_crypted_cell(cell, TO_CIRCUIT(circ), cell_direction,
+                                     NULL, recognized);
+
+  if (retval == 0 && cell_direction == CELL_DIRECTION_OUT)
+    split_handle_buffered_cells(TO_CIRCUIT(circ));
+
+  return retval;
+}
+
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
  *  - Append it to the appropriate cell_queue on <b>circ</b>.
@@ -554,6 +612,12 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (relay_worker_handles_circ(or_circ)) {
+      /* the workers encrypt the cell, and we queue it once they are done */
+      ++stats_n_relay_cells_relayed;
+      relay_worker_queue_originated_cell(or_circ, cell, on_stream);
+      return 0;
+    }
     relay_encrypt_cell_inbound(cell, or_circ);
     chan = or_circ->p_chan;
   }
@@ -2279,6 +2343,80 @@ uint64_t stats_n_data_cells_received = 0;
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
 
+/** Package <b>n_cells</b> (at most RELAY_CRYPT_MAX_BATCH) full data cells
+ * from the inbuf of the exit stream <b>conn</b> and send them to the origin
+ * on <b>or_circ</b>.  This saves repeating the per-cell checks and setup of
+ * connection_edge_package_raw_inbuf() for each cell; the crypto is the same
+ * as for single cells.
+ *
+ * This does the same as calling connection_edge_send_command() for each of
+ * the cells; the caller has to check that the circuit is open and that the
+ * package windows allow sending <b>n_cells</b> cells.
+ */
+static void
+connection_exit_package_full_cells(edge_connection_t *conn,
+                                   or_circuit_t *or_circ, int n_cells)
+{
+  cell_t cells[RELAY_CRYPT_MAX_BATCH];
+  cell_t *cell_ptrs[RELAY_CRYPT_MAX_BATCH];
+  relay_header_t rh;
+  int i;
+
+  tor_assert(n_cells > 0 && n_cells <= RELAY_CRYPT_MAX_BATCH);
+  tor_assert(connection_get_inbuf_len(TO_CONN(conn)) >=
+             (size_t)n_cells * RELAY_PAYLOAD_SIZE);
+
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.stream_id = conn->stream_id;
+  rh.length = RELAY_PAYLOAD_SIZE;
+
+  for (i = 0; i < n_cells; ++i) {
+    cell_t *cell = &cells[i];
+    memset(cell, 0, sizeof(cell_t));
+    cell->command = CELL_RELAY;
+    cell->circ_id = or_circ->p_circ_id;
+    relay_header_pack(cell->payload, &rh);
+    connection_buf_get_bytes((char *)cell->payload + RELAY_HEADER_SIZE,
+                             RELAY_PAYLOAD_SIZE, TO_CONN(conn));
+    cell_ptrs[i] = cell;
+    demo_register_cell(0, CELL_DIRECTION_IN, false);
+  }
+
+  stats_n_data_bytes_packaged += n_cells * RELAY_PAYLOAD_SIZE;
+  stats_n_data_cells_packaged += n_cells;
+
+#ifdef MEASUREMENTS_21206
+  connection_t *linked_conn = TO_CONN(conn)->linked_conn;
+  if (linked_conn && linked_conn->type == CONN_TYPE_DIR) {
+    TO_DIR_CONN(linked_conn)->data_cells_sent += n_cells;
+  }
+#endif /* defined(MEASUREMENTS_21206) */
+
+  log_debug(LD_EXIT,TOR_SOCKET_T_FORMAT": Packaged %d cells (%d waiting).",
+            conn->base_.s, n_cells,
+            (int)connection_get_inbuf_len(TO_CONN(conn)));
+
+  if (relay_worker_handles_circ(or_circ)) {
+    for (i = 0; i < n_cells; ++i) {
+      ++stats_n_relay_cells_relayed;
+      relay_worker_queue_originated_cell(or_circ, &cells[i], conn->stream_id);
+    }
+    return;
+  }
+
+  relay_encrypt_cells_inbound(cell_ptrs, n_cells, or_circ);
+
+  for (i = 0; i < n_cells; ++i) {
+    ++stats_n_relay_cells_relayed;
+    /* If this marks the circuit for close (e.g. when we are out of memory),
+     * the remaining cells are dropped. */
+    append_cell_to_circuit_queue(TO_CIRCUIT(or_circ), or_circ->p_chan,
+                                 &cells[i], CELL_DIRECTION_IN,
+                                 conn->stream_id);
+  }
+}
+
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
  * empty, grab a cell and send it down the circuit.
@@ -2368,6 +2506,37 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   if (!package_partial && bytes_to_process < RELAY_PAYLOAD_SIZE)
     return 0;
 
+  if (!CIRCUIT_IS_ORIGIN(circ) && !cpath_layer && !circ->marked_for_close &&
+      !sending_from_optimistic &&
+      bytes_to_process >= 2 * RELAY_PAYLOAD_SIZE) {
+    /* We are an exit with several full cells to send: package as many of
+     * them as our windows allow at once. */
+    int n_cells = (int)MIN(bytes_to_process / RELAY_PAYLOAD_SIZE,
+                           RELAY_CRYPT_MAX_BATCH);
+    n_cells = MIN(n_cells, conn->package_window);
+    n_cells = MIN(n_cells, circ->package_window);
+    if (max_cells)
+      n_cells = MIN(n_cells, *max_cells);
+
+    if (n_cells >= 2) {
+      connection_exit_package_full_cells(conn, TO_OR_CIRCUIT(circ), n_cells);
+      circ->package_window -= n_cells;
+      conn->package_window -= n_cells;
+      if (conn->package_window <= 0) {
+        connection_stop_reading(TO_CONN(conn));
+        log_debug(domain,"conn->package_window reached 0.");
+        circuit_consider_stop_edge_reading(circ, cpath_layer);
+        return 0; /* don't process the inbuf any more */
+      }
+      if (max_cells) {
+        *max_cells -= n_cells;
+        if (*max_cells <= 0)
+          return 0;
+      }
+      goto repeat_connection_edge_package_raw_inbuf;
+    }
+  }
+
   if (bytes_to_process > RELAY_PAYLOAD_SIZE) {
     length = RELAY_PAYLOAD_SIZE;
   } else {
@@ -2720,20 +2889,31 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** Number of packed (or destroy) cells that are carved out of every chunk of
+ * memory that a cell pool allocates. */
+#define CELL_POOL_CHUNK_CAPACITY 64
+
+/** Pool from which we allocate all packed_cell_t. */
+static mp_pool_t *cell_pool = NULL;
+/** Pool from which we allocate all destroy_cell_t. */
+static mp_pool_t *destroy_cell_pool = NULL;
+
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
   --total_cells_allocated;
-  tor_free(cell);
+  mp_pool_release(cell);
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
+  if (PREDICT_UNLIKELY(!cell_pool))
+    cell_pool = mp_pool_new(sizeof(packed_cell_t), CELL_POOL_CHUNK_CAPACITY);
   ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  return mp_pool_get_zero(cell_pool);
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2762,10 +2942,43 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  if (cell_pool) {
+    mp_pool_stats_t stats;
+    mp_pool_get_stats(cell_pool, &stats);
+    tor_log(severity, LD_MM,
+            "Cell pool holds %"TOR_PRIuSZ" bytes in %"TOR_PRIuSZ" chunks "
+            "(%"TOR_PRIuSZ" empty) for %"TOR_PRIuSZ" cells; "
+            "%"TOR_PRIuSZ" bytes unused.",
+            stats.bytes_allocated, stats.n_chunks, stats.n_empty_chunks,
+            stats.n_items, stats.bytes_unused);
+  }
+}
+
+/** Give the empty chunks of our cell pools back to the system, and return
+ * the number of bytes freed. */
+size_t
+cell_pools_clean(void)
+{
+  size_t freed = 0;
+  if (cell_pool)
+    freed += mp_pool_clean(cell_pool, 0);
+  if (destroy_cell_pool)
+    freed += mp_pool_clean(destroy_cell_pool, 0);
+  return freed;
+}
+
+/** Release all storage held by our cell pools.  Must only be called when no
+ * more cells are in use, i.e. after all circuits and channels are freed. */
+void
+cell_pools_free_all(void)
+{
+  mp_pool_destroy(cell_pool);
+  mp_pool_destroy(destroy_cell_pool);
+  total_cells_allocated = 0;
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
-static inline packed_cell_t *
+packed_cell_t *
 packed_cell_copy(const cell_t *cell, int wide_circ_ids)
 {
   packed_cell_t *c = packed_cell_new();
@@ -2827,7 +3040,7 @@ cell_queue_clear(cell_queue_t *queue)
 
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
  * <b>queue</b> is empty. */
-STATIC packed_cell_t *
+packed_cell_t *
 cell_queue_pop(cell_queue_t *queue)
 {
   packed_cell_t *cell = TOR_SIMPLEQ_FIRST(&queue->head);
@@ -2853,12 +3066,21 @@ destroy_cell_queue_clear(destroy_cell_queue_t *queue)
   destroy_cell_t *cell;
   while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
     TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    tor_free(cell);
+    destroy_cell_free(cell);
   }
   TOR_SIMPLEQ_INIT(&queue->head);
   queue->n = 0;
 }
 
+/** Release storage held by the destroy cell <b>cell</b>. */
+void
+destroy_cell_free_(destroy_cell_t *cell)
+{
+  if (!cell)
+    return;
+  mp_pool_release(cell);
+}
+
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
  * <b>queue</b> is empty. */
 STATIC destroy_cell_t *
@@ -2878,7 +3100,11 @@ destroy_cell_queue_append(destroy_cell_queue_t *queue,
                           circid_t circid,
                           uint8_t reason)
 {
-  destroy_cell_t *cell = tor_malloc_zero(sizeof(destroy_cell_t));
+  destroy_cell_t *cell;
+  if (PREDICT_UNLIKELY(!destroy_cell_pool))
+    destroy_cell_pool = mp_pool_new(sizeof(destroy_cell_t),
+                                    CELL_POOL_CHUNK_CAPACITY);
+  cell = mp_pool_get_zero(destroy_cell_pool);
   cell->circid = circid;
   cell->reason = reason;
   /* Not yet used, but will be required for OOM handling. */
@@ -2900,7 +3126,7 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
   cell.payload[0] = inp->reason;
   cell_pack(packed, &cell, wide_circ_ids);
 
-  tor_free(inp);
+  destroy_cell_free(inp);
   return packed;
 }
 
@@ -2946,6 +3172,13 @@ cell_queues_check_size(void)
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
+      /* Cached empty chunks of our cell pools and buffer freelists are not
+       * part of alloc, but there is no point in keeping them while we kill
+       * circuits.  We only get here once per OOM, not once per cell, so
+       * they don't get freed and refilled over and over. */
+      size_t pool_slack_freed = cell_pools_clean();
+      pool_slack_freed += split_cell_buffer_pool_clean();
+      pool_slack_freed += buf_shrink_freelists(1);
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
@@ -2965,7 +3198,7 @@ cell_queues_check_size(void)
           dns_cache_total - (size_t)(get_options()->MaxMemInQueues / 10);
         alloc -= dns_cache_handle_oom(now, bytes_to_remove);
       }
-      circuits_handle_oom(alloc);
+      circuits_handle_oom(alloc, pool_slack_freed);
       return 1;
     }
   }
@@ -3371,24 +3604,29 @@ relay_consensus_has_changed(const networkstatus_t *ns)
                             RELAY_CIRC_CELL_QUEUE_SIZE_MAX);
 }
 
-/** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>chan</b>
- * transmitting in <b>direction</b>.
- *
- * The given <b>cell</b> is copied onto the circuit queue so the caller must
- * cleanup the memory.
+/** Helper: add either <b>cell</b> (by copying it) or the already packed
+ * <b>packed</b> (by taking ownership of it) to the queue of <b>circ</b>
+ * writing to <b>chan</b> transmitting in <b>direction</b>. Exactly one of
+ * cell and packed must be given.
  *
  * This function is part of the fast path. */
-void
-append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
-                             cell_t *cell, cell_direction_t direction,
+static void
+append_to_circuit_queue_impl(circuit_t *circ, channel_t *chan,
+                             cell_t *cell, packed_cell_t *packed,
+                             cell_direction_t direction,
                              streamid_t fromstream)
 {
   or_circuit_t *orcirc = NULL;
   cell_queue_t *queue;
   int streams_blocked;
   int exitward;
-  if (circ->marked_for_close)
+
+  tor_assert(!cell != !packed);
+
+  if (circ->marked_for_close) {
+    packed_cell_free(packed);
     return;
+  }
 
   exitward = (direction == CELL_DIRECTION_OUT);
   if (exitward) {
@@ -3408,13 +3646,22 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
            max_circuit_cell_queue_size);
     circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
     stats_n_circ_max_cell_reached++;
+    packed_cell_free(packed);
     return;
   }
 
-  /* Very important that we copy to the circuit queue because all calls to
-   * this function use the stack for the cell memory. */
-  cell_queue_append_packed_copy(circ, queue, exitward, cell,
-                                chan->wide_circ_ids, 1);
+  if (packed) {
+    packed->inserted_timestamp = monotime_coarse_get_stamp();
+    cell_queue_append(queue, packed);
+#ifdef SPLIT_EVAL
+    clock_gettime(CLOCK_MONOTONIC, &circ->temp);
+#endif /* SPLIT_EVAL */
+  } else {
+    /* Very important that we copy to the circuit queue because all calls to
+     * append_cell_to_circuit_queue() use the stack for the cell memory. */
+    cell_queue_append_packed_copy(circ, queue, exitward, cell,
+                                  chan->wide_circ_ids, 1);
+  }
 
   /* Check and run the OOM if needed. */
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
@@ -3444,6 +3691,37 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   scheduler_channel_has_waiting_cells(chan);
 }
 
+/** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>chan</b>
+ * transmitting in <b>direction</b>.
+ *
+ * The given <b>cell</b> is copied onto the circuit queue so the caller must
+ * cleanup the memory.
+ *
+ * This function is part of the fast path. */
+void
+append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                             cell_t *cell, cell_direction_t direction,
+                             streamid_t fromstream)
+{
+  append_to_circuit_queue_impl(circ, chan, cell, NULL, direction,
+                               fromstream);
+}
+
+/** Move the packed <b>cell</b> to the queue of <b>circ</b> writing to
+ * <b>chan</b> transmitting in <b>direction</b>. The cell must already be
+ * packed for <b>chan</b> and this circuit's ID on it.
+ *
+ * The queue takes ownership of <b>cell</b> (it is freed, if the circuit
+ * cannot take it), so the caller must not use it afterwards. */
+void
+append_packed_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                    packed_cell_t *cell,
+                                    cell_direction_t direction)
+{
+  tor_assert(cell);
+  append_to_circuit_queue_impl(circ, chan, NULL, cell, direction, 0);
+}
+
 /** Append an encoded value of <b>addr</b> to <b>payload_out</b>, which must
  * have at least 18 bytes of free space.  The encoding is, as specified in
  * tor-spec.txt:
@@ -22,6 +22,9 @@ int circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
                                     crypt_path_t* start_at);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_relay_cell_crypted(cell_t *cell, or_circuit_t *circ,
+                                       cell_direction_t cell_direction,
+                                       char recognized);
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -53,6 +56,8 @@ extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
 size_t packed_cell_mem_cost(void);
+size_t cell_pools_clean(void);
+void cell_pools_free_all(void);
 
 int have_been_under_memory_pressure(void);
 
@@ -60,10 +65,15 @@ int have_been_under_memory_pressure(void);
 void packed_cell_free_(packed_cell_t *cell);
 #define packed_cell_free(cell) \
   FREE_AND_NULL(packed_cell_t, packed_cell_free_, (cell))
+void destroy_cell_free_(destroy_cell_t *cell);
+#define destroy_cell_free(cell) \
+  FREE_AND_NULL(destroy_cell_t, destroy_cell_free_, (cell))
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
 void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+packed_cell_t *cell_queue_pop(cell_queue_t *queue);
+packed_cell_t *packed_cell_copy(const cell_t *cell, int wide_circ_ids);
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
                                    int wide_circ_ids, int use_stats);
@@ -71,6 +81,9 @@ void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
 void append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                                   cell_t *cell, cell_direction_t direction,
                                   streamid_t fromstream);
+void append_packed_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                         packed_cell_t *cell,
+                                         cell_direction_t direction);
 
 void destroy_cell_queue_init(destroy_cell_queue_t *queue);
 void destroy_cell_queue_clear(destroy_cell_queue_t *queue);
@@ -116,7 +129,6 @@ STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const cell_t *cell,
                                                  const relay_header_t *rh);
 STATIC packed_cell_t *packed_cell_new(void);
-STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 STATIC destroy_cell_t *destroy_cell_queue_pop(destroy_cell_queue_t *queue);
 STATIC int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
                                    edge_connection_t *conn,
@@ -476,6 +476,17 @@ scheduler_notify_networkstatus_changed(void)
   }
 }
 
+/**
+ * Called from the heartbeat: let the current scheduler log its statistics.
+ */
+void
+scheduler_log_heartbeat(void)
+{
+  if (the_scheduler && the_scheduler->log_heartbeat) {
+    the_scheduler->log_heartbeat();
+  }
+}
+
 /**
  * Free everything scheduling-related from main.c. Note this is only called
  * when Tor is shutting down, while scheduler_t->free_all() is called both when
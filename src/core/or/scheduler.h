@@ -93,6 +93,10 @@ typedef struct scheduler_s {
    * scheduler should use this as an opportunity to parse and cache torrc
    * options so that it doesn't have to call get_options() all the time. */
   void (*on_new_options)(void);
+
+  /* (Optional) To be called when Tor logs its heartbeat message. A scheduler
+   * that keeps statistics about its own work should log them here. */
+  void (*log_heartbeat)(void);
 } scheduler_t;
 
 /*****************************************************************************
@@ -107,6 +111,9 @@ typedef struct scheduler_s {
 #define KIST_SCHED_RUN_INTERVAL_MIN 0
 /* Maximum interval that KIST runs (in ms). */
 #define KIST_SCHED_RUN_INTERVAL_MAX 100
+/* Maximum age (in ms) of the kernel information that KIST estimates
+ * per-socket limits from. */
+#define KIST_SOCK_INFO_MAX_AGE_MAX 1000
 
 /*****************************************************************************
  * Globally visible scheduler functions
@@ -119,6 +126,7 @@ void scheduler_init(void);
 void scheduler_free_all(void);
 void scheduler_conf_changed(void);
 void scheduler_notify_networkstatus_changed(void);
+void scheduler_log_heartbeat(void);
 MOCK_DECL(void, scheduler_release_channel, (channel_t *chan));
 
 /*
@@ -185,6 +193,23 @@ typedef struct socket_table_ent_s {
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* Smoothed round trip time in usec, from the kernel */
+  uint32_t rtt;
+  /* Estimator state, used if KISTSockInfoMaxAge is set. We only ask the
+   * kernel for TCP info again once the snapshot below is too old or the
+   * socket hit its limit; until then, we estimate the limit from it. */
+  /* True iff we have a snapshot of the kernel information. */
+  unsigned int have_snapshot : 1;
+  /* True iff the socket hit its limit since the snapshot. */
+  unsigned int hit_limit : 1;
+  /* When we took the snapshot. */
+  monotime_t snapshot_time;
+  /* Bytes in the kernel and in the outbuf when we took the snapshot. */
+  uint64_t snapshot_queued;
+  /* Amount written since the snapshot */
+  uint64_t written_since_snapshot;
+  /* Inode of the socket, to find it in sock_diag answers; 0 if unknown */
+  uint64_t inode;
 } socket_table_ent_t;
 
 typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_s) outbuf_table_t;
@@ -202,6 +227,11 @@ int kist_scheduler_run_interval(void);
 
 #ifdef TOR_UNIT_TESTS
 extern int32_t sched_run_interval;
+STATIC void socket_info_take_snapshot(socket_table_ent_t *ent,
+                                      const monotime_t *now,
+                                      size_t outbuf_len);
+STATIC int socket_info_estimate(socket_table_ent_t *ent,
+                                const monotime_t *now, size_t outbuf_len);
 #endif /* TOR_UNIT_TESTS */
 
 #endif /* defined(SCHEDULER_KIST_PRIVATE) */
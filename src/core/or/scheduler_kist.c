@@ -27,6 +27,17 @@
 #include <linux/sockios.h>
 #endif /* HAVE_KIST_SUPPORT */
 
+#ifdef HAVE_KIST_SOCK_DIAG
+/* Kernel interface to get the TCP information of many sockets at once. */
+#include <sys/stat.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include "lib/container/bitarray.h"
+#include "lib/net/socket.h"
+#endif /* defined(HAVE_KIST_SOCK_DIAG) */
+
 /*****************************************************************************
  * Data structures and supporting functions
  *****************************************************************************/
@@ -95,6 +106,28 @@ static monotime_t scheduler_last_run;
 static double sock_buf_size_factor = 1.0;
 /* How often the scheduler runs. */
 STATIC int sched_run_interval = KIST_SCHED_RUN_INTERVAL_DEFAULT;
+/* For how long (in msec) we may estimate the limit of a socket from a
+ * snapshot of its kernel information instead of asking the kernel again
+ * every run. Zero means we ask the kernel every run. */
+static int sock_info_max_age = 0;
+/* Indicate if we ask the kernel about many sockets at once through netlink
+ * sock_diag instead of asking about them one by one. */
+static int use_sock_diag = 0;
+
+/* Statistics about the work of the scheduler since the last heartbeat. */
+static struct {
+  /* Number of scheduler runs. */
+  uint64_t n_runs;
+  /* Number of socket limits we computed, and how many of those we estimated
+   * without asking the kernel. */
+  uint64_t n_sockets;
+  uint64_t n_estimated;
+  /* Number of system calls we made to get socket information. */
+  uint64_t n_syscalls;
+  /* Total and longest time of the runs, in usec. */
+  uint64_t run_usec;
+  uint64_t max_run_usec;
+} kist_stats;
 
 #ifdef HAVE_KIST_SUPPORT
 /* Indicate if KIST lite mode is on or off. We can disable it at runtime.
@@ -188,53 +221,13 @@ free_socket_info_by_chan(socket_table_t *table, const channel_t *chan)
   free_socket_info_by_ent(ent, NULL);
 }
 
-/* Perform system calls for the given socket in order to calculate kist's
- * per-socket limit as documented in the function body. */
-MOCK_IMPL(void,
-update_socket_info_impl, (socket_table_ent_t *ent))
-{
 #ifdef HAVE_KIST_SUPPORT
+/* Calculate kist's per-socket limit for the socket of <b>ent</b> from the
+ * kernel information in <b>ent</b>, as documented in the function body. */
+static void
+compute_socket_limit(socket_table_ent_t *ent)
+{
   int64_t tcp_space, extra_space;
-  tor_assert(ent);
-  tor_assert(ent->chan);
-  const tor_socket_t sock =
-    TO_CONN(BASE_CHAN_TO_TLS((channel_t *) ent->chan)->conn)->s;
-  struct tcp_info tcp;
-  socklen_t tcp_info_len = sizeof(tcp);
-
-  if (kist_no_kernel_support || kist_lite_mode) {
-    goto fallback;
-  }
-
-  /* Gather information */
-  if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0) {
-    if (errno == EINVAL) {
-      /* Oops, this option is not provided by the kernel, we'll have to
-       * disable KIST entirely. This can happen if tor was built on a machine
-       * with the support previously or if the kernel was updated and lost the
-       * support. */
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
-                           "for KIST anymore. We will fallback to the naive "
-                           "approach. Remove KIST from the Schedulers list "
-                           "to disable.");
-      kist_no_kernel_support = 1;
-    }
-    goto fallback;
-  }
-  if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
-    if (errno == EINVAL) {
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
-                           "for KIST anymore. We will fallback to the naive "
-                           "approach. Remove KIST from the Schedulers list "
-                           "to disable.");
-      /* Same reason as the above. */
-      kist_no_kernel_support = 1;
-    }
-    goto fallback;
-  }
-  ent->cwnd = tcp.tcpi_snd_cwnd;
-  ent->unacked = tcp.tcpi_unacked;
-  ent->mss = tcp.tcpi_snd_mss;
 
   /* In order to reduce outbound kernel queuing delays and thus improve Tor's
    * ability to prioritize circuits, KIST wants to set a socket write limit
@@ -296,6 +289,59 @@ update_socket_info_impl, (socket_table_ent_t *ent))
      * And we know this will always be positive, since we checked above. */
     ent->limit = (uint64_t)tcp_space + (uint64_t)extra_space;
   }
+}
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
+/* Perform system calls for the given socket in order to calculate kist's
+ * per-socket limit as documented in compute_socket_limit(). */
+MOCK_IMPL(void,
+update_socket_info_impl, (socket_table_ent_t *ent))
+{
+#ifdef HAVE_KIST_SUPPORT
+  tor_assert(ent);
+  tor_assert(ent->chan);
+  const tor_socket_t sock =
+    TO_CONN(BASE_CHAN_TO_TLS((channel_t *) ent->chan)->conn)->s;
+  struct tcp_info tcp;
+  socklen_t tcp_info_len = sizeof(tcp);
+
+  if (kist_no_kernel_support || kist_lite_mode) {
+    goto fallback;
+  }
+
+  /* Gather information */
+  kist_stats.n_syscalls++;
+  if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0) {
+    if (errno == EINVAL) {
+      /* Oops, this option is not provided by the kernel, we'll have to
+       * disable KIST entirely. This can happen if tor was built on a machine
+       * with the support previously or if the kernel was updated and lost the
+       * support. */
+      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
+                           "for KIST anymore. We will fallback to the naive "
+                           "approach. Remove KIST from the Schedulers list "
+                           "to disable.");
+      kist_no_kernel_support = 1;
+    }
+    goto fallback;
+  }
+  kist_stats.n_syscalls++;
+  if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
+    if (errno == EINVAL) {
+      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
+                           "for KIST anymore. We will fallback to the naive "
+                           "approach. Remove KIST from the Schedulers list "
+                           "to disable.");
+      /* Same reason as the above. */
+      kist_no_kernel_support = 1;
+    }
+    goto fallback;
+  }
+  ent->cwnd = tcp.tcpi_snd_cwnd;
+  ent->unacked = tcp.tcpi_unacked;
+  ent->mss = tcp.tcpi_snd_mss;
+  ent->rtt = tcp.tcpi_rtt;
+  compute_socket_limit(ent);
   return;
 
 #else /* !(defined(HAVE_KIST_SUPPORT)) */
@@ -308,7 +354,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
    * also allow the socket to write as much as it can from the estimated
    * number of cells the lower layer can accept, effectively returning it to
    * Vanilla scheduler behavior. */
-  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = ent->rtt = 0;
   /* This function calls the specialized channel object (currently channeltls)
    * and ask how many cells it can write on the outbuf which we then multiply
    * by the size of the cells for this channel. The cast is because this
@@ -318,6 +364,344 @@ update_socket_info_impl, (socket_table_ent_t *ent))
                 TLS_PER_CELL_OVERHEAD);
 }
 
+/* Remember the kernel information that we just got for the socket of
+ * <b>ent</b> at <b>now</b>, when its outbuf held <b>outbuf_len</b> bytes, so
+ * that we can estimate its limit from it later on. */
+STATIC void
+socket_info_take_snapshot(socket_table_ent_t *ent, const monotime_t *now,
+                          size_t outbuf_len)
+{
+  /* Without TCP information (KISTLite, or the kernel lost its support for
+   * KIST), there is nothing to estimate from. */
+  if (ent->cwnd == 0 || ent->mss == 0) {
+    ent->have_snapshot = 0;
+    return;
+  }
+  ent->have_snapshot = 1;
+  ent->hit_limit = 0;
+  memcpy(&ent->snapshot_time, now, sizeof(monotime_t));
+  ent->snapshot_queued = (uint64_t)ent->unacked * ent->mss + ent->notsent +
+                         outbuf_len;
+  ent->written_since_snapshot = 0;
+}
+
+/* Estimate the limit of the socket of <b>ent</b> at <b>now</b>, when its
+ * outbuf holds <b>outbuf_len</b> bytes, from the snapshot of its kernel
+ * information. On success, set the limit of <b>ent</b> and return 0. Return
+ * -1 if we have to ask the kernel instead: because the snapshot is missing or
+ * too old, or because the socket hit its limit since we took it. */
+STATIC int
+socket_info_estimate(socket_table_ent_t *ent, const monotime_t *now,
+                     size_t outbuf_len)
+{
+  int64_t age_usec, window, queued, limit;
+
+  if (sock_info_max_age <= 0 || !ent->have_snapshot || ent->hit_limit) {
+    return -1;
+  }
+  age_usec = monotime_diff_usec(&ent->snapshot_time, now);
+  if (age_usec < 0 || age_usec > sock_info_max_age * INT64_C(1000)) {
+    return -1;
+  }
+
+  /* We model the socket like this: what we wrote since the snapshot went to
+   * the outbuf and on to the kernel, and the kernel sends one congestion
+   * window per round trip time. So the bytes still queued are the ones that
+   * were queued at the snapshot and the ones we wrote since, minus what the
+   * kernel sent meanwhile; but never fewer than the bytes in the outbuf,
+   * since the kernel can't have sent those. */
+  window = (int64_t)ent->cwnd * ent->mss;
+  queued = (int64_t)(ent->snapshot_queued + ent->written_since_snapshot);
+  if (ent->rtt > 0) {
+    queued -= clamp_double_to_int64((double)window * age_usec / ent->rtt);
+  }
+  if (queued < (int64_t)outbuf_len) {
+    queued = (int64_t)outbuf_len;
+  }
+
+  /* Then, as in compute_socket_limit(), we allow one congestion window on
+   * the wire and sock_buf_size_factor windows waiting in the kernel. */
+  limit = clamp_double_to_int64(window * (1.0 + sock_buf_size_factor)) -
+          queued;
+  if (limit < (int64_t)(CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD)) {
+    /* According to our model, the socket is at its limit. The kernel might
+     * know better, because it got ACKs faster than we assumed. */
+    return -1;
+  }
+  ent->limit = (uint64_t)limit;
+  return 0;
+}
+
+/* We just asked the kernel about the socket of <b>ent</b> at <b>now</b>: log
+ * what we got, and keep it for estimating the limit later on. */
+static void
+socket_info_updated(socket_table_ent_t *ent, const monotime_t *now)
+{
+  log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
+                      ", cwnd: %" PRIu32 ", unacked: %" PRIu32
+                      ", notsent: %" PRIu32 ", mss: %" PRIu32,
+            ent->chan->global_identifier, ent->limit, ent->cwnd, ent->unacked,
+            ent->notsent, ent->mss);
+
+  if (sock_info_max_age <= 0 || ent->cwnd == 0) {
+    ent->have_snapshot = 0;
+    return;
+  }
+  socket_info_take_snapshot(ent, now,
+                            channel_outbuf_length((channel_t *) ent->chan));
+}
+
+#ifdef HAVE_KIST_SOCK_DIAG
+
+/* If we have fewer sockets than this to ask the kernel about, we ask about
+ * each one on its own rather than through sock_diag, which reports on all TCP
+ * sockets of the host. */
+#define KIST_SOCK_DIAG_MIN_SOCKETS 16
+/* Size of the buffer for sock_diag answers. */
+#define KIST_SOCK_DIAG_BUF_LEN 32768
+
+/* Netlink socket for sock_diag requests, or TOR_INVALID_SOCKET if we didn't
+ * open it yet. */
+static tor_socket_t sock_diag_sock = TOR_INVALID_SOCKET;
+/* Buffer for sock_diag answers. */
+static uint8_t *sock_diag_buf = NULL;
+/* Indicate if sock_diag failed us, so that we don't try it again. */
+static unsigned int sock_diag_broken = 0;
+
+/* Close our sock_diag socket, if we have one. */
+static void
+sock_diag_close(void)
+{
+  if (SOCKET_OK(sock_diag_sock)) {
+    tor_close_socket(sock_diag_sock);
+    sock_diag_sock = TOR_INVALID_SOCKET;
+  }
+  tor_free(sock_diag_buf);
+}
+
+/* Helper for sorting socket table entries by inode. */
+static int
+compare_socket_ent_inodes_(const void **a_, const void **b_)
+{
+  const socket_table_ent_t *a = *a_, *b = *b_;
+  if (a->inode < b->inode)
+    return -1;
+  else if (a->inode > b->inode)
+    return 1;
+  return 0;
+}
+
+/* Helper for finding a socket table entry by inode. */
+static int
+compare_inode_to_socket_ent_(const void *key, const void **member)
+{
+  const uint64_t inode = *(const uint64_t *) key;
+  const socket_table_ent_t *ent = *member;
+  if (inode < ent->inode)
+    return -1;
+  else if (inode > ent->inode)
+    return 1;
+  return 0;
+}
+
+/* Ask the kernel for the TCP information of all TCP sockets of address
+ * family <b>family</b> that can send data. Return 0 on success, -1 on
+ * failure. */
+static int
+sock_diag_send_request(int family)
+{
+  struct {
+    struct nlmsghdr nlh;
+    struct inet_diag_req_v2 req;
+  } msg;
+  struct sockaddr_nl nladdr;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.nlh.nlmsg_len = sizeof(msg);
+  msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  msg.req.sdiag_family = family;
+  msg.req.sdiag_protocol = IPPROTO_TCP;
+  msg.req.idiag_states = (1 << TCP_ESTABLISHED) | (1 << TCP_CLOSE_WAIT);
+  msg.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+  memset(&nladdr, 0, sizeof(nladdr));
+  nladdr.nl_family = AF_NETLINK;
+
+  kist_stats.n_syscalls++;
+  if (sendto(sock_diag_sock, &msg, sizeof(msg), 0,
+             (struct sockaddr *) &nladdr, sizeof(nladdr)) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Handle the sock_diag answer <b>msg</b> of length <b>msg_len</b> about one
+ * socket: if the socket belongs to an entry of <b>ents</b> (sorted by
+ * inode), compute the limit of that entry and set its bit in <b>found</b>. */
+static void
+sock_diag_handle_answer(struct inet_diag_msg *msg, int msg_len,
+                        const smartlist_t *ents, bitarray_t *found)
+{
+  const uint64_t inode = msg->idiag_inode;
+  struct rtattr *attr = (struct rtattr *) (msg + 1);
+  int attr_len = msg_len - (int) NLMSG_ALIGN(sizeof(*msg));
+  struct tcp_info tcp;
+  socket_table_ent_t *ent;
+  uint64_t inflight;
+  int idx, is_found = 0, have_tcp_info = 0;
+
+  idx = smartlist_bsearch_idx(ents, &inode, compare_inode_to_socket_ent_,
+                              &is_found);
+  if (!is_found) {
+    return;
+  }
+  ent = smartlist_get(ents, idx);
+
+  memset(&tcp, 0, sizeof(tcp));
+  for (; RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+    if (attr->rta_type == INET_DIAG_INFO) {
+      memcpy(&tcp, RTA_DATA(attr), MIN(sizeof(tcp), RTA_PAYLOAD(attr)));
+      have_tcp_info = 1;
+    }
+  }
+  if (!have_tcp_info) {
+    return;
+  }
+
+  ent->cwnd = tcp.tcpi_snd_cwnd;
+  ent->unacked = tcp.tcpi_unacked;
+  ent->mss = tcp.tcpi_snd_mss;
+  ent->rtt = tcp.tcpi_rtt;
+  /* The write queue length is what SIOCOUTQ would tell us: all bytes that
+   * weren't ACKed yet. The ones that weren't sent yet, which SIOCOUTQNSD
+   * would tell us, are roughly the ones beyond the unacked packets. */
+  inflight = (uint64_t) ent->unacked * ent->mss;
+  ent->notsent = (msg->idiag_wqueue > inflight) ?
+    (uint32_t) (msg->idiag_wqueue - inflight) : 0;
+  compute_socket_limit(ent);
+  bitarray_set(found, idx);
+}
+
+/* Ask the kernel through sock_diag about the sockets of all entries in
+ * <b>ents</b>, which must be sorted by inode, and compute their limits. Set
+ * the bits in <b>found</b> of the entries we got an answer for. Return 0 on
+ * success, or -1 with errno set on failure. */
+static int
+sock_diag_update_socket_info(const smartlist_t *ents, bitarray_t *found)
+{
+  static const int families[] = { AF_INET, AF_INET6 };
+  unsigned i;
+
+  if (!SOCKET_OK(sock_diag_sock)) {
+    sock_diag_sock = tor_open_socket_with_extensions(AF_NETLINK, SOCK_RAW,
+                                                     NETLINK_SOCK_DIAG, 1, 1);
+    if (!SOCKET_OK(sock_diag_sock)) {
+      return -1;
+    }
+    sock_diag_buf = tor_malloc(KIST_SOCK_DIAG_BUF_LEN);
+  }
+
+  for (i = 0; i < ARRAY_LENGTH(families); ++i) {
+    int done = 0;
+    if (sock_diag_send_request(families[i]) < 0) {
+      return -1;
+    }
+    /* The kernel prepares each part of the answer while we wait for it, so
+     * we never have to block. */
+    while (!done) {
+      struct nlmsghdr *nlh;
+      ssize_t n;
+
+      kist_stats.n_syscalls++;
+      n = recv(sock_diag_sock, sock_diag_buf, KIST_SOCK_DIAG_BUF_LEN,
+               MSG_DONTWAIT);
+      if (n <= 0) {
+        if (n == 0)
+          errno = EPROTO;
+        return -1;
+      }
+      for (nlh = (struct nlmsghdr *) sock_diag_buf; NLMSG_OK(nlh, n);
+           nlh = NLMSG_NEXT(nlh, n)) {
+        if (nlh->nlmsg_type == NLMSG_DONE) {
+          done = 1;
+          break;
+        }
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+          /* The kernel tells us what went wrong in the message itself;
+           * errno is left over from some earlier call. */
+          const struct nlmsgerr *err = NLMSG_DATA(nlh);
+          if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*err)) && err->error)
+            errno = -err->error;
+          else
+            errno = EPROTO;
+          return -1;
+        }
+        if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct inet_diag_msg))) {
+          errno = EPROTO;
+          return -1;
+        }
+        sock_diag_handle_answer(NLMSG_DATA(nlh),
+                                (int) (nlh->nlmsg_len - NLMSG_HDRLEN),
+                                ents, found);
+      }
+    }
+  }
+  return 0;
+}
+
+/* Update the socket information of all entries in <b>ents</b> at <b>now</b>,
+ * asking the kernel about many sockets at once through sock_diag if we can.
+ * Reorders <b>ents</b>. */
+static void
+update_socket_info_batch(smartlist_t *ents, const monotime_t *now)
+{
+  bitarray_t *found = NULL;
+  const int n_ents = smartlist_len(ents);
+  int i;
+
+  if (n_ents >= KIST_SOCK_DIAG_MIN_SOCKETS && !sock_diag_broken &&
+      !kist_no_kernel_support && !kist_lite_mode) {
+    /* sock_diag tells us the inodes of the sockets, so we need to know the
+     * inodes of ours. They don't change, so we look them up only once. */
+    SMARTLIST_FOREACH_BEGIN(ents, socket_table_ent_t *, ent) {
+      if (!ent->inode) {
+        struct stat st;
+        const tor_socket_t sock =
+          TO_CONN(BASE_CHAN_TO_TLS((channel_t *) ent->chan)->conn)->s;
+        kist_stats.n_syscalls++;
+        if (fstat(sock, &st) == 0) {
+          ent->inode = st.st_ino;
+        }
+      }
+    } SMARTLIST_FOREACH_END(ent);
+    smartlist_sort(ents, compare_socket_ent_inodes_);
+
+    found = bitarray_init_zero(n_ents);
+    if (sock_diag_update_socket_info(ents, found) < 0) {
+      log_notice(LD_SCHED, "Unable to get socket information through "
+                 "sock_diag: %s. We will ask about each socket on its own.",
+                 strerror(errno));
+      sock_diag_broken = 1;
+      sock_diag_close();
+      bitarray_free(found);
+      found = bitarray_init_zero(n_ents);
+    }
+  }
+
+  for (i = 0; i < n_ents; ++i) {
+    socket_table_ent_t *ent = smartlist_get(ents, i);
+    /* Sockets that sock_diag didn't tell us about, if any, and all sockets
+     * if we didn't use it. */
+    if (!found || !bitarray_is_set(found, i)) {
+      update_socket_info_impl(ent);
+    }
+    socket_info_updated(ent, now);
+  }
+  bitarray_free(found);
+}
+
+#endif /* defined(HAVE_KIST_SOCK_DIAG) */
+
 /* Given a socket that isn't in the table, add it.
  * Given a socket that is in the table, re-init values that need init-ing
  * every scheduling run
@@ -396,24 +780,40 @@ socket_can_write(socket_table_t *table, const channel_t *chan)
   int64_t kist_limit_space =
     (int64_t) (ent->limit - ent->written) /
     (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
+  if (kist_limit_space <= 0) {
+    /* Don't estimate the next limit of this socket, ask the kernel. */
+    ent->hit_limit = 1;
+  }
   return kist_limit_space > 0;
 }
 
-/* Update the channel's socket kernel information. */
+/* Update the channel's socket kernel information at <b>now</b>, or estimate
+ * it if we may. If <b>batch</b> is set and we need to ask the kernel, add
+ * the entry to <b>batch</b> so that we ask about all of them at once. */
 static void
-update_socket_info(socket_table_t *table, const channel_t *chan)
+update_socket_info(socket_table_t *table, const channel_t *chan,
+                   const monotime_t *now, smartlist_t *batch)
 {
   socket_table_ent_t *ent = NULL;
   ent = socket_table_search(table, chan);
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
+  kist_stats.n_sockets++;
+  if (ent->have_snapshot &&
+      socket_info_estimate(ent, now,
+                           channel_outbuf_length((channel_t *) chan)) == 0) {
+    kist_stats.n_estimated++;
+    log_debug(LD_SCHED, "chan=%" PRIu64 " estimated socket info, limit: %"
+              PRIu64, chan->global_identifier, ent->limit);
+    return;
+  }
+  if (batch) {
+    smartlist_add(batch, ent);
+    return;
+  }
   update_socket_info_impl(ent);
-  log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
-                      ", cwnd: %" PRIu32 ", unacked: %" PRIu32
-                      ", notsent: %" PRIu32 ", mss: %" PRIu32,
-            ent->chan->global_identifier, ent->limit, ent->cwnd, ent->unacked,
-            ent->notsent, ent->mss);
+  socket_info_updated(ent, now);
 }
 
 /* Increment the channel's socket written value by the number of bytes. */
@@ -430,6 +830,7 @@ update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
             chan->global_identifier, (unsigned long) bytes, ent->written);
 
   ent->written += bytes;
+  ent->written_since_snapshot += bytes;
 }
 
 /*
@@ -477,6 +878,9 @@ static void
 kist_free_all(void)
 {
   free_all_socket_info();
+#ifdef HAVE_KIST_SOCK_DIAG
+  sock_diag_close();
+#endif
 }
 
 /* Function of the scheduler interface: on_channel_free() */
@@ -498,6 +902,8 @@ static void
 kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
+  sock_info_max_age = get_options()->KISTSockInfoMaxAge;
+  use_sock_diag = get_options()->KISTSockDiag;
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
@@ -576,15 +982,34 @@ kist_scheduler_run(void)
   /* Channels to be re-adding to pending at the end */
   smartlist_t *to_readd = NULL;
   smartlist_t *cp = get_channels_pending();
+  /* Sockets to ask the kernel about all at once, if we do that. */
+  smartlist_t *batch = NULL;
+  monotime_t run_start;
+  int64_t run_usec;
 
   outbuf_table_t outbuf_table = HT_INITIALIZER();
 
+  monotime_get(&run_start);
+  kist_stats.n_runs++;
+#ifdef HAVE_KIST_SOCK_DIAG
+  if (use_sock_diag) {
+    batch = smartlist_new();
+  }
+#endif
+
   /* For each pending channel, collect new kernel information */
   SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
       init_socket_info(&socket_table, pchan);
-      update_socket_info(&socket_table, pchan);
+      update_socket_info(&socket_table, pchan, &run_start, batch);
   } SMARTLIST_FOREACH_END(pchan);
 
+#ifdef HAVE_KIST_SOCK_DIAG
+  if (batch) {
+    update_socket_info_batch(batch, &run_start);
+    smartlist_free(batch);
+  }
+#endif
+
   log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
             smartlist_len(cp));
 
@@ -737,6 +1162,33 @@ kist_scheduler_run(void)
   }
 
   monotime_get(&scheduler_last_run);
+  run_usec = monotime_diff_usec(&run_start, &scheduler_last_run);
+  if (run_usec > 0) {
+    kist_stats.run_usec += run_usec;
+    kist_stats.max_run_usec = MAX(kist_stats.max_run_usec,
+                                  (uint64_t) run_usec);
+  }
+}
+
+/* Function of the scheduler interface: log_heartbeat() */
+static void
+kist_scheduler_log_heartbeat(void)
+{
+  if (kist_stats.n_runs == 0) {
+    return;
+  }
+  log_notice(LD_HEARTBEAT, "KIST scheduler: %" PRIu64 " runs since the last "
+             "heartbeat, taking %" PRIu64 " usec on average and %" PRIu64
+             " usec at most. On average, each run computed the limits of "
+             "%.1f sockets (%.1f%% of them estimated) using %.1f system "
+             "calls.",
+             kist_stats.n_runs, kist_stats.run_usec / kist_stats.n_runs,
+             kist_stats.max_run_usec,
+             (double) kist_stats.n_sockets / kist_stats.n_runs,
+             kist_stats.n_sockets ?
+               100.0 * kist_stats.n_estimated / kist_stats.n_sockets : 0.0,
+             (double) kist_stats.n_syscalls / kist_stats.n_runs);
+  memset(&kist_stats, 0, sizeof(kist_stats));
 }
 
 /*****************************************************************************
@@ -753,6 +1205,7 @@ static scheduler_t kist_scheduler = {
   .schedule = kist_scheduler_schedule,
   .run = kist_scheduler_run,
   .on_new_options = kist_scheduler_on_new_options,
+  .log_heartbeat = kist_scheduler_log_heartbeat,
 };
 
 /* Return the KIST scheduler object. If it didn't exists, return a newly
@@ -30,6 +30,7 @@
 #include "feature/hs/hs_stats.h"
 #include "feature/hs/hs_service.h"
 #include "core/or/dos.h"
+#include "core/or/scheduler.h"
 #include "feature/stats/geoip_stats.h"
 
 #include "app/config/or_state_st.h"
@@ -173,6 +174,7 @@ log_heartbeat(time_t now)
     rep_hist_log_circuit_handshake_stats(now);
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
+    scheduler_log_heartbeat();
   }
 
   circuit_log_ancient_one_hop_circuits(1800);
@@ -95,6 +95,31 @@ tor_version_is_obsolete(const char *myversion, const char *versionlist)
   return ret;
 }
 
+/** Copy the version part of the <b>platform</b> line from a router
+ * descriptor into the <b>tmp_len</b>-byte buffer <b>tmp</b>.  Return 1 on
+ * success, -1 if there is no version or it is too long, and 0 if the
+ * platform line does not indicate some version of Tor. */
+static int
+platform_get_version_str(const char *platform, char *tmp, size_t tmp_len)
+{
+  const char *s, *s2, *start;
+
+  if (strcmpstart(platform,"Tor ")) /* nonstandard Tor; say 0. */
+    return 0;
+
+  start = eat_whitespace(platform+3);
+  if (!*start) return -1;
+  s = find_whitespace(start); /* also finds '\0', which is fine */
+  s2 = eat_whitespace(s);
+  if (!strcmpstart(s2, "(r") || !strcmpstart(s2, "(git-"))
+    s = find_whitespace(s2);
+
+  if ((size_t)(s-start+1) >= tmp_len) /* too big, no */
+    return -1;
+  strlcpy(tmp, start, s-start+1);
+  return 1;
+}
+
 /** Extract a Tor version from a <b>platform</b> line from a router
  * descriptor, and place the result in <b>router_version</b>.
  *
@@ -110,21 +135,11 @@ tor_version_parse_platform(const char *platform,
                            int strict)
 {
   char tmp[128];
-  char *s, *s2, *start;
-
-  if (strcmpstart(platform,"Tor ")) /* nonstandard Tor; say 0. */
-    return 0;
-
-  start = (char *)eat_whitespace(platform+3);
-  if (!*start) return -1;
-  s = (char *)find_whitespace(start); /* also finds '\0', which is fine */
-  s2 = (char*)eat_whitespace(s);
-  if (!strcmpstart(s2, "(r") || !strcmpstart(s2, "(git-"))
-    s = (char*)find_whitespace(s2);
+  int r;
 
-  if ((size_t)(s-start+1) >= sizeof(tmp)) /* too big, no */
-    return -1;
-  strlcpy(tmp, start, s-start+1);
+  r = platform_get_version_str(platform, tmp, sizeof(tmp));
+  if (r <= 0)
+    return r;
 
   if (tor_version_parse(tmp, router_version)<0) {
     log_info(LD_DIR,"Router version '%s' unparseable.",tmp);
@@ -144,6 +159,18 @@ tor_version_parse_platform(const char *platform,
   return 1;
 }
 
+/** Return true iff tor_version_parse_platform() would log about
+ * <b>platform</b>, because it names a Tor version that we can't parse. */
+int
+tor_version_parse_platform_would_log(const char *platform)
+{
+  char tmp[128];
+  tor_version_t router_version;
+
+  return platform_get_version_str(platform, tmp, sizeof(tmp)) > 0 &&
+    tor_version_parse(tmp, &router_version) < 0;
+}
+
 /** Parse the Tor version of the platform string <b>platform</b>,
  * and compare it to the version in <b>cutoff</b>. Return 1 if
  * the router is at least as new as the cutoff, else return 0.
@@ -31,6 +31,7 @@ version_status_t tor_version_is_obsolete(const char *myversion,
 int tor_version_parse_platform(const char *platform,
                                tor_version_t *version_out,
                                int strict);
+int tor_version_parse_platform_would_log(const char *platform);
 int tor_version_as_new_as(const char *platform, const char *cutoff);
 int tor_version_parse(const char *s, tor_version_t *out);
 int tor_version_compare(tor_version_t *a, tor_version_t *b);
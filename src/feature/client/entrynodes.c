@@ -3716,6 +3716,34 @@ guards_choose_guard(cpath_build_state_t *state,
   return r;
 }
 
+/** Return a new smartlist of the nodes of all primary guards that could
+ * currently be chosen for a circuit, i.e., that are not known to be
+ * unreachable and that have a descriptor. The list is in the order of
+ * preference of the primary guards.
+ */
+smartlist_t *
+guards_get_usable_primary_nodes(void)
+{
+  guard_selection_t *gs = get_guard_selection_info();
+  smartlist_t *nodes = smartlist_new();
+
+  if (!gs->primary_guards_up_to_date)
+    entry_guards_update_primary(gs);
+
+  SMARTLIST_FOREACH_BEGIN(gs->primary_entry_guards, entry_guard_t *, guard) {
+    const node_t *node;
+    entry_guard_consider_retry(guard);
+    if (guard->is_reachable == GUARD_REACHABLE_NO ||
+        !guard_has_descriptor(guard))
+      continue;
+    node = node_get_by_id(guard->identity);
+    if (node)
+      smartlist_add(nodes, (void*)node);
+  } SMARTLIST_FOREACH_END(guard);
+
+  return nodes;
+}
+
 /** Remove all currently listed entry guards for a given guard selection
  * context.  This frees and replaces <b>gs</b>, so don't use <b>gs</b>
  * after calling this function. */
@@ -334,6 +334,7 @@ const node_t *guards_choose_guard(cpath_build_state_t *state,
                                   circuit_guard_state_t **guard_state_out);
 const node_t *guards_choose_dirguard(uint8_t dir_purpose,
                                      circuit_guard_state_t **guard_state_out);
+smartlist_t *guards_get_usable_primary_nodes(void);
 
 int node_is_possible_guard(const node_t *node);
 int node_passes_guard_filter(const or_options_t *options, const node_t *node);
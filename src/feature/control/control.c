@@ -85,6 +85,7 @@
 #include "feature/rend/rendcommon.h"
 #include "feature/rend/rendparse.h"
 #include "feature/rend/rendservice.h"
+#include "feature/split/splitcommon.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/predict_ports.h"
 #include "lib/container/buffers.h"
@@ -1907,6 +1908,8 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     tor_asprintf(answer, "%"PRIu64, (get_bytes_read()));
   } else if (!strcmp(question, "traffic/written")) {
     tor_asprintf(answer, "%"PRIu64, (get_bytes_written()));
+  } else if (!strcmp(question, "traffic/written-zero-copy")) {
+    tor_asprintf(answer, "%"PRIu64, dirserv_get_n_zero_copy_bytes());
   } else if (!strcmp(question, "uptime")) {
     long uptime_secs = get_uptime();
     tor_asprintf(answer, "%ld", uptime_secs);
@@ -1946,6 +1949,8 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
   } else if (!strcmp(question, "limits/max-mem-in-queues")) {
     tor_asprintf(answer, "%"PRIu64,
                  (get_options()->MaxMemInQueues));
+  } else if (!strcmp(question, "memory/buffer-freelists")) {
+    *answer = buf_get_freelist_stats();
   } else if (!strcmp(question, "fingerprint")) {
     crypto_pk_t *server_key;
     if (!server_mode(get_options())) {
@@ -3372,6 +3377,9 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("traffic/read", misc,"Bytes read since the process was started."),
   ITEM("traffic/written", misc,
        "Bytes written since the process was started."),
+  ITEM("traffic/written-zero-copy", misc,
+       "Directory bytes written with sendfile() since the process was "
+       "started."),
   ITEM("uptime", misc, "Uptime of the Tor daemon in seconds."),
   ITEM("process/pid", misc, "Process id belonging to the main tor process."),
   ITEM("process/uid", misc, "User id running the tor process."),
@@ -3379,6 +3387,8 @@ static const getinfo_item_t getinfo_items[] = {
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("limits/max-mem-in-queues", misc, "Actual limit on memory in queues"),
+  ITEM("memory/buffer-freelists", misc,
+       "Usage of the freelists of buffer chunks, by chunk size."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -3403,6 +3413,8 @@ static const getinfo_item_t getinfo_items[] = {
        "Onion services detached from the control connection."),
   ITEM("sr/current", sr, "Get current shared random value."),
   ITEM("sr/previous", sr, "Get previous shared random value."),
+  ITEM("split/reorder-stats", split,
+       "Cell reordering statistics of split circuits, per split strategy."),
   { NULL, NULL, NULL, 0 }
 };
 
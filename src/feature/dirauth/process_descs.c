@@ -24,6 +24,7 @@
 #include "feature/dircommon/directory.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
@@ -507,6 +508,7 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
 {
   node->is_valid = (authstatus & FP_INVALID) ? 0 : 1;
   node->is_bad_exit = (authstatus & FP_BADEXIT) ? 1 : 0;
+  node_select_weights_changed();
 }
 
 /** True iff <b>a</b> is more severe than <b>b</b>. */
@@ -831,6 +833,7 @@ directory_remove_invalid(void)
       log_info(LD_DIRSERV, "Router '%s' is now a %s exit", description,
                (r & FP_BADEXIT) ? "bad" : "good");
       node->is_bad_exit = (r&FP_BADEXIT) ? 1: 0;
+      node_select_weights_changed();
     }
   } SMARTLIST_FOREACH_END(node);
 
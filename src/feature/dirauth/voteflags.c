@@ -21,6 +21,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -308,6 +309,8 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
       ++n_active;
     }
   } SMARTLIST_FOREACH_END(node);
+  /* We may have changed some Exit flags. */
+  node_select_weights_changed();
 
   /* Now, compute thresholds. */
   if (n_active) {
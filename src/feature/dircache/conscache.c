@@ -437,6 +437,39 @@ consensus_cache_entry_get_body(const consensus_cache_entry_t *ent,
   return 0;
 }
 
+/**
+ * Open the file that holds <b>ent</b> for reading, and return its file
+ * descriptor.  Set *<b>offset_out</b> to the position of the body within the
+ * file: it is as long as the body from consensus_cache_entry_get_body().  On
+ * failure return -1.
+ *
+ * The caller must close the file descriptor.  It stays usable even if the
+ * entry is removed from the cache, but that only matters where unlink()
+ * works on open files.
+ */
+int
+consensus_cache_entry_open_body(const consensus_cache_entry_t *ent,
+                                off_t *offset_out)
+{
+  const uint8_t *body;
+  size_t bodylen;
+
+  if (! ent->in_cache)
+    return -1;
+  /* Map the entry, if it isn't yet, to learn where its body starts. */
+  if (consensus_cache_entry_get_body(ent, &body, &bodylen) < 0)
+    return -1;
+
+  int fd = storage_dir_open(ent->in_cache->dir, ent->fname);
+  if (fd < 0) {
+    log_info(LD_FS, "Unable to open file %s from consensus cache: %s",
+             escaped(ent->fname), strerror(errno));
+    return -1;
+  }
+  *offset_out = (off_t)(body - (const uint8_t *)ent->map->data);
+  return fd;
+}
+
 /**
  * Unmap every mmap'd element of <b>cache</b> that has been unused
  * since <b>cutoff</b>.
@@ -27,6 +27,13 @@
 
 #include "lib/compress/compress.h"
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 /**
  * \file dirserv.c
  * \brief Directory server core implementation. Manages directory
@@ -481,6 +488,10 @@ spooled_resource_free_(spooled_resource_t *spooled)
     cached_dir_decref(spooled->cached_dir_ref);
   }
 
+  if (spooled->zero_copy) {
+    close(spooled->cce_fd);
+  }
+
   if (spooled->consensus_cache_entry) {
     consensus_cache_entry_decref(spooled->consensus_cache_entry);
   }
@@ -553,6 +564,60 @@ spooled_resource_estimate_size(const spooled_resource_t *spooled,
   }
 }
 
+/** How many bytes of directory documents have we written with sendfile(),
+ * straight from the consensus cache? */
+static uint64_t n_zero_copy_bytes = 0;
+
+/** Return true iff we can send consensus cache entries on <b>conn</b> with
+ * sendfile() instead of copying them through its outbuf.
+ *
+ * That only works when the bytes in the file are exactly the bytes we want
+ * on the wire: so not when we are compressing on the fly, and not over a
+ * linked connection, whose bytes end up in relay cells on a TLS
+ * connection. */
+static int
+connection_dirserv_can_sendfile(const dir_connection_t *conn)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+  const or_options_t *options = get_options();
+  const connection_t *base = &conn->base_;
+  /* The sandbox doesn't allow sendfile(). */
+  if (!options->DirCacheZeroCopy || options->Sandbox)
+    return 0;
+  return conn->compress_state == NULL &&
+    !base->linked &&
+    base->uring == NULL &&
+    SOCKET_OK(base->s);
+#else
+  (void) conn;
+  return 0;
+#endif /* defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) */
+}
+
+/** Try to switch <b>spooled</b>, a consensus cache entry that we haven't
+ * started to send yet, to sending with sendfile() on <b>conn</b>.  Return
+ * true on success, and false if we should copy it through the outbuf as
+ * usual. */
+static int
+spooled_resource_start_zero_copy(spooled_resource_t *spooled,
+                                 dir_connection_t *conn)
+{
+  off_t offset = 0;
+  int fd;
+
+  if (spooled->cached_dir_offset != 0 ||
+      !connection_dirserv_can_sendfile(conn))
+    return 0;
+  fd = consensus_cache_entry_open_body(spooled->consensus_cache_entry,
+                                       &offset);
+  if (fd < 0)
+    return 0;
+  spooled->zero_copy = 1;
+  spooled->cce_fd = fd;
+  spooled->cce_fd_offset = offset;
+  return 1;
+}
+
 /** Return code for spooled_resource_flush_some */
 typedef enum {
   SRFS_ERR = -1,
@@ -604,6 +669,16 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     if (BUG(!cached && !cce))
       return SRFS_DONE;
 
+    if (cce && (spooled->zero_copy ||
+                spooled_resource_start_zero_copy(spooled, conn))) {
+      /* connection_dirserv_sendfile() sends this one, once everything ahead
+       * of it has left the outbuf. */
+      if (spooled->cached_dir_offset >= (off_t)spooled->cce_len)
+        return SRFS_DONE;
+      else
+        return SRFS_MORE;
+    }
+
     int64_t total_len;
     const char *ptr;
     if (cached) {
@@ -896,6 +971,92 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
   return 0;
 }
 
+/** Return the resource that <b>conn</b> is sending with sendfile(), if it
+ * still has bytes to send.  Otherwise return NULL. */
+static spooled_resource_t *
+connection_dirserv_get_zero_copy(const dir_connection_t *conn)
+{
+  spooled_resource_t *spooled;
+
+  if (conn->spool == NULL || smartlist_len(conn->spool) == 0)
+    return NULL;
+  spooled = smartlist_get(conn->spool, smartlist_len(conn->spool)-1);
+  if (!spooled->zero_copy ||
+      spooled->cached_dir_offset >= (off_t)spooled->cce_len)
+    return NULL;
+  return spooled;
+}
+
+/** Return the number of bytes that <b>conn</b> has to send with
+ * connection_dirserv_sendfile() once its outbuf is empty. */
+size_t
+connection_dirserv_sendfile_pending(const dir_connection_t *conn)
+{
+  const spooled_resource_t *spooled = connection_dirserv_get_zero_copy(conn);
+  if (spooled == NULL)
+    return 0;
+  return spooled->cce_len - (size_t)spooled->cached_dir_offset;
+}
+
+/**
+ * Send up to <b>max_bytes</b> of the resource that <b>conn</b> is spooling
+ * with sendfile(), straight from the consensus cache to its socket.  The
+ * caller must have emptied the outbuf first.
+ *
+ * Return the number of bytes sent, which may be 0 if the socket would
+ * block, or -1 if the connection has failed.
+ */
+ssize_t
+connection_dirserv_sendfile(dir_connection_t *conn, size_t max_bytes)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+  spooled_resource_t *spooled = connection_dirserv_get_zero_copy(conn);
+  off_t offset;
+  size_t remaining;
+  ssize_t r;
+
+  if (spooled == NULL || max_bytes == 0)
+    return 0;
+  if (BUG(connection_get_outbuf_len(TO_CONN(conn))))
+    return 0;
+
+  remaining = connection_dirserv_sendfile_pending(conn);
+  offset = spooled->cce_fd_offset + spooled->cached_dir_offset;
+  r = sendfile(conn->base_.s, spooled->cce_fd, &offset,
+               MIN(max_bytes, remaining));
+  if (r < 0) {
+    int e = tor_socket_errno(conn->base_.s);
+    if (ERRNO_IS_EAGAIN(e) || e == EINTR)
+      return 0;
+    log_info(LD_DIRSERV, "sendfile() failed on directory connection: %s",
+             tor_socket_strerror(e));
+    return -1;
+  } else if (r == 0) {
+    /* The cache file is shorter than we mapped it: it must have been
+     * truncated under us. */
+    log_warn(LD_BUG, "sendfile() hit the end of a consensus cache entry "
+             "early.");
+    return -1;
+  }
+
+  spooled->cached_dir_offset += r;
+  n_zero_copy_bytes += r;
+  return r;
+#else
+  (void) conn;
+  (void) max_bytes;
+  return 0;
+#endif /* defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) */
+}
+
+/** Return the number of bytes of directory documents that we have written
+ * with sendfile(). */
+uint64_t
+dirserv_get_n_zero_copy_bytes(void)
+{
+  return n_zero_copy_bytes;
+}
+
 /** Remove every element from <b>conn</b>'s outgoing spool, and delete
  * the spool. */
 void
@@ -45,6 +45,11 @@ typedef struct spooled_resource_t {
    * we spool the object a few K at a time.
    */
   unsigned spool_eagerly : 1;
+  /**
+   * If true, we send the consensus cache entry with sendfile() straight
+   * from cce_fd, instead of adding it to the outbuf.
+   */
+  unsigned zero_copy : 1;
   /**
    * Tells us what kind of object to get, and how to look it up.
    */
@@ -65,6 +70,12 @@ typedef struct spooled_resource_t {
   struct consensus_cache_entry_t *consensus_cache_entry;
   const uint8_t *cce_body;
   size_t cce_len;
+  /**
+   * The file holding the consensus cache entry, and the position of its
+   * body in that file.  Only used when zero_copy is true.
+   */
+  int cce_fd;
+  off_t cce_fd_offset;
   /**
    * The current offset into cached_dir or cce_body. Only used when
    * spool_eagerly is false */
@@ -72,6 +83,9 @@ typedef struct spooled_resource_t {
 } spooled_resource_t;
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+size_t connection_dirserv_sendfile_pending(const dir_connection_t *conn);
+ssize_t connection_dirserv_sendfile(dir_connection_t *conn, size_t max_bytes);
+uint64_t dirserv_get_n_zero_copy_bytes(void);
 
 int directory_fetches_from_authorities(const or_options_t *options);
 int directory_fetches_dir_info_early(const or_options_t *options);
@@ -15,19 +15,22 @@
  * it, relying on gen_ed_diff to generate the ed diff and some digest helper
  * functions to generate the digest hashes.
  *
- * gen_ed_diff is the tricky bit. In it simplest form, it will take quadratic
- * time and linear space to generate an ed diff given two smartlists. As shown
- * in its comment section, calling calc_changes on the entire two consensuses
- * will calculate what is to be added and what is to be deleted in the diff.
- * Its comment section briefly explains how it works.
+ * gen_ed_diff is the tricky bit. In it simplest form, it will take O(ND)
+ * time and linear space to generate an ed diff given two smartlists of total
+ * length N whose shortest diff has D lines. As shown in its comment section,
+ * calling myers_changes on the entire two consensuses will calculate what is
+ * to be added and what is to be deleted in the diff. Its comment section
+ * briefly explains how it works. calc_changes is an older, quadratic
+ * implementation of the same thing, based on longest common subsequences,
+ * that we only keep for the unit tests.
  *
  * In our case specific to consensuses, we take advantage of the fact that
  * consensuses list routers sorted by their identities. We use that
- * information to avoid running calc_changes on the whole smartlists.
+ * information to avoid running myers_changes on the whole smartlists.
  * gen_ed_diff will navigate through the two consensuses identity by identity
- * and will send small couples of slices to calc_changes, keeping the running
- * time near-linear. This is explained in more detail in the gen_ed_diff
- * comments.
+ * and will send small couples of slices to myers_changes, keeping the
+ * running time near-linear. This is explained in more detail in the
+ * gen_ed_diff comments.
  *
  * The allocation strategy tries to save time and memory by avoiding needless
  * copies.  Instead of actually splitting the inputs into separate strings, we
@@ -42,6 +45,7 @@
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
 #include "feature/dirparse/ns_parse.h"
+#include "siphash.h"
 
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
@@ -154,6 +158,10 @@ smartlist_slice(const smartlist_t *list, int start, int end)
   return slice;
 }
 
+#ifdef TOR_UNIT_TESTS
+/* gen_ed_diff uses myers_changes; we keep the older calc_changes, and the
+ * helpers that only it uses, to test myers_changes against. */
+
 /** Helper: Compute the longest common subsequence lengths for the two slices.
  * Used as part of the diff generation to find the column at which to split
  * slice2 while still having the optimal solution.
@@ -206,6 +214,8 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
   return result;
 }
 
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Helper: Trim any number of lines that are equally at the start or the end
  * of both slices.
  */
@@ -282,6 +292,7 @@ set_changed(bitarray_t *changed1, bitarray_t *changed2,
   }
 }
 
+#ifdef TOR_UNIT_TESTS
 /*
  * Helper: Given that slice1 has been split by half into top and bot, we want
  * to fetch the column at which to split slice2 so that we are still on track
@@ -361,6 +372,214 @@ calc_changes(smartlist_slice_t *slice1,
   }
 }
 
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** State shared by the helpers of myers_changes(). Line positions are
+ * relative to the start of the two slices being compared, and diagonals are
+ * numbered by the difference between a position in the first slice and one
+ * in the second. */
+typedef struct myers_diff_t {
+  /** The two slices, and a hash of each of their lines. */
+  const smartlist_slice_t *slice1, *slice2;
+  uint64_t *hashes1, *hashes2;
+  /** The bitarrays to mark the lines that are gone or new. */
+  bitarray_t *changed1, *changed2;
+  /** For each diagonal, the furthest position in the first slice reached by
+   * the forward and the backward search. Both can be indexed from
+   * -(slice2->len+1) to slice1->len+1 inclusive. */
+  int *fwd, *bwd;
+} myers_diff_t;
+
+/** Helper: Store a 64-bit hash of each line of <b>slice</b> in
+ * <b>hashes_out</b>, in the same order.
+ *
+ * The key doesn't need to be secret: we only use the hashes to tell lines
+ * apart quickly, and compare lines with matching hashes byte by byte.
+ */
+static void
+hash_slice_lines(const smartlist_slice_t *slice, uint64_t *hashes_out)
+{
+  static const struct sipkey line_hash_key = { 0, 0 };
+  for (int i = 0; i < slice->len; ++i) {
+    const cdline_t *line = smartlist_get(slice->list, slice->offset + i);
+    hashes_out[i] = siphash24(line->s, line->len, &line_hash_key);
+  }
+}
+
+/** Helper: Return true iff line <b>i1</b> of the first slice and line
+ * <b>i2</b> of the second slice in <b>md</b> are equal. */
+static inline int
+myers_lines_eq(const myers_diff_t *md, int i1, int i2)
+{
+  return md->hashes1[i1] == md->hashes2[i2] &&
+    lines_eq(smartlist_get(md->slice1->list, md->slice1->offset + i1),
+             smartlist_get(md->slice2->list, md->slice2->offset + i2));
+}
+
+/** Helper: Find a point (*<b>split1_out</b>, *<b>split2_out</b>) that a
+ * shortest edit script between lines [<b>off1</b>, <b>lim1</b>) of the first
+ * slice and lines [<b>off2</b>, <b>lim2</b>) of the second one goes through,
+ * near its middle. Neither range may be empty.
+ *
+ * This is the "middle snake" search of Myers' "An O(ND) Difference Algorithm
+ * and Its Variations": we extend the furthest reaching D-paths from both
+ * corners of the box, one edit at a time, until a forward and a backward
+ * path overlap. Diagonals that leave the box are never searched; their
+ * neighbours hold sentinels instead.
+ */
+static void
+myers_split(myers_diff_t *md, int off1, int lim1, int off2, int lim2,
+            int *split1_out, int *split2_out)
+{
+  int *fwd = md->fwd, *bwd = md->bwd;
+  const int dmin = off1 - lim2, dmax = lim1 - off2;
+  const int fmid = off1 - off2, bmid = lim1 - lim2;
+  const int odd = (fmid - bmid) & 1;
+  int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+  int d, i1, i2;
+
+  fwd[fmid] = off1;
+  bwd[bmid] = lim1;
+
+  for (;;) {
+    /* One more edit for the forward search. */
+    if (fmin > dmin)
+      fwd[--fmin - 1] = -1;
+    else
+      ++fmin;
+    if (fmax < dmax)
+      fwd[++fmax + 1] = -1;
+    else
+      --fmax;
+    for (d = fmax; d >= fmin; d -= 2) {
+      if (fwd[d - 1] >= fwd[d + 1])
+        i1 = fwd[d - 1] + 1;
+      else
+        i1 = fwd[d + 1];
+      i2 = i1 - d;
+      while (i1 < lim1 && i2 < lim2 && myers_lines_eq(md, i1, i2)) {
+        ++i1;
+        ++i2;
+      }
+      fwd[d] = i1;
+      if (odd && bmin <= d && d <= bmax && bwd[d] <= i1) {
+        *split1_out = i1;
+        *split2_out = i2;
+        return;
+      }
+    }
+
+    /* One more edit for the backward search. */
+    if (bmin > dmin)
+      bwd[--bmin - 1] = INT_MAX;
+    else
+      ++bmin;
+    if (bmax < dmax)
+      bwd[++bmax + 1] = INT_MAX;
+    else
+      --bmax;
+    for (d = bmax; d >= bmin; d -= 2) {
+      if (bwd[d - 1] < bwd[d + 1])
+        i1 = bwd[d - 1];
+      else
+        i1 = bwd[d + 1] - 1;
+      i2 = i1 - d;
+      while (i1 > off1 && i2 > off2 && myers_lines_eq(md, i1 - 1, i2 - 1)) {
+        --i1;
+        --i2;
+      }
+      bwd[d] = i1;
+      if (!odd && fmin <= d && d <= fmax && i1 <= fwd[d]) {
+        *split1_out = i1;
+        *split2_out = i2;
+        return;
+      }
+    }
+  }
+}
+
+/** Helper: Mark the lines that are gone or new between lines [<b>off1</b>,
+ * <b>lim1</b>) of the first slice and lines [<b>off2</b>, <b>lim2</b>) of
+ * the second one, by splitting them at the middle of a shortest edit script
+ * and recursing on both halves. */
+static void
+myers_compare(myers_diff_t *md, int off1, int lim1, int off2, int lim2)
+{
+  int split1, split2, i;
+
+  while (off1 < lim1 && off2 < lim2 && myers_lines_eq(md, off1, off2)) {
+    ++off1;
+    ++off2;
+  }
+  while (off1 < lim1 && off2 < lim2 &&
+         myers_lines_eq(md, lim1 - 1, lim2 - 1)) {
+    --lim1;
+    --lim2;
+  }
+
+  if (off1 == lim1) {
+    for (i = off2; i < lim2; ++i)
+      bitarray_set(md->changed2, md->slice2->offset + i);
+  } else if (off2 == lim2) {
+    for (i = off1; i < lim1; ++i)
+      bitarray_set(md->changed1, md->slice1->offset + i);
+  } else {
+    myers_split(md, off1, lim1, off2, lim2, &split1, &split2);
+    myers_compare(md, off1, split1, off2, split2);
+    myers_compare(md, split1, lim1, split2, lim2);
+  }
+}
+
+/**
+ * Helper: Like calc_changes, figure out what elements are new or gone on
+ * the second slice relative to the first one, and set their bits in the
+ * bitarrays. The slices are trimmed the same way.
+ *
+ * This uses Myers' O(ND) algorithm in its linear space form, where N is the
+ * length of the slices and D the size of the resulting diff, so it is fast
+ * when the slices are similar. Lines are compared by their hashes first,
+ * and byte by byte only when the hashes match.
+ */
+STATIC void
+myers_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
+              bitarray_t *changed1, bitarray_t *changed2)
+{
+  myers_diff_t md;
+
+  /* Most of the slices that gen_ed_diff hands us are equal, or differ in a
+   * single line: handle those without hashing anything. */
+  trim_slices(slice1, slice2);
+  if (slice1->len <= 1) {
+    set_changed(changed1, changed2, slice1, slice2);
+    return;
+  } else if (slice2->len <= 1) {
+    set_changed(changed2, changed1, slice2, slice1);
+    return;
+  }
+
+  const int len1 = slice1->len, len2 = slice2->len;
+  const int n_diagonals = len1 + len2 + 3;
+  uint64_t *hashes = tor_malloc(sizeof(uint64_t) * (len1 + len2));
+  int *diagonals = tor_malloc(sizeof(int) * 2 * n_diagonals);
+
+  memset(&md, 0, sizeof(md));
+  md.slice1 = slice1;
+  md.slice2 = slice2;
+  md.hashes1 = hashes;
+  md.hashes2 = hashes + len1;
+  md.changed1 = changed1;
+  md.changed2 = changed2;
+  md.fwd = diagonals + len2 + 1;
+  md.bwd = diagonals + n_diagonals + len2 + 1;
+
+  hash_slice_lines(slice1, md.hashes1);
+  hash_slice_lines(slice2, md.hashes2);
+  myers_compare(&md, 0, len1, 0, len2);
+
+  tor_free(hashes);
+  tor_free(diagonals);
+}
+
 /* This table is from crypto.c. The SP and PAD defines are different. */
 #define NOT_VALID_BASE64 255
 #define X NOT_VALID_BASE64
@@ -608,7 +827,7 @@ preprocess_consensus(memarea_t *area,
  * in one of the inputs, or are newly allocated lines in the provided memarea.
  *
  * This implementation is consensus-specific. To generate an ed diff for any
- * given input in quadratic time, you can replace all the code until the
+ * given input in O(ND) time, you can replace all the code until the
  * navigation in reverse order with the following:
  *
  *   int len1 = smartlist_len(cons1);
@@ -617,7 +836,7 @@ preprocess_consensus(memarea_t *area,
  *   bitarray_t *changed2 = bitarray_init_zero(len2);
  *   cons1_sl = smartlist_slice(cons1, 0, -1);
  *   cons2_sl = smartlist_slice(cons2, 0, -1);
- *   calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+ *   myers_changes(cons1_sl, cons2_sl, changed1, changed2);
  */
 STATIC smartlist_t *
 gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
@@ -636,8 +855,8 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
     smartlist_add(result, remove_trailer);
   }
 
-  /* Initialize the changed bitarrays to zero, so that calc_changes only needs
-   * to set the ones that matter and leave the rest untouched.
+  /* Initialize the changed bitarrays to zero, so that myers_changes only
+   * needs to set the ones that matter and leave the rest untouched.
    */
   bitarray_t *changed1 = bitarray_init_zero(len1);
   bitarray_t *changed2 = bitarray_init_zero(len2);
@@ -723,8 +942,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
     /* Make slices out of these chunks (up to the common router entry) and
      * calculate the changes for them.
      * Error if any of the two slices are longer than 10K lines. That should
-     * never happen with any pair of real consensuses. Feeding more than 10K
-     * lines to calc_changes would be very slow anyway.
+     * never happen with any pair of real consensuses.
      */
 #define MAX_LINE_COUNT (10000)
     if (i1-start1 > MAX_LINE_COUNT || i2-start2 > MAX_LINE_COUNT) {
@@ -735,7 +953,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
 
     smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
     smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+    myers_changes(cons1_sl, cons2_sl, changed1, changed2);
     tor_free(cons1_sl);
     tor_free(cons2_sl);
     start1 = i1, start2 = i2;
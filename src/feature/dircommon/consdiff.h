@@ -61,14 +61,11 @@ STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
-STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
-                         bitarray_t *changed1, bitarray_t *changed2);
+STATIC void myers_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
+                          bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
 STATIC int next_router(const smartlist_t *cons, int cur);
-STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
-                        const smartlist_slice_t *slice2,
-                        int direction);
 STATIC void trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2);
 STATIC int base64cmp(const cdline_t *hash1, const cdline_t *hash2);
 STATIC int get_id_hash(const cdline_t *line, cdline_t *hash_out);
@@ -85,6 +82,14 @@ STATIC void smartlist_add_linecpy(smartlist_t *lst, struct memarea_t *area,
 STATIC int lines_eq(const cdline_t *a, const cdline_t *b);
 STATIC int line_str_eq(const cdline_t *a, const char *b);
 
+#ifdef TOR_UNIT_TESTS
+STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
+                        const smartlist_slice_t *slice2,
+                        int direction);
+STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
+                         bitarray_t *changed1, bitarray_t *changed2);
+#endif /* defined(TOR_UNIT_TESTS) */
+
 MOCK_DECL(STATIC int,
           consensus_compute_digest,(const char *cons,
                                     consensus_digest_t *digest_out));
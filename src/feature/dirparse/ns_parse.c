@@ -13,6 +13,8 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/protover.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
 #include "feature/dirauth/dirvote.h"
@@ -28,6 +30,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
 
 #include "feature/dirauth/vote_microdesc_hash_st.h"
@@ -273,6 +276,54 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   return 0;
 }
 
+/** Return true iff every "a" line in <b>a_lines</b> is an
+ * "[IPv6 address]:port" that find_single_ipv6_orport() will parse without
+ * logging anything. */
+static int
+a_lines_parse_quietly(const smartlist_t *a_lines)
+{
+  SMARTLIST_FOREACH_BEGIN(a_lines, const directory_token_t *, t) {
+    char addrbuf[TOR_ADDR_BUF_LEN];
+    struct in6_addr in6;
+    const char *arg = t->args[0], *rbracket;
+    int ok;
+    if (*arg != '[' || !(rbracket = strchr(arg, ']')) || rbracket[1] != ':')
+      return 0;
+    if ((size_t)(rbracket - arg) > sizeof(addrbuf))
+      return 0;
+    strlcpy(addrbuf, arg+1, rbracket - arg);
+    if (tor_inet_pton(AF_INET6, addrbuf, &in6) != 1)
+      return 0;
+    tor_parse_long(rbracket+2, 10, 1, 65535, &ok, NULL);
+    if (!ok)
+      return 0;
+  } SMARTLIST_FOREACH_END(t);
+  return 1;
+}
+
+/** Return true iff no protocol name in <b>protocols</b> is long enough for
+ * protover.c to log about it. We check every word, which is stricter than
+ * checking the names alone. */
+static int
+protocol_list_parses_quietly(const char *protocols)
+{
+  while (*protocols) {
+    const size_t len = strcspn(protocols, " ");
+    if (len > MAX_PROTOCOL_NAME_LENGTH)
+      return 0;
+    protocols += len;
+    protocols += strspn(protocols, " ");
+  }
+  return 1;
+}
+
+/** Log a warning from routerstatus_parse_entry_impl(), unless it is parsing
+ * quietly. <b>args</b> are the arguments to log_warn(), in parentheses. */
+#define RS_WARN(args) STMT_BEGIN                \
+    if (!quiet)                                 \
+      log_warn args;                            \
+  STMT_END
+
 /** Given a string at *<b>s</b>, containing a routerstatus object, and an
  * empty smartlist at <b>tokens</b>, parse and return the first router status
  * object in the string, and advance *<b>s</b> to just after the end of the
@@ -286,14 +337,20 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
  * make that consensus.
  *
  * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ *
+ * If <b>quiet</b> is set, we may be running outside the main thread, where
+ * escaped() and dump_desc() are off limits: fail instead of logging
+ * anything about the entry, so the caller can parse it again on the main
+ * thread and get the usual messages, once.
  **/
-STATIC routerstatus_t *
-routerstatus_parse_entry_from_string(memarea_t *area,
-                                     const char **s, smartlist_t *tokens,
-                                     networkstatus_t *vote,
-                                     vote_routerstatus_t *vote_rs,
-                                     int consensus_method,
-                                     consensus_flavor_t flav)
+static routerstatus_t *
+routerstatus_parse_entry_impl(memarea_t *area,
+                              const char **s, smartlist_t *tokens,
+                              networkstatus_t *vote,
+                              vote_routerstatus_t *vote_rs,
+                              int consensus_method,
+                              consensus_flavor_t flav,
+                              int quiet)
 {
   const char *eos, *s_dup = *s;
   routerstatus_t *rs = NULL;
@@ -310,19 +367,20 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   eos = find_start_of_next_routerstatus(*s);
 
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
-    log_warn(LD_DIR, "Error tokenizing router status");
+  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,
+                      quiet ? TS_QUIET : 0)) {
+    RS_WARN((LD_DIR, "Error tokenizing router status"));
     goto err;
   }
   if (smartlist_len(tokens) < 1) {
-    log_warn(LD_DIR, "Impossibly short router status");
+    RS_WARN((LD_DIR, "Impossibly short router status"));
     goto err;
   }
   tok = find_by_keyword(tokens, K_R);
   tor_assert(tok->n_args >= 7); /* guaranteed by GE(7) in K_R setup */
   if (flav == FLAV_NS) {
     if (tok->n_args < 8) {
-      log_warn(LD_DIR, "Too few arguments to r");
+      RS_WARN((LD_DIR, "Too few arguments to r"));
       goto err;
     }
   } else if (flav == FLAV_MICRODESC) {
@@ -336,23 +394,23 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   }
 
   if (!is_legal_nickname(tok->args[0])) {
-    log_warn(LD_DIR,
+    RS_WARN((LD_DIR,
              "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+             escaped(tok->args[0])));
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
-    log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+    RS_WARN((LD_DIR, "Error decoding identity digest %s",
+             escaped(tok->args[1])));
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
-      log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+      RS_WARN((LD_DIR, "Error decoding descriptor digest %s",
+               escaped(tok->args[2])));
       goto err;
     }
   }
@@ -360,15 +418,15 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (tor_snprintf(timebuf, sizeof(timebuf), "%s %s",
                    tok->args[3+offset], tok->args[4+offset]) < 0 ||
       parse_iso_time(timebuf, &rs->published_on)<0) {
-    log_warn(LD_DIR, "Error parsing time '%s %s' [%d %d]",
+    RS_WARN((LD_DIR, "Error parsing time '%s %s' [%d %d]",
              tok->args[3+offset], tok->args[4+offset],
-             offset, (int)flav);
+             offset, (int)flav));
     goto err;
   }
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
-    log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+    RS_WARN((LD_DIR, "Error parsing router address in network-status %s",
+             escaped(tok->args[5+offset])));
     goto err;
   }
   rs->addr = ntohl(in.s_addr);
@@ -381,6 +439,10 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   {
     smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
     if (a_lines) {
+      if (quiet && !a_lines_parse_quietly(a_lines)) {
+        smartlist_free(a_lines);
+        goto err;
+      }
       find_single_ipv6_orport(a_lines, &rs->ipv6_addr, &rs->ipv6_orport);
       smartlist_free(a_lines);
     }
@@ -395,8 +457,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       if (p >= 0) {
         vote_rs->flags |= (UINT64_C(1)<<p);
       } else {
-        log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+        RS_WARN((LD_DIR,
+                 "Flags line had a flag %s not listed in known_flags.",
+                 escaped(tok->args[i])));
         goto err;
       }
     }
@@ -442,10 +505,14 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if ((tok = find_opt_by_keyword(tokens, K_PROTO))) {
       tor_assert(tok->n_args == 1);
       protocols = tok->args[0];
+      if (quiet && !protocol_list_parses_quietly(protocols))
+        goto err;
     }
     if ((tok = find_opt_by_keyword(tokens, K_V))) {
       tor_assert(tok->n_args == 1);
       version = tok->args[0];
+      if (quiet && tor_version_parse_platform_would_log(version))
+        goto err;
       if (vote_rs) {
         vote_rs->version = tor_strdup(tok->args[0]);
       }
@@ -465,7 +532,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                     10, 0, UINT32_MAX,
                                     &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          RS_WARN((LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i])));
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -475,8 +542,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
             (uint32_t)tor_parse_ulong(strchr(tok->args[i], '=')+1,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+          RS_WARN((LD_DIR, "Invalid Measured Bandwidth %s",
+                   escaped(tok->args[i])));
           goto err;
         }
         vote_rs->has_measured_bw = 1;
@@ -484,6 +551,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       } else if (!strcmpstart(tok->args[i], "Unmeasured=1")) {
         rs->bw_is_unmeasured = 1;
       } else if (!strcmpstart(tok->args[i], "GuardFraction=")) {
+        /* This consults our options, and may log. */
+        if (quiet)
+          goto err;
         if (routerstatus_parse_guardfraction(tok->args[i],
                                              vote, vote_rs, rs) < 0) {
           goto err;
@@ -497,8 +567,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     tor_assert(tok->n_args == 1);
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
-      log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+      RS_WARN((LD_DIR, "Unknown exit policy summary type %s.",
+               escaped(tok->args[0])));
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -525,7 +595,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
           if (strcmp(t->args[1], "none") &&
               digest256_from_base64((char*)vote_rs->ed25519_id,
                                     t->args[1])<0) {
-            log_warn(LD_DIR, "Bogus ed25519 key in networkstatus vote");
+            RS_WARN((LD_DIR, "Bogus ed25519 key in networkstatus vote"));
             goto err;
           }
         }
@@ -540,11 +610,13 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (tok) {
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
-        log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+        RS_WARN((LD_DIR, "Error decoding microdescriptor digest %s",
+                 escaped(tok->args[0])));
         goto err;
       }
     } else {
+      if (quiet)
+        goto err;
       log_info(LD_BUG, "Found an entry in networkstatus with no "
                "microdescriptor digest. (Router %s ($%s) at %s:%d.)",
                rs->nickname, hex_str(rs->identity_digest, DIGEST_LEN),
@@ -557,7 +629,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  if (!quiet)
+    dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
@@ -573,6 +646,26 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+#undef RS_WARN
+
+/** Given a string at *<b>s</b>, containing a routerstatus object, and an
+ * empty smartlist at <b>tokens</b>, parse and return the first router status
+ * object in the string, and advance *<b>s</b> to just after the end of the
+ * router status.  Return NULL and advance *<b>s</b> on error.
+ *
+ * The other arguments are as for routerstatus_parse_entry_impl(). */
+STATIC routerstatus_t *
+routerstatus_parse_entry_from_string(memarea_t *area,
+                                     const char **s, smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav)
+{
+  return routerstatus_parse_entry_impl(area, s, tokens, vote, vote_rs,
+                                       consensus_method, flav, 0);
+}
+
 int
 compare_vote_routerstatus_entries(const void **_a, const void **_b)
 {
@@ -1048,8 +1141,280 @@ extract_shared_random_srvs(networkstatus_t *ns, smartlist_t *tokens)
   }
 }
 
+/** Don't split the routerstatus entries of a consensus into chunks smaller
+ * than this many bytes: a smaller chunk isn't worth handing to a worker. */
+#define RS_PARSE_MIN_CHUNK_LEN (32*1024)
+/** How many chunks to aim for per thread parsing them, so that the threads
+ * that finish early can take up the slack of the others. */
+#define RS_PARSE_CHUNKS_PER_THREAD 4
+
+/** A run of consecutive routerstatus entries in a consensus, which one
+ * thread parses. */
+typedef struct rs_parse_chunk_t {
+  /** The start of the first entry in the chunk. */
+  const char *start;
+  /** The end of the last entry in the chunk. */
+  const char *end;
+  /** The start of each entry in the chunk, in order. */
+  smartlist_t *entry_starts;
+  /** The routerstatus_t parsed from each entry in the chunk, in order, or
+   * NULL for an entry that we couldn't parse quietly. */
+  smartlist_t *entries;
+} rs_parse_chunk_t;
+
+/** The routerstatus entries of a consensus, which the main thread and the
+ * cpuworkers are parsing in parallel. The chunks point into the consensus
+ * text, which the main thread keeps alive until it is done with the job. */
+typedef struct rs_parse_job_t {
+  /** Protects next_chunk and n_chunks_done. */
+  tor_mutex_t lock;
+  /** Signalled when n_chunks_done reaches n_chunks. */
+  tor_cond_t done_cond;
+  /** The consensus method and flavor of the consensus. */
+  int consensus_method;
+  consensus_flavor_t flav;
+  /** The chunks of the consensus, in order. */
+  rs_parse_chunk_t *chunks;
+  int n_chunks;
+  /** The index of the first chunk that no thread has started parsing. */
+  int next_chunk;
+  /** How many chunks have been parsed? */
+  int n_chunks_done;
+  /** One reference for the main thread, and one for each task on the
+   * cpuworkers. Only the main thread touches this: the tasks drop their
+   * references from their reply functions. */
+  int refcnt;
+} rs_parse_job_t;
+
+/** Return the number of cpuworkers that should help us parse a consensus
+ * right now, or 0 if we should parse it all by ourselves. */
+static int
+consensus_parse_n_threads(void)
+{
+  /* The cpuworkers may themselves be parsing a consensus for consdiffmgr;
+   * they can't wait for each other. */
+  if (!in_main_thread())
+    return 0;
+  if (!get_options()->ParallelConsensusParsing)
+    return 0;
+  return cpuworker_get_n_threads();
+}
+
+/** Return the first "directory-footer" or "directory-signature" line after
+ * <b>s</b>, or the end of <b>s</b> if there is none.  That is where
+ * networkstatus_parse_vote_from_string() stops parsing routerstatus entries
+ * that begin at <b>s</b>. */
+static const char *
+find_end_of_routerstatuses(const char *s)
+{
+  const char *end, *footer, *sig;
+  if ((footer = strstr(s, "\ndirectory-footer")))
+    end = footer + 1;
+  else
+    end = s + strlen(s);
+  if ((sig = tor_memstr(s, end - s, "\ndirectory-signature")))
+    end = sig + 1;
+  return end;
+}
+
+/** Parse the entries of <b>chunk</b> of <b>job</b> quietly, using
+ * <b>area</b> and <b>tokens</b> as scratch space. */
+static void
+rs_parse_chunk(const rs_parse_job_t *job, rs_parse_chunk_t *chunk,
+               memarea_t *area, smartlist_t *tokens)
+{
+  const char *s = chunk->start;
+  while (s < chunk->end && !strcmpstart(s, "r ")) {
+    smartlist_add(chunk->entry_starts, (char *) s);
+    smartlist_add(chunk->entries,
+                  routerstatus_parse_entry_impl(area, &s, tokens, NULL, NULL,
+                                                job->consensus_method,
+                                                job->flav, 1));
+  }
+}
+
+/** Parse chunks of <b>job</b> until no chunk is left for us to start. */
+static void
+rs_parse_job_run(rs_parse_job_t *job, memarea_t *area, smartlist_t *tokens)
+{
+  while (1) {
+    int idx = -1;
+    tor_mutex_acquire(&job->lock);
+    if (job->next_chunk < job->n_chunks)
+      idx = job->next_chunk++;
+    tor_mutex_release(&job->lock);
+    if (idx < 0)
+      break;
+
+    rs_parse_chunk(job, &job->chunks[idx], area, tokens);
+
+    tor_mutex_acquire(&job->lock);
+    if (++job->n_chunks_done == job->n_chunks)
+      tor_cond_signal_all(&job->done_cond);
+    tor_mutex_release(&job->lock);
+  }
+}
+
+/** Drop a reference to <b>job</b>, freeing it if that was the last one. */
+static void
+rs_parse_job_decref(rs_parse_job_t *job)
+{
+  int i;
+  if (--job->refcnt > 0)
+    return;
+  for (i = 0; i < job->n_chunks; ++i) {
+    rs_parse_chunk_t *chunk = &job->chunks[i];
+    SMARTLIST_FOREACH(chunk->entries, routerstatus_t *, rs,
+                      routerstatus_free(rs));
+    smartlist_free(chunk->entries);
+    smartlist_free(chunk->entry_starts);
+  }
+  tor_free(job->chunks);
+  tor_mutex_uninit(&job->lock);
+  tor_cond_uninit(&job->done_cond);
+  tor_free(job);
+}
+
+/** Worker function: help parse the rs_parse_job_t in <b>arg</b>. */
+static workqueue_reply_t
+rs_parse_job_threadfn(void *state_, void *arg)
+{
+  rs_parse_job_t *job = arg;
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  (void) state_;
+
+  rs_parse_job_run(job, area, tokens);
+
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: a cpuworker is done with the rs_parse_job_t in
+ * <b>arg</b>. */
+static void
+rs_parse_job_replyfn(void *arg)
+{
+  rs_parse_job_decref(arg);
+}
+
+/** Split the routerstatus entries of a consensus, which run from
+ * <b>start</b> to <b>end</b>, into chunks, and start parsing them on up to
+ * <b>n_threads</b> cpuworkers, according to <b>consensus_method</b> and
+ * <b>flav</b>.  Return the job; the caller must hand it to
+ * rs_parse_job_finish(). */
+static rs_parse_job_t *
+rs_parse_job_start(const char *start, const char *end, int n_threads,
+                   int consensus_method, consensus_flavor_t flav)
+{
+  rs_parse_job_t *job = tor_malloc_zero(sizeof(rs_parse_job_t));
+  const size_t len = end - start;
+  const char *chunk_start = start;
+  int max_chunks, n_tasks, i;
+
+  tor_mutex_init_for_cond(&job->lock);
+  tor_cond_init(&job->done_cond);
+  job->consensus_method = consensus_method;
+  job->flav = flav;
+  job->refcnt = 1;
+
+  max_chunks = (int) MIN(len / RS_PARSE_MIN_CHUNK_LEN,
+                         (size_t) (n_threads + 1) *
+                         RS_PARSE_CHUNKS_PER_THREAD);
+  max_chunks = MAX(max_chunks, 1);
+  job->chunks = tor_calloc(max_chunks, sizeof(rs_parse_chunk_t));
+
+  /* Cut the entries at the first entry boundary after each multiple of
+   * len/max_chunks. Every "\nr " in the entries starts an entry, just as
+   * find_start_of_next_routerstatus() would find it. */
+  for (i = 1; i <= max_chunks && chunk_start < end; ++i) {
+    rs_parse_chunk_t *chunk = &job->chunks[job->n_chunks++];
+    const char *chunk_end = end;
+    if (i < max_chunks) {
+      const char *cut = MAX(start + len * i / max_chunks, chunk_start);
+      const char *next_r = tor_memstr(cut, end - cut, "\nr ");
+      if (next_r)
+        chunk_end = next_r + 1;
+    }
+    chunk->start = chunk_start;
+    chunk->end = chunk_end;
+    chunk->entry_starts = smartlist_new();
+    chunk->entries = smartlist_new();
+    chunk_start = chunk_end;
+  }
+
+  /* We'll parse one chunk ourselves, so don't wake up more workers than
+   * there are other chunks. */
+  n_tasks = MIN(n_threads, job->n_chunks - 1);
+  for (i = 0; i < n_tasks; ++i) {
+    ++job->refcnt;
+    if (!cpuworker_queue_work(WQ_PRI_HIGH, rs_parse_job_threadfn,
+                              rs_parse_job_replyfn, job)) {
+      --job->refcnt;
+      break;
+    }
+  }
+  return job;
+}
+
+/** Help the cpuworkers parse the chunks of <b>job</b> until they are all
+ * done, using <b>area</b> and <b>tokens</b> as scratch space, then append
+ * the routerstatus entries that parsed to <b>out</b>, in order.  Parse the
+ * entries that failed to parse quietly again here, so that we log about
+ * them as usual.  Drops our reference to <b>job</b>. */
+static void
+rs_parse_job_finish(rs_parse_job_t *job, smartlist_t *out,
+                    memarea_t *area, smartlist_t *tokens)
+{
+  int i;
+
+  rs_parse_job_run(job, area, tokens);
+
+  tor_mutex_acquire(&job->lock);
+  while (job->n_chunks_done < job->n_chunks)
+    tor_cond_wait(&job->done_cond, &job->lock, NULL);
+  tor_mutex_release(&job->lock);
+
+  for (i = 0; i < job->n_chunks; ++i) {
+    rs_parse_chunk_t *chunk = &job->chunks[i];
+    SMARTLIST_FOREACH_BEGIN(chunk->entries, routerstatus_t *, rs) {
+      if (!rs) {
+        const char *entry = smartlist_get(chunk->entry_starts, rs_sl_idx);
+        rs = routerstatus_parse_entry_from_string(area, &entry, tokens,
+                                                  NULL, NULL,
+                                                  job->consensus_method,
+                                                  job->flav);
+      }
+      if (rs)
+        smartlist_add(out, rs);
+    } SMARTLIST_FOREACH_END(rs);
+    smartlist_clear(chunk->entries);
+  }
+
+  rs_parse_job_decref(job);
+}
+
+/** Compute the digests of the networkstatus document <b>s</b> that its
+ * signatures cover, into <b>digests_out</b> and <b>sha3_as_signed_out</b>.
+ * Return 0 on success, -1 on failure. */
+static int
+networkstatus_compute_digests(const char *s, common_digests_t *digests_out,
+                              uint8_t *sha3_as_signed_out)
+{
+  if (router_get_networkstatus_v3_hashes(s, digests_out) ||
+      router_get_networkstatus_v3_sha3_as_signed(sha3_as_signed_out, s)<0) {
+    log_warn(LD_DIR, "Unable to compute digest of network-status");
+    return -1;
+  }
+  return 0;
+}
+
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure.
+ *
+ * If ParallelConsensusParsing is set and the cpuworkers are running, parse
+ * the routerstatus entries of a consensus on them, in chunks. */
 networkstatus_t *
 networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
                                      networkstatus_type_t ns_type)
@@ -1067,17 +1432,19 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   memarea_t *area = NULL, *rs_area = NULL;
   consensus_flavor_t flav = FLAV_NS;
   char *last_kwd=NULL;
+  const int n_parse_threads =
+    (ns_type == NS_TYPE_CONSENSUS) ? consensus_parse_n_threads() : 0;
 
   tor_assert(s);
 
   if (eos_out)
     *eos_out = NULL;
 
-  if (router_get_networkstatus_v3_hashes(s, &ns_digests) ||
-      router_get_networkstatus_v3_sha3_as_signed(sha3_as_signed, s)<0) {
-    log_warn(LD_DIR, "Unable to compute digest of network-status");
+  /* If the cpuworkers are going to parse the routerstatus entries, we'll
+   * compute the digests while they do. */
+  if (!n_parse_threads &&
+      networkstatus_compute_digests(s, &ns_digests, sha3_as_signed) < 0)
     goto err;
-  }
 
   area = memarea_new();
   end_of_header = find_start_of_next_routerstatus(s);
@@ -1090,8 +1457,6 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   }
 
   ns = tor_malloc_zero(sizeof(networkstatus_t));
-  memcpy(&ns->digests, &ns_digests, sizeof(ns_digests));
-  memcpy(&ns->digest_sha3_as_signed, sha3_as_signed, sizeof(sha3_as_signed));
 
   tok = find_by_keyword(tokens, K_NETWORK_STATUS_VERSION);
   tor_assert(tok);
@@ -1424,6 +1789,28 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
+  if (n_parse_threads) {
+    rs_parse_job_t *job = NULL;
+    const char *end_of_entries = NULL;
+    int digests_ok;
+    if (!strcmpstart(s, "r ")) {
+      end_of_entries = find_end_of_routerstatuses(s);
+      job = rs_parse_job_start(s, end_of_entries, n_parse_threads,
+                               ns->consensus_method, flav);
+    }
+    digests_ok =
+      networkstatus_compute_digests(s_dup, &ns_digests, sha3_as_signed) == 0;
+    if (job) {
+      rs_parse_job_finish(job, ns->routerstatus_list, rs_area, rs_tokens);
+      /* This leaves nothing for the loop below. */
+      s = end_of_entries;
+    }
+    if (!digests_ok)
+      goto err;
+  }
+  memcpy(&ns->digests, &ns_digests, sizeof(ns_digests));
+  memcpy(&ns->digest_sha3_as_signed, sha3_as_signed, sizeof(sha3_as_signed));
+
   while (!strcmpstart(s, "r ")) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
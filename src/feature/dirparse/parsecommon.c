@@ -43,10 +43,17 @@ token_clear(directory_token_t *tok)
     crypto_pk_free(tok->key);
 }
 
+/** Log a warning from tokenize_string(), unless <b>flags</b> has TS_QUIET.
+ * <b>args</b> are the arguments to log_warn(), in parentheses. */
+#define TS_WARN(args) STMT_BEGIN                \
+    if (!(flags & TS_QUIET))                    \
+      log_warn args;                            \
+  STMT_END
+
 /** Read all tokens from a string between <b>start</b> and <b>end</b>, and add
  * them to <b>out</b>.  Parse according to the token rules in <b>table</b>.
  * Caller must free tokens in <b>out</b>.  If <b>end</b> is NULL, use the
- * entire string.
+ * entire string.  If <b>flags</b> has TS_QUIET, don't log about errors.
  */
 int
 tokenize_string(memarea_t *area,
@@ -67,7 +74,7 @@ tokenize_string(memarea_t *area,
   } else {
     /* it's only meaningful to check for nuls if we got an end-of-string ptr */
     if (memchr(start, '\0', end-start)) {
-      log_warn(LD_DIR, "parse error: internal NUL character.");
+      TS_WARN((LD_DIR, "parse error: internal NUL character."));
       return -1;
     }
   }
@@ -79,7 +86,7 @@ tokenize_string(memarea_t *area,
   while (*s < end && (!tok || tok->tp != EOF_)) {
     tok = get_next_token(area, s, end, table);
     if (tok->tp == ERR_) {
-      log_warn(LD_DIR, "parse error: %s", tok->error);
+      TS_WARN((LD_DIR, "parse error: %s", tok->error));
       token_clear(tok);
       return -1;
     }
@@ -101,19 +108,19 @@ tokenize_string(memarea_t *area,
       }
     }
     if (first_nonannotation < 0) {
-      log_warn(LD_DIR, "parse error: item contains only annotations");
+      TS_WARN((LD_DIR, "parse error: item contains only annotations"));
       return -1;
     }
     for (i=first_nonannotation;  i < smartlist_len(out); ++i) {
       tok = smartlist_get(out, i);
       if (tok->tp >= MIN_ANNOTATION && tok->tp <= MAX_ANNOTATION) {
-        log_warn(LD_DIR, "parse error: Annotations mixed with keywords");
+        TS_WARN((LD_DIR, "parse error: Annotations mixed with keywords"));
         return -1;
       }
     }
     if ((flags & TS_NO_NEW_ANNOTATIONS)) {
       if (first_nonannotation != prev_len) {
-        log_warn(LD_DIR, "parse error: Unexpected annotations.");
+        TS_WARN((LD_DIR, "parse error: Unexpected annotations."));
         return -1;
       }
     }
@@ -121,7 +128,7 @@ tokenize_string(memarea_t *area,
     for (i=0;  i < smartlist_len(out); ++i) {
       tok = smartlist_get(out, i);
       if (tok->tp >= MIN_ANNOTATION && tok->tp <= MAX_ANNOTATION) {
-        log_warn(LD_DIR, "parse error: no annotations allowed.");
+        TS_WARN((LD_DIR, "parse error: no annotations allowed."));
         return -1;
       }
     }
@@ -129,24 +136,24 @@ tokenize_string(memarea_t *area,
   }
   for (i = 0; table[i].t; ++i) {
     if (counts[table[i].v] < table[i].min_cnt) {
-      log_warn(LD_DIR, "Parse error: missing %s element.", table[i].t);
+      TS_WARN((LD_DIR, "Parse error: missing %s element.", table[i].t));
       return -1;
     }
     if (counts[table[i].v] > table[i].max_cnt) {
-      log_warn(LD_DIR, "Parse error: too many %s elements.", table[i].t);
+      TS_WARN((LD_DIR, "Parse error: too many %s elements.", table[i].t));
       return -1;
     }
     if (table[i].pos & AT_START) {
       if (smartlist_len(out) < 1 ||
           (tok = smartlist_get(out, first_nonannotation))->tp != table[i].v) {
-        log_warn(LD_DIR, "Parse error: first item is not %s.", table[i].t);
+        TS_WARN((LD_DIR, "Parse error: first item is not %s.", table[i].t));
         return -1;
       }
     }
     if (table[i].pos & AT_END) {
       if (smartlist_len(out) < 1 ||
           (tok = smartlist_get(out, smartlist_len(out)-1))->tp != table[i].v) {
-        log_warn(LD_DIR, "Parse error: last item is not %s.", table[i].t);
+        TS_WARN((LD_DIR, "Parse error: last item is not %s.", table[i].t));
         return -1;
       }
     }
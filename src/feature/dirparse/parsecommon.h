@@ -230,6 +230,8 @@ typedef enum {
 #define TS_ANNOTATIONS_OK 1
 #define TS_NOCHECK 2
 #define TS_NO_NEW_ANNOTATIONS 4
+/** Don't log about parse errors: the caller will report them. */
+#define TS_QUIET 8
 
 /**
  * @name macros for defining token rules
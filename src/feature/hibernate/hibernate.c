@@ -1242,6 +1242,8 @@ on_hibernate_state_change(hibernate_state_t prev_state)
   }
 
   reschedule_per_second_timer();
+  /* Whether we're hibernating decides which connections we keep. */
+  connection_reschedule_all_housekeeping();
 }
 
 /** Free all resources held by the accounting module */
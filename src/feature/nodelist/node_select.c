@@ -480,6 +480,242 @@ kb_to_bytes(uint32_t bw)
   return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
 }
 
+/** Largest total weight we keep in a weighted_alias_t. Keeping it (plus one
+ * for each entry) below 2^38 lets us multiply any weight by the number of
+ * entries without overflow. */
+#define WEIGHTED_ALIAS_MAX_TOTAL (UINT64_C(1)<<38)
+/** Largest number of entries we put in a weighted_alias_t. */
+#define WEIGHTED_ALIAS_MAX_ENTRIES (1<<22)
+
+/** Build an alias table for choosing an index of the <b>n</b>-element array
+ * <b>weights</b> with probability proportional to its value, using Vose's
+ * method. Every computation is done in integers, so each index keeps
+ * exactly its share of the (rescaled) total weight. Return NULL if there
+ * are no entries, too many entries, or if all the weights are 0.
+ *
+ * The weights must sum to less than INT64_MAX, as the output of
+ * scale_array_elements_to_u64() does. */
+STATIC weighted_alias_t *
+weighted_alias_new(const uint64_t *weights, int n)
+{
+  weighted_alias_t *wa;
+  uint64_t total = 0, scale = 0;
+  uint64_t *scaled;
+  int *small, *large;
+  int n_small = 0, n_large = 0, shift = 0, i;
+
+  if (n < 1 || n > WEIGHTED_ALIAS_MAX_ENTRIES)
+    return NULL;
+  for (i = 0; i < n; ++i)
+    total += weights[i];
+  if (total == 0)
+    return NULL;
+  tor_assert(total < INT64_MAX);
+
+  /* Scale the weights down so that we can multiply them by n. A nonzero
+   * weight stays nonzero. */
+  while ((total >> shift) >= WEIGHTED_ALIAS_MAX_TOTAL)
+    ++shift;
+  scaled = tor_calloc(n, sizeof(uint64_t));
+  for (i = 0; i < n; ++i) {
+    scaled[i] = weights[i] >> shift;
+    if (scaled[i] == 0 && weights[i] != 0)
+      scaled[i] = 1;
+    scale += scaled[i];
+  }
+
+  wa = tor_malloc_zero(sizeof(weighted_alias_t));
+  wa->n = n;
+  wa->scale = scale;
+  wa->threshold = tor_calloc(n, sizeof(uint64_t));
+  wa->alias = tor_calloc(n, sizeof(int));
+
+  /* Each index now holds scaled[i]*n out of the n*scale units we spread
+   * over n columns of scale units each. */
+  small = tor_calloc(n, sizeof(int));
+  large = tor_calloc(n, sizeof(int));
+  for (i = 0; i < n; ++i) {
+    scaled[i] *= n;
+    if (scaled[i] < scale)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  /* Fill the column of each small index with units from a large one. */
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large - 1];
+    wa->threshold[s] = scaled[s];
+    wa->alias[s] = l;
+    scaled[l] -= scale - scaled[s];
+    if (scaled[l] < scale) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+  /* Whatever is left holds exactly one column. */
+  while (n_large) {
+    i = large[--n_large];
+    wa->threshold[i] = scale;
+    wa->alias[i] = i;
+  }
+  while (n_small) {
+    i = small[--n_small];
+    wa->threshold[i] = scale;
+    wa->alias[i] = i;
+  }
+
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+  return wa;
+}
+
+/** Choose a random index from <b>wa</b>, with probability proportional to
+ * its weight. */
+STATIC int
+weighted_alias_choose(const weighted_alias_t *wa)
+{
+  const int i = crypto_rand_int(wa->n);
+  return crypto_rand_uint64(wa->scale) < wa->threshold[i] ? i : wa->alias[i];
+}
+
+/** Release all storage held in <b>wa</b>. */
+STATIC void
+weighted_alias_free_(weighted_alias_t *wa)
+{
+  if (!wa)
+    return;
+  tor_free(wa->threshold);
+  tor_free(wa->alias);
+  tor_free(wa);
+}
+
+/** The bandwidth weights of every node in the nodelist under one
+ * bandwidth_weight_rule_t. We keep them until the nodelist or the consensus
+ * changes, so that choosing a node doesn't mean weighting every candidate
+ * again. */
+typedef struct node_weight_table_t {
+  /** The nodelist we computed these weights for, and its length then. */
+  const smartlist_t *nodelist;
+  int n_nodes;
+  /** The nodes of the nodelist, in order, so that we can tell whether a
+   * node's nodelist_idx still names the node we weighted. */
+  const node_t **nodes;
+  /** The weight of each node, scaled by scale_array_elements_to_u64(). */
+  uint64_t *weights;
+  /** An alias table over <b>weights</b>, or NULL if they are all 0. */
+  weighted_alias_t *alias;
+} node_weight_table_t;
+
+/** Our cached weight tables, indexed by bandwidth_weight_rule_t. */
+static node_weight_table_t *node_weight_tables[WEIGHT_FOR_DIR + 1];
+
+/** Release all storage held in <b>table</b>. */
+static void
+node_weight_table_free_(node_weight_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->nodes);
+  tor_free(table->weights);
+  weighted_alias_free(table->alias);
+  tor_free(table);
+}
+#define node_weight_table_free(table) \
+  FREE_AND_NULL(node_weight_table_t, node_weight_table_free_, (table))
+
+/** Called when the nodes in the nodelist, their flags or descriptors, or
+ * the consensus bandwidth weights have changed: forget our cached node
+ * weights. */
+void
+node_select_weights_changed(void)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(node_weight_tables); ++i)
+    node_weight_table_free(node_weight_tables[i]);
+}
+
+/** Return the weights of the whole nodelist under <b>rule</b>, computing
+ * them if we haven't since the nodelist last changed. Return NULL if the
+ * nodelist is empty. */
+static const node_weight_table_t *
+node_weight_table_get(bandwidth_weight_rule_t rule)
+{
+  const smartlist_t *nodelist = nodelist_get_list();
+  node_weight_table_t *table = node_weight_tables[rule];
+  const int n = smartlist_len(nodelist);
+  double *bandwidths = NULL;
+
+  if (table && table->nodelist == nodelist && table->n_nodes == n)
+    return table;
+  node_weight_table_free(node_weight_tables[rule]);
+  if (n == 0)
+    return NULL;
+  if (compute_weighted_bandwidths(nodelist, rule, &bandwidths, NULL) < 0)
+    return NULL;
+
+  table = tor_malloc_zero(sizeof(node_weight_table_t));
+  table->nodelist = nodelist;
+  table->n_nodes = n;
+  table->nodes = tor_calloc(n, sizeof(const node_t *));
+  memcpy(table->nodes, nodelist->list, n * sizeof(const node_t *));
+  table->weights = tor_calloc(n, sizeof(uint64_t));
+  scale_array_elements_to_u64(table->weights, bandwidths, n, NULL);
+  table->alias = weighted_alias_new(table->weights, n);
+  tor_free(bandwidths);
+
+  node_weight_tables[rule] = table;
+  return table;
+}
+
+/** Compute the weights of the nodes in <b>sl</b> under <b>rule</b>, as
+ * compute_weighted_bandwidths() does, and return them in a newly allocated
+ * array scaled by scale_array_elements_to_u64(). Return NULL on failure. */
+static uint64_t *
+compute_scaled_bandwidth_weights(const smartlist_t *sl,
+                                 bandwidth_weight_rule_t rule)
+{
+  double *bandwidths_dbl = NULL;
+  uint64_t *bandwidths_u64 = NULL;
+
+  if (compute_weighted_bandwidths(sl, rule, &bandwidths_dbl, NULL) < 0)
+    return NULL;
+
+  bandwidths_u64 = tor_calloc(smartlist_len(sl), sizeof(uint64_t));
+  scale_array_elements_to_u64(bandwidths_u64, bandwidths_dbl,
+                              smartlist_len(sl), NULL);
+  tor_free(bandwidths_dbl);
+  return bandwidths_u64;
+}
+
+/** Return a newly allocated array of the weights of the nodes in <b>sl</b>
+ * under <b>rule</b>, scaled as by compute_scaled_bandwidth_weights(). Use
+ * our cached weights if every node in <b>sl</b> is in the nodelist, and
+ * compute them otherwise. Return NULL on failure. */
+static uint64_t *
+get_scaled_bandwidth_weights(const smartlist_t *sl,
+                             bandwidth_weight_rule_t rule)
+{
+  const node_weight_table_t *table;
+  uint64_t *bandwidths_u64;
+
+  if (smartlist_len(sl) == 0 || !(table = node_weight_table_get(rule)))
+    return compute_scaled_bandwidth_weights(sl, rule);
+
+  bandwidths_u64 = tor_calloc(smartlist_len(sl), sizeof(uint64_t));
+  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+    const int idx = node->nodelist_idx;
+    if (idx < 0 || idx >= table->n_nodes || table->nodes[idx] != node) {
+      tor_free(bandwidths_u64);
+      return compute_scaled_bandwidth_weights(sl, rule);
+    }
+    bandwidths_u64[node_sl_idx] = table->weights[idx];
+  } SMARTLIST_FOREACH_END(node);
+  return bandwidths_u64;
+}
+
 /** Helper function:
  * choose a random element of smartlist <b>sl</b> of nodes, weighted by
  * the advertised bandwidth of each element using the consensus
@@ -498,23 +734,15 @@ static const node_t *
 smartlist_choose_node_by_bandwidth_weights(const smartlist_t *sl,
                                            bandwidth_weight_rule_t rule)
 {
-  double *bandwidths_dbl=NULL;
-  uint64_t *bandwidths_u64=NULL;
+  uint64_t *bandwidths_u64 = get_scaled_bandwidth_weights(sl, rule);
+  int idx;
 
-  if (compute_weighted_bandwidths(sl, rule, &bandwidths_dbl, NULL) < 0)
+  if (!bandwidths_u64)
     return NULL;
 
-  bandwidths_u64 = tor_calloc(smartlist_len(sl), sizeof(uint64_t));
-  scale_array_elements_to_u64(bandwidths_u64, bandwidths_dbl,
-                              smartlist_len(sl), NULL);
-
-  {
-    int idx = choose_array_element_by_weight(bandwidths_u64,
-                                             smartlist_len(sl));
-    tor_free(bandwidths_dbl);
-    tor_free(bandwidths_u64);
-    return idx < 0 ? NULL : smartlist_get(sl, idx);
-  }
+  idx = choose_array_element_by_weight(bandwidths_u64, smartlist_len(sl));
+  tor_free(bandwidths_u64);
+  return idx < 0 ? NULL : smartlist_get(sl, idx);
 }
 
 /** When weighting bridges, enforce these values as lower and upper
@@ -804,6 +1032,63 @@ node_sl_choose_by_bandwidth(const smartlist_t *sl,
   return smartlist_choose_node_by_bandwidth_weights(sl, rule);
 }
 
+/** Choose up to <b>k</b> distinct elements of status list <b>sl</b> that are
+ * not in <b>excluded</b> (if given) and that are pairwise not in the same
+ * family. Sample without replacement, weighted by the advertised bandwidth
+ * of each node: the bandwidth weights are computed only once, and after
+ * each pick the chosen node and its family lose their weight, so that no
+ * pick has to be retried. Return a new smartlist of the chosen nodes in
+ * the order they were picked; it is shorter than <b>k</b> if there are
+ * not enough suitable nodes.
+ */
+smartlist_t *
+node_sl_choose_k_by_bandwidth(const smartlist_t *sl,
+                              bandwidth_weight_rule_t rule, int k,
+                              const smartlist_t *excluded)
+{
+  smartlist_t *chosen = smartlist_new();
+  uint64_t *bandwidths_u64 = NULL;
+  uint64_t total = 0;
+  int n = smartlist_len(sl);
+
+  tor_assert(k >= 0);
+
+  if (k == 0 || n == 0)
+    return chosen;
+
+  if (!(bandwidths_u64 = get_scaled_bandwidth_weights(sl, rule)))
+    return chosen;
+
+  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+    if (excluded && smartlist_contains(excluded, node))
+      bandwidths_u64[node_sl_idx] = 0;
+    total += bandwidths_u64[node_sl_idx];
+  } SMARTLIST_FOREACH_END(node);
+
+  while (smartlist_len(chosen) < k && total > 0) {
+    const node_t *choice;
+    int idx;
+
+    tor_assert(total < INT64_MAX);
+    idx = select_array_member_cumulative_timei(bandwidths_u64, n, total,
+                                               crypto_rand_uint64(total));
+    choice = smartlist_get(sl, idx);
+    smartlist_add(chosen, (void *)choice);
+
+    /* Remove the choice and its family from the remaining population. */
+    total = 0;
+    SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+      if (bandwidths_u64[node_sl_idx] &&
+          (node == choice || nodes_in_same_family(node, choice)))
+        bandwidths_u64[node_sl_idx] = 0;
+      total += bandwidths_u64[node_sl_idx];
+    } SMARTLIST_FOREACH_END(node);
+  }
+
+  tor_free(bandwidths_u64);
+  return chosen;
+}
+
 /** Given a <b>router</b>, add every node_t in its family (including the
  * node itself!) to <b>sl</b>.
  *
@@ -825,6 +1110,76 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
   nodelist_add_node_and_family(sl, node);
 }
 
+/** How many nodes router_choose_random_node_impl() draws from the cached
+ * node weights, looking for an acceptable one, before it falls back to
+ * listing every acceptable node. */
+#define CRN_MAX_SAMPLES 64
+
+/** Helper for router_choose_random_node_impl(): draw nodes from the whole
+ * nodelist, weighted by bandwidth under <b>rule</b>, until one passes
+ * <b>flags</b> and the exclusions and restrictions. Since every node is
+ * drawn in proportion to its weight, the node we accept is distributed
+ * just as if we had weighted over the acceptable nodes alone. Return NULL
+ * if no draw out of CRN_MAX_SAMPLES was acceptable. */
+static const node_t *
+router_choose_random_node_by_sampling(const smartlist_t *excludedsmartlist,
+                                      const routerset_t *excludedset,
+                                      const routerset_t *restrictedset,
+                                      router_crn_flags_t flags,
+                                      bandwidth_weight_rule_t rule)
+{
+  const int need_uptime = (flags & CRN_NEED_UPTIME) != 0;
+  const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
+  const int need_guard = (flags & CRN_NEED_GUARD) != 0;
+  const int need_guard_strict = (flags & CRN_NEED_GUARD_STRICT) != 0;
+  const int need_desc = (flags & CRN_NEED_DESC) != 0;
+  const int pref_addr = (flags & CRN_PREF_ADDR) != 0;
+  const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
+  const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
+  const node_weight_table_t *table = node_weight_table_get(rule);
+  smartlist_t *excludednodes = NULL;
+  const node_t *choice = NULL;
+  const routerinfo_t *r;
+  int check_reach, i;
+
+  if (!table || !table->alias)
+    return NULL;
+
+  if ((r = router_get_my_routerinfo())) {
+    excludednodes = smartlist_new();
+    routerlist_add_node_and_family(excludednodes, r);
+  }
+  check_reach = !router_skip_or_reachability(get_options(), pref_addr);
+
+  for (i = 0; i < CRN_MAX_SAMPLES; ++i) {
+    const node_t *node = table->nodes[weighted_alias_choose(table->alias)];
+    if (!router_node_is_running_candidate(node, need_uptime, need_capacity,
+                                          need_guard, need_guard_strict,
+                                          need_desc, pref_addr, direct_conn,
+                                          check_reach))
+      continue;
+    if (node_allows_single_hop_exits(node))
+      continue;
+    if (rendezvous_v3 && !node_supports_v3_rendezvous_point(node))
+      continue;
+    if (excludednodes && smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedsmartlist && smartlist_contains(excludedsmartlist, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    if (restrictedset && !routerset_contains_node(restrictedset, node))
+      continue;
+    choice = node;
+    break;
+  }
+
+  smartlist_free(excludednodes);
+  log_debug(LD_CIRC, "%s a node after %d draws from the cached weights.",
+            choice ? "Found" : "Didn't find", i + (choice != NULL));
+  return choice;
+}
+
 /** Return a random running node from the nodelist that is in
  * <b>restrictedset</b> (when provided, i.e. != NULL). Never
  * pick a node that is in
@@ -845,6 +1200,9 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
  * have an address that is preferred by the ClientPreferIPv6ORPort setting
  * (regardless of this flag, we exclude nodes that aren't allowed by the
  * firewall, including ClientUseIPv4 0 and fascist_firewall_use_ipv6() == 0).
+ *
+ * We first try to draw an acceptable node from the cached weights of the
+ * whole nodelist, and only list every acceptable node if that fails.
  */
 const node_t *
 router_choose_random_node_impl(smartlist_t *excludedsmartlist,
@@ -862,8 +1220,7 @@ router_choose_random_node_impl(smartlist_t *excludedsmartlist,
   const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
   const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
 
-  smartlist_t *sl=smartlist_new(),
-    *excludednodes=smartlist_new();
+  smartlist_t *sl, *excludednodes;
   const node_t *choice = NULL;
   const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
@@ -872,6 +1229,14 @@ router_choose_random_node_impl(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
+  choice = router_choose_random_node_by_sampling(excludedsmartlist,
+                                                 excludedset, restrictedset,
+                                                 flags, rule);
+  if (choice)
+    return choice;
+
+  sl = smartlist_new();
+  excludednodes = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), node_t *, node) {
     if (node_allows_single_hop_exits(node)) {
       /* Exclude relays that allow single hop exit circuits. This is an
@@ -75,6 +75,11 @@ int router_get_my_share_of_directory_requests(double *v3_share_out);
 
 const node_t *node_sl_choose_by_bandwidth(const smartlist_t *sl,
                                           bandwidth_weight_rule_t rule);
+smartlist_t *node_sl_choose_k_by_bandwidth(const smartlist_t *sl,
+                                           bandwidth_weight_rule_t rule,
+                                           int k,
+                                           const smartlist_t *excluded);
+void node_select_weights_changed(void);
 double frac_nodes_with_descriptors(const smartlist_t *sl,
                                    bandwidth_weight_rule_t rule,
                                    int for_direct_conn);
@@ -94,6 +99,25 @@ const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
                                                      int flags);
 
 #ifdef NODE_SELECT_PRIVATE
+/** An alias table, for choosing an index of an array of weights in
+ * constant time. Index i is chosen if we draw column i and a value below
+ * threshold[i] out of <b>scale</b>, and otherwise alias[i] is. */
+typedef struct weighted_alias_t {
+  /** Number of indexes (and columns). */
+  int n;
+  /** Total of the weights, after rescaling. */
+  uint64_t scale;
+  /** For each column, how much of it belongs to its own index. */
+  uint64_t *threshold;
+  /** For each column, the index that owns the rest of it. */
+  int *alias;
+} weighted_alias_t;
+
+STATIC weighted_alias_t *weighted_alias_new(const uint64_t *weights, int n);
+STATIC int weighted_alias_choose(const weighted_alias_t *wa);
+STATIC void weighted_alias_free_(weighted_alias_t *wa);
+#define weighted_alias_free(wa) \
+  FREE_AND_NULL(weighted_alias_t, weighted_alias_free_, (wa))
 STATIC int choose_array_element_by_weight(const uint64_t *entries,
                                           int n_entries);
 STATIC void scale_array_elements_to_u64(uint64_t *entries_out,
@@ -254,6 +254,7 @@ node_get_or_create(const char *identity_digest)
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
 
   node->country = -1;
+  node_select_weights_changed();
 
   return node;
 }
@@ -514,6 +515,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  node_select_weights_changed();
 
   node_add_to_ed25519_map(node);
 
@@ -683,6 +685,10 @@ nodelist_set_consensus(networkstatus_t *ns)
     } SMARTLIST_FOREACH_END(node);
   }
 
+  /* The nodes' flags and bandwidths, and the bandwidth weights, may all
+   * have changed. */
+  node_select_weights_changed();
+
   /* If the consensus is live, note down the consensus valid-after that formed
    * the nodelist. */
   if (networkstatus_is_live(ns, approx_time())) {
@@ -728,6 +734,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    node_select_weights_changed();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -758,6 +765,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  node_select_weights_changed();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -828,6 +836,8 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  node_select_weights_changed();
+
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   HT_CLEAR(nodelist_ed_map, &the_nodelist->nodes_by_ed_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -2190,6 +2200,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_select_weights_changed();
   rend_hsdir_routers_changed();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
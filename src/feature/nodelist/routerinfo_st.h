@@ -55,6 +55,9 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** <b>exit_policy</b>, compiled for fast lookups, or NULL if we didn't
+   * compile it. */
+  struct compiled_addr_policy_t *exit_policy_compiled;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
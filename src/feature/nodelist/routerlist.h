@@ -51,6 +51,11 @@ int router_skip_or_reachability(const or_options_t *options, int try_ip_pref);
 int router_skip_dir_reachability(const or_options_t *options, int try_ip_pref);
 void router_reset_status_download_failures(void);
 int routers_have_same_or_addrs(const routerinfo_t *r1, const routerinfo_t *r2);
+int router_node_is_running_candidate(const node_t *node, int need_uptime,
+                                     int need_capacity, int need_guard,
+                                     int need_guard_strict, int need_desc,
+                                     int pref_addr, int direct_conn,
+                                     int check_reach);
 void router_add_running_nodes_to_smartlist(smartlist_t *sl, int need_uptime,
                                            int need_capacity, int need_guard,
                                            int need_guard_strict, int need_desc,
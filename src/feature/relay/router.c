@@ -777,6 +777,8 @@ router_initialize_tls_context(void)
   int lifetime = options->SSLKeyLifetime;
   if (public_server_mode(options))
     flags |= TOR_TLS_CTX_IS_PUBLIC_SERVER;
+  if (options->KernelTLS)
+    flags |= TOR_TLS_CTX_ENABLE_KTLS;
   if (!lifetime) { /* we should guess a good ssl cert lifetime */
 
     /* choose between 5 and 365 days, and round to the day */
@@ -1542,6 +1544,9 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
+    if (me->exit_policy_compiled)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                      me->exit_policy_compiled) != ADDR_POLICY_ACCEPTED;
     return compare_tor_addr_to_addr_policy(addr, port,
                                me->exit_policy) != ADDR_POLICY_ACCEPTED;
 #if 0
@@ -1907,6 +1912,7 @@ router_build_fresh_descriptor(routerinfo_t **r, extrainfo_t **e)
     policies_parse_exit_policy_from_options(options,ri->addr,&ri->ipv6_addr,
                                             &ri->exit_policy);
   }
+  ri->exit_policy_compiled = addr_policy_compile(ri->exit_policy);
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy, AF_INET, 1) &&
     policy_is_reject_star(ri->exit_policy, AF_INET6, 1);
@@ -7,23 +7,51 @@
  * storing of cell_t structures. It borrows heavily from cell_queue_t, the
  * main difference is, however, that cell_queue_t stores
  * <em>packed</em>_cell_t structs (instead of cell_t).
+ *
+ * Cells that are only forwarded after reordering (at the merging middle)
+ * do not need to be processed as cell_t again. These are stored as
+ * packed_cell_t in an embedded cell_queue_t, so they can be moved to the
+ * base circuit's queue without another copy. Packed cells are accounted
+ * in the cell queue totals instead of our own total.
+ *
+ * Cells are drained from the packed queue first. To keep the buffer in
+ * FIFO order, a cell is only stored packed while no cell_t is buffered:
+ * every packed cell is then older than every buffered cell_t.
+ *
+ * Buffered cells are allocated from a memory pool, since every cell that
+ * passes a split circuit is buffered at least briefly.
  */
 
 #include "feature/split/cell_buffer.h"
 
 #include "core/or/or.h"
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/relay.h"
+#include "lib/memarea/mempool.h"
 
 #include <string.h>
 
+/** Number of buffered cells that are carved out of every chunk of memory
+ * that the cell pool allocates. */
+#define BUFFERED_CELL_POOL_CHUNK_CAPACITY 64
+
 static size_t total_bytes_allocated = 0;
 
+/** Pool from which we allocate all buffered_cell_t. */
+static mp_pool_t* buffered_cell_pool = NULL;
+
 /** Allocate and return a new buffered_cell_t */
 buffered_cell_t*
 buffered_cell_new(void)
 {
   buffered_cell_t* cell;
-  cell = tor_malloc_zero(sizeof(buffered_cell_t));
+
+  if (PREDICT_UNLIKELY(!buffered_cell_pool))
+    buffered_cell_pool = mp_pool_new(sizeof(buffered_cell_t),
+                                     BUFFERED_CELL_POOL_CHUNK_CAPACITY);
+
+  cell = mp_pool_get_zero(buffered_cell_pool);
   total_bytes_allocated += sizeof(buffered_cell_t);
 
   return cell;
@@ -39,7 +67,7 @@ buffered_cell_free_(buffered_cell_t* cell)
   tor_assert(total_bytes_allocated >= sizeof(buffered_cell_t));
   total_bytes_allocated -= sizeof(buffered_cell_t);
 
-  tor_free(cell);
+  mp_pool_release(cell);
 }
 
 /** Allocate and return a new cell_buffer_t. */
@@ -58,6 +86,7 @@ cell_buffer_init(cell_buffer_t* buf)
 {
   tor_assert(buf);
   TOR_SIMPLEQ_INIT(&buf->head);
+  cell_queue_init(&buf->packed);
 }
 
 /** Deallocate the storage associated with <b>buf</b>. */
@@ -99,6 +128,47 @@ cell_buffer_append_cell(cell_buffer_t* buf, const cell_t* cell)
   cell_buffer_append(buf, buf_cell);
 }
 
+/** Pack <b>cell</b> (using <b>wide_circ_ids</b>) into a new packed_cell_t
+ * and append it to the packed queue of <b>buf</b>. If <b>buf</b> already
+ * holds a cell_t, append <b>cell</b> as a cell_t behind it instead, so that
+ * the cells still leave the buffer in order.
+ */
+void
+cell_buffer_append_packed_copy(cell_buffer_t* buf, const cell_t* cell,
+                               int wide_circ_ids)
+{
+  packed_cell_t* packed;
+  tor_assert(buf);
+  tor_assert(cell);
+
+  if (!TOR_SIMPLEQ_EMPTY(&buf->head)) {
+    cell_buffer_append_cell(buf, cell);
+    return;
+  }
+
+  packed = packed_cell_copy(cell, wide_circ_ids);
+  packed->inserted_timestamp = monotime_coarse_get_stamp();
+
+  cell_queue_append(&buf->packed, packed);
+  ++buf->num;
+}
+
+/** Extract and return the packed cell at the head of <b>buf</b>'s packed
+ * queue; return NULL if there is none. */
+packed_cell_t*
+cell_buffer_pop_packed(cell_buffer_t* buf)
+{
+  packed_cell_t* cell;
+  tor_assert(buf);
+
+  cell = cell_queue_pop(&buf->packed);
+  if (!cell)
+    return NULL;
+  buf->num -= 1;
+  tor_assert(buf->num >= 0);
+  return cell;
+}
+
 /** Extract and return the cell at the head of <b>buf</b>; return NULL if
  * <b>buf</b> is empty. */
 buffered_cell_t*
@@ -116,8 +186,8 @@ cell_buffer_pop(cell_buffer_t* buf)
   return cell;
 }
 
-/** Remove and free every buffered_cell_t in <b>buf</b>. Return
- * the number of bytes that were deallocated. */
+/** Remove and free every buffered_cell_t and packed_cell_t in <b>buf</b>.
+ * Return the number of bytes that were deallocated. */
 size_t
 cell_buffer_clear(cell_buffer_t* buf)
 {
@@ -131,6 +201,9 @@ cell_buffer_clear(cell_buffer_t* buf)
     buffered_cell_free_(cell);
   }
   TOR_SIMPLEQ_INIT(&buf->head);
+
+  freed += buf->packed.n * packed_cell_mem_cost();
+  cell_queue_clear(&buf->packed);
   buf->num = 0;
 
   return freed;
@@ -148,6 +221,7 @@ cell_buffer_max_buffered_age(cell_buffer_t* buf, uint32_t now)
 {
   uint32_t age = 0;
   buffered_cell_t* first;
+  packed_cell_t* first_packed;
   tor_assert(buf);
 
   /* the oldest cell is always at the beginning of the queue */
@@ -157,14 +231,40 @@ cell_buffer_max_buffered_age(cell_buffer_t* buf, uint32_t now)
     age = now - first->inserted_timestamp;
   }
 
+  first_packed = TOR_SIMPLEQ_FIRST(&buf->packed.head);
+  if (first_packed) {
+    tor_assert(now >= first_packed->inserted_timestamp);
+    if (now - first_packed->inserted_timestamp > age)
+      age = now - first_packed->inserted_timestamp;
+  }
+
   return age;
 }
 
 /** Return the total amount of bytes that are currently allocated to
- * store buffered cells.
+ * store buffered cells (not including packed cells).
  */
 size_t
 split_cell_buffer_get_total_allocation(void)
 {
   return total_bytes_allocated;
 }
+
+/** Give the empty chunks of the buffered cell pool back to the system, and
+ * return the number of bytes freed. */
+size_t
+split_cell_buffer_pool_clean(void)
+{
+  if (!buffered_cell_pool)
+    return 0;
+  return mp_pool_clean(buffered_cell_pool, 0);
+}
+
+/** Release all storage held by the buffered cell pool.  Must only be called
+ * when no more cells are buffered. */
+void
+split_cell_buffer_free_all(void)
+{
+  mp_pool_destroy(buffered_cell_pool);
+  total_bytes_allocated = 0;
+}
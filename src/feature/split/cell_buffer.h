@@ -9,6 +9,7 @@
 
 #include "core/or/or.h"
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "ext/tor_queue.h"
 
 /** Wrapper for a buffered cell */
@@ -28,7 +29,12 @@ typedef struct cell_buffer_t {
   /** Linked list of buffered_cell_t*/
   TOR_SIMPLEQ_HEAD(buffered_cell_q, buffered_cell_t) head;
 
-  /** The number of cells in the queue. */
+  /** Queue of cells that are only forwarded (at the merging middle), so
+   * they are already stored packed for the base circuit's channel. They are
+   * all older than the cells in <b>head</b>. */
+  cell_queue_t packed;
+
+  /** The number of cells in both queues. */
   int num;
 } cell_buffer_t;
 
@@ -49,11 +55,16 @@ void cell_buffer_free_(cell_buffer_t* buf);
 
 void cell_buffer_append(cell_buffer_t* buf, buffered_cell_t* cell);
 void cell_buffer_append_cell(cell_buffer_t* buf, const cell_t* cell);
+void cell_buffer_append_packed_copy(cell_buffer_t* buf, const cell_t* cell,
+                                    int wide_circ_ids);
 buffered_cell_t* cell_buffer_pop(cell_buffer_t* buf);
+packed_cell_t* cell_buffer_pop_packed(cell_buffer_t* buf);
 size_t cell_buffer_clear(cell_buffer_t* buf);
 uint32_t cell_buffer_max_buffered_age(cell_buffer_t* buf, uint32_t now);
 
 size_t split_cell_buffer_get_total_allocation(void);
+size_t split_cell_buffer_pool_clean(void);
+void split_cell_buffer_free_all(void);
 
 #else /* HAVE_MODULE_SPLIT */
 
@@ -99,12 +110,25 @@ cell_buffer_append_cell(cell_buffer_t* buf, const cell_t* cell)
   (void)buf; (void)cell; return;
 }
 
+static inline void
+cell_buffer_append_packed_copy(cell_buffer_t* buf, const cell_t* cell,
+                               int wide_circ_ids)
+{
+  (void)buf; (void)cell; (void)wide_circ_ids; return;
+}
+
 static inline buffered_cell_t*
 cell_buffer_pop(cell_buffer_t* buf)
 {
   (void)buf; return NULL;
 }
 
+static inline packed_cell_t*
+cell_buffer_pop_packed(cell_buffer_t* buf)
+{
+  (void)buf; return NULL;
+}
+
 static inline size_t
 cell_buffer_clear(cell_buffer_t* buf)
 {
@@ -123,6 +147,18 @@ split_cell_buffer_get_total_allocation(void)
   return 0;
 }
 
+static inline size_t
+split_cell_buffer_pool_clean(void)
+{
+  return 0;
+}
+
+static inline void
+split_cell_buffer_free_all(void)
+{
+  return;
+}
+
 #endif /* HAVE_MODULE_SPLIT */
 
 #endif /* TOR_CELL_BUFFER_H */
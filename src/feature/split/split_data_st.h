@@ -47,6 +47,10 @@ struct split_data_client_t {
    * (included) */
   crypt_path_t* remaining_cpath;
 
+  /** exclude list that was planned for the next join circuit to launch
+   * (taken over by split_data_get_excluded_nodes) */
+  smartlist_t* planned_excluded;
+
   /** the split strategy that is currently used */
   split_strategy_t strategy;
 
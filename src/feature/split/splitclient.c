@@ -18,15 +18,19 @@
 #include "core/or/crypt_path_st.h"
 #include "core/or/cpath_build_state_st.h"
 #include "core/or/extend_info_st.h"
+#include "feature/client/entrynodes.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/split/demo.h"
 #include "feature/split/splitcommon.h"
 #include "feature/split/splitdefines.h"
 #include "feature/split/spliteval.h"
+#include "feature/split/splitperf.h"
 #include "feature/split/splitstrategy.h"
 #include "feature/split/splitutil.h"
 
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/time/tvdiff.h"
 #include <string.h>
 
 /* Forward declarations */
@@ -397,12 +401,70 @@ split_data_launch_join_circuit(split_data_t* split_data)
   return launched_circ;
 }
 
+/** Plan the entries of <b>num</b> new sub-circuits of <b>split_data</b> at
+ * once: choose distinct, family-disjoint primary guards weighted by their
+ * bandwidth. Return a new smartlist with one exclude list (smartlist_t* of
+ * const node_t*) per sub-circuit to launch, that leaves the sub-circuit's
+ * planned entry as the only usable primary guard. If there are fewer
+ * suitable primary guards than sub-circuits, the remaining exclude lists
+ * exclude all primary guards.
+ * Return NULL, if we don't choose our entries among the primary guards.
+ */
+static smartlist_t*
+split_data_plan_entries(split_data_t* split_data, int num)
+{
+  const or_options_t* options = get_options();
+  smartlist_t *excluded, *primaries, *planned, *plans;
+
+  tor_assert(split_data);
+
+  if (options->SplitEntryNodes || !options->UseEntryGuards)
+    return NULL;
+
+  excluded = split_data_get_excluded_nodes(split_data);
+  primaries = guards_get_usable_primary_nodes();
+  planned = node_sl_choose_k_by_bandwidth(primaries, WEIGHT_FOR_GUARD, num,
+                                          excluded);
+
+  log_info(LD_CIRC, "Planned %d of %d entries for new sub-circuits of "
+           "split_data %p", smartlist_len(planned), num, split_data);
+
+  plans = smartlist_new();
+  for (int i = 0; i < num; i++) {
+    smartlist_t* plan = smartlist_new();
+    const node_t* entry = NULL;
+
+    if (i < smartlist_len(planned))
+      entry = smartlist_get(planned, i);
+
+    smartlist_add_all(plan, excluded);
+    SMARTLIST_FOREACH_BEGIN(primaries, const node_t*, node) {
+      if (node != entry)
+        smartlist_add(plan, (void*)node);
+    } SMARTLIST_FOREACH_END(node);
+    /* the other planned entries will be used by our other new
+     * sub-circuits */
+    SMARTLIST_FOREACH_BEGIN(planned, const node_t*, node) {
+      if (node != entry)
+        nodelist_add_node_and_family(plan, node);
+    } SMARTLIST_FOREACH_END(node);
+
+    smartlist_add(plans, plan);
+  }
+
+  smartlist_free(excluded);
+  smartlist_free(primaries);
+  smartlist_free(planned);
+  return plans;
+}
+
 /** Launch and add a new sub-circuit to <b>split_data</b>.
  */
 static void
 split_data_launch_subcirc(split_data_t* split_data, int num)
 {
   origin_circuit_t* launched_circ;
+  smartlist_t* plans;
 
   tor_assert(split_data);
   tor_assert(split_data->split_data_client);
@@ -446,14 +508,31 @@ split_data_launch_subcirc(split_data_t* split_data, int num)
     tor_assert_unreached();
   }
 
+  plans = split_data_plan_entries(split_data, num);
+
   for (int i = 0; i < num; i++) {
+    if (plans) {
+      smartlist_free(split_data->split_data_client->planned_excluded);
+      split_data->split_data_client->planned_excluded =
+          smartlist_get(plans, i);
+      smartlist_set(plans, i, NULL);
+    }
+
     launched_circ = split_data_launch_join_circuit(split_data);
     if (!launched_circ) {
       log_info(LD_CIRC, "Launching new split sub-circuit failed. Retry later?");
       //TODO-split retry
-      return;
+      break;
     }
   }
+
+  if (plans) {
+    /* drop the plans we did not use */
+    smartlist_free(split_data->split_data_client->planned_excluded);
+    split_data->split_data_client->planned_excluded = NULL;
+    SMARTLIST_FOREACH(plans, smartlist_t*, plan, smartlist_free(plan));
+    smartlist_free(plans);
+  }
 }
 
 /** Called when received a COOKIE_SET successful cell to try and
@@ -750,6 +829,8 @@ split_circuit_add_excluded(smartlist_t* excluded, origin_circuit_t* circ)
 
 /** Return a new smartlist_t of const node_t* containing all nodes
  * that are currently used by circuits associated with <b>split_data<b>.
+ * If an exclude list was planned for the next join circuit (see
+ * split_data_plan_entries), return that one instead.
  * Returns NULL, if split_data is NULL.
  */
 smartlist_t*
@@ -765,6 +846,14 @@ split_data_get_excluded_nodes(split_data_t* split_data)
   if (!split_data)
     return NULL;
 
+  if (split_data->split_data_client &&
+      split_data->split_data_client->planned_excluded) {
+    /* the exclude list was already created when planning the entries */
+    excluded = split_data->split_data_client->planned_excluded;
+    split_data->split_data_client->planned_excluded = NULL;
+    return excluded;
+  }
+
   log_info(LD_CIRC, "Begin creating exclude list for split_data %p",
            split_data);
 
@@ -822,6 +911,11 @@ split_data_get_excluded_nodes(split_data_t* split_data)
     } while (cpath != circ->cpath);
 #endif /* SPLIT_GENERATE_EXCLUDE */
 
+  /* steer new sub-circuits away from entries that performed poorly for us,
+   * unless the user pinned the entries explicitly */
+  if (!get_options()->SplitEntryNodes)
+    split_perf_add_avoided_entries(excluded, approx_time());
+
   log_info(LD_CIRC, "Finished creating exclude list for split_data %p",
            split_data);
 
@@ -833,6 +927,8 @@ void
 split_join_has_opened(origin_circuit_t* circ)
 {
   crypt_path_t* middle;
+  struct timeval end;
+  long build_msec;
 
   tor_assert(circ);
   tor_assert(circ->cpath);
@@ -842,6 +938,12 @@ split_join_has_opened(origin_circuit_t* circ)
   tor_assert(middle->subcirc);
   tor_assert(middle->subcirc->state == SUBCIRC_STATE_PENDING_JOIN);
 
+  /* building the join circuit took two round trips to the middle */
+  tor_gettimeofday(&end);
+  build_msec = tv_mdiff(&TO_CIRCUIT(circ)->timestamp_began, &end);
+  if (build_msec > 0 && build_msec < INT32_MAX)
+    middle->subcirc->rtt_msec = (uint32_t)(build_msec / 2);
+
   if (split_send_join_request(circ, middle) < 0) {
     log_info(LD_CIRC, "Unable to send join request to %s (split_data %p) "
              "on circuit %p (ID %u). Closing...", cpath_name(middle),
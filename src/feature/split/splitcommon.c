@@ -13,6 +13,7 @@
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
+#include "core/or/channel.h"
 #include "core/or/relay.h"
 #include "core/or/circuit_st.h"
 #include "core/or/or_circuit_st.h"
@@ -24,6 +25,7 @@
 #include "feature/split/splitdefines.h"
 #include "feature/split/spliteval.h"
 #include "feature/split/splitor.h"
+#include "feature/split/splitperf.h"
 #include "feature/split/splitstrategy.h"
 #include "feature/split/splitutil.h"
 #include "feature/split/subcirc_list.h"
@@ -31,6 +33,50 @@
 #include "feature/split/subcircuit_st.h"
 #include "core/or/channeltls.h" //wdlc
 
+/** Cell reordering statistics for one bucket of split circuits. */
+typedef struct split_reorder_stats_t {
+  /** number of cells merged into a base circuit */
+  uint64_t n_merged;
+  /** number of cells that arrived on an unexpected sub-circuit and had to
+   * be buffered for reordering */
+  uint64_t n_buffered;
+  /** accumulated time (in msec) cells spent in reordering buffers */
+  uint64_t buffered_msec;
+  /** maximum number of cells that were buffered on one sub-circuit */
+  int max_depth;
+} split_reorder_stats_t;
+
+/** Reordering statistics at the merging point of split circuits. Clients
+ * merge inbound cells and know the split strategy in use, so their
+ * statistics are kept per strategy; middles merge outbound cells and
+ * account them in the last bucket. */
+static split_reorder_stats_t split_reorder_stats[SPLIT_NUM_STRATEGIES + 1];
+
+/** Return the reordering statistics bucket for <b>split_data</b>. */
+static split_reorder_stats_t*
+split_reorder_stats_get(const split_data_t* split_data)
+{
+  split_strategy_t strategy;
+
+  if (!split_data->split_data_client)
+    return &split_reorder_stats[SPLIT_NUM_STRATEGIES];
+
+  strategy = split_data->split_data_client->strategy;
+  if (BUG((int)strategy < 0 || (int)strategy >= SPLIT_NUM_STRATEGIES))
+    return &split_reorder_stats[SPLIT_NUM_STRATEGIES];
+  return &split_reorder_stats[strategy];
+}
+
+/** Return true iff <b>direction</b> is the direction in which cells of
+ * <b>split_data</b> are merged at this node. */
+static inline int
+split_data_is_merge_direction(const split_data_t* split_data,
+                              cell_direction_t direction)
+{
+  return direction == (split_data->split_data_client ?
+                       CELL_DIRECTION_IN : CELL_DIRECTION_OUT);
+}
+
 /** Allocate a new split_data_t structure and return a pointer (never returns
  * NULL, if 'split' module is activated)
  *
@@ -503,6 +549,8 @@ split_data_remove_subcirc(split_data_t** split_data_ptr,
 
     case SUBCIRC_STATE_ADDED:
       tor_assert(split_data_get_subcirc(split_data, subcirc->id) == subcirc);
+      if (split_data->split_data_client)
+        split_perf_note_subcirc(subcirc, approx_time());
       subcirc_list_remove(split_data->subcircs, subcirc->id);
       break;
 
@@ -631,6 +679,19 @@ split_data_used_subcirc(split_data_t* split_data,
       tor_assert_unreached();
   }
 
+  if (split_data_is_merge_direction(split_data, direction)) {
+    split_reorder_stats_get(split_data)->n_merged++;
+
+    if (split_data->split_data_client && *next_subcirc) {
+      /* remember the delivery rate for the path performance history */
+      subcircuit_t* subcirc = *next_subcirc;
+      uint64_t now_msec = monotime_coarse_absolute_msec();
+      if (subcirc->n_delivered++ == 0)
+        subcirc->first_delivered_msec = now_msec;
+      subcirc->last_delivered_msec = now_msec;
+    }
+  }
+
   *next_subcirc = NULL;
 }
 
@@ -717,6 +778,7 @@ split_data_client_free_(split_data_client_t* split_data_client)
   /* free struct members */
   tor_assert_nonfatal(!smartlist_len(split_data_client->pending_subcircs));
   smartlist_free(split_data_client->pending_subcircs);
+  smartlist_free(split_data_client->planned_excluded);
 
   extend_info_free(split_data_client->middle_info);
 
@@ -1434,12 +1496,15 @@ split_base_should_unblock(circuit_t* base)
 }
 
 /** Store <b>cell</b> in <b>subcirc</b>'s split_cell_buf for later
- * reordering
+ * reordering (<b>subcirc</b> is part of <b>split_data</b>)
  */
 void
-split_buffer_cell(subcircuit_t* subcirc, cell_t* cell)
+split_buffer_cell(split_data_t* split_data, subcircuit_t* subcirc,
+                  cell_t* cell)
 {
   cell_buffer_t* buf = NULL;
+  split_reorder_stats_t* stats;
+  tor_assert(split_data);
   tor_assert(subcirc);
   tor_assert(cell);
 
@@ -1453,7 +1518,38 @@ split_buffer_cell(subcircuit_t* subcirc, cell_t* cell)
   buf = subcirc->cell_buf;
 
   tor_assert(buf);
-  cell_buffer_append_cell(buf, cell);
+#ifndef SPLIT_EVAL_DATARATE
+  /* at the middle, the cell is forwarded as it is after reordering, so
+   * store it packed for the base circuit's channel right away (the data
+   * rate evaluation needs the receive time of the cell_t, though) */
+  if (split_data->split_data_or && split_data->base->n_chan) {
+    cell_buffer_append_packed_copy(buf, cell,
+                                   split_data->base->n_chan->wide_circ_ids);
+  } else
+#endif /* !defined(SPLIT_EVAL_DATARATE) */
+  {
+    cell_buffer_append_cell(buf, cell);
+  }
+
+  stats = split_reorder_stats_get(split_data);
+  stats->n_buffered++;
+  if (buf->num > stats->max_depth)
+    stats->max_depth = buf->num;
+}
+
+/** Account the time a cell that was inserted at <b>inserted_timestamp</b>
+ * spent in a reordering buffer of <b>split_data</b>. */
+static void
+split_note_unbuffered_cell(const split_data_t* split_data,
+                           uint32_t inserted_timestamp)
+{
+  uint32_t now = monotime_coarse_get_stamp();
+
+  if (now < inserted_timestamp)
+    return;
+
+  split_reorder_stats_get(split_data)->buffered_msec +=
+    monotime_coarse_stamp_units_to_approx_msec(now - inserted_timestamp);
 }
 
 /** Handle cells that were potentially buffered while we were waiting for the
@@ -1488,6 +1584,8 @@ split_handle_buffered_cells(circuit_t* circ)
           int reason;
           buf_cell = cell_buffer_pop(next_subcirc->cell_buf);
           tor_assert(buf_cell);
+          split_note_unbuffered_cell(cpath->split_data,
+                                     buf_cell->inserted_timestamp);
 
           tor_assert(cpath->next != cpath);
           tor_assert(cpath->next != TO_ORIGIN_CIRCUIT(base)->cpath);
@@ -1525,29 +1623,43 @@ split_handle_buffered_cells(circuit_t* circ)
     next_subcirc = split_get_next_subcirc(base, NULL, CELL_DIRECTION_OUT);
 
     while (next_subcirc && next_subcirc->cell_buf->num > 0) {
-      buf_cell = cell_buffer_pop(next_subcirc->cell_buf);
-      tor_assert(buf_cell);
+      packed_cell_t* packed;
 
       //TODO-split add rendezvous-splice
       tor_assert(base->n_chan);
 
       log_debug(LD_OR, "Passing on buffered split cell.");
-
       stats_n_relay_cells_relayed++;
-      append_cell_to_circuit_queue(base, base->n_chan, &buf_cell->cell,
-                                   CELL_DIRECTION_OUT, 0);
+
+      if ((packed = cell_buffer_pop_packed(next_subcirc->cell_buf))) {
+        split_note_unbuffered_cell(TO_OR_CIRCUIT(base)->split_data,
+                                   packed->inserted_timestamp);
+        /* move the cell without copying it again */
+        append_packed_cell_to_circuit_queue(base, base->n_chan, packed,
+                                            CELL_DIRECTION_OUT);
+      } else {
+        buf_cell = cell_buffer_pop(next_subcirc->cell_buf);
+        tor_assert(buf_cell);
+        split_note_unbuffered_cell(TO_OR_CIRCUIT(base)->split_data,
+                                   buf_cell->inserted_timestamp);
+
+        append_cell_to_circuit_queue(base, base->n_chan, &buf_cell->cell,
+                                     CELL_DIRECTION_OUT, 0);
 
 #ifdef SPLIT_EVAL_DATARATE
-  if (CIRCUIT_IS_ORCIRC(circ)) {
-    or_circuit_t* or_circ = TO_OR_CIRCUIT(circ);
-    if (or_circ->split_eval_data.consider) {
-      split_eval_append_cell(&or_circ->split_eval_data, CELL_DIRECTION_OUT,
-                             &buf_cell->cell.received, &base->temp);
-    }
-  }
+        if (CIRCUIT_IS_ORCIRC(circ)) {
+          or_circuit_t* or_circ = TO_OR_CIRCUIT(circ);
+          if (or_circ->split_eval_data.consider) {
+            split_eval_append_cell(&or_circ->split_eval_data,
+                                   CELL_DIRECTION_OUT,
+                                   &buf_cell->cell.received, &base->temp);
+          }
+        }
 #endif /* SPLIT_EVAL_DATARATE */
 
-      buffered_cell_free(buf_cell);
+        buffered_cell_free(buf_cell);
+      }
+
       split_used_circuit(base, CELL_DIRECTION_OUT);
       next_subcirc = split_get_next_subcirc(base, NULL, CELL_DIRECTION_OUT);
     }
@@ -1575,9 +1687,11 @@ split_max_buffered_cell_age(const circuit_t* circ, uint32_t now)
   if (CIRCUIT_IS_ORIGIN(circ)) {
     crypt_path_t* cpath = CONST_TO_ORIGIN_CIRCUIT(circ)->cpath;
 
-    do {
-      tor_assert(cpath);
+    /* A circuit whose path we haven't chosen yet has nothing buffered. */
+    if (!cpath)
+      return 0;
 
+    do {
       if (cpath->subcirc) {
         tmp_age = cell_buffer_max_buffered_age(cpath->subcirc->cell_buf, now);
         if (tmp_age > age)
@@ -1612,9 +1726,10 @@ split_marked_circuit_free_buffer(circuit_t* circ)
   if (CIRCUIT_IS_ORIGIN(circ)) {
       crypt_path_t* cpath = TO_ORIGIN_CIRCUIT(circ)->cpath;
 
-      do {
-        tor_assert(cpath);
+      if (!cpath)
+        return 0;
 
+      do {
         if (cpath->subcirc)
           freed += cell_buffer_clear(cpath->subcirc->cell_buf);
 
@@ -1631,3 +1746,34 @@ split_marked_circuit_free_buffer(circuit_t* circ)
   return freed;
 }
 
+/** Implementation helper for GETINFO: answers queries about the cell
+ * reordering statistics of the 'split' module. */
+int
+getinfo_helper_split(control_connection_t *conn,
+                     const char *question, char **answer,
+                     const char **errmsg)
+{
+  (void)conn;
+  (void)errmsg;
+
+  if (!strcmp(question, "split/reorder-stats")) {
+    smartlist_t* lines = smartlist_new();
+
+    for (int i = 0; i <= SPLIT_NUM_STRATEGIES; i++) {
+      const split_reorder_stats_t* stats = &split_reorder_stats[i];
+      smartlist_add_asprintf(lines,
+            "%s merged=%"PRIu64" buffered=%"PRIu64" buffered-msec=%"PRIu64
+            " max-depth=%d",
+            i < SPLIT_NUM_STRATEGIES ?
+                split_strategy_str((split_strategy_t)i) : "MIDDLE",
+            stats->n_merged, stats->n_buffered, stats->buffered_msec,
+            stats->max_depth);
+    }
+
+    *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char*, line, tor_free(line));
+    smartlist_free(lines);
+  }
+
+  return 0;
+}
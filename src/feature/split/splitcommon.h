@@ -59,13 +59,18 @@ void split_base_inc_blocked(circuit_t* base);
 void split_base_dec_blocked(circuit_t* base);
 int split_base_should_unblock(circuit_t* base);
 
-void split_buffer_cell(subcircuit_t* subcirc, cell_t* cell);
+void split_buffer_cell(split_data_t* split_data, subcircuit_t* subcirc,
+                       cell_t* cell);
 
 void split_handle_buffered_cells(circuit_t* circ);
 
 uint32_t split_max_buffered_cell_age(const circuit_t* circ, uint32_t now);
 size_t split_marked_circuit_free_buffer(circuit_t* circ);
 
+int getinfo_helper_split(control_connection_t *conn,
+                         const char *question, char **answer,
+                         const char **errmsg);
+
 #else /* HAVE_MODULE_SPLIT */
 
 static inline split_data_t*
@@ -199,9 +204,10 @@ split_base_should_unblock(circuit_t* base)
 }
 
 static inline void
-split_buffer_cell(subcircuit_t* subcirc, cell_t* cell)
+split_buffer_cell(split_data_t* split_data, subcircuit_t* subcirc,
+                  cell_t* cell)
 {
-  (void)subcirc; (void)cell; return;
+  (void)split_data; (void)subcirc; (void)cell; return;
 }
 
 static inline void
@@ -222,6 +228,14 @@ split_marked_circuit_free_buffer(circuit_t* circ)
   (void)circ; return 0;
 }
 
+static inline int
+getinfo_helper_split(control_connection_t *conn,
+                     const char *question, char **answer,
+                     const char **errmsg)
+{
+  (void)conn; (void)question; (void)answer; (void)errmsg; return 0;
+}
+
 #endif /* HAVE_MODULE_SPLIT */
 
 /*** Internal functions (only use within the 'split' module) ***/
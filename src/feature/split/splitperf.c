@@ -0,0 +1,429 @@
+/**
+ * \file splitperf.c
+ *
+ * \brief Traffic splitting implementation: per-relay history of the
+ * performance that sub-circuits achieved from this client's vantage point.
+ *
+ * Whenever a sub-circuit of a split circuit is removed at the client, we
+ * fold the throughput it delivered and (for join circuits) the RTT to its
+ * merging middle into the history of its entry node. Observations decay
+ * with a half-life of SPLIT_PERF_HALF_LIFE and the history is bounded to
+ * SPLIT_PERF_MAX_ENTRIES relays. It is persisted in the state file.
+ *
+ * The history is used to avoid entries that were considerably slower than
+ * the others when launching new sub-circuits, and to seed the weights of
+ * the weighted split strategies.
+ **/
+
+#define MODULE_SPLIT_INTERNAL
+#define TOR_SPLITPERF_PRIVATE
+#include "feature/split/splitperf.h"
+
+#include "app/config/config.h"
+#include "app/config/statefile.h"
+#include "core/or/or.h"
+#include "core/or/circuitlist.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/extend_info_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "feature/nodelist/describe.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/split/subcirc_list.h"
+#include "feature/split/subcircuit_st.h"
+#include "lib/container/order.h"
+#include "lib/encoding/confline.h"
+#include "lib/encoding/time_fmt.h"
+#include "lib/math/fp.h"
+
+#include "app/config/or_state_st.h"
+
+#include <float.h>
+#include <math.h>
+
+/** Map from relay identity digest to split_perf_entry_t */
+static digestmap_t* split_perf_map = NULL;
+
+/** Return the decayed number of observations of <b>ent</b> at <b>now</b>.
+ */
+STATIC double
+split_perf_get_weight(const split_perf_entry_t* ent, time_t now)
+{
+  double age;
+
+  tor_assert(ent);
+
+  age = now > ent->last_update ? (double)(now - ent->last_update) : 0.0;
+  return ent->weight * pow(0.5, age / SPLIT_PERF_HALF_LIFE);
+}
+
+/** Return the performance history of the relay with identity <b>digest</b>
+ * or NULL, if there is none.
+ */
+STATIC const split_perf_entry_t*
+split_perf_get(const char* digest)
+{
+  if (!split_perf_map)
+    return NULL;
+
+  return digestmap_get(split_perf_map, digest);
+}
+
+/** Return the number of relays we currently keep a history for. */
+STATIC int
+split_perf_get_num_entries(void)
+{
+  return split_perf_map ? digestmap_size(split_perf_map) : 0;
+}
+
+/** Make room for a new entry by removing the one with the smallest decayed
+ * weight at <b>now</b>.
+ */
+static void
+split_perf_evict(time_t now)
+{
+  char victim[DIGEST_LEN];
+  double victim_weight = 0;
+  int found = 0;
+
+  DIGESTMAP_FOREACH(split_perf_map, digest, split_perf_entry_t*, ent) {
+    double weight = split_perf_get_weight(ent, now);
+    if (!found || weight < victim_weight) {
+      memcpy(victim, digest, DIGEST_LEN);
+      victim_weight = weight;
+      found = 1;
+    }
+  } DIGESTMAP_FOREACH_END;
+
+  if (found) {
+    split_perf_entry_t* ent = digestmap_remove(split_perf_map, victim);
+    tor_free(ent);
+  }
+}
+
+/** Fold one observation of <b>throughput</b> (in bytes/sec) and
+ * <b>rtt_msec</b> (0 if unknown) into the history of the relay with
+ * identity <b>digest</b>.
+ */
+STATIC void
+split_perf_note(const char* digest, double throughput, double rtt_msec,
+                time_t now)
+{
+  split_perf_entry_t* ent;
+  double old_weight;
+
+  tor_assert(digest);
+  tor_assert(throughput >= 0);
+
+  if (!split_perf_map)
+    split_perf_map = digestmap_new();
+
+  ent = digestmap_get(split_perf_map, digest);
+  if (!ent) {
+    if (digestmap_size(split_perf_map) >= SPLIT_PERF_MAX_ENTRIES)
+      split_perf_evict(now);
+    ent = tor_malloc_zero(sizeof(split_perf_entry_t));
+    digestmap_set(split_perf_map, digest, ent);
+  }
+
+  old_weight = split_perf_get_weight(ent, now);
+
+  ent->throughput = (ent->throughput * old_weight + throughput) /
+      (old_weight + 1);
+  if (rtt_msec > 0) {
+    ent->rtt_msec = ent->rtt_msec > 0 ?
+        (ent->rtt_msec * old_weight + rtt_msec) / (old_weight + 1) :
+        rtt_msec;
+  }
+  ent->weight = old_weight + 1;
+  ent->last_update = now;
+}
+
+/** Record the performance of <b>subcirc</b> (which is about to be removed
+ * from its split circuit) for its entry node.
+ */
+void
+split_perf_note_subcirc(const subcircuit_t* subcirc, time_t now)
+{
+  const origin_circuit_t* circ;
+  uint64_t active_msec;
+  double throughput;
+
+  tor_assert(subcirc);
+
+  if (!subcirc->circ || !CIRCUIT_IS_ORIGIN(subcirc->circ))
+    return;
+
+  circ = CONST_TO_ORIGIN_CIRCUIT(subcirc->circ);
+  if (!circ->cpath || !circ->cpath->extend_info)
+    return;
+
+  if (subcirc->n_delivered < SPLIT_PERF_MIN_CELLS)
+    return;
+
+  active_msec = subcirc->last_delivered_msec - subcirc->first_delivered_msec;
+  if (active_msec == 0)
+    return;
+
+  throughput = (double)subcirc->n_delivered * RELAY_PAYLOAD_SIZE * 1000 /
+      (double)active_msec;
+
+  split_perf_note(circ->cpath->extend_info->identity_digest, throughput,
+                  subcirc->rtt_msec, now);
+
+  if (!get_options()->AvoidDiskWrites)
+    or_state_mark_dirty(get_or_state(), now + 600);
+}
+
+/** Add up to SPLIT_PERF_MAX_AVOIDED_ENTRIES relays to <b>excluded</b>, whose
+ * trusted history shows that they were considerably slower entries than
+ * the others. Relays already in excluded are not considered.
+ */
+void
+split_perf_add_avoided_entries(smartlist_t* excluded, time_t now)
+{
+  smartlist_t *trusted, *trusted_ents;
+  double *throughputs, *rtts;
+  double median_throughput, median_rtt = 0;
+  int n_rtts = 0;
+
+  tor_assert(excluded);
+
+  if (split_perf_get_num_entries() < SPLIT_PERF_MIN_RELAYS)
+    return;
+
+  /* digests of the trusted relays and their entries (at the same index) */
+  trusted = smartlist_new();
+  trusted_ents = smartlist_new();
+  DIGESTMAP_FOREACH(split_perf_map, digest, split_perf_entry_t*, ent) {
+    if (split_perf_get_weight(ent, now) >= SPLIT_PERF_MIN_CONFIDENCE) {
+      smartlist_add(trusted, (void*)digest);
+      smartlist_add(trusted_ents, ent);
+    }
+  } DIGESTMAP_FOREACH_END;
+
+  if (smartlist_len(trusted) < SPLIT_PERF_MIN_RELAYS) {
+    smartlist_free(trusted);
+    smartlist_free(trusted_ents);
+    return;
+  }
+
+  throughputs = tor_calloc(smartlist_len(trusted), sizeof(double));
+  rtts = tor_calloc(smartlist_len(trusted), sizeof(double));
+  SMARTLIST_FOREACH_BEGIN(trusted_ents, const split_perf_entry_t*, ent) {
+    throughputs[ent_sl_idx] = ent->throughput;
+    if (ent->rtt_msec > 0)
+      rtts[n_rtts++] = ent->rtt_msec;
+  } SMARTLIST_FOREACH_END(ent);
+
+  median_throughput = median_double(throughputs, smartlist_len(trusted));
+  if (n_rtts >= SPLIT_PERF_MIN_RELAYS)
+    median_rtt = median_double(rtts, n_rtts);
+
+  for (int i = 0; i < SPLIT_PERF_MAX_AVOIDED_ENTRIES; i++) {
+    const node_t* slowest = NULL;
+    double slowest_throughput = 0;
+
+    SMARTLIST_FOREACH_BEGIN(trusted, const char*, digest) {
+      const split_perf_entry_t* ent = smartlist_get(trusted_ents,
+                                                    digest_sl_idx);
+      const node_t* node;
+      int slow;
+
+      slow = ent->throughput < SPLIT_PERF_SLOW_FRACTION * median_throughput;
+      if (median_rtt > 0 && ent->rtt_msec > 0)
+        slow |= ent->rtt_msec > SPLIT_PERF_SLOW_RTT_FACTOR * median_rtt;
+      if (!slow)
+        continue;
+
+      node = node_get_by_id(digest);
+      if (!node || smartlist_contains(excluded, node))
+        continue;
+
+      if (!slowest || ent->throughput < slowest_throughput) {
+        slowest = node;
+        slowest_throughput = ent->throughput;
+      }
+    } SMARTLIST_FOREACH_END(digest);
+
+    if (!slowest)
+      break;
+
+    log_info(LD_CIRC, "Avoiding slow entry %s for new split sub-circuits "
+             "(%.0f bytes/sec; median %.0f bytes/sec)",
+             node_describe(slowest), slowest_throughput, median_throughput);
+    smartlist_add(excluded, (void*)slowest);
+  }
+
+  tor_free(throughputs);
+  tor_free(rtts);
+  smartlist_free(trusted);
+  smartlist_free(trusted_ents);
+}
+
+/** Fill the first <b>num</b> elements of <b>alpha</b> with parameters of a
+ * Dirichlet distribution for the sub-circuits with IDs 0 to num-1 in
+ * <b>subcircs</b>, so that each sub-circuit's expected weight follows the
+ * trusted throughput history of its entry node. Sub-circuits without
+ * trusted history expect the average weight. The parameters sum up to
+ * <b>num</b>, so the variance of the distribution stays comparable to the
+ * standard Dirichlet distribution (all parameters 1).
+ * Return 1 if alpha was seeded from the history; otherwise set all
+ * parameters to 1 and return 0.
+ */
+int
+split_perf_get_dirichlet_alpha(subcirc_list_t* subcircs, double* alpha,
+                               int num, time_t now)
+{
+  double sum = 0;
+  int n_known = 0;
+
+  tor_assert(subcircs);
+  tor_assert(alpha);
+
+  for (int k = 0; k < num; k++) {
+    subcircuit_t* subcirc = subcirc_list_get(subcircs, (subcirc_id_t)k);
+    const split_perf_entry_t* ent = NULL;
+    const origin_circuit_t* circ;
+
+    alpha[k] = 0;
+    if (!subcirc || !subcirc->circ || !CIRCUIT_IS_ORIGIN(subcirc->circ))
+      continue;
+
+    circ = CONST_TO_ORIGIN_CIRCUIT(subcirc->circ);
+    if (circ->cpath && circ->cpath->extend_info)
+      ent = split_perf_get(circ->cpath->extend_info->identity_digest);
+
+    if (ent && ent->throughput > 0 &&
+        split_perf_get_weight(ent, now) >= SPLIT_PERF_MIN_CONFIDENCE) {
+      alpha[k] = ent->throughput;
+      sum += ent->throughput;
+      n_known++;
+    }
+  }
+
+  if (n_known == 0) {
+    for (int k = 0; k < num; k++)
+      alpha[k] = 1;
+    return 0;
+  }
+
+  /* unknown sub-circuits get the average of the known ones */
+  for (int k = 0; k < num; k++) {
+    if (alpha[k] <= 0)
+      alpha[k] = sum / n_known;
+  }
+  sum = sum * num / n_known;
+
+  for (int k = 0; k < num; k++)
+    alpha[k] = MAX(num * alpha[k] / sum, SPLIT_PERF_MIN_ALPHA);
+
+  return 1;
+}
+
+/** Output the performance history to the or_state_t <b>state</b>.
+ * Each relay takes one line:
+ * "SplitPathPerf <hex id> <bytes/sec> <rtt msec> <weight> <last update>"
+ */
+void
+split_perf_update_state(or_state_t* state)
+{
+  config_line_t **next, *line;
+  time_t now = time(NULL);
+
+  config_free_lines(state->SplitPathPerf);
+  next = &state->SplitPathPerf;
+  *next = NULL;
+
+  if (!split_perf_map)
+    return;
+
+  DIGESTMAP_FOREACH_MODIFY(split_perf_map, digest, split_perf_entry_t*, ent) {
+    char hex[HEX_DIGEST_LEN+1];
+    char tbuf[ISO_TIME_LEN+1];
+
+    if (split_perf_get_weight(ent, now) < SPLIT_PERF_MIN_WEIGHT) {
+      /* forget about relays we haven't used for a long time */
+      MAP_DEL_CURRENT(digest);
+      tor_free(ent);
+      continue;
+    }
+
+    base16_encode(hex, sizeof(hex), digest, DIGEST_LEN);
+    format_iso_time_nospace(tbuf, ent->last_update);
+
+    *next = line = tor_malloc_zero(sizeof(config_line_t));
+    line->key = tor_strdup("SplitPathPerf");
+    tor_asprintf(&line->value, "%s %.0f %.0f %.3f %s", hex, ent->throughput,
+                 ent->rtt_msec, ent->weight, tbuf);
+    next = &(line->next);
+  } DIGESTMAP_FOREACH_END;
+}
+
+/** Load the performance history from the or_state_t <b>state</b>, replacing
+ * the current history. Return -1 if a line could not be parsed (the valid
+ * lines are still loaded); otherwise 0.
+ */
+int
+split_perf_parse_state(or_state_t* state)
+{
+  config_line_t* line;
+  int err = 0;
+
+  split_perf_free_all();
+  split_perf_map = digestmap_new();
+
+  for (line = state->SplitPathPerf; line; line = line->next) {
+    smartlist_t* args = smartlist_new();
+    char digest[DIGEST_LEN];
+    split_perf_entry_t ent;
+    int ok = 0;
+
+    memset(&ent, 0, sizeof(ent));
+    smartlist_split_string(args, line->value, " ",
+                           SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+
+    if (smartlist_len(args) == 5 &&
+        strlen(smartlist_get(args, 0)) == HEX_DIGEST_LEN &&
+        base16_decode(digest, DIGEST_LEN, smartlist_get(args, 0),
+                      HEX_DIGEST_LEN) == DIGEST_LEN) {
+      int ok_t, ok_r, ok_w;
+      ent.throughput = tor_parse_double(smartlist_get(args, 1), 0, DBL_MAX,
+                                        &ok_t, NULL);
+      ent.rtt_msec = tor_parse_double(smartlist_get(args, 2), 0, DBL_MAX,
+                                      &ok_r, NULL);
+      ent.weight = tor_parse_double(smartlist_get(args, 3), 0, DBL_MAX,
+                                    &ok_w, NULL);
+      ok = ok_t && ok_r && ok_w &&
+          parse_iso_time_nospace(smartlist_get(args, 4),
+                                 &ent.last_update) == 0;
+    }
+
+    if (ok && digestmap_get(split_perf_map, digest)) {
+      log_warn(LD_GENERAL, "Ignoring duplicate split path performance line "
+               "\"%s\"", escaped(line->value));
+    } else if (ok &&
+               digestmap_size(split_perf_map) < SPLIT_PERF_MAX_ENTRIES) {
+      digestmap_set(split_perf_map, digest,
+                    tor_memdup(&ent, sizeof(split_perf_entry_t)));
+    } else if (!ok) {
+      log_warn(LD_GENERAL, "Unable to parse split path performance line "
+               "\"%s\"", escaped(line->value));
+      err = 1;
+    }
+
+    SMARTLIST_FOREACH(args, char*, cp, tor_free(cp));
+    smartlist_free(args);
+  }
+
+  log_info(LD_CIRC, "Loaded split path performance history of %d relays",
+           digestmap_size(split_perf_map));
+
+  return err ? -1 : 0;
+}
+
+/** Release all storage held by the performance history. */
+void
+split_perf_free_all(void)
+{
+  digestmap_free(split_perf_map, tor_free_);
+}
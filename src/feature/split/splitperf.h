@@ -0,0 +1,112 @@
+/**
+ * \file splitperf.h
+ *
+ * \brief Headers for splitperf.c
+ **/
+
+#ifndef TOR_SPLITPERF_H
+#define TOR_SPLITPERF_H
+
+#include "core/or/or.h"
+#include "feature/split/splitdefines.h"
+#include "feature/split/subcirc_list.h"
+
+/* maximum number of relays we keep a performance history for */
+#define SPLIT_PERF_MAX_ENTRIES 256
+
+/* half-life (in seconds) of the observations in the performance history */
+#define SPLIT_PERF_HALF_LIFE (7*24*60*60)
+
+/* decayed number of observations below which a relay's history is dropped */
+#define SPLIT_PERF_MIN_WEIGHT 0.05
+
+/* decayed number of observations a relay's history needs to be trusted */
+#define SPLIT_PERF_MIN_CONFIDENCE 2.0
+
+/* minimum number of cells a sub-circuit must have delivered for measuring
+ * its throughput */
+#define SPLIT_PERF_MIN_CELLS 50
+
+/* a trusted entry is considered slow, if its throughput is below this
+ * fraction of the median throughput of all trusted entries ... */
+#define SPLIT_PERF_SLOW_FRACTION 0.5
+/* ... or if its RTT is above this multiple of their median RTT */
+#define SPLIT_PERF_SLOW_RTT_FACTOR 2.0
+
+/* minimum number of trusted entries before we consider any of them slow */
+#define SPLIT_PERF_MIN_RELAYS 3
+
+/* maximum number of slow entries to avoid for new sub-circuits */
+#define SPLIT_PERF_MAX_AVOIDED_ENTRIES 1
+
+/* lower bound of the seeded Dirichlet parameters (so that no sub-circuit is
+ * starved completely) */
+#define SPLIT_PERF_MIN_ALPHA 0.2
+
+#ifdef HAVE_MODULE_SPLIT
+
+void split_perf_update_state(or_state_t* state);
+int split_perf_parse_state(or_state_t* state);
+void split_perf_free_all(void);
+
+#else /* HAVE_MODULE_SPLIT */
+
+static inline void
+split_perf_update_state(or_state_t* state)
+{
+  (void)state; return;
+}
+
+static inline int
+split_perf_parse_state(or_state_t* state)
+{
+  (void)state; return 0;
+}
+
+static inline void
+split_perf_free_all(void)
+{
+  return;
+}
+
+#endif /* HAVE_MODULE_SPLIT */
+
+/*** Internal functions (only use within the 'split' module) ***/
+#ifdef MODULE_SPLIT_INTERNAL
+
+void split_perf_note_subcirc(const subcircuit_t* subcirc, time_t now);
+
+void split_perf_add_avoided_entries(smartlist_t* excluded, time_t now);
+
+int split_perf_get_dirichlet_alpha(subcirc_list_t* subcircs, double* alpha,
+                                   int num, time_t now);
+
+#endif /* MODULE_SPLIT_INTERNAL */
+
+/*** Static functions (only for testing) ***/
+#ifdef TOR_SPLITPERF_PRIVATE
+
+/** Performance history of one relay that was used as entry node of split
+ * sub-circuits */
+typedef struct split_perf_entry_t {
+  /** decayed average of the delivered throughput (in bytes/sec) */
+  double throughput;
+  /** decayed average of the RTT to the merging middle (in msec);
+   * 0 if unknown */
+  double rtt_msec;
+  /** decayed number of observations */
+  double weight;
+  /** time of the last observation */
+  time_t last_update;
+} split_perf_entry_t;
+
+STATIC void split_perf_note(const char* digest, double throughput,
+                            double rtt_msec, time_t now);
+STATIC const split_perf_entry_t* split_perf_get(const char* digest);
+STATIC double split_perf_get_weight(const split_perf_entry_t* ent,
+                                    time_t now);
+STATIC int split_perf_get_num_entries(void);
+
+#endif /* TOR_SPLITPERF_PRIVATE */
+
+#endif /* TOR_SPLITPERF_H */
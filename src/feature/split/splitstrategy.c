@@ -9,6 +9,7 @@
 #include "feature/split/splitstrategy.h"
 #include "app/config/config.h"
 #include "core/or/or.h"
+#include "feature/split/splitperf.h"
 #include "feature/split/splitutil.h"
 #include "feature/split/split_instruction_st.h"
 #include "feature/split/subcirc_list.h"
@@ -526,6 +527,9 @@ get_instruction_weighted_random(subcirc_list_t* subcircs,
     gettimeofday(&tv,0);
     unsigned long mySeed = tv.tv_sec + tv.tv_usec;
     gsl_rng_set(r, mySeed);
+    /* bias the weights towards entries that performed well in the past */
+    split_perf_get_dirichlet_alpha(subcircs, alpha, number_of_paths,
+                                   approx_time());
     ran_dirichlet(r, max_id +1 ,alpha,theta);
     gsl_rng_free(r);
     log_info (LD_CIRC, "Weight vector %f,%f,%f", 100*(theta[0]), 100*(theta[1]), 100*(theta[2]) );
@@ -548,7 +552,7 @@ get_instruction_weighted_random(subcirc_list_t* subcircs,
   for (int j = 0; j < number_of_paths ; j++){
       int max_subindex = (int) tor_lround(100*theta[j]);
       log_info (LD_CIRC, "number of circuit %i, %i limits %i,%i", j, max_subindex, last_index, max_subindex);
-      for (int g = 0; g < (max_subindex) ; g++){
+      for (int g = 0; g < (max_subindex) && g + last_index < 100 ; g++){
       	weighted_paths[g + last_index] = j;
       }
       last_index = max_subindex + last_index;
@@ -610,6 +614,9 @@ get_instruction_batched_weighted_random(subcirc_list_t* subcircs,
     gettimeofday(&tv,0);
     unsigned long mySeed = tv.tv_sec + tv.tv_usec;
     gsl_rng_set(r, mySeed);
+    /* bias the weights towards entries that performed well in the past */
+    split_perf_get_dirichlet_alpha(subcircs, alpha, number_of_paths,
+                                   approx_time());
     ran_dirichlet(r, max_id +1 ,alpha,theta);
     gsl_rng_free(r);
     log_info (LD_CIRC, "BWR Weight vector %f,%f,%f", 100*(theta[0]), 100*(theta[1]), 100*(theta[2]) );
@@ -633,7 +640,7 @@ get_instruction_batched_weighted_random(subcirc_list_t* subcircs,
   for (int j = 0; j < number_of_paths ; j++){
       int max_subindex = (int) tor_lround(100*theta[j]);
       log_info (LD_CIRC, "number of circuit %i, %i limits %i,%i", j, max_subindex, last_index, max_subindex);
-      for (int g = 0; g < (max_subindex) ; g++){
+      for (int g = 0; g < (max_subindex) && g + last_index < 100 ; g++){
       	weighted_paths[g + last_index] = j;
       }
       last_index = max_subindex + last_index;
@@ -853,3 +860,26 @@ split_get_default_strategy(void)
   else
     return SPLIT_DEFAULT_STRATEGY;
 }
+
+/** Return a human-readable name for <b>strategy</b> (matching the values
+ * accepted by the SplitStrategy option). */
+const char*
+split_strategy_str(split_strategy_t strategy)
+{
+  switch (strategy) {
+    case SPLIT_STRATEGY_MIN_ID:
+      return "MIN_ID";
+    case SPLIT_STRATEGY_MAX_ID:
+      return "MAX_ID";
+    case SPLIT_STRATEGY_ROUND_ROBIN:
+      return "ROUND_ROBIN";
+    case SPLIT_STRATEGY_RANDOM_UNIFORM:
+      return "RANDOM_UNIFORM";
+    case SPLIT_STRATEGY_WEIGHTED_RANDOM:
+      return "WEIGHTED_RANDOM";
+    case SPLIT_STRATEGY_BATCHED_WEIGHTED_RANDOM:
+      return "BATCHED_WEIGHTED_RANDOM";
+    default:
+      return "UNKNOWN";
+  }
+}
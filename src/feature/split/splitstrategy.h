@@ -35,6 +35,9 @@ enum split_strategy_t {
 
 };
 
+/** number of entries in enum split_strategy_t */
+#define SPLIT_NUM_STRATEGIES (SPLIT_STRATEGY_BATCHED_WEIGHTED_RANDOM + 1)
+
 #ifdef HAVE_MODULE_SPLIT
 split_instruction_t* split_instruction_new(void);
 void split_instruction_free_(split_instruction_t* inst);
@@ -85,6 +88,7 @@ int split_instruction_check(split_instruction_t* inst,
 void split_instruction_free_list(split_instruction_t** list);
 
 split_strategy_t split_get_default_strategy(void);
+const char* split_strategy_str(split_strategy_t strategy);
 #endif /* MODULE_SPLIT_INTERNAL */
 
 
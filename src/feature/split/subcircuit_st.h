@@ -37,6 +37,18 @@ struct subcircuit_t {
 
   /** Buffer for cell reordering */
   cell_buffer_t* cell_buf;
+
+  /** Number of cells that were merged from this sub-circuit (only at
+   * the client) */
+  uint64_t n_delivered;
+  /** Monotonic timestamps (in msec) of the first and the last cell that
+   * were merged from this sub-circuit (only at the client) */
+  uint64_t first_delivered_msec;
+  uint64_t last_delivered_msec;
+
+  /** Estimated RTT (in msec) from the client to the merging middle via this
+   * sub-circuit; 0 if unknown */
+  uint32_t rtt_msec;
 };
 
 #endif /*TOR_SUBCIRCUIT_H */
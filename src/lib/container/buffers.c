@@ -26,10 +26,12 @@
 #include "orconfig.h"
 #include <stddef.h>
 #include "lib/container/buffers.h"
+#include "lib/container/smartlist.h"
 #include "lib/cc/torint.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/ctime/di_ops.h"
+#include "lib/intmath/bits.h"
 #include "lib/malloc/malloc.h"
 #include "lib/string/printf.h"
 #include "lib/time/compat_time.h"
@@ -37,6 +39,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include <stdlib.h>
 #include <string.h>
@@ -121,38 +126,382 @@ chunk_repack(chunk_t *chunk)
   chunk->data = &chunk->mem[0];
 }
 
-/** Keep track of total size of allocated chunks for consistency asserts */
+/** Keep track of total size of allocated chunks for consistency asserts.
+ * Chunks on freelists don't count. */
 static size_t total_bytes_allocated_in_chunks = 0;
+
+/* Chunk freelists.
+ *
+ * Almost every chunk we allocate has one of a few power-of-two allocation
+ * sizes, and the rate at which we allocate and free them tracks our traffic.
+ * Rather than handing each of them back to malloc, we keep a freelist of
+ * recently freed chunks for each of these sizes.  Every time we trim the
+ * freelists, we free all but <b>slack</b> of the chunks that have sat on the
+ * freelist unused since the last trim; under memory pressure, we free them
+ * all.
+ *
+ * Optionally, new chunks of these sizes are carved out of 2 MB arenas, which
+ * the kernel can back with transparent huge pages.  An arena is only
+ * unmapped once all of its chunks are free, so chunks taken off a freelist
+ * go back to their arena rather than to malloc.
+ */
+
+/** Size of each arena.  This is a multiple of every freelist chunk size, so
+ * that chunks never straddle an arena boundary. */
+#define CHUNK_ARENA_SIZE (2*1024*1024)
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+#define HAVE_CHUNK_ARENAS
+#endif
+
+/** A region of memory that we carve into chunks of a single size. */
+typedef struct chunk_arena_t {
+  struct chunk_arena_t *next; /**< Next arena for the same freelist. */
+  /** Next and previous arenas on the avail_arenas list of our freelist, if
+   * we have room for another chunk. */
+  struct chunk_arena_t *next_avail, *prev_avail;
+  char *mem; /**< Start of the mapped region. */
+  size_t n_chunks; /**< How many chunks fit in this arena? */
+  size_t n_carved; /**< How many chunks have we carved out of mem so far? */
+  size_t n_used; /**< How many carved chunks are not on <b>free_chunks</b>? */
+  chunk_t *free_chunks; /**< Carved chunks that are neither in a buffer nor
+                         * on a freelist. */
+} chunk_arena_t;
+
+/** Static array of freelists, sorted by alloc_size, terminated by an entry
+ * with alloc_size of 0. */
+static chunk_freelist_t freelists[] = {
+#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL, NULL, 0, NULL }
+  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
+  FL(65536, 16, 1),
+  FL(0, 0, 0)
+#undef FL
+};
+/** How many freelists are there?  Freelist <b>i</b> holds chunks of
+ * freelists[0].alloc_size << <b>i</b> bytes. */
+#define N_FREELISTS ((int)ARRAY_LENGTH(freelists) - 1)
+/** How many times have we allocated a chunk of a size that no freelist could
+ * help with? */
+static uint64_t n_freelist_miss = 0;
+/** True iff new freelist-sized chunks should come from arenas. */
+static int use_chunk_arenas = 0;
+
+/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
+ * no freelist exists for that size. */
+chunk_freelist_t *
+buf_get_freelist(size_t alloc)
+{
+  int idx;
+  /* The freelist sizes are consecutive powers of two. */
+  if (alloc < freelists[0].alloc_size || (alloc & (alloc - 1)))
+    return NULL;
+  idx = tor_log2(alloc) - tor_log2(freelists[0].alloc_size);
+  if (idx >= N_FREELISTS)
+    return NULL;
+  tor_assert(freelists[idx].alloc_size == alloc);
+  return &freelists[idx];
+}
+
+/** If <b>enable</b>, carve new chunks of the freelist sizes out of arenas
+ * that can be backed by huge pages; otherwise, allocate them with malloc.
+ * Chunks that already live in an arena stay there until they are freed.
+ * Return 0 on success, or -1 if this platform has no arena support. */
+int
+buf_set_chunk_arenas(int enable)
+{
+#ifdef HAVE_CHUNK_ARENAS
+  use_chunk_arenas = !!enable;
+  return 0;
+#else
+  use_chunk_arenas = 0;
+  return enable ? -1 : 0;
+#endif
+}
+
+#ifdef HAVE_CHUNK_ARENAS
+/** Put <b>arena</b> at the front of the avail_arenas list of <b>fl</b>. */
+static void
+chunk_arena_link_avail(chunk_freelist_t *fl, chunk_arena_t *arena)
+{
+  arena->prev_avail = NULL;
+  arena->next_avail = fl->avail_arenas;
+  if (fl->avail_arenas)
+    fl->avail_arenas->prev_avail = arena;
+  fl->avail_arenas = arena;
+}
+
+/** Take <b>arena</b> off the avail_arenas list of <b>fl</b>. */
+static void
+chunk_arena_unlink_avail(chunk_freelist_t *fl, chunk_arena_t *arena)
+{
+  if (arena->prev_avail)
+    arena->prev_avail->next_avail = arena->next_avail;
+  else
+    fl->avail_arenas = arena->next_avail;
+  if (arena->next_avail)
+    arena->next_avail->prev_avail = arena->prev_avail;
+  arena->next_avail = arena->prev_avail = NULL;
+}
+
+/** Map and return a new arena for chunks from <b>fl</b>, or NULL if we
+ * can't. */
+static chunk_arena_t *
+chunk_arena_new(chunk_freelist_t *fl)
+{
+  const size_t len = CHUNK_ARENA_SIZE;
+  char *region, *aligned;
+  size_t head;
+  chunk_arena_t *arena;
+
+  /* Huge pages need an aligned region, so map twice what we need and trim
+   * it. */
+  region = mmap(NULL, 2*len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                -1, 0);
+  if (region == MAP_FAILED)
+    return NULL;
+  aligned = (char *)(((uintptr_t)region + len - 1) & ~(uintptr_t)(len - 1));
+  head = aligned - region;
+  if (head)
+    munmap(region, head);
+  munmap(aligned + len, len - head);
+#ifdef MADV_HUGEPAGE
+  /* This is only advice: if transparent huge pages are disabled, we still
+   * get an arena of ordinary pages. */
+  (void) madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+
+  arena = tor_malloc_zero(sizeof(chunk_arena_t));
+  arena->mem = aligned;
+  arena->n_chunks = len / fl->alloc_size;
+  arena->next = fl->arenas;
+  fl->arenas = arena;
+  ++fl->n_arenas;
+  chunk_arena_link_avail(fl, arena);
+  return arena;
+}
+
+/** Take a chunk from one of the arenas of <b>fl</b>, mapping a new arena if
+ * they are all in use.  Return NULL if we can't map a new arena. */
+static chunk_t *
+chunk_arena_get(chunk_freelist_t *fl)
+{
+  chunk_arena_t *best = fl->avail_arenas;
+  chunk_t *ch;
+
+  /* The first arena with room was full (or new) most recently, so it is
+   * likely to be among the most used: filling it up gives the others a
+   * chance to become free and be unmapped. */
+  if (!best && !(best = chunk_arena_new(fl)))
+    return NULL;
+
+  if (best->free_chunks) {
+    ch = best->free_chunks;
+    best->free_chunks = ch->next;
+  } else {
+    tor_assert(best->n_carved < best->n_chunks);
+    ch = (chunk_t *)(best->mem + best->n_carved++ * fl->alloc_size);
+  }
+  if (++best->n_used == best->n_chunks)
+    chunk_arena_unlink_avail(fl, best);
+  ch->arena = best;
+  return ch;
+}
+
+/** Give <b>chunk</b>, which must belong to an arena of <b>fl</b>, back to
+ * its arena, and unmap the arena if all of its chunks are free. */
+static void
+chunk_arena_put(chunk_freelist_t *fl, chunk_t *chunk)
+{
+  chunk_arena_t *arena = chunk->arena, **ap;
+
+  tor_assert(arena->n_used > 0);
+  chunk->next = arena->free_chunks;
+  arena->free_chunks = chunk;
+  if (arena->n_used == arena->n_chunks)
+    chunk_arena_link_avail(fl, arena);
+  if (--arena->n_used)
+    return;
+
+  chunk_arena_unlink_avail(fl, arena);
+  for (ap = &fl->arenas; *ap != arena; ap = &(*ap)->next)
+    tor_assert(*ap);
+  *ap = arena->next;
+  --fl->n_arenas;
+  munmap(arena->mem, CHUNK_ARENA_SIZE);
+  tor_free(arena);
+}
+#endif /* defined(HAVE_CHUNK_ARENAS) */
+
+/** Give the memory of <b>chunk</b>, which is neither in a buffer nor on a
+ * freelist, back to wherever it came from. */
+static void
+chunk_release(chunk_freelist_t *fl, chunk_t *chunk)
+{
+  if (fl)
+    ++fl->n_free;
+#ifdef HAVE_CHUNK_ARENAS
+  if (chunk->arena) {
+    tor_assert(fl);
+    chunk_arena_put(fl, chunk);
+    return;
+  }
+#else
+  (void)fl;
+#endif /* defined(HAVE_CHUNK_ARENAS) */
+  tor_free(chunk);
+}
+
+/** Deallocate a chunk or put it on a freelist. */
 static void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  chunk_freelist_t *fl;
+  size_t alloc;
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
-  tor_free(chunk);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+  fl = buf_get_freelist(alloc);
+  if (fl && fl->cur_length < fl->max_length) {
+    chunk->next = fl->head;
+    fl->head = chunk;
+    ++fl->cur_length;
+  } else {
+    chunk_release(fl, chunk);
+  }
 }
+
+/** Allocate a new chunk with a given allocation size, or get one from the
+ * freelist.  Note that a chunk with allocation size A can actually hold only
+ * CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
-  chunk_t *ch;
-  ch = tor_malloc(alloc);
-  ch->next = NULL;
-  ch->datalen = 0;
+  chunk_t *ch = NULL;
+  chunk_freelist_t *fl = buf_get_freelist(alloc);
+  if (fl && fl->head) {
+    ch = fl->head;
+    fl->head = ch->next;
+    if (--fl->cur_length < fl->lowest_length)
+      fl->lowest_length = fl->cur_length;
+    ++fl->n_hit;
+  } else {
+    if (fl)
+      ++fl->n_alloc;
+    else
+      ++n_freelist_miss;
+#ifdef HAVE_CHUNK_ARENAS
+    if (fl && use_chunk_arenas)
+      ch = chunk_arena_get(fl);
+#endif
+    if (!ch) {
+      ch = tor_malloc(alloc);
+      ch->arena = NULL;
+    }
 #ifdef DEBUG_CHUNK_ALLOC
-  ch->DBG_alloc = alloc;
+    ch->DBG_alloc = alloc;
 #endif
-  ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
+  }
   total_bytes_allocated_in_chunks += alloc;
+  ch->next = NULL;
+  ch->datalen = 0;
+  ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   ch->data = &ch->mem[0];
   CHUNK_SET_SENTINEL(ch, alloc);
   return ch;
 }
 
+/** Remove from the freelists most chunks that have not been used since the
+ * last call to buf_shrink_freelists(), or all of them if <b>free_all</b>.
+ * Return the number of bytes taken off the freelists. */
+size_t
+buf_shrink_freelists(int free_all)
+{
+  int i;
+  size_t total_freed = 0;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *fl = &freelists[i];
+    int n_to_free = free_all ? fl->cur_length : fl->lowest_length - fl->slack;
+    int n_to_skip = fl->cur_length - n_to_free;
+    chunk_t **chp = &fl->head, *chunk;
+
+    if (n_to_free > 0) {
+      while (n_to_skip--) {
+        tor_assert(*chp);
+        chp = &(*chp)->next;
+      }
+      chunk = *chp;
+      *chp = NULL;
+      while (chunk) {
+        chunk_t *next = chunk->next;
+        chunk_release(fl, chunk);
+        chunk = next;
+      }
+      fl->cur_length -= n_to_free;
+      total_freed += (size_t)n_to_free * fl->alloc_size;
+    }
+    fl->lowest_length = fl->cur_length;
+  }
+  return total_freed;
+}
+
+/** Return the number of bytes held in chunks that are on freelists. */
+size_t
+buf_get_freelist_allocation(void)
+{
+  int i;
+  size_t total = 0;
+  for (i = 0; freelists[i].alloc_size; ++i)
+    total += (size_t)freelists[i].cur_length * freelists[i].alloc_size;
+  return total;
+}
+
+/** Return a newly allocated string describing the usage of each freelist,
+ * one line per chunk size. */
+char *
+buf_get_freelist_stats(void)
+{
+  int i;
+  char *result;
+  smartlist_t *lines = smartlist_new();
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    const chunk_freelist_t *fl = &freelists[i];
+    smartlist_add_asprintf(lines,
+               "chunk-size=%d cached=%d allocated=%"PRIu64" hits=%"PRIu64
+               " freed=%"PRIu64" arenas=%d",
+               (int)fl->alloc_size, fl->cur_length, fl->n_alloc, fl->n_hit,
+               fl->n_free, fl->n_arenas);
+  }
+  smartlist_add_asprintf(lines, "other-allocated=%"PRIu64, n_freelist_miss);
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log the usage of each freelist at log level <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    const chunk_freelist_t *fl = &freelists[i];
+    tor_log(severity, LD_MM,
+            "%"TOR_PRIuSZ" bytes in %d %d-byte chunks [%"PRIu64" misses; "
+            "%"PRIu64" frees; %"PRIu64" hits; %d arenas]",
+            (size_t)fl->cur_length * fl->alloc_size, fl->cur_length,
+            (int)fl->alloc_size, fl->n_alloc, fl->n_free, fl->n_hit,
+            fl->n_arenas);
+  }
+  tor_log(severity, LD_MM, "%"PRIu64" allocations in non-freelist sizes",
+          n_freelist_miss);
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -164,6 +513,18 @@ chunk_grow(chunk_t *chunk, size_t sz)
   const size_t new_alloc = CHUNK_ALLOC_SIZE(sz);
   tor_assert(sz > chunk->memlen);
   offset = chunk->data - chunk->mem;
+  if (chunk->arena || buf_get_freelist(new_alloc)) {
+    /* We can't realloc a chunk in an arena, and a chunk of a freelist size
+     * is cheapest to take from its freelist. */
+    chunk_t *newch = chunk_new_with_alloc_size(new_alloc);
+    memcpy(newch->mem, chunk->mem, offset + chunk->datalen);
+    newch->next = chunk->next;
+    newch->data = newch->mem + offset;
+    newch->datalen = chunk->datalen;
+    newch->inserted_time = chunk->inserted_time;
+    buf_chunk_free_unchecked(chunk);
+    return newch;
+  }
   chunk = tor_realloc(chunk, new_alloc);
   chunk->memlen = sz;
   chunk->data = chunk->mem + offset;
@@ -433,12 +794,11 @@ buf_free_(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
-  chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
-  total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
-#ifdef DEBUG_CHUNK_ALLOC
-  newch->DBG_alloc = CHUNK_ALLOC_SIZE(in_chunk->memlen);
-#endif
-  newch->next = NULL;
+  chunk_t *newch = chunk_new_with_alloc_size(
+                                       CHUNK_ALLOC_SIZE(in_chunk->memlen));
+  memcpy(newch->mem, in_chunk->mem, in_chunk->memlen);
+  newch->datalen = in_chunk->datalen;
+  newch->inserted_time = in_chunk->inserted_time;
   if (in_chunk->data) {
     off_t offset = in_chunk->data - in_chunk->mem;
     newch->data = newch->mem + offset;
@@ -496,6 +856,29 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   return chunk;
 }
 
+/** Remove and free all chunks of <b>buf</b> after <b>chunk</b>, which must
+ * all be empty, and make <b>chunk</b> the tail of <b>buf</b>.  If
+ * <b>chunk</b> is NULL, remove and free all chunks of <b>buf</b>, which must
+ * all be empty. */
+void
+buf_free_chunks_after(buf_t *buf, chunk_t *chunk)
+{
+  chunk_t *victim = chunk ? chunk->next : buf->head;
+
+  while (victim) {
+    chunk_t *next = victim->next;
+    tor_assert(victim->datalen == 0);
+    buf_chunk_free_unchecked(victim);
+    victim = next;
+  }
+  if (chunk)
+    chunk->next = NULL;
+  else
+    buf->head = NULL;
+  buf->tail = chunk;
+  check();
+}
+
 /** Return the age of the oldest chunk in the buffer <b>buf</b>, in
  * timestamp units.  Requires the current monotonic timestamp as its
  * input <b>now</b>.
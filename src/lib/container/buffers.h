@@ -36,6 +36,12 @@ size_t buf_slack(const buf_t *buf);
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
 
+size_t buf_shrink_freelists(int free_all);
+size_t buf_get_freelist_allocation(void);
+char *buf_get_freelist_stats(void);
+void buf_dump_freelist_sizes(int severity);
+int buf_set_chunk_arenas(int enable);
+
 int buf_add(buf_t *buf, const char *string, size_t string_len);
 void buf_add_string(buf_t *buf, const char *string);
 void buf_add_printf(buf_t *buf, const char *format, ...)
@@ -79,10 +85,36 @@ typedef struct chunk_t {
 #endif
   char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
   uint32_t inserted_time; /**< Timestamp when this chunk was inserted. */
+  struct chunk_arena_t *arena; /**< The arena holding this chunk, or NULL if
+                                * it was allocated with malloc. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
 } chunk_t;
 
+/** A freelist of chunks of a single allocation size. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks does this freelist hold? */
+  int max_length; /**< Never allow more than this number of chunks in the
+                   * freelist. */
+  int slack; /**< When trimming the freelist, leave this number of extra
+              * chunks beyond lowest_length.*/
+  int cur_length; /**< How many chunks on the freelist now? */
+  int lowest_length; /**< What's the smallest value of cur_length since the
+                      * last time we trimmed this freelist? */
+  uint64_t n_alloc; /**< How many chunks of this size did we allocate? */
+  uint64_t n_free; /**< How many chunks of this size did we free? */
+  uint64_t n_hit; /**< How many chunks did we take from the freelist? */
+  chunk_t *head; /**< First chunk on the freelist. */
+  struct chunk_arena_t *arenas; /**< Arenas holding chunks of this size. */
+  int n_arenas; /**< How many arenas are in <b>arenas</b>? */
+  struct chunk_arena_t *avail_arenas; /**< The arenas that have room for
+                                       * another chunk, the ones that were
+                                       * full or mapped most recently
+                                       * first. */
+} chunk_freelist_t;
+
+chunk_freelist_t *buf_get_freelist(size_t alloc);
+
 /** Magic value for buf_t.magic, to catch pointer errors. */
 #define BUFFER_MAGIC 0xB0FFF312u
 /** A resizeable buffer, optimized for reading and writing. */
@@ -97,6 +129,7 @@ struct buf_t {
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
+void buf_free_chunks_after(buf_t *buf, chunk_t *chunk);
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
 #define MIN_READ_LEN 8
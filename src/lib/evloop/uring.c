@@ -0,0 +1,524 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file uring.c
+ * \brief A small wrapper around the Linux io_uring interface.
+ *
+ * An io_uring is a pair of rings that we share with the kernel: we put
+ * requests (recv, sendmsg, ...) on the submission ring, tell the kernel
+ * about all of them with a single system call, and later find their results
+ * on the completion ring, without any further system calls.  The kernel can
+ * signal an eventfd whenever it adds a completion, so that a libevent loop
+ * can wait for completions along with its other events.
+ *
+ * We talk to the kernel directly rather than through liburing, since we
+ * only need a handful of operations.  On other systems, or when the kernel
+ * doesn't support io_uring, tor_uring_new() returns NULL.
+ **/
+
+#include "orconfig.h"
+#include "lib/evloop/uring.h"
+#include "lib/cc/compat_compiler.h"
+#include "lib/intmath/cmp.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H) && \
+  defined(HAVE_SYS_MMAN_H)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+/* IORING_FEAT_FAST_POLL came with the headers that have IORING_OP_RECV,
+ * which is an enum value. */
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_FAST_POLL)
+#define HAVE_TOR_URING
+#endif
+#endif /* defined(HAVE_LINUX_IO_URING_H) && ... */
+
+#ifdef HAVE_TOR_URING
+
+/** An io_uring instance, with the rings mapped into our memory. */
+struct tor_uring_t {
+  /** The file descriptor of the io_uring. */
+  int fd;
+  /** Mapping of the submission ring, and its length. */
+  void *sq_ring;
+  size_t sq_ring_len;
+  /** Mapping of the completion ring, and its length.  Same as
+   * <b>sq_ring</b> if the kernel maps both at once. */
+  void *cq_ring;
+  size_t cq_ring_len;
+  /** Mapping of the submission queue entries, and its length. */
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+
+  /** Pointers into the submission ring. */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  unsigned sq_entries;
+  /** Pointers into the completion ring. */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /** Our tail of the submission ring: entries before this are prepared,
+   * but the kernel only sees them once we call tor_uring_submit(). */
+  unsigned sqe_tail;
+  /** Number of prepared entries that we didn't submit yet. */
+  unsigned n_prepared;
+
+  /** Number of io_uring_enter() calls we made. */
+  uint64_t n_syscalls;
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** Return true iff the kernel behind <b>fd</b> supports all the operations
+ * we use. */
+static int
+uring_supports_our_ops(int fd)
+{
+  const int ops[] = { IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+                      IORING_OP_ASYNC_CANCEL };
+  const unsigned n_probe_ops = 256;
+  struct io_uring_probe *probe;
+  int ok = 1;
+  unsigned i;
+
+  probe = tor_malloc_zero(sizeof(*probe) +
+                          n_probe_ops * sizeof(struct io_uring_probe_op));
+  if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+                            n_probe_ops) < 0) {
+    ok = 0;
+  } else {
+    for (i = 0; i < ARRAY_LENGTH(ops); ++i) {
+      if (ops[i] > probe->last_op ||
+          !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        ok = 0;
+    }
+  }
+  tor_free(probe);
+  return ok;
+}
+
+/** Create a new io_uring with room for at least <b>n_entries</b> prepared
+ * requests.  Return NULL if this system doesn't support io_uring or some of
+ * the operations we need. */
+tor_uring_t *
+tor_uring_new(unsigned int n_entries)
+{
+  struct io_uring_params params;
+  tor_uring_t *ring = tor_malloc_zero(sizeof(tor_uring_t));
+  char *sq, *cq;
+
+  ring->fd = -1;
+  memset(&params, 0, sizeof(params));
+  ring->fd = sys_io_uring_setup(n_entries, &params);
+  if (ring->fd < 0) {
+    log_info(LD_NET, "Unable to set up an io_uring: %s", strerror(errno));
+    goto err;
+  }
+  if (!uring_supports_our_ops(ring->fd)) {
+    log_info(LD_NET, "The kernel's io_uring lacks operations we need.");
+    goto err;
+  }
+
+  ring->sq_ring_len = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_len = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_len > ring->sq_ring_len)
+      ring->sq_ring_len = ring->cq_ring_len;
+    ring->cq_ring_len = ring->sq_ring_len;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto err;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto err;
+    }
+  }
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto err;
+  }
+
+  sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_flags = (unsigned *)(sq + params.sq_off.flags);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  cq = ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return ring;
+ err:
+  tor_uring_free(ring);
+  return NULL;
+}
+
+/** Release all storage held by <b>ring</b>.  Requests that are still in
+ * flight are cancelled by the kernel. */
+void
+tor_uring_free_(tor_uring_t *ring)
+{
+  if (!ring)
+    return;
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_len);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_len);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  tor_free(ring);
+}
+
+/** Ask the kernel to signal the eventfd <b>fd</b> whenever it adds a
+ * completion to <b>ring</b>.  Return 0 on success, -1 on failure. */
+int
+tor_uring_set_eventfd(tor_uring_t *ring, int fd)
+{
+  tor_assert(ring);
+  return sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &fd, 1)
+    < 0 ? -1 : 0;
+}
+
+/** Return a cleared submission queue entry of <b>ring</b> to prepare a
+ * request in, submitting the prepared requests first if the ring is full.
+ * Return NULL on failure. */
+static struct io_uring_sqe *
+uring_get_sqe(tor_uring_t *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    if (tor_uring_submit(ring) < 0)
+      return NULL;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+      return NULL;
+  }
+  sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/** Make the entry we got from uring_get_sqe() part of the next submission.
+ */
+static void
+uring_commit_sqe(tor_uring_t *ring, struct io_uring_sqe *sqe,
+                 uint64_t user_data)
+{
+  unsigned idx = ring->sqe_tail & *ring->sq_mask;
+  sqe->user_data = user_data;
+  ring->sq_array[idx] = idx;
+  ++ring->sqe_tail;
+  ++ring->n_prepared;
+}
+
+/** Prepare a request to receive up to <b>len</b> bytes from <b>sock</b>
+ * into <b>buf</b>.  The kernel waits for data if there is none, even on a
+ * non-blocking socket.  Return 0 on success, -1 on failure. */
+int
+tor_uring_prep_recv(tor_uring_t *ring, tor_socket_t sock,
+                    void *buf, size_t len, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sock;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = (uint32_t) MIN(len, UINT32_MAX);
+  uring_commit_sqe(ring, sqe, user_data);
+  return 0;
+}
+
+/** Prepare a request to send <b>msg</b> on <b>sock</b>.  <b>msg</b>, its
+ * iovecs and their data must stay valid until the request completes.
+ * Return 0 on success, -1 on failure. */
+int
+tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t sock,
+                       const struct msghdr *msg, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = sock;
+  sqe->addr = (uintptr_t) msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  uring_commit_sqe(ring, sqe, user_data);
+  return 0;
+}
+
+/** Prepare a request that completes once <b>sock</b> has one of the poll()
+ * <b>events</b>.  Return 0 on success, -1 on failure. */
+int
+tor_uring_prep_poll(tor_uring_t *ring, tor_socket_t sock,
+                    short events, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = sock;
+#ifdef IORING_FEAT_POLL_32BITS
+  sqe->poll32_events = (uint16_t) events;
+#else
+  sqe->poll_events = (uint16_t) events;
+#endif
+  uring_commit_sqe(ring, sqe, user_data);
+  return 0;
+}
+
+/** Prepare a request to cancel the request with user data <b>target</b>, if
+ * it is still in flight.  Return 0 on success, -1 on failure. */
+int
+tor_uring_prep_cancel(tor_uring_t *ring, uint64_t target, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  uring_commit_sqe(ring, sqe, user_data);
+  return 0;
+}
+
+/** Return the number of requests on <b>ring</b> that we prepared but didn't
+ * submit yet. */
+unsigned int
+tor_uring_n_prepared(const tor_uring_t *ring)
+{
+  return ring->n_prepared;
+}
+
+/** Hand all prepared requests of <b>ring</b> to the kernel with a single
+ * system call.  Return the number of requests submitted, or -1 on
+ * failure. */
+int
+tor_uring_submit(tor_uring_t *ring)
+{
+  int r;
+  unsigned flags = 0;
+
+  tor_assert(ring);
+  if (!ring->n_prepared)
+    return 0;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  /* If completions overflowed, have the kernel move them to the ring. */
+  if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+      IORING_SQ_CQ_OVERFLOW)
+    flags |= IORING_ENTER_GETEVENTS;
+  do {
+    r = sys_io_uring_enter(ring->fd, ring->n_prepared, 0, flags);
+    ++ring->n_syscalls;
+  } while (r < 0 && errno == EINTR);
+  if (r < 0) {
+    log_warn(LD_NET, "Unable to submit io_uring requests: %s",
+             strerror(errno));
+    return -1;
+  }
+  ring->n_prepared -= MIN((unsigned) r, ring->n_prepared);
+  return r;
+}
+
+/** Submit the prepared requests of <b>ring</b>, and block until there is
+ * at least one completion.  Return 0 on success, -1 on failure. */
+int
+tor_uring_wait(tor_uring_t *ring)
+{
+  int r;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  do {
+    r = sys_io_uring_enter(ring->fd, ring->n_prepared, 1,
+                           IORING_ENTER_GETEVENTS);
+    ++ring->n_syscalls;
+  } while (r < 0 && errno == EINTR);
+  if (r < 0)
+    return -1;
+  ring->n_prepared -= MIN((unsigned) r, ring->n_prepared);
+  return 0;
+}
+
+/** If <b>ring</b> has a completion, take it off the ring, store its user
+ * data in *<b>user_data_out</b> and its result (a byte count, or a
+ * negative errno value) in *<b>result_out</b>, and return 1.  Else return
+ * 0. */
+int
+tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                         int *result_out)
+{
+  unsigned head = *ring->cq_head;
+  const struct io_uring_cqe *cqe;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+        IORING_SQ_CQ_OVERFLOW) {
+      /* The kernel kept some completions aside: fetch them. */
+      sys_io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+      ++ring->n_syscalls;
+      if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    } else {
+      return 0;
+    }
+  }
+  cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data_out = cqe->user_data;
+  *result_out = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/** Return the number of io_uring system calls that <b>ring</b> made. */
+uint64_t
+tor_uring_get_n_syscalls(const tor_uring_t *ring)
+{
+  return ring->n_syscalls;
+}
+
+#else /* !defined(HAVE_TOR_URING) */
+
+struct tor_uring_t {
+  int dummy;
+};
+
+tor_uring_t *
+tor_uring_new(unsigned int n_entries)
+{
+  (void) n_entries;
+  return NULL;
+}
+
+void
+tor_uring_free_(tor_uring_t *ring)
+{
+  tor_free(ring);
+}
+
+int
+tor_uring_set_eventfd(tor_uring_t *ring, int fd)
+{
+  (void) ring;
+  (void) fd;
+  return -1;
+}
+
+int
+tor_uring_prep_recv(tor_uring_t *ring, tor_socket_t sock,
+                    void *buf, size_t len, uint64_t user_data)
+{
+  (void) ring; (void) sock; (void) buf; (void) len; (void) user_data;
+  return -1;
+}
+
+int
+tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t sock,
+                       const struct msghdr *msg, uint64_t user_data)
+{
+  (void) ring; (void) sock; (void) msg; (void) user_data;
+  return -1;
+}
+
+int
+tor_uring_prep_poll(tor_uring_t *ring, tor_socket_t sock,
+                    short events, uint64_t user_data)
+{
+  (void) ring; (void) sock; (void) events; (void) user_data;
+  return -1;
+}
+
+int
+tor_uring_prep_cancel(tor_uring_t *ring, uint64_t target, uint64_t user_data)
+{
+  (void) ring; (void) target; (void) user_data;
+  return -1;
+}
+
+unsigned int
+tor_uring_n_prepared(const tor_uring_t *ring)
+{
+  (void) ring;
+  return 0;
+}
+
+int
+tor_uring_submit(tor_uring_t *ring)
+{
+  (void) ring;
+  return -1;
+}
+
+int
+tor_uring_wait(tor_uring_t *ring)
+{
+  (void) ring;
+  return -1;
+}
+
+int
+tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                         int *result_out)
+{
+  (void) ring; (void) user_data_out; (void) result_out;
+  return 0;
+}
+
+uint64_t
+tor_uring_get_n_syscalls(const tor_uring_t *ring)
+{
+  (void) ring;
+  return 0;
+}
+
+#endif /* defined(HAVE_TOR_URING) */
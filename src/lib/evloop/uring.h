@@ -0,0 +1,44 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file uring.h
+ * \brief Header for uring.c
+ **/
+
+#ifndef TOR_URING_H
+#define TOR_URING_H
+
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+#include "lib/net/nettypes.h"
+
+struct msghdr;
+
+typedef struct tor_uring_t tor_uring_t;
+
+tor_uring_t *tor_uring_new(unsigned int n_entries);
+void tor_uring_free_(tor_uring_t *ring);
+#define tor_uring_free(ring) \
+  FREE_AND_NULL(tor_uring_t, tor_uring_free_, (ring))
+
+int tor_uring_set_eventfd(tor_uring_t *ring, int fd);
+
+int tor_uring_prep_recv(tor_uring_t *ring, tor_socket_t sock,
+                        void *buf, size_t len, uint64_t user_data);
+int tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t sock,
+                           const struct msghdr *msg, uint64_t user_data);
+int tor_uring_prep_poll(tor_uring_t *ring, tor_socket_t sock,
+                        short events, uint64_t user_data);
+int tor_uring_prep_cancel(tor_uring_t *ring, uint64_t target,
+                          uint64_t user_data);
+
+unsigned int tor_uring_n_prepared(const tor_uring_t *ring);
+int tor_uring_submit(tor_uring_t *ring);
+int tor_uring_wait(tor_uring_t *ring);
+int tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                             int *result_out);
+
+uint64_t tor_uring_get_n_syscalls(const tor_uring_t *ring);
+
+#endif /* !defined(TOR_URING_H) */
@@ -9,18 +9,34 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
+ * threads, queues of pending work, and a reply queue.  Every piece of work
  * is a workqueue_entry_t, containing data to process and a function to
  * process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in compat_threads.c.
+ * Every worker thread has its own queue of pending work for each priority
+ * (a work_ring_t).  The main thread spreads new work over these queues.
+ * Each worker takes work from its own queues first, and when they are
+ * empty, it steals work from the queues of the other workers.  With working
+ * C11 atomics, none of this needs a lock, so the workers don't serialize on
+ * each other or on the main thread.  Work that doesn't fit into any of the
+ * queues goes to a shared overflow queue, which is protected by the pool's
+ * lock.
+ *
+ * Workers that find no work at all sleep on a condition variable, which the
+ * main thread signals when it queues work and some worker is asleep.  The
+ * workers inform the main process of completed work by using an
+ * alert_sockets_t object, as implemented in compat_threads.c.  To keep the
+ * number of wakeups down, each worker collects the replies of several work
+ * items and passes them on together.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
  *
- * In Tor today, there is currently only one thread pool, used in cpuworker.c.
+ * Each thread pool has its own workers, queues and locks, so pools don't
+ * contend with each other.  In Tor today, there are two of them: the one in
+ * cpuworker.c, for onion skins and consensus diffs, and the one in
+ * relayworker.c, for relay cell crypto (when RelayCryptoThreads is set),
+ * each with a reply queue of its own.
  */
 
 #include "orconfig.h"
@@ -47,24 +63,77 @@
 TOR_TAILQ_HEAD(work_tailq_t, workqueue_entry_s);
 typedef struct work_tailq_t work_tailq_t;
 
+/** Number of entries that fit into a work_ring_t. */
+#define WORK_RING_SIZE 256
+
+/** Largest number of replies that a worker collects before it passes them
+ * on to the main thread. */
+#define REPLY_BATCH_SIZE 8
+
+/** A bounded FIFO queue of pending work for one worker thread at one
+ * priority.
+ *
+ * Only the main thread adds entries, at the tail.  The worker that owns the
+ * ring takes entries from the head, and so do the other workers when they
+ * run out of work of their own.  With working C11 atomics, adding an entry
+ * is a store to <b>tail</b>, and taking one is a compare-and-swap on
+ * <b>head</b>; otherwise, a mutex protects the ring.
+ */
+typedef struct work_ring_t {
+#ifdef HAVE_WORKING_STDATOMIC
+  /** Index of the oldest entry in the ring.  Never decreases. */
+  atomic_size_t head;
+  /** One more than the index of the newest entry in the ring.  Never
+   * decreases. */
+  atomic_size_t tail;
+  /** The workqueue_entry_t with index <b>i</b> is slots[i % WORK_RING_SIZE].
+   */
+  atomic_uintptr_t slots[WORK_RING_SIZE];
+#else /* !(defined(HAVE_WORKING_STDATOMIC)) */
+  /** Mutex to protect all the other fields. */
+  tor_mutex_t lock;
+  size_t head;
+  size_t tail;
+  workqueue_entry_t *slots[WORK_RING_SIZE];
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+} work_ring_t;
+
 struct threadpool_s {
-  /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+  /** An array of pointers to workerthread_t: one for each worker thread.
+   * This array doesn't change once the threads are running. */
   struct workerthread_s **threads;
 
   /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
+   * gets signaled when we queue work while some worker is asleep. */
   tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
-
-  /** Weak RNG, used to decide when to ignore priority. */
-  tor_weak_rng_t weak_rng;
+  /** Queues of pending work that didn't fit into the rings of the worker
+   * threads. The queue with priority <b>p</b> is overflow[p]. */
+  work_tailq_t overflow[WORKQUEUE_N_PRIORITIES];
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
+   * at an earlier generation needs to run the update function.  Only
+   * changed with <b>lock</b> held. */
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_uint generation;
+#else
   unsigned generation;
+#endif
+
+  /** Number of worker threads that are waiting on <b>condition</b>.  Only
+   * changed with <b>lock</b> held. */
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_int n_sleeping;
+#else
+  int n_sleeping;
+#endif
+
+  /** Number of entries in each of the <b>overflow</b> queues.  Only
+   * changed with <b>lock</b> held. */
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_int n_overflow[WORKQUEUE_N_PRIORITIES];
+#else
+  int n_overflow[WORKQUEUE_N_PRIORITIES];
+#endif
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -78,9 +147,22 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect all the above fields, except where noted. */
   tor_mutex_t lock;
 
+  /** Mutex that serializes the threads that queue work, so that each
+   * work_ring_t has only one thread adding entries at a time.  The workers
+   * never take it. */
+  tor_mutex_t submit_lock;
+  /** Index of the thread that gets the next work we queue.  Protected by
+   * <b>submit_lock</b>. */
+  int next_thread;
+
+#ifndef HAVE_WORKING_STDATOMIC
+  /** Mutex to protect the <b>pending</b> fields of our entries. */
+  tor_mutex_t pending_lock;
+#endif
+
   /** A reply queue to use when constructing new threads. */
   replyqueue_t *reply_queue;
 
@@ -96,15 +178,24 @@ struct threadpool_s {
 #define WORKQUEUE_PRIORITY_BITS 2
 
 struct workqueue_entry_s {
-  /** The next workqueue_entry_t that's pending on the same thread or
-   * reply queue. */
+  /** The next workqueue_entry_t that's pending on the same overflow queue,
+   * reply batch, or reply queue. */
   TOR_TAILQ_ENTRY(workqueue_entry_s) next_work;
   /** The threadpool to which this workqueue_entry_t was assigned. This field
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
-  uint8_t pending;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Whoever clears it, a worker or workqueue_entry_cancel(), owns the
+   * entry. */
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_int pending;
+#else
+  int pending;
+#endif
+  /** True iff this entry is on an overflow queue of <b>on_pool</b>.
+   * Protected by the lock of <b>on_pool</b>. */
+  uint8_t in_overflow;
   /** Priority of this entry. */
   workqueue_priority_bitfield_t priority : WORKQUEUE_PRIORITY_BITS;
   /** Function to run in the worker thread. */
@@ -140,10 +231,18 @@ typedef struct workerthread_s {
   unsigned generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+  /** Weak RNG, used to decide when to ignore priority. */
+  tor_weak_rng_t weak_rng;
+  /** Our queues of pending work.  The queue with priority <b>p</b> is
+   * rings[p]. */
+  work_ring_t rings[WORKQUEUE_N_PRIORITIES];
+  /** Work that we have finished, but not passed on to <b>reply_queue</b>
+   * yet. */
+  work_tailq_t replies;
+  /** Number of entries in <b>replies</b>. */
+  int n_replies;
 } workerthread_t;
 
-static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
-
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
  * thread. See threadpool_queue_work() for full documentation. */
@@ -176,6 +275,23 @@ workqueue_entry_free_(workqueue_entry_t *ent)
   tor_free(ent);
 }
 
+/** Clear the <b>pending</b> flag of <b>ent</b>. Return true iff it was set,
+ * that is, iff the caller now owns <b>ent</b>. */
+static int
+workqueue_entry_claim(workqueue_entry_t *ent)
+{
+#ifdef HAVE_WORKING_STDATOMIC
+  return atomic_exchange(&ent->pending, 0) != 0;
+#else
+  int was_pending;
+  tor_mutex_acquire(&ent->on_pool->pending_lock);
+  was_pending = ent->pending;
+  ent->pending = 0;
+  tor_mutex_release(&ent->on_pool->pending_lock);
+  return was_pending;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+}
+
 /**
  * Cancel a workqueue_entry_t that has been returned from
  * threadpool_queue_work.
@@ -193,55 +309,232 @@ workqueue_entry_free_(workqueue_entry_t *ent)
 void *
 workqueue_entry_cancel(workqueue_entry_t *ent)
 {
-  int cancelled = 0;
-  void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
-  workqueue_priority_t prio = ent->priority;
-  if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
-    cancelled = 1;
-    result = ent->arg;
+  threadpool_t *pool = ent->on_pool;
+  void *result = ent->arg;
+  int cancelled, in_overflow;
+
+  tor_mutex_acquire(&pool->lock);
+  in_overflow = ent->in_overflow;
+  cancelled = workqueue_entry_claim(ent);
+  if (cancelled && in_overflow) {
+    TOR_TAILQ_REMOVE(&pool->overflow[ent->priority], ent, next_work);
+    --pool->n_overflow[ent->priority];
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&pool->lock);
+
+  if (!cancelled)
+    return NULL;
 
-  if (cancelled) {
+  /* If the entry is on a work ring, we must not touch it any more: the
+   * worker that takes it from there notices that it was cancelled, and
+   * frees it. */
+  if (in_overflow)
     workqueue_entry_free(ent);
-  }
   return result;
 }
 
-/**DOCDOC
+/** Add <b>ent</b> to the tail of <b>ring</b>. Return 0 on success, or -1 if
+ * the ring is full.  Only one thread at a time may call this function on a
+ * given ring. */
+static int
+work_ring_push(work_ring_t *ring, workqueue_entry_t *ent)
+{
+#ifdef HAVE_WORKING_STDATOMIC
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head >= WORK_RING_SIZE)
+    return -1;
+  atomic_store_explicit(&ring->slots[tail % WORK_RING_SIZE],
+                        (uintptr_t)ent, memory_order_relaxed);
+  /* This publishes the entry.  It is sequentially consistent so that it is
+   * ordered with our check for sleeping workers in
+   * threadpool_queue_work_priority(). */
+  atomic_store(&ring->tail, tail + 1);
+  return 0;
+#else /* !(defined(HAVE_WORKING_STDATOMIC)) */
+  int r = -1;
+  tor_mutex_acquire(&ring->lock);
+  if (ring->tail - ring->head < WORK_RING_SIZE) {
+    ring->slots[ring->tail++ % WORK_RING_SIZE] = ent;
+    r = 0;
+  }
+  tor_mutex_release(&ring->lock);
+  return r;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+}
 
-   must hold lock */
+/** Remove and return the entry at the head of <b>ring</b>, or return NULL if
+ * the ring is empty.  Any thread may call this function. */
+static workqueue_entry_t *
+work_ring_take(work_ring_t *ring)
+{
+#ifdef HAVE_WORKING_STDATOMIC
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  while (1) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uintptr_t ent;
+    if (head == tail)
+      return NULL;
+    /* If another thread takes this entry first, the main thread may reuse
+     * its slot before we get to the compare-and-swap; but then <b>head</b>
+     * has moved on, so the compare-and-swap fails, and we try again. */
+    ent = atomic_load_explicit(&ring->slots[head % WORK_RING_SIZE],
+                               memory_order_relaxed);
+    if (atomic_compare_exchange_weak_explicit(&ring->head, &head, head + 1,
+                                              memory_order_acq_rel,
+                                              memory_order_acquire))
+      return (workqueue_entry_t *)ent;
+  }
+#else /* !(defined(HAVE_WORKING_STDATOMIC)) */
+  workqueue_entry_t *ent = NULL;
+  tor_mutex_acquire(&ring->lock);
+  if (ring->head != ring->tail)
+    ent = ring->slots[ring->head++ % WORK_RING_SIZE];
+  tor_mutex_release(&ring->lock);
+  return ent;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+}
+
+/** Return true iff <b>ring</b> is empty. */
+static int
+work_ring_is_empty(work_ring_t *ring)
+{
+#ifdef HAVE_WORKING_STDATOMIC
+  /* Sequentially consistent, for the benefit of worker_thread_has_work(). */
+  return atomic_load(&ring->head) == atomic_load(&ring->tail);
+#else
+  int empty;
+  tor_mutex_acquire(&ring->lock);
+  empty = ring->head == ring->tail;
+  tor_mutex_release(&ring->lock);
+  return empty;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+}
+
+/** Return true iff <b>pool</b> has any work with priority <b>prio</b> on
+ * its overflow queue.  The caller must not hold the lock of <b>pool</b>. */
+static int
+threadpool_has_overflow(threadpool_t *pool, int prio)
+{
+#ifdef HAVE_WORKING_STDATOMIC
+  return atomic_load(&pool->n_overflow[prio]) > 0;
+#else
+  int n;
+  tor_mutex_acquire(&pool->lock);
+  n = pool->n_overflow[prio];
+  tor_mutex_release(&pool->lock);
+  return n > 0;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+}
+
+/** Return the current update generation of <b>pool</b>. The caller must not
+ * hold the lock of <b>pool</b>. */
+static unsigned
+threadpool_get_generation(threadpool_t *pool)
+{
+#ifdef HAVE_WORKING_STDATOMIC
+  return atomic_load(&pool->generation);
+#else
+  unsigned generation;
+  tor_mutex_acquire(&pool->lock);
+  generation = pool->generation;
+  tor_mutex_release(&pool->lock);
+  return generation;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+}
+
+/** Return true iff any worker of <b>thread</b>'s pool, or its overflow
+ * queue, has work with priority <b>prio</b>.  The caller must hold the lock
+ * of the pool iff <b>locked</b> is true. */
+static int
+worker_thread_has_work_at(workerthread_t *thread, int prio, int locked)
+{
+  threadpool_t *pool = thread->in_pool;
+  int i;
+
+  for (i = 0; i < pool->n_threads; ++i) {
+    if (!work_ring_is_empty(&pool->threads[i]->rings[prio]))
+      return 1;
+  }
+  if (locked)
+    return !TOR_TAILQ_EMPTY(&pool->overflow[prio]);
+  return threadpool_has_overflow(pool, prio);
+}
+
+/** Return true iff <b>thread</b> has anything to do: either work that it
+ * can take, or an update to run.
+ *
+ * The caller must hold the lock of the pool. */
 static int
 worker_thread_has_work(workerthread_t *thread)
 {
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
-        return 1;
+    if (worker_thread_has_work_at(thread, i, 1))
+      return 1;
   }
   return thread->generation != thread->in_pool->generation;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
- *
- * The caller must hold the lock. */
+/** Take the next work with priority <b>prio</b> for <b>thread</b>: from its
+ * own ring if it can, else from the rings of the other workers, else from
+ * the overflow queue.  Free any cancelled entries that we come across.
+ * Return NULL if there is no such work. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_take_work_at(workerthread_t *thread, int prio)
 {
   threadpool_t *pool = thread->in_pool;
-  work_tailq_t *queue = NULL, *this_queue;
+  workqueue_entry_t *work;
+  int i, claimed;
+
+  /* We start looking at our own ring, and continue with our neighbours, so
+   * that the workers that steal work don't all go for the same ring. */
+  for (i = 0; i < pool->n_threads; ++i) {
+    workerthread_t *victim =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    while ((work = work_ring_take(&victim->rings[prio]))) {
+      if (workqueue_entry_claim(work))
+        return work;
+      /* workqueue_entry_cancel() left it to us. */
+      workqueue_entry_free(work);
+    }
+  }
+
+  if (!threadpool_has_overflow(pool, prio))
+    return NULL;
+
+  tor_mutex_acquire(&pool->lock);
+  work = TOR_TAILQ_FIRST(&pool->overflow[prio]);
+  if (work) {
+    TOR_TAILQ_REMOVE(&pool->overflow[prio], work, next_work);
+    work->in_overflow = 0;
+    --pool->n_overflow[prio];
+    /* workqueue_entry_cancel() removes the entries that it cancels from the
+     * overflow queue, so this one is still pending. */
+    claimed = workqueue_entry_claim(work);
+    tor_assert(claimed);
+  }
+  tor_mutex_release(&pool->lock);
+  return work;
+}
+
+/** Extract the next workqueue_entry_t for <b>thread</b>, removing it from
+ * the relevant queue and marking it as non-pending.  Return NULL if there is
+ * no work. */
+static workqueue_entry_t *
+worker_thread_extract_next_work(workerthread_t *thread)
+{
+  workqueue_entry_t *work = NULL;
+  int prio = -1;
   unsigned i;
+
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
-    if (!TOR_TAILQ_EMPTY(this_queue)) {
-      queue = this_queue;
-      if (! tor_weak_random_one_in_n(&pool->weak_rng,
+    if (worker_thread_has_work_at(thread, i, 0)) {
+      prio = i;
+      if (! tor_weak_random_one_in_n(&thread->weak_rng,
                                      thread->lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
-         * and use the queue where we found work. But with a small
+         * and use the priority where we found work. But with a small
          * probability, we'll keep looking for lower priority work, so that
          * we don't ignore our low-priority queues entirely. */
         break;
@@ -249,15 +542,65 @@ worker_thread_extract_next_work(workerthread_t *thread)
     }
   }
 
-  if (queue == NULL)
-    return NULL;
+  if (prio >= 0)
+    work = worker_thread_take_work_at(thread, prio);
 
-  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
-  TOR_TAILQ_REMOVE(queue, work, next_work);
-  work->pending = 0;
+  /* Another worker may have taken that work first; then we take whatever
+   * is left. */
+  for (i = WORKQUEUE_PRIORITY_FIRST; !work && i <= WORKQUEUE_PRIORITY_LAST;
+       ++i) {
+    work = worker_thread_take_work_at(thread, i);
+  }
   return work;
 }
 
+/** Pass the replies that <b>thread</b> has collected on to its reply queue,
+ * and wake up the main thread if it isn't busy with that queue already. */
+static void
+worker_thread_flush_replies(workerthread_t *thread)
+{
+  replyqueue_t *queue = thread->reply_queue;
+  workqueue_entry_t *work;
+  int was_empty;
+
+  if (!thread->n_replies)
+    return;
+
+  tor_mutex_acquire(&queue->lock);
+  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
+  while ((work = TOR_TAILQ_FIRST(&thread->replies))) {
+    TOR_TAILQ_REMOVE(&thread->replies, work, next_work);
+    TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  }
+  tor_mutex_release(&queue->lock);
+  thread->n_replies = 0;
+
+  if (was_empty) {
+    if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
+      /* XXXX complain! */
+    }
+  }
+}
+
+/** Run the latest update of <b>thread</b>'s pool in <b>thread</b>, and
+ * return what the update function returned. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_reply_t (*update_fn)(void*,void*);
+  void *arg;
+
+  tor_mutex_acquire(&pool->lock);
+  arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  update_fn = pool->update_fn;
+  thread->generation = pool->generation;
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -266,99 +609,94 @@ worker_thread_main(void *thread_)
 {
   workerthread_t *thread = thread_;
   threadpool_t *pool = thread->in_pool;
-  workqueue_entry_t *work;
+  workqueue_entry_t *work = NULL;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
+    /* If we already claimed some work, nobody else can run it, so we finish
+     * it before we run the update (which may tell us to exit). */
+    if (!work && threadpool_get_generation(pool) != thread->generation) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY) {
+        worker_thread_flush_replies(thread);
+        return;
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
+      continue;
+    }
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
+    if (!work)
+      work = worker_thread_extract_next_work(thread);
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+    if (!work) {
+      /* TODO: support an idle-function */
 
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
-        return;
-      }
+      /* Okay. Now, wait till somebody has work for us. */
       tor_mutex_acquire(&pool->lock);
+      ++pool->n_sleeping;
+      /* The main thread checks for sleeping workers after it queues work,
+       * and we check for work after we count ourselves as sleeping, so one
+       * of us notices the other. */
+      if (!worker_thread_has_work(thread)) {
+        if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
+          log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+        }
+      }
+      --pool->n_sleeping;
+      tor_mutex_release(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    /* We run the work function without holding any lock. */
+    result = work->fn(thread->state, work->arg);
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
-    }
-  }
-}
+    /* Queue the reply for the main thread. */
+    TOR_TAILQ_INSERT_TAIL(&thread->replies, work, next_work);
+    ++thread->n_replies;
 
-/** Put a reply on the reply queue.  The reply must not currently be on
- * any thread's work queue. */
-static void
-queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
-{
-  int was_empty;
-  tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
-  tor_mutex_release(&queue->lock);
-
-  if (was_empty) {
-    if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
-      /* XXXX complain! */
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      worker_thread_flush_replies(thread);
+      return;
     }
+
+    /* We hold on to our replies while we have more urgent work, but not
+     * when we are about to run lower-priority work, which may take a
+     * while.  We don't take more work while an update is waiting. */
+    if (threadpool_get_generation(pool) == thread->generation)
+      work = worker_thread_extract_next_work(thread);
+    else
+      work = NULL;
+    if (!work || thread->n_replies >= REPLY_BATCH_SIZE ||
+        work->priority != WQ_PRI_HIGH)
+      worker_thread_flush_replies(thread);
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>. Don't start it yet. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned seed, i;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
-
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    //LCOV_EXCL_START
-    tor_assert_nonfatal_unreached();
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
-    //LCOV_EXCL_STOP
+  crypto_rand((void*)&seed, sizeof(seed));
+  tor_init_weak_random(&thr->weak_rng, seed);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+#ifdef HAVE_WORKING_STDATOMIC
+    unsigned j;
+    atomic_init(&thr->rings[i].head, 0);
+    atomic_init(&thr->rings[i].tail, 0);
+    for (j = 0; j < WORK_RING_SIZE; ++j)
+      atomic_init(&thr->rings[i].slots[j], 0);
+#else
+    tor_mutex_init_nonrecursive(&thr->rings[i].lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
   }
+  TOR_TAILQ_INIT(&thr->replies);
 
   return thr;
 }
@@ -392,6 +730,8 @@ threadpool_queue_work_priority(threadpool_t *pool,
                                void (*reply_fn)(void *),
                                void *arg)
 {
+  int i, queued = 0;
+
   tor_assert(((int)prio) >= WORKQUEUE_PRIORITY_FIRST &&
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
@@ -400,12 +740,33 @@ threadpool_queue_work_priority(threadpool_t *pool,
   ent->pending = 1;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
+  /* Spread the work over the rings of the workers, skipping full ones. */
+  tor_mutex_acquire(&pool->submit_lock);
+  for (i = 0; i < pool->n_threads && !queued; ++i) {
+    workerthread_t *thr = pool->threads[pool->next_thread];
+    pool->next_thread = (pool->next_thread + 1) % pool->n_threads;
+    queued = (work_ring_push(&thr->rings[prio], ent) == 0);
+  }
+  tor_mutex_release(&pool->submit_lock);
+
+  if (!queued) {
+    tor_mutex_acquire(&pool->lock);
+    TOR_TAILQ_INSERT_TAIL(&pool->overflow[prio], ent, next_work);
+    ent->in_overflow = 1;
+    ++pool->n_overflow[prio];
+    tor_mutex_release(&pool->lock);
+  }
 
-  tor_cond_signal_one(&pool->condition);
+#ifdef HAVE_WORKING_STDATOMIC
+  /* Usually, all the workers are awake while we have work for them, and we
+   * don't need the lock at all. */
+  if (atomic_load(&pool->n_sleeping) == 0)
+    return ent;
+#endif
 
+  tor_mutex_acquire(&pool->lock);
+  if (pool->n_sleeping)
+    tor_cond_signal_one(&pool->condition);
   tor_mutex_release(&pool->lock);
 
   return ent;
@@ -492,43 +853,46 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Create <b>n</b> worker threads for <b>pool</b>, which must not have any
+ * yet, and start them.  The workers steal work from each other, so we
+ * set up all of them before we start any. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
+  int i;
+
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
+  if (BUG(pool->n_threads))
+    return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
-  tor_mutex_acquire(&pool->lock);
-
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
 
-  while (pool->n_threads < n) {
+  for (i = 0; i < n; ++i) {
     /* For half of our threads, we'll choose lower priorities permissively;
      * for the other half, we'll stick more strictly to higher priorities.
      * This keeps slow low-priority tasks from taking over completely. */
-    int32_t chance = (pool->n_threads & 1) ? CHANCE_STRICT : CHANCE_PERMISSIVE;
+    int32_t chance = (i & 1) ? CHANCE_STRICT : CHANCE_PERMISSIVE;
 
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = i;
+    pool->threads[i] = thr;
+  }
+  pool->n_threads = n;
 
-    if (!thr) {
+  for (i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
-      tor_mutex_release(&pool->lock);
+      log_err(LD_GENERAL, "Can't launch worker thread.");
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
-  tor_mutex_release(&pool->lock);
 
   return 0;
 }
@@ -550,15 +914,14 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
+  tor_mutex_init_nonrecursive(&pool->submit_lock);
+#ifndef HAVE_WORKING_STDATOMIC
+  tor_mutex_init_nonrecursive(&pool->pending_lock);
+#endif
   tor_cond_init(&pool->condition);
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
-  {
-    unsigned seed;
-    crypto_rand((void*)&seed, sizeof(seed));
-    tor_init_weak_random(&pool->weak_rng, seed);
+    TOR_TAILQ_INIT(&pool->overflow[i]);
   }
 
   pool->new_thread_state_fn = new_thread_state_fn;
@@ -568,10 +931,8 @@ threadpool_new(int n_threads,
 
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
+    /* Some of the threads may be running, so we can't free the pool. */
     tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
-    tor_mutex_uninit(&pool->lock);
-    tor_free(pool);
     return NULL;
     //LCOV_EXCL_STOP
   }
@@ -654,6 +1015,9 @@ threadpool_register_reply_event(threadpool_t *tp,
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  work_tailq_t batch;
+  workqueue_entry_t *work;
+
   int r = queue->alert.drain_fn(queue->alert.read_fd);
   if (r < 0) {
     //LCOV_EXCL_START
@@ -664,16 +1028,25 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+  TOR_TAILQ_INIT(&batch);
+
   tor_mutex_acquire(&queue->lock);
   while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
+    /* lock must be held at this point.  We take all the answers at once, so
+     * that the workers can add more while we handle these. */
+    while ((work = TOR_TAILQ_FIRST(&queue->answers))) {
+      TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
+      TOR_TAILQ_INSERT_TAIL(&batch, work, next_work);
+    }
     tor_mutex_release(&queue->lock);
-    work->on_pool = NULL;
 
-    work->reply_fn(work->arg);
-    workqueue_entry_free(work);
+    while ((work = TOR_TAILQ_FIRST(&batch))) {
+      TOR_TAILQ_REMOVE(&batch, work, next_work);
+      work->on_pool = NULL;
+
+      work->reply_fn(work->arg);
+      workqueue_entry_free(work);
+    }
 
     tor_mutex_acquire(&queue->lock);
   }
@@ -13,9 +13,12 @@
  * statistical functions, which collect statistics about different kinds of
  * per-country usage.
  *
- * The geoip lookup tables are implemented as sorted lists of disjoint address
- * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * The geoip files are parsed into sorted lists of disjoint address ranges,
+ * each mapping to a singleton geoip_country_t.  These country objects are
+ * also indexed by their names in a hashtable.  Once a whole file has been
+ * loaded, its ranges are flattened into a lookup table (see
+ * geoip_ipv4_table_t) that answers most queries with one or two memory
+ * accesses, and the range list is freed.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
  * function.  For more information on the file format they read, see that
@@ -29,6 +32,7 @@
 
 #define GEOIP_PRIVATE
 #include "lib/geoip/geoip.h"
+#include "lib/arch/bytes.h"
 #include "lib/container/map.h"
 #include "lib/container/order.h"
 #include "lib/container/smartlist.h"
@@ -64,6 +68,55 @@ typedef struct geoip_ipv6_entry_t {
   intptr_t country; /**< An index into geoip_countries */
 } geoip_ipv6_entry_t;
 
+/** How many of the high bits of an address we use to index a lookup
+ * table. */
+#define GEOIP_INDEX_BITS 16
+/** How many slots there are in the index of a lookup table. */
+#define GEOIP_INDEX_LEN (1<<GEOIP_INDEX_BITS)
+
+/** A lookup table for IPv4 addresses.  The whole address space is split into
+ * segments, sorted by their first address, with each segment mapping to a
+ * single country (0 for addresses that no range covers).  Adjacent segments
+ * map to different countries.  To find an address, we look up the segments
+ * that overlap its /16 in <b>index</b>, and search only those. */
+typedef struct geoip_ipv4_table_t {
+  /** For each /16, the index of the segment that holds its first address.
+   * The extra final slot holds the index of the last segment. */
+  uint32_t index[GEOIP_INDEX_LEN + 1];
+  /** The number of segments. */
+  int n_segments;
+  /** The first address of each segment, in host order. */
+  uint32_t *segment_start;
+  /** The country of each segment. */
+  country_t *segment_country;
+} geoip_ipv4_table_t;
+
+/** An IPv6 address as a pair of integers, for comparing quickly. */
+typedef struct geoip_ipv6_key_t {
+  uint64_t hi; /**< The high 64 bits, in host order. */
+  uint64_t lo; /**< The low 64 bits, in host order. */
+} geoip_ipv6_key_t;
+
+/** A lookup table for IPv6 addresses.  As geoip_ipv4_table_t, but indexed
+ * by the high 16 bits of the address. */
+typedef struct geoip_ipv6_table_t {
+  /** As geoip_ipv4_table_t.index. */
+  uint32_t index[GEOIP_INDEX_LEN + 1];
+  /** The number of segments. */
+  int n_segments;
+  /** The first address of each segment. */
+  geoip_ipv6_key_t *segment_start;
+  /** The country of each segment. */
+  country_t *segment_country;
+} geoip_ipv6_table_t;
+
+static void geoip_ipv4_table_free_(geoip_ipv4_table_t *table);
+#define geoip_ipv4_table_free(t) \
+  FREE_AND_NULL(geoip_ipv4_table_t, geoip_ipv4_table_free_, (t))
+static void geoip_ipv6_table_free_(geoip_ipv6_table_t *table);
+#define geoip_ipv6_table_free(t) \
+  FREE_AND_NULL(geoip_ipv6_table_t, geoip_ipv6_table_free_, (t))
+
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
 /** A map from lowercased country codes to their position in geoip_countries.
@@ -73,6 +126,11 @@ static strmap_t *country_idxplus1_by_lc_code = NULL;
 /** Lists of all known geoip_ipv4_entry_t and geoip_ipv6_entry_t, sorted
  * by their respective ip_low. */
 static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
+/** Lookup tables built from the last IPv4 and IPv6 files we loaded.  While
+ * we are loading a file (or when entries are added some other way), these
+ * are NULL, and we search the entry lists instead. */
+static geoip_ipv4_table_t *geoip_ipv4_table = NULL;
+static geoip_ipv6_table_t *geoip_ipv6_table = NULL;
 
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
@@ -162,10 +220,14 @@ geoip_parse_entry(const char *line, sa_family_t family)
 
   if (!geoip_countries)
     init_geoip_countries();
+  /* Any table we built from an earlier file no longer describes the
+   * entries. */
   if (family == AF_INET) {
+    geoip_ipv4_table_free(geoip_ipv4_table);
     if (!geoip_ipv4_entries)
       geoip_ipv4_entries = smartlist_new();
   } else if (family == AF_INET6) {
+    geoip_ipv6_table_free(geoip_ipv6_table);
     if (!geoip_ipv6_entries)
       geoip_ipv6_entries = smartlist_new();
   } else {
@@ -278,6 +340,186 @@ geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
     return 0;
 }
 
+/** Release all storage held by the IPv4 lookup table <b>table</b>. */
+static void
+geoip_ipv4_table_free_(geoip_ipv4_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->segment_start);
+  tor_free(table->segment_country);
+  tor_free(table);
+}
+
+/** Release all storage held by the IPv6 lookup table <b>table</b>. */
+static void
+geoip_ipv6_table_free_(geoip_ipv6_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->segment_start);
+  tor_free(table->segment_country);
+  tor_free(table);
+}
+
+/** Return an IPv4 lookup table for the sorted list <b>entries</b> of
+ * geoip_ipv4_entry_t. */
+static geoip_ipv4_table_t *
+geoip_ipv4_table_new(const smartlist_t *entries)
+{
+  geoip_ipv4_table_t *table = tor_malloc_zero(sizeof(geoip_ipv4_table_t));
+  /* Every entry adds at most one segment, plus one for the gap before it,
+   * and there may be a gap at the end. */
+  const int max_segments = 2 * smartlist_len(entries) + 1;
+  uint64_t next = 0; /* The lowest address not yet in a segment. */
+  int n = 0, i, p;
+
+  table->segment_start = tor_calloc(max_segments, sizeof(uint32_t));
+  table->segment_country = tor_calloc(max_segments, sizeof(country_t));
+
+#define ADD_SEGMENT(start, country) STMT_BEGIN                          \
+    if (n == 0 || table->segment_country[n-1] != (country)) {           \
+      table->segment_start[n] = (start);                                \
+      table->segment_country[n] = (country);                            \
+      ++n;                                                              \
+    }                                                                   \
+  STMT_END
+  SMARTLIST_FOREACH_BEGIN(entries, const geoip_ipv4_entry_t *, ent) {
+    if (ent->ip_high < next)
+      continue; /* Overlaps ranges we already have. */
+    if (ent->ip_low > next)
+      ADD_SEGMENT((uint32_t)next, 0);
+    ADD_SEGMENT((uint32_t)MAX(next, ent->ip_low), (country_t)ent->country);
+    next = (uint64_t)ent->ip_high + 1;
+  } SMARTLIST_FOREACH_END(ent);
+  if (next <= UINT32_MAX)
+    ADD_SEGMENT((uint32_t)next, 0);
+#undef ADD_SEGMENT
+  table->n_segments = n;
+
+  /* Index the segment holding the first address of each /16. */
+  for (p = 0, i = 0; p < GEOIP_INDEX_LEN; ++p) {
+    const uint32_t first = ((uint32_t)p) << (32 - GEOIP_INDEX_BITS);
+    while (i + 1 < n && table->segment_start[i+1] <= first)
+      ++i;
+    table->index[p] = i;
+  }
+  table->index[GEOIP_INDEX_LEN] = n - 1;
+
+  return table;
+}
+
+/** Return the country of the IPv4 address <b>addr</b> (in host order)
+ * according to <b>table</b>. */
+static int
+geoip_ipv4_table_lookup(const geoip_ipv4_table_t *table, uint32_t addr)
+{
+  const uint32_t p = addr >> (32 - GEOIP_INDEX_BITS);
+  /* The segment holding addr is at least the one holding the start of its
+   * /16, and at most the one holding the start of the next /16. */
+  uint32_t lo = table->index[p], hi = table->index[p+1];
+
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (table->segment_start[mid] <= addr)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return table->segment_country[lo];
+}
+
+/** Return the key for the IPv6 address <b>addr</b>. */
+static inline geoip_ipv6_key_t
+geoip_ipv6_key(const struct in6_addr *addr)
+{
+  geoip_ipv6_key_t key;
+  key.hi = tor_ntohll(get_uint64(addr->s6_addr));
+  key.lo = tor_ntohll(get_uint64(addr->s6_addr + 8));
+  return key;
+}
+
+/** Return true iff the IPv6 key <b>a</b> is no greater than <b>b</b>. */
+static inline int
+geoip_ipv6_key_le(geoip_ipv6_key_t a, geoip_ipv6_key_t b)
+{
+  return a.hi < b.hi || (a.hi == b.hi && a.lo <= b.lo);
+}
+
+/** Return an IPv6 lookup table for the sorted list <b>entries</b> of
+ * geoip_ipv6_entry_t. */
+static geoip_ipv6_table_t *
+geoip_ipv6_table_new(const smartlist_t *entries)
+{
+  geoip_ipv6_table_t *table = tor_malloc_zero(sizeof(geoip_ipv6_table_t));
+  const int max_segments = 2 * smartlist_len(entries) + 1;
+  /* The lowest address not yet in a segment, unless next_overflowed is
+   * set because we've covered every address. */
+  geoip_ipv6_key_t next = { 0, 0 };
+  int next_overflowed = 0;
+  int n = 0, i, p;
+
+  table->segment_start = tor_calloc(max_segments, sizeof(geoip_ipv6_key_t));
+  table->segment_country = tor_calloc(max_segments, sizeof(country_t));
+
+#define ADD_SEGMENT(start, country) STMT_BEGIN                          \
+    if (n == 0 || table->segment_country[n-1] != (country)) {           \
+      table->segment_start[n] = (start);                                \
+      table->segment_country[n] = (country);                            \
+      ++n;                                                              \
+    }                                                                   \
+  STMT_END
+  SMARTLIST_FOREACH_BEGIN(entries, const geoip_ipv6_entry_t *, ent) {
+    const geoip_ipv6_key_t low = geoip_ipv6_key(&ent->ip_low);
+    const geoip_ipv6_key_t high = geoip_ipv6_key(&ent->ip_high);
+    if (next_overflowed || !geoip_ipv6_key_le(next, high))
+      continue; /* Overlaps ranges we already have. */
+    if (!geoip_ipv6_key_le(low, next))
+      ADD_SEGMENT(next, 0);
+    ADD_SEGMENT(geoip_ipv6_key_le(low, next) ? next : low,
+                (country_t)ent->country);
+    next.lo = high.lo + 1;
+    next.hi = high.hi + (next.lo == 0);
+    next_overflowed = (next.lo == 0 && next.hi == 0);
+  } SMARTLIST_FOREACH_END(ent);
+  if (!next_overflowed)
+    ADD_SEGMENT(next, 0);
+#undef ADD_SEGMENT
+  table->n_segments = n;
+
+  for (p = 0, i = 0; p < GEOIP_INDEX_LEN; ++p) {
+    geoip_ipv6_key_t first;
+    first.hi = ((uint64_t)p) << (64 - GEOIP_INDEX_BITS);
+    first.lo = 0;
+    while (i + 1 < n && geoip_ipv6_key_le(table->segment_start[i+1], first))
+      ++i;
+    table->index[p] = i;
+  }
+  table->index[GEOIP_INDEX_LEN] = n - 1;
+
+  return table;
+}
+
+/** Return the country of the IPv6 address <b>addr</b> according to
+ * <b>table</b>. */
+static int
+geoip_ipv6_table_lookup(const geoip_ipv6_table_t *table,
+                        const struct in6_addr *addr)
+{
+  const geoip_ipv6_key_t key = geoip_ipv6_key(addr);
+  const uint32_t p = (uint32_t)(key.hi >> (64 - GEOIP_INDEX_BITS));
+  uint32_t lo = table->index[p], hi = table->index[p+1];
+
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (geoip_ipv6_key_le(table->segment_start[mid], key))
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return table->segment_country[lo];
+}
+
 /** Set up a new list of geoip countries with no countries (yet) set in it,
  * except for the unknown country.
  */
@@ -336,6 +578,7 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
                         tor_free(e));
       smartlist_free(geoip_ipv4_entries);
     }
+    geoip_ipv4_table_free(geoip_ipv4_table);
     geoip_ipv4_entries = smartlist_new();
   } else { /* AF_INET6 */
     if (geoip_ipv6_entries) {
@@ -343,6 +586,7 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
                         tor_free(e));
       smartlist_free(geoip_ipv6_entries);
     }
+    geoip_ipv6_table_free(geoip_ipv6_table);
     geoip_ipv6_entries = smartlist_new();
   }
   geoip_digest_env = crypto_digest_new();
@@ -360,14 +604,22 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
+  /* Sort list, replace it with a lookup table, and remember file digests so
+   * that we can include it in our extra-info descriptors. */
   if (family == AF_INET) {
     smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
+    geoip_ipv4_table = geoip_ipv4_table_new(geoip_ipv4_entries);
+    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
+                      tor_free(e));
+    smartlist_free(geoip_ipv4_entries);
     crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
   } else {
     /* AF_INET6 */
     smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
+    geoip_ipv6_table = geoip_ipv6_table_new(geoip_ipv6_entries);
+    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                      tor_free(e));
+    smartlist_free(geoip_ipv6_entries);
     crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
   }
   crypto_digest_free(geoip_digest_env);
@@ -385,6 +637,8 @@ int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
   geoip_ipv4_entry_t *ent;
+  if (geoip_ipv4_table)
+    return geoip_ipv4_table_lookup(geoip_ipv4_table, ipaddr);
   if (!geoip_ipv4_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
@@ -402,6 +656,8 @@ geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
   geoip_ipv6_entry_t *ent;
 
+  if (geoip_ipv6_table)
+    return geoip_ipv6_table_lookup(geoip_ipv6_table, addr);
   if (!geoip_ipv6_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv6_entries, addr,
@@ -455,9 +711,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_entries != NULL || geoip_ipv4_table != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_entries != NULL || geoip_ipv6_table != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -493,6 +749,8 @@ clear_geoip_db(void)
                       tor_free(ent));
     smartlist_free(geoip_ipv6_entries);
   }
+  geoip_ipv4_table_free(geoip_ipv4_table);
+  geoip_ipv6_table_free(geoip_ipv6_table);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
   geoip_ipv4_entries = NULL;
@@ -0,0 +1,441 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file mempool.c
+ *
+ * \brief Implementation for mp_pool_t, an allocator for lots of
+ * fixed-size objects that are allocated and freed one at a time.
+ *
+ * A pool carves its items out of large <em>chunks</em>.  Each item is
+ * preceded by a pointer to the chunk it belongs to, so that releasing an
+ * item is a constant-time operation that does not need to know the pool.
+ * Released items are kept on a per-chunk freelist and are handed out again
+ * before any new memory is used.
+ *
+ * Every chunk is on exactly one of three lists: <em>full</em> chunks have
+ * no free item left, <em>used</em> chunks have some items allocated and
+ * some free, and <em>empty</em> chunks have no allocated item at all.  New
+ * items come from the first chunk on the used list if there is one, and
+ * only then from an empty or new chunk.  The used list is not sorted by
+ * fill: its first chunk is the one that most recently became used (a new
+ * chunk, or a full chunk that got an item back).  This keeps allocations
+ * out of empty chunks, so that those can be given back to the system,
+ * without packing the used chunks as tightly as possible.  A pool keeps
+ * at most a few empty chunks around for reuse (and leaves its last used
+ * chunk where it is when it becomes empty); mp_pool_clean() releases them
+ * when memory is tight.
+ *
+ * Pools are not thread-safe: every pool must only be used from a single
+ * thread (in practice, the main thread).
+ */
+
+#include "orconfig.h"
+#include "lib/memarea/mempool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/cc/torint.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+
+typedef struct mp_chunk_t mp_chunk_t;
+
+/** Holds a single allocated item, preceded by the chunk it belongs to. */
+typedef struct mp_allocated_t {
+  /** The chunk that this item is allocated in. */
+  mp_chunk_t *in_chunk;
+  union {
+    /** If this item is free, the next free item in the same chunk. */
+    struct mp_allocated_t *next_free;
+    /** If this item is not free, the actual memory returned to the user. */
+    char mem;
+    /** Dummies to make sure that mem is aligned. */
+    void *void_for_alignment_;
+    double double_for_alignment_;
+    uint64_t u64_for_alignment_;
+  } u;
+} mp_allocated_t;
+
+/** How many bytes are needed for overhead before we get to the memory part
+ * of an item? */
+#define A_OFFSET offsetof(mp_allocated_t, u.mem)
+/** Alignment of every item in a chunk. */
+#define MP_ALIGN (sizeof(((mp_allocated_t*)0)->u))
+/** Given a pointer to an mp_allocated_t, return the user memory. */
+#define A2M(a) (&(a)->u.mem)
+/** Given a pointer to the user memory, return the mp_allocated_t. */
+#define M2A(p) ((mp_allocated_t*) (((char*)(p)) - A_OFFSET))
+
+/** A chunk of memory that holds up to <b>capacity</b> items. */
+struct mp_chunk_t {
+  mp_chunk_t *next; /**< The next chunk on this chunk's list. */
+  mp_chunk_t *prev; /**< The previous chunk on this chunk's list. */
+  mp_pool_t *pool; /**< The pool that this chunk is part of. */
+  /** First free item in this chunk, or NULL if we need to carve new items
+   * from next_mem. */
+  mp_allocated_t *first_free;
+  int n_allocated; /**< Number of items allocated in this chunk. */
+  int capacity; /**< Number of items that fit into this chunk. */
+  size_t mem_size; /**< Number of usable bytes in mem. */
+  char *next_mem; /**< Pointer into mem to the next never-used item. */
+  union {
+    char mem[1]; /**< Storage for the items. */
+    void *void_for_alignment_;
+    double double_for_alignment_;
+    uint64_t u64_for_alignment_;
+  } u;
+};
+
+/** How many bytes are needed for overhead before we get to the memory part
+ * of a chunk? */
+#define CHUNK_OVERHEAD offsetof(mp_chunk_t, u.mem)
+
+/** A pool of fixed-size items. */
+struct mp_pool_t {
+  /** Doubly-linked list of chunks in which no items have been allocated. */
+  mp_chunk_t *empty_chunks;
+  /** Doubly-linked list of chunks in which some items have been allocated,
+   * but which are not full. */
+  mp_chunk_t *used_chunks;
+  /** Doubly-linked list of chunks in which every item has been allocated. */
+  mp_chunk_t *full_chunks;
+  /** Length of <b>empty_chunks</b>. */
+  int n_empty_chunks;
+  /** Length of <b>used_chunks</b> plus <b>full_chunks</b>.  (The only
+   * used chunk may have no item allocated.) */
+  int n_nonempty_chunks;
+  /** Number of items currently allocated from this pool. */
+  size_t n_items;
+  /** Size of each item, including its header and alignment padding. */
+  size_t item_alloc_size;
+  /** Number of items in each chunk. */
+  int new_chunk_capacity;
+};
+
+/** Upper bound on the number of items in a chunk. */
+#define MAX_CHUNK_CAPACITY (1<<16)
+
+/** Remove <b>chunk</b> from the doubly-linked list at <b>*head</b>. */
+static inline void
+chunk_list_remove(mp_chunk_t **head, mp_chunk_t *chunk)
+{
+  if (chunk->next)
+    chunk->next->prev = chunk->prev;
+  if (chunk->prev)
+    chunk->prev->next = chunk->next;
+  else
+    *head = chunk->next;
+  chunk->next = chunk->prev = NULL;
+}
+
+/** Add <b>chunk</b> to the front of the doubly-linked list at
+ * <b>*head</b>. */
+static inline void
+chunk_list_push(mp_chunk_t **head, mp_chunk_t *chunk)
+{
+  chunk->prev = NULL;
+  chunk->next = *head;
+  if (*head)
+    (*head)->prev = chunk;
+  *head = chunk;
+}
+
+/** Allocate and return a new empty chunk for <b>pool</b>. */
+static mp_chunk_t *
+mp_chunk_new(mp_pool_t *pool)
+{
+  size_t sz = pool->new_chunk_capacity * pool->item_alloc_size;
+  mp_chunk_t *chunk = tor_malloc_zero(CHUNK_OVERHEAD + sz);
+  chunk->pool = pool;
+  chunk->capacity = pool->new_chunk_capacity;
+  chunk->mem_size = sz;
+  chunk->next_mem = chunk->u.mem;
+  return chunk;
+}
+
+/** Return the number of bytes that <b>chunk</b> takes up. */
+static inline size_t
+mp_chunk_alloc_size(const mp_chunk_t *chunk)
+{
+  return CHUNK_OVERHEAD + chunk->mem_size;
+}
+
+/** Create and return a new pool for items of <b>item_size</b> bytes, which
+ * carves <b>chunk_capacity</b> items out of each chunk it allocates. */
+mp_pool_t *
+mp_pool_new(size_t item_size, size_t chunk_capacity)
+{
+  mp_pool_t *pool;
+  size_t alloc_size;
+
+  tor_assert(item_size > 0);
+  tor_assert(item_size < SIZE_T_CEILING / MAX_CHUNK_CAPACITY);
+  tor_assert(chunk_capacity > 0);
+
+  pool = tor_malloc_zero(sizeof(mp_pool_t));
+
+  /* every item needs room for its header and the freelist pointer, and
+   * every item must be aligned */
+  alloc_size = A_OFFSET + item_size;
+  if (alloc_size < sizeof(mp_allocated_t))
+    alloc_size = sizeof(mp_allocated_t);
+  alloc_size = (alloc_size + MP_ALIGN - 1) & ~(MP_ALIGN - 1);
+  pool->item_alloc_size = alloc_size;
+
+  if (chunk_capacity > MAX_CHUNK_CAPACITY)
+    chunk_capacity = MAX_CHUNK_CAPACITY;
+  pool->new_chunk_capacity = (int)chunk_capacity;
+
+  return pool;
+}
+
+/** Return a newly allocated item from <b>pool</b>, taken from the first
+ * chunk on its used list if it has one.  The contents of the item are
+ * undefined. */
+void *
+mp_pool_get(mp_pool_t *pool)
+{
+  mp_chunk_t *chunk;
+  mp_allocated_t *allocated;
+
+  if (PREDICT_LIKELY(pool->used_chunks != NULL)) {
+    /* use a chunk that is already in use before touching an empty one */
+    chunk = pool->used_chunks;
+  } else if (pool->empty_chunks) {
+    /* reuse an empty chunk as if it was new */
+    chunk = pool->empty_chunks;
+    chunk_list_remove(&pool->empty_chunks, chunk);
+    --pool->n_empty_chunks;
+    ++pool->n_nonempty_chunks;
+    chunk->first_free = NULL;
+    chunk->next_mem = chunk->u.mem;
+    chunk_list_push(&pool->used_chunks, chunk);
+  } else {
+    chunk = mp_chunk_new(pool);
+    ++pool->n_nonempty_chunks;
+    chunk_list_push(&pool->used_chunks, chunk);
+  }
+
+  tor_assert(chunk->n_allocated < chunk->capacity);
+
+  if (chunk->first_free) {
+    allocated = chunk->first_free;
+    chunk->first_free = allocated->u.next_free;
+    allocated->u.next_free = NULL;
+    tor_assert(allocated->in_chunk == chunk);
+  } else {
+    tor_assert(chunk->next_mem + pool->item_alloc_size <=
+               chunk->u.mem + chunk->mem_size);
+    allocated = (mp_allocated_t*)chunk->next_mem;
+    chunk->next_mem += pool->item_alloc_size;
+    allocated->in_chunk = chunk;
+  }
+
+  ++chunk->n_allocated;
+  ++pool->n_items;
+
+  if (PREDICT_UNLIKELY(chunk->n_allocated == chunk->capacity)) {
+    chunk_list_remove(&pool->used_chunks, chunk);
+    chunk_list_push(&pool->full_chunks, chunk);
+  }
+
+  return A2M(allocated);
+}
+
+/** Return a newly allocated item from <b>pool</b>, with all bytes set to
+ * zero. */
+void *
+mp_pool_get_zero(mp_pool_t *pool)
+{
+  void *item = mp_pool_get(pool);
+  memset(item, 0, pool->item_alloc_size - A_OFFSET);
+  return item;
+}
+
+/** Return <b>item</b>, which must have been allocated with mp_pool_get(),
+ * to its pool.  If this leaves its chunk empty and the pool already holds
+ * enough empty chunks, the chunk is freed. */
+void
+mp_pool_release(void *item)
+{
+  mp_allocated_t *allocated = M2A(item);
+  mp_chunk_t *chunk = allocated->in_chunk;
+  mp_pool_t *pool;
+
+  tor_assert(chunk);
+  tor_assert(chunk->n_allocated > 0);
+  pool = chunk->pool;
+
+  allocated->u.next_free = chunk->first_free;
+  chunk->first_free = allocated;
+
+  if (PREDICT_UNLIKELY(chunk->n_allocated == chunk->capacity)) {
+    chunk_list_remove(&pool->full_chunks, chunk);
+    chunk_list_push(&pool->used_chunks, chunk);
+  }
+
+  --chunk->n_allocated;
+  --pool->n_items;
+
+  /* Keep the last used chunk around as it is, so that a pool that never
+   * holds more than a few items does not move its chunk between lists. */
+  if (PREDICT_UNLIKELY(chunk->n_allocated == 0) &&
+      (chunk != pool->used_chunks || chunk->next)) {
+    chunk_list_remove(&pool->used_chunks, chunk);
+    --pool->n_nonempty_chunks;
+    if (pool->n_empty_chunks < MP_POOL_DEFAULT_EMPTY_CHUNKS) {
+      chunk_list_push(&pool->empty_chunks, chunk);
+      ++pool->n_empty_chunks;
+    } else {
+      tor_free(chunk);
+    }
+  }
+}
+
+/** Free all but <b>n_to_keep</b> of the empty chunks held by <b>pool</b>,
+ * and return the number of bytes freed. */
+size_t
+mp_pool_clean(mp_pool_t *pool, int n_to_keep)
+{
+  size_t freed = 0;
+
+  if (n_to_keep < 0)
+    n_to_keep = 0;
+
+  if (pool->used_chunks && pool->used_chunks->n_allocated == 0) {
+    mp_chunk_t *chunk = pool->used_chunks;
+    tor_assert(! chunk->next);
+    chunk_list_remove(&pool->used_chunks, chunk);
+    --pool->n_nonempty_chunks;
+    chunk_list_push(&pool->empty_chunks, chunk);
+    ++pool->n_empty_chunks;
+  }
+
+  while (pool->n_empty_chunks > n_to_keep) {
+    mp_chunk_t *chunk = pool->empty_chunks;
+    tor_assert(chunk);
+    chunk_list_remove(&pool->empty_chunks, chunk);
+    --pool->n_empty_chunks;
+    freed += mp_chunk_alloc_size(chunk);
+    tor_free(chunk);
+  }
+
+  return freed;
+}
+
+/** Helper: add the statistics of every chunk in <b>chunk</b>'s list to
+ * <b>stats</b>. */
+static void
+mp_chunk_list_get_stats(const mp_chunk_t *chunk, size_t item_alloc_size,
+                        mp_pool_stats_t *stats)
+{
+  for (; chunk; chunk = chunk->next) {
+    ++stats->n_chunks;
+    if (chunk->n_allocated == 0)
+      ++stats->n_empty_chunks;
+    stats->bytes_allocated += mp_chunk_alloc_size(chunk);
+    stats->bytes_unused +=
+      (chunk->capacity - chunk->n_allocated) * item_alloc_size;
+  }
+}
+
+/** Set <b>stats_out</b> to the current usage statistics of <b>pool</b>. */
+void
+mp_pool_get_stats(const mp_pool_t *pool, mp_pool_stats_t *stats_out)
+{
+  memset(stats_out, 0, sizeof(mp_pool_stats_t));
+  stats_out->n_items = pool->n_items;
+  mp_chunk_list_get_stats(pool->empty_chunks, pool->item_alloc_size,
+                          stats_out);
+  mp_chunk_list_get_stats(pool->used_chunks, pool->item_alloc_size,
+                          stats_out);
+  mp_chunk_list_get_stats(pool->full_chunks, pool->item_alloc_size,
+                          stats_out);
+}
+
+/** Helper: check that every chunk in <b>chunk</b>'s list belongs to
+ * <b>pool</b>, and that its number of allocated items is within
+ * [<b>min</b>, <b>max</b>] (where a negative <b>max</b> means "up to its
+ * capacity").  Return the total number of items allocated in the list. */
+static size_t
+mp_chunk_list_assert_ok(const mp_pool_t *pool, const mp_chunk_t *chunk,
+                        int min, int max, int *n_chunks_out)
+{
+  size_t n_items = 0;
+  const mp_chunk_t *prev = NULL;
+
+  for (; chunk; prev = chunk, chunk = chunk->next) {
+    const mp_allocated_t *allocated;
+    int n_free = 0;
+
+    tor_assert(chunk->pool == pool);
+    tor_assert(chunk->prev == prev);
+    tor_assert(chunk->n_allocated >= min);
+    tor_assert(chunk->n_allocated <= (max < 0 ? chunk->capacity : max));
+    tor_assert(chunk->next_mem >= chunk->u.mem);
+    tor_assert(chunk->next_mem <= chunk->u.mem + chunk->mem_size);
+
+    for (allocated = chunk->first_free; allocated;
+         allocated = allocated->u.next_free) {
+      tor_assert(allocated->in_chunk == chunk);
+      ++n_free;
+    }
+    tor_assert((size_t)(chunk->n_allocated + n_free) ==
+               (size_t)(chunk->next_mem - chunk->u.mem) /
+               pool->item_alloc_size);
+
+    n_items += chunk->n_allocated;
+    ++*n_chunks_out;
+  }
+
+  return n_items;
+}
+
+/** Assert that <b>pool</b> is internally consistent. */
+void
+mp_pool_assert_ok(const mp_pool_t *pool)
+{
+  int n_empty = 0, n_nonempty = 0;
+  size_t n_items = 0;
+
+  n_items += mp_chunk_list_assert_ok(pool, pool->empty_chunks, 0, 0,
+                                     &n_empty);
+  n_items += mp_chunk_list_assert_ok(pool, pool->used_chunks, 0,
+                                     pool->new_chunk_capacity - 1,
+                                     &n_nonempty);
+  n_items += mp_chunk_list_assert_ok(pool, pool->full_chunks,
+                                     pool->new_chunk_capacity,
+                                     pool->new_chunk_capacity,
+                                     &n_nonempty);
+
+  tor_assert(n_empty == pool->n_empty_chunks);
+  tor_assert(n_nonempty == pool->n_nonempty_chunks);
+  tor_assert(n_items == pool->n_items);
+}
+
+/** Helper: free every chunk in the list at <b>chunk</b>. */
+static void
+mp_chunk_list_free(mp_chunk_t *chunk)
+{
+  while (chunk) {
+    mp_chunk_t *next = chunk->next;
+    tor_free(chunk);
+    chunk = next;
+  }
+}
+
+/** Free all storage held by <b>pool</b>, including every item that is still
+ * allocated from it. */
+void
+mp_pool_destroy_(mp_pool_t *pool)
+{
+  if (!pool)
+    return;
+
+  mp_chunk_list_free(pool->empty_chunks);
+  mp_chunk_list_free(pool->used_chunks);
+  mp_chunk_list_free(pool->full_chunks);
+  tor_free(pool);
+}
@@ -0,0 +1,48 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file mempool.h
+ * \brief Headers for mempool.c
+ **/
+
+#ifndef TOR_MEMPOOL_H
+#define TOR_MEMPOOL_H
+
+#include <stddef.h>
+#include "lib/malloc/malloc.h"
+
+/** A memory pool is a context in which a large number of fixed-sized
+ * objects can be allocated efficiently.  See mempool.c for implementation
+ * details. */
+typedef struct mp_pool_t mp_pool_t;
+
+/** Usage statistics of a memory pool, as returned by mp_pool_get_stats(). */
+typedef struct mp_pool_stats_t {
+  /** Number of items currently handed out by the pool. */
+  size_t n_items;
+  /** Number of chunks held by the pool, including empty ones. */
+  size_t n_chunks;
+  /** Number of chunks that hold no allocated item. */
+  size_t n_empty_chunks;
+  /** Number of bytes held by the pool's chunks. */
+  size_t bytes_allocated;
+  /** Number of bytes of the pool's chunks that are not handed out. */
+  size_t bytes_unused;
+} mp_pool_stats_t;
+
+mp_pool_t *mp_pool_new(size_t item_size, size_t chunk_capacity);
+void *mp_pool_get(mp_pool_t *pool);
+void *mp_pool_get_zero(mp_pool_t *pool);
+void mp_pool_release(void *item);
+size_t mp_pool_clean(mp_pool_t *pool, int n_to_keep);
+void mp_pool_get_stats(const mp_pool_t *pool, mp_pool_stats_t *stats_out);
+void mp_pool_assert_ok(const mp_pool_t *pool);
+void mp_pool_destroy_(mp_pool_t *pool);
+#define mp_pool_destroy(pool) \
+  FREE_AND_NULL(mp_pool_t, mp_pool_destroy_, (pool))
+
+/** Default number of empty chunks a pool keeps around for reuse. */
+#define MP_POOL_DEFAULT_EMPTY_CHUNKS 2
+
+#endif /* !defined(TOR_MEMPOOL_H) */
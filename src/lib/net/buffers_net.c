@@ -12,6 +12,7 @@
 #define BUFFERS_PRIVATE
 #include "lib/net/buffers_net.h"
 #include "lib/container/buffers.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/net/nettypes.h"
@@ -20,6 +21,10 @@
 #include <winsock2.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #include <stdlib.h>
 
 #ifdef PARANOIA
@@ -68,6 +73,76 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef BUF_SOCKET_IO_VECTORED
+/** Read up to <b>at_most</b> bytes from the socket <b>fd</b> onto the end of
+ * <b>buf</b> with a single readv(): into the free space of its tail chunk, if
+ * there is enough of it, and into as many new chunks as it takes.  Set
+ * *<b>capacity_out</b> to the number of bytes we tried to read, which may be
+ * less than <b>at_most</b>.  If we get an EOF, set *<b>reached_eof</b> to 1.
+ * Return -1 on error, 0 on eof or blocking, and the number of bytes read
+ * otherwise. */
+static inline int
+read_to_chunks(buf_t *buf, tor_socket_t fd, size_t at_most,
+               size_t *capacity_out, int *reached_eof, int *socket_error)
+{
+  struct iovec iov[BUF_MAX_IOVECS];
+  chunk_t *chunks[BUF_MAX_IOVECS];
+  /* The last chunk that holds data (or that we had before reading). */
+  chunk_t *last = buf->tail;
+  size_t capacity = 0;
+  ssize_t read_result;
+  int n_iov = 0, i;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    chunks[n_iov] = buf->tail;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(buf->tail);
+    iov[n_iov].iov_len = MIN(CHUNK_REMAINING_CAPACITY(buf->tail), at_most);
+    capacity += iov[n_iov++].iov_len;
+  }
+  while (capacity < at_most && n_iov < BUF_MAX_IOVECS) {
+    chunk_t *chunk = buf_add_chunk_with_capacity(buf, at_most - capacity, 1);
+    chunks[n_iov] = chunk;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n_iov].iov_len = MIN(chunk->memlen, at_most - capacity);
+    capacity += iov[n_iov++].iov_len;
+  }
+  *capacity_out = capacity;
+
+  read_result = readv(fd, iov, n_iov);
+
+  if (read_result > 0) {
+    size_t left = (size_t)read_result;
+    for (i = 0; i < n_iov && left; ++i) {
+      size_t n = MIN(left, iov[i].iov_len);
+      chunks[i]->datalen += n;
+      left -= n;
+      last = chunks[i];
+    }
+    buf->datalen += read_result;
+  }
+  /* Don't keep the new chunks that we didn't read anything into. */
+  buf_free_chunks_after(buf, last);
+
+  if (read_result < 0) {
+    int e = tor_socket_errno(fd);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      *socket_error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+              (int)buf->datalen);
+    tor_assert(read_result < INT_MAX);
+    return (int)read_result;
+  }
+}
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
+
 /** Read from socket <b>s</b>, writing onto end of <b>buf</b>.  Read at most
  * <b>at_most</b> bytes, growing the buffer as necessary.  If recv() returns 0
  * (because of EOF), set *<b>reached_eof</b> to 1 and return 0. Return -1 on
@@ -94,6 +169,21 @@ buf_read_from_socket(buf_t *buf, tor_socket_t s, size_t at_most,
   if (BUG(buf->datalen >= INT_MAX - at_most))
     return -1;
 
+#ifdef BUF_SOCKET_IO_VECTORED
+  while (at_most > total_read) {
+    size_t capacity;
+    r = read_to_chunks(buf, s, at_most - total_read, &capacity,
+                       reached_eof, socket_error);
+    check();
+    if (r < 0)
+      return r; /* Error */
+    tor_assert(total_read+r < INT_MAX);
+    total_read += r;
+    if ((size_t)r < capacity) { /* eof, block, or no more to read. */
+      break;
+    }
+  }
+#else /* !(defined(BUF_SOCKET_IO_VECTORED)) */
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
@@ -118,6 +208,7 @@ buf_read_from_socket(buf_t *buf, tor_socket_t s, size_t at_most,
       break;
     }
   }
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
   return (int)total_read;
 }
 
@@ -155,6 +246,109 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef BUF_SOCKET_IO_VECTORED
+/** Helper for buf_flush_to_socket(): try to write <b>sz</b> bytes from the
+ * first chunks of buffer <b>buf</b> onto socket <b>s</b> with a single
+ * writev().  Set *<b>tried_out</b> to the number of bytes we tried to write,
+ * which may be less than <b>sz</b>.  On success, deduct the bytes written
+ * from *<b>buf_flushlen</b>.  Return the number of bytes written on success,
+ * 0 on blocking, -1 on failure.
+ */
+static inline int
+flush_chunks(tor_socket_t s, buf_t *buf, size_t sz, size_t *tried_out,
+             size_t *buf_flushlen)
+{
+  struct iovec iov[BUF_MAX_IOVECS];
+  ssize_t write_result;
+  int n_iov;
+
+  n_iov = buf_get_iovecs(buf, sz, iov, BUF_MAX_IOVECS, tried_out);
+
+  write_result = writev(s, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(s);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_drain(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
+
+#ifdef BUF_SOCKET_IO_VECTORED
+/** Fill in up to <b>max_iov</b> entries of <b>iov</b> to point at the first
+ * <b>sz</b> bytes of <b>buf</b>, in place.  Set *<b>len_out</b> to the
+ * number of bytes they cover, which may be less than <b>sz</b> if the
+ * buffer holds more than <b>max_iov</b> chunks.  Return the number of
+ * entries used.
+ *
+ * The entries stay valid until the data is removed from <b>buf</b>; adding
+ * data to the end of <b>buf</b> doesn't move it. */
+int
+buf_get_iovecs(const buf_t *buf, size_t sz, struct iovec *iov, int max_iov,
+               size_t *len_out)
+{
+  const chunk_t *chunk;
+  size_t len = 0;
+  int n_iov = 0;
+
+  for (chunk = buf->head; chunk && len < sz && n_iov < max_iov;
+       chunk = chunk->next) {
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = MIN(chunk->datalen, sz - len);
+    len += iov[n_iov++].iov_len;
+  }
+  *len_out = len;
+  return n_iov;
+}
+
+/** Return a pointer to free space at the end of <b>buf</b>, where someone
+ * else (such as the kernel) can put up to *<b>len_out</b> bytes of new
+ * data, adding a new chunk of at most <b>at_most</b> bytes if the buffer
+ * has too little free space.  Once the data is there, call
+ * buf_commit_space() with its length; don't change <b>buf</b> in
+ * between. */
+char *
+buf_reserve_space(buf_t *buf, size_t at_most, size_t *len_out)
+{
+  chunk_t *chunk = buf->tail;
+
+  if (!chunk || CHUNK_REMAINING_CAPACITY(chunk) < MIN_READ_LEN)
+    chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+  *len_out = MIN(CHUNK_REMAINING_CAPACITY(chunk), at_most);
+  return CHUNK_WRITE_PTR(chunk);
+}
+
+/** Note that <b>n</b> bytes of new data arrived in the space that we got
+ * from buf_reserve_space() for <b>buf</b>. */
+void
+buf_commit_space(buf_t *buf, size_t n)
+{
+  chunk_t *chunk = buf->tail, *prev = NULL;
+
+  tor_assert(chunk);
+  tor_assert(n <= CHUNK_REMAINING_CAPACITY(chunk));
+  chunk->datalen += n;
+  buf->datalen += n;
+  if (chunk->datalen == 0) {
+    /* Don't keep a chunk that we didn't put anything into. */
+    if (buf->head != chunk) {
+      for (prev = buf->head; prev->next != chunk; prev = prev->next)
+        ;
+    }
+    buf_free_chunks_after(buf, prev);
+  }
+  check();
+}
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
+
 /** Write data from <b>buf</b> to the socket <b>s</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
  * the number of bytes actually written, and remove the written bytes
@@ -180,6 +374,20 @@ buf_flush_to_socket(buf_t *buf, tor_socket_t s, size_t sz,
   }
 
   check();
+#ifdef BUF_SOCKET_IO_VECTORED
+  while (sz) {
+    size_t tried;
+    tor_assert(buf->head);
+    r = flush_chunks(s, buf, sz, &tried, buf_flushlen);
+    check();
+    if (r < 0)
+      return r;
+    flushed += r;
+    sz -= r;
+    if (r == 0 || (size_t)r < tried) /* can't flush any more now. */
+      break;
+  }
+#else /* !(defined(BUF_SOCKET_IO_VECTORED)) */
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
@@ -197,6 +405,7 @@ buf_flush_to_socket(buf_t *buf, tor_socket_t s, size_t sz,
     if (r == 0 || (size_t)r < flushlen0) /* can't flush any more now. */
       break;
   }
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
   tor_assert(flushed < INT_MAX);
   return (int)flushed;
 }
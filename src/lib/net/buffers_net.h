@@ -16,6 +16,16 @@
 #include <stddef.h>
 #include "lib/net/socket.h"
 
+#if defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+/** Defined if buf_read_from_socket() and buf_flush_to_socket() move data
+ * into and out of several chunks of a buffer with a single readv() or
+ * writev(). */
+#define BUF_SOCKET_IO_VECTORED
+/** Largest number of chunks that we read into or write from with a single
+ * system call.  POSIX guarantees that IOV_MAX is at least this large. */
+#define BUF_MAX_IOVECS 16
+#endif
+
 struct buf_t;
 int buf_read_from_socket(struct buf_t *buf, tor_socket_t s, size_t at_most,
                          int *reached_eof,
@@ -24,4 +34,12 @@ int buf_read_from_socket(struct buf_t *buf, tor_socket_t s, size_t at_most,
 int buf_flush_to_socket(struct buf_t *buf, tor_socket_t s, size_t sz,
                         size_t *buf_flushlen);
 
+#ifdef BUF_SOCKET_IO_VECTORED
+struct iovec;
+int buf_get_iovecs(const struct buf_t *buf, size_t sz, struct iovec *iov,
+                   int max_iov, size_t *len_out);
+char *buf_reserve_space(struct buf_t *buf, size_t at_most, size_t *len_out);
+void buf_commit_space(struct buf_t *buf, size_t n);
+#endif
+
 #endif /* !defined(TOR_BUFFERS_H) */
@@ -170,7 +170,9 @@ tor_tls_err_to_string(int err)
  * the same TLS context for incoming and outgoing connections, and
  * ignore <b>client_identity</b>. If one of TOR_TLS_CTX_USE_ECDHE_P{224,256}
  * is set in <b>flags</b>, use that ECDHE group if possible; otherwise use
- * the default ECDHE group. */
+ * the default ECDHE group. If TOR_TLS_CTX_ENABLE_KTLS is set in
+ * <b>flags</b>, let the kernel do the record crypto once the handshake is
+ * done, where the TLS library and the kernel support it. */
 int
 tor_tls_context_init(unsigned flags,
                      crypto_pk_t *client_identity,
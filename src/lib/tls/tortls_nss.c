@@ -642,6 +642,14 @@ tor_tls_get_pending_bytes(tor_tls_t *tls)
   return (int)n;
 }
 
+int
+tor_tls_uses_kernel_tls(tor_tls_t *tls)
+{
+  (void) tls;
+  /* We don't support kernel TLS with NSS. */
+  return 0;
+}
+
 size_t
 tor_tls_get_forced_write_size(tor_tls_t *tls)
 {
@@ -99,6 +99,12 @@ ENABLE_GCC_WARNING(redundant-decls)
 #define SSL3_FLAGS_ALLOW_UNSAFE_LEGACY_RENEGOTIATION 0x0010
 #endif
 
+/* OpenSSL 3.0 and later can hand the record crypto to the kernel (Linux
+ * kTLS) once the handshake is done. */
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+#define TOR_USE_KTLS
+#endif
+
 /** Set to true iff openssl bug 7712 has been detected. */
 static int openssl_bug_7712_is_present = 0;
 
@@ -610,6 +616,15 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
 
 #ifdef SSL_MODE_RELEASE_BUFFERS
   SSL_CTX_set_mode(result->ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
+#ifdef TOR_USE_KTLS
+  /* If the kernel and the negotiated cipher support it, OpenSSL installs the
+   * session keys on the socket with setsockopt(TCP_ULP, "tls") when the
+   * handshake is done; otherwise it silently keeps doing the crypto itself.
+   * The kernel can't rekey, so renegotiations fail on such connections:
+   * that is fine for link protocol 3 and later. */
+  if (flags & TOR_TLS_CTX_ENABLE_KTLS)
+    SSL_CTX_set_options(result->ctx, SSL_OP_ENABLE_KTLS);
 #endif
   if (! is_client) {
     if (result->my_link_cert &&
@@ -1215,6 +1230,35 @@ tor_tls_impl_free_(tor_tls_impl_t *ssl)
   SSL_free(ssl);
 }
 
+#ifdef TOR_USE_KTLS
+/** Return true iff the kernel does the record crypto for the data that we
+ * send on <b>tls</b>, and OpenSSL has nothing left to send, so that we can
+ * write our data to the socket directly. */
+static int
+tor_tls_can_write_to_socket(tor_tls_t *tls)
+{
+  BIO *wbio = SSL_get_wbio(tls->ssl);
+  if (!wbio || BIO_method_type(wbio) != BIO_TYPE_SOCKET)
+    return 0;
+  return BIO_get_ktls_send(wbio) && BIO_wpending(wbio) == 0 &&
+    SSL_is_init_finished(tls->ssl);
+}
+#endif /* defined(TOR_USE_KTLS) */
+
+/** Return true iff the kernel does the record crypto for <b>tls</b> in both
+ * directions. */
+int
+tor_tls_uses_kernel_tls(tor_tls_t *tls)
+{
+#ifdef TOR_USE_KTLS
+  return BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) &&
+    BIO_get_ktls_recv(SSL_get_rbio(tls->ssl));
+#else
+  (void) tls;
+  return 0;
+#endif
+}
+
 /** Underlying function for TLS reading.  Reads up to <b>len</b>
  * characters from <b>tls</b> into <b>cp</b>.  On success, returns the
  * number of characters read.  On failure, returns TOR_TLS_ERROR,
@@ -1273,6 +1317,24 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
   tor_assert(n < INT_MAX);
   if (n == 0)
     return 0;
+#ifdef TOR_USE_KTLS
+  if (!tls->wantwrite_n && tor_tls_can_write_to_socket(tls)) {
+    /* The kernel frames and encrypts whatever we write as application
+     * data, so we skip SSL_write() and its copy of our data. */
+    r = (int) tor_socket_send(tls->socket, cp, n, 0);
+    if (r < 0) {
+      int e = tor_socket_errno(tls->socket);
+      if (ERRNO_IS_EAGAIN(e))
+        return TOR_TLS_WANTWRITE;
+      log_info(LD_NET, "Error writing to kernel TLS socket of %s: %s",
+               ADDR(tls), tor_socket_strerror(e));
+      return tor_errno_to_tls_error(e);
+    }
+    tls->ktls_write_count += r;
+    total_bytes_written_over_tls += r;
+    return r;
+  }
+#endif /* defined(TOR_USE_KTLS) */
   if (tls->wantwrite_n) {
     /* if WANTWRITE last time, we must use the _same_ n as before */
     tor_assert(n >= tls->wantwrite_n);
@@ -1380,6 +1442,14 @@ tor_tls_finish_handshake(tor_tls_t *tls)
       r = TOR_TLS_ERROR_MISC;
     }
   }
+#ifdef TOR_USE_KTLS
+  if (SSL_get_options(tls->ssl) & SSL_OP_ENABLE_KTLS) {
+    log_info(LD_HANDSHAKE, "Kernel TLS with %s: %s for sending, %s for "
+             "receiving.", ADDR(tls),
+             BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) ? "on" : "off",
+             BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) ? "on" : "off");
+  }
+#endif /* defined(TOR_USE_KTLS) */
   tls_log_errors(NULL, LOG_WARN, LD_NET, "finishing the handshake");
   return r;
 }
@@ -1513,7 +1583,7 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
   if (wbio->method == BIO_f_buffer() && (tmpbio = BIO_next(wbio)) != NULL)
     wbio = tmpbio;
 #endif /* OPENSSL_VERSION_NUMBER >= OPENSSL_VER(1,1,0,0,5) */
-  w = (unsigned long) BIO_number_written(wbio);
+  w = (unsigned long) BIO_number_written(wbio) + tls->ktls_write_count;
 
   /* We are ok with letting these unsigned ints go "negative" here:
    * If we wrapped around, this should still give us the right answer, unless
@@ -59,6 +59,9 @@ struct tor_tls_t {
    */
   unsigned long last_write_count;
   unsigned long last_read_count;
+  /** Number of bytes that we wrote directly onto the socket, since the
+   * kernel does the TLS record crypto for it; see tor_tls_write(). */
+  unsigned long ktls_write_count;
   /** If set, a callback to invoke whenever the client tries to renegotiate
    * the handshake. */
   void (*negotiated_callback)(tor_tls_t *tls, void *arg);
@@ -23,20 +23,60 @@
 #endif
 
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/circuituse.h"
+#include "core/or/dos_sketch.h"
+#include "core/or/policies.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "core/mainloop/cpuworker.h"
 #include "feature/dircommon/consdiff.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/relay/router.h"
+#include "feature/stats/geoip_stats.h"
 #include "lib/compress/compress.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "core/or/relay_crypto_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerstatus_st.h"
 
 #include "lib/crypt_ops/digestset.h"
+#include "lib/encoding/confline.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/memarea/mempool.h"
+#include "lib/encoding/binascii.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/uring.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/container/buffers.h"
+#include "lib/net/alertsock.h"
+#include "lib/net/buffers_net.h"
+#include "lib/thread/numcpus.h"
+#include "lib/time/compat_time.h"
+
+#ifdef BUF_SOCKET_IO_VECTORED
+#include <event2/event.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -552,6 +592,1202 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+static void
+bench_cell_pool(void)
+{
+  const int iters = 1<<8;
+  /* roughly the number of cells queued on a busy circuit */
+  const int n_cells = 1<<10;
+  mp_pool_t *pool = mp_pool_new(sizeof(packed_cell_t), 64);
+  packed_cell_t **cells = tor_calloc(n_cells, sizeof(packed_cell_t *));
+  int i, j, use_pool;
+  uint64_t start, end;
+
+  reset_perftime();
+
+  /* Fill and drain a queue of cells, as a circuit does. */
+  for (use_pool = 0; use_pool <= 1; ++use_pool) {
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (j = 0; j < n_cells; ++j) {
+        if (use_pool)
+          cells[j] = mp_pool_get_zero(pool);
+        else
+          cells[j] = tor_malloc_zero(sizeof(packed_cell_t));
+      }
+      for (j = 0; j < n_cells; ++j) {
+        if (use_pool)
+          mp_pool_release(cells[j]);
+        else
+          tor_free(cells[j]);
+      }
+    }
+    end = perftime();
+    printf("%s: %.2f ns per cell allocated and freed.\n",
+           use_pool ? "  mp_pool" : "tor_malloc",
+           NANOCOUNT(start, end, iters*n_cells));
+  }
+
+  /* Allocate and free cells one at a time, as a relay forwarding cells
+   * without queueing does. */
+  for (use_pool = 0; use_pool <= 1; ++use_pool) {
+    start = perftime();
+    for (i = 0; i < iters*n_cells; ++i) {
+      if (use_pool) {
+        packed_cell_t *cell = mp_pool_get_zero(pool);
+        mp_pool_release(cell);
+      } else {
+        packed_cell_t *cell = tor_malloc_zero(sizeof(packed_cell_t));
+        tor_free(cell);
+      }
+    }
+    end = perftime();
+    printf("%s: %.2f ns per single cell allocated and freed.\n",
+           use_pool ? "  mp_pool" : "tor_malloc",
+           NANOCOUNT(start, end, iters*n_cells));
+  }
+
+  tor_free(cells);
+  mp_pool_destroy(pool);
+}
+
+/** Number of cells in a batch of bench_relay_crypto_threads(), as the relay
+ * crypto workers use them. */
+#define BENCH_BATCH_CELLS 32
+
+/** A batch of relay cells of one circuit for bench_relay_crypto_threads(). */
+typedef struct bench_relay_batch_t {
+  relay_crypto_t crypto;
+  cell_t cells[BENCH_BATCH_CELLS];
+} bench_relay_batch_t;
+
+static threadpool_t *bench_threadpool = NULL;
+/** Batches to crypt, and batches with the workers. */
+static int bench_batches_left = 0, bench_batches_pending = 0;
+
+static void *
+bench_worker_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+static void
+bench_worker_state_free(void *state)
+{
+  (void)state;
+}
+
+/** Worker thread: crypt a batch like the relay crypto workers do, half of
+ * the cells outbound and half of them inbound. */
+static workqueue_reply_t
+bench_relay_batch_threadfn(void *state, void *batch_)
+{
+  bench_relay_batch_t *batch = batch_;
+  int i;
+  (void)state;
+
+  for (i = 0; i < BENCH_BATCH_CELLS; ++i) {
+    char recognized = 0;
+    relay_crypt_relayed_cell(&batch->crypto, &batch->cells[i],
+                             (i & 1) ? CELL_DIRECTION_OUT : CELL_DIRECTION_IN,
+                             &recognized);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread: a batch is done; queue the next batch of its circuit. */
+static void
+bench_relay_batch_reply(void *batch)
+{
+  --bench_batches_pending;
+  if (bench_batches_left > 0) {
+    --bench_batches_left;
+    ++bench_batches_pending;
+    threadpool_queue_work(bench_threadpool, bench_relay_batch_threadfn,
+                          bench_relay_batch_reply, batch);
+  }
+}
+
+/** Measure how the throughput of relay crypto scales with the number of
+ * worker threads (RelayCryptoThreads).  Like the relay crypto workers, we
+ * have at most one batch of each circuit with the workers at a time. */
+static void
+bench_relay_crypto_threads(void)
+{
+  const int n_circs = 64;
+  const int batches_per_circ = 128;
+  const int thread_counts[] = { 1, 2, 4, 8, 16 };
+  const int n_cells = n_circs * batches_per_circ * BENCH_BATCH_CELLS;
+  bench_relay_batch_t *batches = tor_calloc(n_circs, sizeof(*batches));
+  char key_data[CPATH_KEY_MATERIAL_LEN];
+  double ns_one_thread = 0;
+  unsigned t;
+  int i, j;
+
+  for (i = 0; i < n_circs; ++i) {
+    crypto_rand(key_data, sizeof(key_data));
+    relay_crypto_init(&batches[i].crypto, key_data, sizeof(key_data), 0, 0);
+    for (j = 0; j < BENCH_BATCH_CELLS; ++j)
+      crypto_rand((char*)batches[i].cells[j].payload, CELL_PAYLOAD_SIZE);
+  }
+
+  printf("(%d CPUs available)\n", compute_num_cpus());
+  for (t = 0; t < ARRAY_LENGTH(thread_counts); ++t) {
+    replyqueue_t *replyqueue = replyqueue_new(0);
+    monotime_t start, end;
+    double ns_per_cell;
+
+    /* Our threadpools can't be freed, so the idle workers of each round stay
+     * around until we exit. */
+    bench_threadpool = threadpool_new(thread_counts[t], replyqueue,
+                                      bench_worker_state_new,
+                                      bench_worker_state_free, NULL);
+    bench_batches_left = n_circs * batches_per_circ;
+    bench_batches_pending = 0;
+
+    monotime_get(&start);
+    for (i = 0; i < n_circs; ++i) {
+      --bench_batches_left;
+      ++bench_batches_pending;
+      threadpool_queue_work(bench_threadpool, bench_relay_batch_threadfn,
+                            bench_relay_batch_reply, &batches[i]);
+    }
+    while (bench_batches_pending > 0)
+      replyqueue_process(replyqueue);
+    monotime_get(&end);
+
+    ns_per_cell = NANOCOUNT(0, monotime_diff_nsec(&start, &end), n_cells);
+    if (t == 0)
+      ns_one_thread = ns_per_cell;
+    printf("%2d threads: %.2f ns per cell (%.1f MB/s of payload), "
+           "%.2fx the throughput of one thread\n",
+           thread_counts[t], ns_per_cell,
+           CELL_PAYLOAD_SIZE * 1000.0 / ns_per_cell,
+           ns_one_thread / ns_per_cell);
+  }
+
+  for (i = 0; i < n_circs; ++i)
+    relay_crypto_clear(&batches[i].crypto);
+  tor_free(batches);
+}
+
+/** Items to queue, and items with the workers, in bench_workqueue(). */
+static int bench_items_left = 0, bench_items_pending = 0;
+
+/** Worker thread: an item of work that takes almost no time, so that we
+ * measure the cost of passing it around. */
+static workqueue_reply_t
+bench_workqueue_threadfn(void *state, void *arg)
+{
+  uint64_t *counter = arg;
+  (void)state;
+  ++*counter;
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread: an item is done; queue another one in its place, at one of
+ * the three priorities. */
+static void
+bench_workqueue_reply(void *arg)
+{
+  --bench_items_pending;
+  if (bench_items_left > 0) {
+    --bench_items_left;
+    ++bench_items_pending;
+    threadpool_queue_work_priority(bench_threadpool,
+                                   bench_items_left % 3,
+                                   bench_workqueue_threadfn,
+                                   bench_workqueue_reply, arg);
+  }
+}
+
+/** Measure how many tiny items of work per second a threadpool can move
+ * between the main thread and its workers, so that the cost of queueing work
+ * and replies (and the contention on them) dominates. */
+static void
+bench_workqueue(void)
+{
+  const int n_items = 1<<18;
+  const int n_inflight = 1024;
+  const int thread_counts[] = { 1, 2, 4, 8, 16 };
+  uint64_t *counters = tor_calloc(n_inflight, sizeof(uint64_t));
+  unsigned t;
+  int i;
+
+  printf("(%d CPUs available)\n", compute_num_cpus());
+  for (t = 0; t < ARRAY_LENGTH(thread_counts); ++t) {
+    replyqueue_t *replyqueue = replyqueue_new(0);
+    monotime_t start, end;
+    double ns_per_item;
+
+    /* As in bench_relay_crypto_threads(), the idle workers of each round
+     * stay around until we exit. */
+    bench_threadpool = threadpool_new(thread_counts[t], replyqueue,
+                                      bench_worker_state_new,
+                                      bench_worker_state_free, NULL);
+    bench_items_left = n_items;
+    bench_items_pending = 0;
+
+    monotime_get(&start);
+    for (i = 0; i < n_inflight; ++i) {
+      --bench_items_left;
+      ++bench_items_pending;
+      threadpool_queue_work_priority(bench_threadpool, i % 3,
+                                     bench_workqueue_threadfn,
+                                     bench_workqueue_reply, &counters[i]);
+    }
+    while (bench_items_pending > 0)
+      replyqueue_process(replyqueue);
+    monotime_get(&end);
+
+    ns_per_item = NANOCOUNT(0, monotime_diff_nsec(&start, &end), n_items);
+    printf("%2d threads: %.2f ns per item (%.0f items/sec)\n",
+           thread_counts[t], ns_per_item, 1e9 / ns_per_item);
+  }
+
+  tor_free(counters);
+}
+
+/** Drive the EWMA circuitmux policy of one channel with many active
+ * circuits, the way the scheduler does: pick the preferred circuit, send a
+ * cell on it, repeat.  Also measure how long it takes to deactivate and
+ * reactivate a circuit. */
+static void
+bench_cmux_ewma(void)
+{
+  const int n_circs = 10000;
+  const int iters = 1<<20;
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol;
+  circuitmux_policy_circ_data_t **cdata;
+  circuit_t *circs;
+  uint64_t start, end;
+  int i;
+
+  cmux_ewma_set_options(NULL, NULL);
+  pol = ewma_policy.alloc_cmux_data(cmux);
+  circs = tor_calloc(n_circs, sizeof(circuit_t));
+  cdata = tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+  for (i = 0; i < n_circs; ++i) {
+    cdata[i] = ewma_policy.alloc_circ_data(cmux, pol, &circs[i],
+                                           CELL_DIRECTION_OUT, 0);
+    ewma_policy.notify_circ_active(cmux, pol, &circs[i], cdata[i]);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol);
+    ewma_policy.notify_xmit_cells(cmux, pol, circ, cdata[circ - circs], 1);
+  }
+  end = perftime();
+  printf("Pick a circuit and send a cell, %d active circuits: %.2f nsec\n",
+         n_circs, NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    int idx = (int)((i * UINT64_C(7919)) % n_circs);
+    ewma_policy.notify_circ_inactive(cmux, pol, &circs[idx], cdata[idx]);
+    ewma_policy.notify_circ_active(cmux, pol, &circs[idx], cdata[idx]);
+  }
+  end = perftime();
+  printf("Deactivate and reactivate a circuit, %d active circuits: "
+         "%.2f nsec\n", n_circs, NANOCOUNT(start, end, iters));
+
+  for (i = 0; i < n_circs; ++i) {
+    ewma_policy.notify_circ_inactive(cmux, pol, &circs[i], cdata[i]);
+    ewma_policy.free_circ_data(cmux, pol, &circs[i], cdata[i]);
+  }
+  ewma_policy.free_cmux_data(cmux, pol);
+  circuitmux_free(cmux);
+  tor_free(cdata);
+  tor_free(circs);
+}
+
+/** Time the periodic circuit expiry passes on a relay with many circuits,
+ * hardly any of which need looking at, against a walk of the global
+ * circuit list like the one those passes used to do. */
+static void
+bench_circuit_expiry(void)
+{
+  const int n_or_circs = 50000, n_origin_circs = 20;
+  const int iters = 1<<10;
+  uint64_t start, end;
+  int i, n_found = 0;
+
+  for (i = 0; i < n_or_circs; ++i)
+    or_circuit_new(0, NULL);
+  for (i = 0; i < n_origin_circs; ++i) {
+    origin_circuit_t *circ = origin_circuit_new();
+    circ->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+    circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_OPEN);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(circuit_get_global_list(), circuit_t *, circ,
+                      if (CIRCUIT_IS_ORIGIN(circ) &&
+                          !circ->marked_for_close &&
+                          circuit_may_expire_building(circ))
+                        ++n_found);
+  }
+  end = perftime();
+  printf("Walk %d circuits for expiry candidates: %.2f usec\n",
+         n_or_circs + n_origin_circs, MICROCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    circuit_expire_building();
+  end = perftime();
+  printf("circuit_expire_building(): %.2f usec\n",
+         MICROCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    circuit_expire_old_circuits_serverside(approx_time());
+  end = perftime();
+  printf("circuit_expire_old_circuits_serverside(): %.2f usec\n",
+         MICROCOUNT(start, end, iters));
+
+  if (n_found)
+    printf("ERROR: found %d candidates.\n", n_found);
+  circuit_free_all();
+}
+
+/** Time the per-address DoS accounting for a new connection and circuit
+ * from each of many distinct addresses, in the geoip client cache and in
+ * the fixed-size sketches. */
+static void
+bench_dos_accounting(void)
+{
+  const int n_addrs = 1<<21;
+  const time_t now = approx_time();
+  tor_addr_t addr;
+  uint64_t start, end;
+  int i;
+
+  /* The geoip cache only remembers connecting clients for statistics. */
+  get_options_mutable()->EntryStatistics = 1;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_addrs; ++i) {
+    clientmap_entry_t *ent;
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+    ent = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
+    ent->dos_stats.concurrent_count++;
+  }
+  end = perftime();
+  printf("geoip client cache: %.2f nsec per address, %"TOR_PRIuSZ
+         " bytes for %d addresses\n",
+         NANOCOUNT(start, end, n_addrs),
+         geoip_client_cache_total_allocation(), n_addrs);
+  geoip_stats_free_all();
+  get_options_mutable()->EntryStatistics = 0;
+
+  start = perftime();
+  for (i = 0; i < n_addrs; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    dos_sketch_conn_add(&addr);
+    if (dos_sketch_circ_note(&addr, 3, now) >= 45 &&
+        !dos_sketch_heavy_hitter_get(&addr, now))
+      dos_sketch_heavy_hitter_add(&addr, now);
+  }
+  end = perftime();
+  printf("DoS sketches: %.2f nsec per address, %d heavy hitters\n",
+         NANOCOUNT(start, end, n_addrs), dos_sketch_heavy_hitter_count());
+  dos_sketch_free_all();
+}
+
+/** Time exit policy lookups, walking the rules and in compiled policies, for
+ * the exit policies of a consensus' worth of exits: each rejects private
+ * addresses and its own, then takes one of a few common ExitPolicy lines
+ * followed by the default or the reduced exit policy. */
+static void
+bench_exit_policy(void)
+{
+  static const char *exit_lines[] = {
+    "",
+    "accept *:80, accept *:443, reject *:*",
+    "reject *:25, reject *:465, reject *:587",
+    "accept *:53, accept *:80-81, accept *:443, accept *:8080, reject *:*",
+  };
+  const int n_exits = 1000, iters = 1<<20;
+  smartlist_t **policies = tor_calloc(n_exits, sizeof(smartlist_t *));
+  compiled_addr_policy_t **compiled =
+    tor_calloc(n_exits, sizeof(compiled_addr_policy_t *));
+  tor_addr_t *addrs = tor_calloc(iters, sizeof(tor_addr_t));
+  uint16_t *ports = tor_calloc(iters, sizeof(uint16_t));
+  smartlist_t *my_addrs = smartlist_new();
+  config_line_t line;
+  tor_addr_t my_addr;
+  uint64_t start, end;
+  int i, n_accepted = 0, n_accepted_compiled = 0;
+
+  memset(&line, 0, sizeof(line));
+  line.key = (char *)"ExitPolicy";
+  smartlist_add(my_addrs, &my_addr);
+  for (i = 0; i < n_exits; ++i) {
+    line.value = (char *)exit_lines[i % ARRAY_LENGTH(exit_lines)];
+    tor_addr_from_ipv4h(&my_addr, (uint32_t)crypto_rand_uint64(
+                                               UINT64_C(1) << 32));
+    policies_parse_exit_policy(*line.value ? &line : NULL, &policies[i],
+                               EXIT_POLICY_REJECT_PRIVATE |
+                               ((i & 4) ? EXIT_POLICY_ADD_REDUCED :
+                                EXIT_POLICY_ADD_DEFAULT),
+                               my_addrs);
+  }
+  for (i = 0; i < iters; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], (uint32_t)crypto_rand_uint64(
+                                                UINT64_C(1) << 32));
+    /* Half of the streams are to the web, the rest to any port. */
+    ports[i] = (i & 1) ? 443 : 1 + crypto_rand_int(65535);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_exits; ++i)
+    compiled[i] = addr_policy_compile(policies[i]);
+  end = perftime();
+  printf("Compile %d exit policies of about %d rules: %.2f usec each\n",
+         n_exits, smartlist_len(policies[0]),
+         MICROCOUNT(start, end, n_exits));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    if (compare_tor_addr_to_addr_policy(&addrs[i], ports[i],
+                                        policies[i % n_exits]) ==
+        ADDR_POLICY_ACCEPTED)
+      ++n_accepted;
+  }
+  end = perftime();
+  printf("compare_tor_addr_to_addr_policy(): %.2f nsec\n",
+         NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    if (compare_tor_addr_to_compiled_policy(&addrs[i], ports[i],
+                                            compiled[i % n_exits]) ==
+        ADDR_POLICY_ACCEPTED)
+      ++n_accepted_compiled;
+  }
+  end = perftime();
+  printf("compare_tor_addr_to_compiled_policy(): %.2f nsec\n",
+         NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    compare_tor_addr_to_addr_policy(NULL, ports[i], policies[i % n_exits]);
+  end = perftime();
+  printf("compare_tor_addr_to_addr_policy(), unknown address: %.2f nsec\n",
+         NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    compare_tor_addr_to_compiled_policy(NULL, ports[i],
+                                        compiled[i % n_exits]);
+  end = perftime();
+  printf("compare_tor_addr_to_compiled_policy(), unknown address: "
+         "%.2f nsec\n", NANOCOUNT(start, end, iters));
+
+  if (n_accepted != n_accepted_compiled)
+    printf("ERROR: %d accepted, but %d in compiled policies.\n",
+           n_accepted, n_accepted_compiled);
+
+  for (i = 0; i < n_exits; ++i) {
+    compiled_addr_policy_free(compiled[i]);
+    addr_policy_list_free(policies[i]);
+  }
+  tor_free(compiled);
+  tor_free(policies);
+  tor_free(addrs);
+  tor_free(ports);
+  smartlist_free(my_addrs);
+}
+
+/** Helper for bench_node_select(): choose a node from <b>nodes</b> the way
+ * router_choose_random_node() did before it cached node weights, by
+ * listing every acceptable node and weighting each of them. The nodes are
+ * copies that aren't in the nodelist, so node_sl_choose_by_bandwidth()
+ * can't use the cached weights for them. */
+static const node_t *
+bench_choose_node_uncached(const smartlist_t *nodes,
+                           const smartlist_t *excluded,
+                           int need_guard, bandwidth_weight_rule_t rule)
+{
+  smartlist_t *sl = smartlist_new();
+  const node_t *choice;
+
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    if (router_node_is_running_candidate(node, need_guard, 1, need_guard,
+                                         0, 0, 0, 0, 0) &&
+        !smartlist_contains(excluded, node))
+      smartlist_add(sl, (void *)node);
+  } SMARTLIST_FOREACH_END(node);
+  choice = node_sl_choose_by_bandwidth(sl, rule);
+  smartlist_free(sl);
+  return choice;
+}
+
+/** Time how many three-hop paths per second we can choose from a
+ * consensus' worth of relays, weighting every candidate on each pick, and
+ * drawing from the cached node weights. */
+static void
+bench_node_select(void)
+{
+  const int n_relays = 7000, n_circs = 20000;
+  routerinfo_t **routers = tor_calloc(n_relays, sizeof(routerinfo_t *));
+  routerstatus_t *statuses = tor_calloc(n_relays, sizeof(routerstatus_t));
+  smartlist_t *copies = smartlist_new();
+  smartlist_t *path = smartlist_new();
+  uint64_t start, end;
+  int i, n_failed = 0;
+
+  /* We have no consensus to install, so we give each node a descriptor and
+   * a routerstatus by hand. */
+  for (i = 0; i < n_relays; ++i) {
+    routerinfo_t *ri = routers[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    routerstatus_t *rs = &statuses[i];
+    const int bw = crypto_rand_int(300);
+    node_t *node;
+
+    crypto_rand(ri->cache_info.identity_digest, DIGEST_LEN);
+    ri->addr = (uint32_t)crypto_rand_uint64(UINT64_C(1) << 32);
+    ri->or_port = 9001;
+    ri->onion_curve25519_pkey =
+      tor_malloc_zero(sizeof(curve25519_public_key_t));
+    crypto_rand((char *)ri->onion_curve25519_pkey->public_key,
+                CURVE25519_PUBKEY_LEN);
+    memcpy(rs->identity_digest, ri->cache_info.identity_digest, DIGEST_LEN);
+    rs->is_v2_dir = 1;
+    /* Most relays are slow; a few are very fast. */
+    rs->has_bandwidth = 1;
+    rs->bandwidth_kb = 20 + bw * bw;
+
+    node = nodelist_set_routerinfo(ri, NULL);
+    node->rs = rs;
+    node->is_running = node->is_valid = 1;
+    node->is_fast = (i % 8) != 0;
+    node->is_stable = (i % 4) != 0;
+    node->is_possible_guard = (i % 3) == 0;
+    node->is_exit = (i % 7) == 0;
+  }
+  node_select_weights_changed();
+  SMARTLIST_FOREACH(nodelist_get_list(), const node_t *, node, {
+    node_t *copy = tor_memdup(node, sizeof(node_t));
+    copy->nodelist_idx = -1;
+    smartlist_add(copies, copy);
+  });
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_circs; ++i) {
+    const node_t *node;
+    smartlist_clear(path);
+    if ((node = bench_choose_node_uncached(copies, path, 1,
+                                           WEIGHT_FOR_GUARD)))
+      smartlist_add(path, (void *)node);
+    if ((node = bench_choose_node_uncached(copies, path, 0, WEIGHT_FOR_MID)))
+      smartlist_add(path, (void *)node);
+    if ((node = bench_choose_node_uncached(copies, path, 0,
+                                           WEIGHT_FOR_EXIT)))
+      smartlist_add(path, (void *)node);
+    n_failed += smartlist_len(path) != 3;
+  }
+  end = perftime();
+  printf("Weighting every candidate: %.2f usec per path, "
+         "%.0f paths per second\n",
+         MICROCOUNT(start, end, n_circs),
+         n_circs / (NANOCOUNT(start, end, 1) / 1e9));
+
+  start = perftime();
+  for (i = 0; i < n_circs; ++i) {
+    const node_t *node;
+    smartlist_clear(path);
+    if ((node = router_choose_random_node(path, NULL,
+                                          CRN_NEED_GUARD|CRN_NEED_UPTIME|
+                                          CRN_NEED_CAPACITY)))
+      smartlist_add(path, (void *)node);
+    if ((node = router_choose_random_node(path, NULL, CRN_NEED_CAPACITY)))
+      smartlist_add(path, (void *)node);
+    if ((node = router_choose_random_node(path, NULL,
+                                          CRN_NEED_CAPACITY|
+                                          CRN_WEIGHT_AS_EXIT)))
+      smartlist_add(path, (void *)node);
+    n_failed += smartlist_len(path) != 3;
+  }
+  end = perftime();
+  printf("Drawing from cached weights: %.2f usec per path, "
+         "%.0f paths per second\n",
+         MICROCOUNT(start, end, n_circs),
+         n_circs / (NANOCOUNT(start, end, 1) / 1e9));
+
+  if (n_failed)
+    printf("ERROR: couldn't choose %d paths.\n", n_failed);
+
+  SMARTLIST_FOREACH(copies, node_t *, copy, tor_free(copy));
+  smartlist_free(copies);
+  smartlist_free(path);
+  nodelist_free_all();
+  for (i = 0; i < n_relays; ++i)
+    routerinfo_free(routers[i]);
+  tor_free(routers);
+  tor_free(statuses);
+}
+
+/** Return a microdesc consensus with <b>n_relays</b> routerstatus entries,
+ * one directory source, and a signature that nothing will check. */
+static char *
+bench_make_consensus(int n_relays)
+{
+  smartlist_t *chunks = smartlist_new();
+  char auth_id[DIGEST_LEN], auth_hex[HEX_DIGEST_LEN+1];
+  char sig[256], sig64[512];
+  char *result;
+  int i;
+
+  crypto_rand(auth_id, sizeof(auth_id));
+  base16_encode(auth_hex, sizeof(auth_hex), auth_id, sizeof(auth_id));
+  smartlist_add_asprintf(chunks,
+                         "network-status-version 3 microdesc\n"
+                         "vote-status consensus\n"
+                         "consensus-method 28\n"
+                         "valid-after 2019-05-05 06:00:00\n"
+                         "fresh-until 2019-05-05 07:00:00\n"
+                         "valid-until 2019-05-05 09:00:00\n"
+                         "voting-delay 300 300\n"
+                         "client-versions 0.3.5.11\n"
+                         "server-versions 0.3.5.11\n"
+                         "known-flags Exit Fast Guard Running Stable Valid\n"
+                         "dir-source auth %s 127.0.0.1 127.0.0.1 80 9001\n"
+                         "contact auth@example.com\n"
+                         "vote-digest %s\n", auth_hex, auth_hex);
+  for (i = 0; i < n_relays; ++i) {
+    char id[DIGEST_LEN], md[DIGEST256_LEN];
+    char id64[BASE64_DIGEST_LEN+1], md64[BASE64_DIGEST256_LEN+1];
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    crypto_rand(md, sizeof(md));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(chunks,
+                           "r relay%d %s 2019-05-05 05:05:05 10.%d.%d.%d "
+                           "9001 0\n", i, id64, (i >> 16) & 0xff,
+                           (i >> 8) & 0xff, i & 0xff);
+    if (i % 3 == 0)
+      smartlist_add_asprintf(chunks, "a [2001:db8::%x]:9001\n", i);
+    smartlist_add_asprintf(chunks,
+                           "m %s\n"
+                           "s %sFast%s Running Stable Valid\n"
+                           "v Tor 0.3.5.11\n"
+                           "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 "
+                           "HSIntro=3-4 HSRend=1-2 Link=1-5 LinkAuth=1,3 "
+                           "Microdesc=1-2 Relay=1-2\n"
+                           "w Bandwidth=%d\n",
+                           md64, (i % 4) ? "" : "Exit ",
+                           (i % 3) ? "" : " Guard", crypto_rand_int(50000));
+  }
+  crypto_rand(sig, sizeof(sig));
+  base64_encode(sig64, sizeof(sig64), sig, sizeof(sig),
+                BASE64_ENCODE_MULTILINE);
+  smartlist_add_asprintf(chunks,
+                         "directory-footer\n"
+                         "directory-signature sha256 %s %s\n"
+                         "-----BEGIN SIGNATURE-----\n%s"
+                         "-----END SIGNATURE-----\n", auth_hex, auth_hex,
+                         sig64);
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Time how long it takes to parse a consensus with as many relays as the
+ * real one, on the main thread alone and with ParallelConsensusParsing. */
+static void
+bench_consensus_parse(void)
+{
+  const int n_relays = 7000, iters = 20;
+  char *consensus = bench_make_consensus(n_relays);
+  struct tor_libevent_cfg cfg;
+  uint64_t start, end;
+  int i, parallel, n_failed = 0;
+
+  /* The cpuworkers want an event base for their replies, and onion keys. */
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  if (init_keys_client() < 0) {
+    printf("Couldn't make keys; skipping.\n");
+    tor_free(consensus);
+    return;
+  }
+  cpu_init();
+
+  for (parallel = 0; parallel <= 1; ++parallel) {
+    get_options_mutable()->ParallelConsensusParsing = parallel;
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      networkstatus_t *ns =
+        networkstatus_parse_vote_from_string(consensus, NULL,
+                                             NS_TYPE_CONSENSUS);
+      if (!ns || smartlist_len(ns->routerstatus_list) != n_relays)
+        ++n_failed;
+      networkstatus_vote_free(ns);
+      /* Let the workers' replies release their jobs. */
+      event_base_loop(tor_libevent_get_base(), EVLOOP_NONBLOCK);
+    }
+    end = perftime();
+    printf("%s: %.2f msec per %d-relay consensus (%d worker threads)\n",
+           parallel ? "Parallel" : "Main thread only",
+           NANOCOUNT(start, end, iters) / 1e6, n_relays,
+           parallel ? cpuworker_get_n_threads() : 0);
+  }
+  get_options_mutable()->ParallelConsensusParsing = 0;
+
+  if (n_failed)
+    printf("ERROR: %d parses failed.\n", n_failed);
+  tor_free(consensus);
+}
+
+/** Return a copy of <b>consensus</b>, made by bench_make_consensus(), that
+ * has changed about as much as a real one does in an hour: a few relays
+ * are gone, and many have new bandwidths or microdescriptors. */
+static char *
+bench_next_consensus(const char *consensus)
+{
+  smartlist_t *lines = smartlist_new();
+  smartlist_t *out = smartlist_new();
+  int dropping = 0;
+  char *result;
+
+  smartlist_split_string(lines, consensus, "\n", 0, 0);
+  SMARTLIST_FOREACH_BEGIN(lines, char *, line) {
+    if (!strcmpstart(line, "r "))
+      dropping = crypto_rand_int(100) < 2;
+    else if (!strcmpstart(line, "directory-footer"))
+      dropping = 0;
+    if (dropping) {
+      tor_free(line);
+      continue;
+    }
+    if (!strcmpstart(line, "w ") && crypto_rand_int(2)) {
+      tor_free(line);
+      tor_asprintf(&line, "w Bandwidth=%d", crypto_rand_int(50000));
+    } else if (!strcmpstart(line, "m ") && crypto_rand_int(10) == 0) {
+      char md[DIGEST256_LEN], md64[BASE64_DIGEST256_LEN+1];
+      crypto_rand(md, sizeof(md));
+      digest256_to_base64(md64, md);
+      tor_free(line);
+      tor_asprintf(&line, "m %s", md64);
+    } else if (!strcmpstart(line, "valid-after ")) {
+      tor_free(line);
+      line = tor_strdup("valid-after 2019-05-05 07:00:00");
+    }
+    smartlist_add(out, line);
+  } SMARTLIST_FOREACH_END(line);
+  result = smartlist_join_strings(out, "\n", 0, NULL);
+
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  smartlist_free(lines);
+  return result;
+}
+
+/** Return a document that consensus_diff_generate() accepts, but that has
+ * no router entries, so that its diffs are made of a single chunk. Its
+ * <b>n_lines</b> lines are numbered; every <b>edit_every</b>th of them
+ * (if nonzero) gets a different number. */
+static char *
+bench_make_flat_document(int n_lines, int edit_every)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+
+  smartlist_add_strdup(chunks, "network-status-version 3\n");
+  for (i = 0; i < n_lines; ++i) {
+    smartlist_add_asprintf(chunks, "line %d\n",
+                           (edit_every && i % edit_every == 0) ? -i : i);
+  }
+  smartlist_add_strdup(chunks, "directory-signature x\nsignature\n");
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Helper for bench_consensus_diff: time how long it takes to generate a
+ * diff from <b>cons1</b> to <b>cons2</b>, and describe the result as
+ * <b>what</b>. */
+static void
+bench_consensus_diff_pair(const char *what, const char *cons1,
+                          const char *cons2, int iters)
+{
+  char *diff, *applied;
+  uint64_t start, end;
+  int i;
+
+  diff = consensus_diff_generate(cons1, cons2);
+  applied = diff ? consensus_diff_apply(cons1, diff) : NULL;
+  if (!applied || strcmp(applied, cons2)) {
+    printf("ERROR: the diff doesn't turn one %s into the other.\n", what);
+    goto done;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    char *d = consensus_diff_generate(cons1, cons2);
+    tor_free(d);
+  }
+  end = perftime();
+  printf("%.2f msec per diff of %s (%d bytes)\n",
+         NANOCOUNT(start, end, iters) / 1e6, what, (int)strlen(diff));
+
+ done:
+  tor_free(diff);
+  tor_free(applied);
+}
+
+/** Time how long it takes to generate a diff between two consensuses an hour
+ * apart, with as many relays as the real ones, and between two documents
+ * that can't be cut into chunks by router identity. Use "bench diff" to time
+ * real consensuses. */
+static void
+bench_consensus_diff(void)
+{
+  char *cons1 = bench_make_consensus(7000);
+  char *cons2 = bench_next_consensus(cons1);
+  char *flat1 = bench_make_flat_document(9000, 0);
+  char *flat2 = bench_make_flat_document(9000, 100);
+
+  bench_consensus_diff_pair("7000-relay consensuses", cons1, cons2, 20);
+  bench_consensus_diff_pair("9000-line chunks", flat1, flat2, 5);
+
+  tor_free(cons1);
+  tor_free(cons2);
+  tor_free(flat1);
+  tor_free(flat2);
+}
+
+/** Move data through a socketpair with buf_flush_to_socket() and
+ * buf_read_from_socket(), the way a busy connection does: from an outbuf
+ * full of cells (so, of default-sized chunks), and up to a bucket-sized
+ * limit per call. */
+static void
+bench_buf_socket(void)
+{
+  const size_t total = 64<<20;
+  const size_t limit = 256<<10;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *outbuf = buf_new(), *inbuf = buf_new();
+  char cell[CELL_MAX_NETWORK_SIZE];
+  size_t queued = 0, received = 0;
+  int reached_eof = 0, socket_error = 0;
+  monotime_t start, end;
+
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+      set_socket_nonblocking(fds[0]) < 0 ||
+      set_socket_nonblocking(fds[1]) < 0) {
+    puts("Couldn't make a socketpair.");
+    goto done;
+  }
+  memset(cell, 'x', sizeof(cell));
+
+  monotime_get(&start);
+  while (received < total) {
+    size_t flushlen;
+    int r;
+
+    while (buf_datalen(outbuf) < limit && queued < total) {
+      buf_add(outbuf, cell, sizeof(cell));
+      queued += sizeof(cell);
+    }
+    flushlen = buf_datalen(outbuf);
+    r = buf_flush_to_socket(outbuf, fds[0], MIN(flushlen, limit), &flushlen);
+    if (r < 0) {
+      puts("Write failed.");
+      goto done;
+    }
+    r = buf_read_from_socket(inbuf, fds[1], limit, &reached_eof,
+                             &socket_error);
+    if (r < 0) {
+      puts("Read failed.");
+      goto done;
+    }
+    received += r;
+    buf_clear(inbuf);
+  }
+  monotime_get(&end);
+
+  printf("%.2f usec per MB\n",
+         monotime_diff_usec(&start, &end) / (double)(total >> 20));
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(outbuf);
+  buf_free(inbuf);
+}
+
+#ifdef BUF_SOCKET_IO_VECTORED
+/** Number of TCP connections, and bytes per connection, for
+ * bench_conn_loop(). */
+#define BENCH_LOOP_N_CONNS 64
+#define BENCH_LOOP_BYTES_PER_CONN (1<<20)
+/** Bytes per read or write for bench_conn_loop(). */
+#define BENCH_LOOP_IO_LEN 16384
+
+/** State of one connection of bench_conn_loop(): we send from
+ * <b>fds[0]</b> to <b>fds[1]</b>. */
+typedef struct bench_loop_conn_t {
+  tor_socket_t fds[2];
+  size_t sent;
+  size_t received;
+  struct event *write_ev;
+  struct event *read_ev;
+  struct iovec iov;
+  struct msghdr msg;
+  char rbuf[BENCH_LOOP_IO_LEN];
+} bench_loop_conn_t;
+
+static char bench_loop_data[BENCH_LOOP_IO_LEN];
+static size_t bench_loop_n_done;
+static uint64_t bench_loop_n_syscalls;
+static tor_uring_t *bench_loop_ring;
+static bench_loop_conn_t *bench_loop_conns;
+
+/** Open a connected pair of non-blocking TCP sockets on the loopback
+ * address.  Return 0 on success, -1 on failure. */
+static int
+bench_loopback_tcp_pair(tor_socket_t fds[2])
+{
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof(sin);
+  tor_socket_t listener;
+  int r = -1;
+
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(listener))
+    return -1;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&sin, &sin_len) < 0)
+    goto done;
+  fds[0] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(fds[0]) ||
+      connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    goto done;
+  fds[1] = tor_accept_socket(listener, NULL, NULL);
+  if (!SOCKET_OK(fds[1]) ||
+      set_socket_nonblocking(fds[0]) < 0 ||
+      set_socket_nonblocking(fds[1]) < 0)
+    goto done;
+  r = 0;
+ done:
+  tor_close_socket(listener);
+  return r;
+}
+
+/** Libevent callback for bench_conn_loop(): a sender can write. */
+static void
+bench_loop_write_cb(evutil_socket_t fd, short what, void *arg)
+{
+  bench_loop_conn_t *c = arg;
+  size_t len = MIN(BENCH_LOOP_IO_LEN, BENCH_LOOP_BYTES_PER_CONN - c->sent);
+  ssize_t r = tor_socket_send(fd, bench_loop_data, len, 0);
+  (void)what;
+  ++bench_loop_n_syscalls;
+  if (r > 0)
+    c->sent += r;
+  if (c->sent == BENCH_LOOP_BYTES_PER_CONN)
+    event_del(c->write_ev);
+}
+
+/** Libevent callback for bench_conn_loop(): a receiver can read. */
+static void
+bench_loop_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+  bench_loop_conn_t *c = arg;
+  ssize_t r = tor_socket_recv(fd, c->rbuf, sizeof(c->rbuf), 0);
+  (void)what;
+  ++bench_loop_n_syscalls;
+  if (r > 0)
+    c->received += r;
+  if (c->received == BENCH_LOOP_BYTES_PER_CONN) {
+    event_del(c->read_ev);
+    ++bench_loop_n_done;
+  }
+}
+
+/** Post the io_uring requests that connection <b>i</b> of bench_conn_loop()
+ * needs next: <b>send</b> and <b>recv</b> say which. */
+static void
+bench_loop_uring_prep(int i, int send, int recv)
+{
+  bench_loop_conn_t *c = &bench_loop_conns[i];
+  if (send && c->sent < BENCH_LOOP_BYTES_PER_CONN) {
+    c->iov.iov_base = bench_loop_data;
+    c->iov.iov_len = MIN(BENCH_LOOP_IO_LEN,
+                         BENCH_LOOP_BYTES_PER_CONN - c->sent);
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = &c->iov;
+    c->msg.msg_iovlen = 1;
+    tor_uring_prep_sendmsg(bench_loop_ring, c->fds[0], &c->msg, i*2);
+  }
+  if (recv && c->received < BENCH_LOOP_BYTES_PER_CONN)
+    tor_uring_prep_recv(bench_loop_ring, c->fds[1], c->rbuf,
+                        sizeof(c->rbuf), i*2+1);
+}
+
+/** Libevent callback for bench_conn_loop(): the io_uring's eventfd is
+ * readable, so some requests completed. */
+static void
+bench_loop_uring_cb(evutil_socket_t fd, short what, void *arg)
+{
+  uint64_t user_data, count;
+  int res;
+  (void)what;
+  (void)arg;
+  if (read(fd, &count, sizeof(count)) < 0)
+    return;
+  ++bench_loop_n_syscalls;
+  while (tor_uring_get_completion(bench_loop_ring, &user_data, &res)) {
+    bench_loop_conn_t *c = &bench_loop_conns[user_data / 2];
+    if (res < 0)
+      continue;
+    if (user_data & 1) {
+      c->received += res;
+      if (c->received == BENCH_LOOP_BYTES_PER_CONN)
+        ++bench_loop_n_done;
+      bench_loop_uring_prep((int)(user_data / 2), 0, 1);
+    } else {
+      c->sent += res;
+      bench_loop_uring_prep((int)(user_data / 2), 1, 0);
+    }
+  }
+  tor_uring_submit(bench_loop_ring);
+}
+
+/** Move data over many loopback TCP connections at once, with a libevent
+ * loop: either the usual way, where libevent tells us which sockets are
+ * ready and we call send() and recv() on them, or with an io_uring whose
+ * eventfd libevent watches, where we keep requests posted on every socket
+ * and submit all of them at once. */
+static void
+bench_conn_loop(void)
+{
+  const size_t total = (size_t)BENCH_LOOP_N_CONNS *
+    BENCH_LOOP_BYTES_PER_CONN;
+  int use_uring, i;
+
+  memset(bench_loop_data, 'x', sizeof(bench_loop_data));
+  for (use_uring = 0; use_uring <= 1; ++use_uring) {
+    struct event_base *base = event_base_new();
+    struct event *uring_ev = NULL;
+    alert_sockets_t efd;
+    uint64_t n_passes = 0;
+    monotime_t start, end;
+
+    memset(&efd, 0, sizeof(efd));
+    efd.read_fd = efd.write_fd = TOR_INVALID_SOCKET;
+    bench_loop_conns = tor_calloc(BENCH_LOOP_N_CONNS,
+                                  sizeof(bench_loop_conn_t));
+    bench_loop_n_done = 0;
+    bench_loop_n_syscalls = 0;
+    for (i = 0; i < BENCH_LOOP_N_CONNS; ++i) {
+      if (bench_loopback_tcp_pair(bench_loop_conns[i].fds) < 0) {
+        puts("Couldn't open a TCP connection.");
+        goto done;
+      }
+    }
+
+    if (use_uring) {
+      bench_loop_ring = tor_uring_new(4 * BENCH_LOOP_N_CONNS);
+      if (!bench_loop_ring ||
+          alert_sockets_create(&efd, ASOCKS_NOPIPE2|ASOCKS_NOPIPE|
+                               ASOCKS_NOSOCKETPAIR) < 0 ||
+          tor_uring_set_eventfd(bench_loop_ring, efd.read_fd) < 0) {
+        puts("io_uring is unavailable.");
+        goto done;
+      }
+      uring_ev = event_new(base, efd.read_fd, EV_READ|EV_PERSIST,
+                           bench_loop_uring_cb, NULL);
+      event_add(uring_ev, NULL);
+    } else {
+      for (i = 0; i < BENCH_LOOP_N_CONNS; ++i) {
+        bench_loop_conn_t *c = &bench_loop_conns[i];
+        c->write_ev = event_new(base, c->fds[0], EV_WRITE|EV_PERSIST,
+                                bench_loop_write_cb, c);
+        c->read_ev = event_new(base, c->fds[1], EV_READ|EV_PERSIST,
+                               bench_loop_read_cb, c);
+      }
+    }
+
+    monotime_get(&start);
+    if (use_uring) {
+      for (i = 0; i < BENCH_LOOP_N_CONNS; ++i)
+        bench_loop_uring_prep(i, 1, 1);
+      tor_uring_submit(bench_loop_ring);
+    } else {
+      for (i = 0; i < BENCH_LOOP_N_CONNS; ++i) {
+        event_add(bench_loop_conns[i].write_ev, NULL);
+        event_add(bench_loop_conns[i].read_ev, NULL);
+      }
+    }
+    while (bench_loop_n_done < BENCH_LOOP_N_CONNS) {
+      event_base_loop(base, EVLOOP_ONCE);
+      ++n_passes;
+    }
+    monotime_get(&end);
+
+    if (use_uring)
+      bench_loop_n_syscalls += tor_uring_get_n_syscalls(bench_loop_ring);
+    /* Each pass of the loop is also one epoll_wait(). */
+    bench_loop_n_syscalls += n_passes;
+    printf("%s: %.2f usec per MB, %.1f system calls per MB\n",
+           use_uring ? "io_uring" : "libevent",
+           monotime_diff_usec(&start, &end) / (double)(total >> 20),
+           bench_loop_n_syscalls / (double)(total >> 20));
+
+  done:
+    for (i = 0; i < BENCH_LOOP_N_CONNS; ++i) {
+      bench_loop_conn_t *c = &bench_loop_conns[i];
+      if (c->write_ev)
+        event_free(c->write_ev);
+      if (c->read_ev)
+        event_free(c->read_ev);
+    }
+    if (uring_ev)
+      event_free(uring_ev);
+    /* Close the ring first: it may still refer to the sockets. */
+    tor_uring_free(bench_loop_ring);
+    for (i = 0; i < BENCH_LOOP_N_CONNS; ++i) {
+      bench_loop_conn_t *c = &bench_loop_conns[i];
+      if (SOCKET_OK(c->fds[0]))
+        tor_close_socket(c->fds[0]);
+      if (SOCKET_OK(c->fds[1]))
+        tor_close_socket(c->fds[1]);
+    }
+    if (SOCKET_OK(efd.read_fd))
+      alert_sockets_close(&efd);
+    tor_free(bench_loop_conns);
+    event_base_free(base);
+  }
+}
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
+
 static void
 bench_dh(void)
 {
@@ -660,6 +1896,20 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_pool),
+  ENT(relay_crypto_threads),
+  ENT(workqueue),
+  ENT(cmux_ewma),
+  ENT(circuit_expiry),
+  ENT(dos_accounting),
+  ENT(exit_policy),
+  ENT(node_select),
+  ENT(consensus_parse),
+  ENT(consensus_diff),
+  ENT(buf_socket),
+#ifdef BUF_SOCKET_IO_VECTORED
+  ENT(conn_loop),
+#endif
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -0,0 +1,583 @@
+#!/usr/bin/env python3
+# Copyright (c) 2007-2019, The Tor Project, Inc.
+# See LICENSE for licensing information
+
+"""
+End-to-end benchmark for split circuits on a private loopback network.
+
+This script launches a small Tor network on 127.0.0.0/8 -- a set of
+directory authorities, at least six relays and one split-enabled client,
+all voting on and using a private consensus -- and pushes bulk and
+request/response workloads through the client's SOCKSPort to a local sink
+server.  For every configured split strategy it reports throughput, time to
+first byte (TTFB), request/response latency and the cell reordering
+statistics the client exposes via GETINFO split/reorder-stats.
+
+Per-link rate shaping is done inside tor's token buckets through
+TestingORConnBWRate/TestingORConnBWBurst.  Per-link delay is applied with a
+netem qdisc on the loopback interface if requested and permitted.
+
+Usage:
+  bench_split_network.py --tor-dir <builddir> [options]
+
+The exit status is non-zero if the network fails to bootstrap, a workload
+fails, or a result falls below one of the --min-* release gates.
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import shutil
+import socket
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+BASE_PORT = 7100
+BOOTSTRAP_TIMEOUT = 300.0
+STRATEGIES = ["ROUND_ROBIN", "RANDOM_UNIFORM", "WEIGHTED_RANDOM",
+              "BATCHED_WEIGHTED_RANDOM"]
+
+COMMON_TORRC = """\
+TestingTorNetwork 1
+DataDirectory {datadir}
+RunAsDaemon 0
+PidFile {datadir}/pid
+Log notice file {datadir}/notice.log
+SafeLogging 0
+ShutdownWaitLength 0
+AssumeReachable 1
+PathsNeededToBuildCircuits 0.25
+TestingDirAuthVoteExit *
+TestingDirAuthVoteGuard *
+TestingDirAuthVoteHSDir *
+TestingMinExitFlagThreshold 0
+V3AuthNIntervalsValid 2
+TestingV3AuthInitialVotingInterval 20
+TestingV3AuthInitialVoteDelay 4
+TestingV3AuthInitialDistDelay 4
+V3AuthVotingInterval 20
+V3AuthVoteDelay 4
+V3AuthDistDelay 4
+ControlPort {address}:{control_port}
+Nickname {nick}
+{shaping}
+{dirauths}
+"""
+
+RELAY_TORRC = """\
+SocksPort 0
+Address {address}
+OutboundBindAddress {address}
+ORPort {address}:{or_port}
+DirPort {address}:{dir_port}
+ContactInfo bench-split-network
+ExitRelay 1
+ExitPolicyRejectPrivate 0
+ExitPolicy accept *:*
+"""
+
+AUTHORITY_TORRC = """\
+AuthoritativeDirectory 1
+V3AuthoritativeDirectory 1
+AuthDirMaxServersPerAddr 0
+"""
+
+CLIENT_TORRC = """\
+SocksPort {address}:{socks_port}
+SplitSubcircuits {subcircuits}
+SplitStrategy {strategy}
+"""
+
+
+def log(msg):
+    print("[bench-split] {}".format(msg), file=sys.stderr)
+    sys.stderr.flush()
+
+
+def fail(msg):
+    log("FAIL: {}".format(msg))
+    sys.exit(1)
+
+
+class Node(object):
+    """One tor process of the benchmark network."""
+
+    def __init__(self, net, idx, kind):
+        self.net = net
+        self.idx = idx
+        self.kind = kind
+        self.nick = "{}{:03d}".format(kind, idx)
+        self.address = "127.0.0.{}".format(10 + idx)
+        port = BASE_PORT + 10 * idx
+        self.or_port = port
+        self.dir_port = port + 1
+        self.control_port = port + 2
+        self.socks_port = port + 3
+        self.datadir = os.path.join(net.workdir, self.nick)
+        self.fingerprint = None
+        self.v3ident = None
+        self.proc = None
+        os.makedirs(os.path.join(self.datadir, "keys"))
+
+    def make_authority_keys(self):
+        keydir = os.path.join(self.datadir, "keys")
+        cmd = [self.net.gencert, "--create-identity-key",
+               "--passphrase-fd", "0",
+               "-i", os.path.join(keydir, "authority_identity_key"),
+               "-s", os.path.join(keydir, "authority_signing_key"),
+               "-c", os.path.join(keydir, "authority_certificate"),
+               "-m", "12",
+               "-a", "{}:{}".format(self.address, self.dir_port)]
+        subprocess.run(cmd, input=b"\n", check=True,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open(os.path.join(keydir, "authority_certificate")) as f:
+            for line in f:
+                if line.startswith("fingerprint "):
+                    self.v3ident = line.split()[1]
+        if not self.v3ident:
+            fail("tor-gencert did not produce a fingerprint for "
+                 + self.nick)
+
+    def make_identity(self):
+        out = subprocess.check_output(
+            [self.net.tor, "--quiet", "--ignore-missing-torrc",
+             "--list-fingerprint", "--ORPort", "1",
+             "--Nickname", self.nick, "--DataDirectory", self.datadir])
+        self.fingerprint = "".join(out.decode().split()[1:])
+
+    def dirauth_line(self):
+        return ("DirAuthority {} orport={} no-v2 v3ident={} {}:{} {}"
+                .format(self.nick, self.or_port, self.v3ident, self.address,
+                        self.dir_port, self.fingerprint))
+
+    def write_torrc(self, dirauths, shaping, strategy, subcircuits):
+        conf = COMMON_TORRC.format(datadir=self.datadir, nick=self.nick,
+                                   address=self.address,
+                                   control_port=self.control_port,
+                                   shaping=shaping, dirauths=dirauths)
+        if self.kind == "client":
+            conf += CLIENT_TORRC.format(address=self.address,
+                                        socks_port=self.socks_port,
+                                        strategy=strategy,
+                                        subcircuits=subcircuits)
+        else:
+            conf += RELAY_TORRC.format(address=self.address,
+                                       or_port=self.or_port,
+                                       dir_port=self.dir_port)
+        if self.kind == "auth":
+            conf += AUTHORITY_TORRC
+        self.torrc = os.path.join(self.datadir, "torrc")
+        with open(self.torrc, "w") as f:
+            f.write(conf)
+
+    def start(self):
+        self.proc = subprocess.Popen([self.net.tor, "-f", self.torrc],
+                                     stdout=subprocess.DEVNULL,
+                                     stderr=subprocess.DEVNULL)
+
+    def stop(self):
+        if self.proc and self.proc.poll() is None:
+            self.proc.terminate()
+            try:
+                self.proc.wait(10)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+
+
+class Controller(object):
+    """Minimal tor control port client."""
+
+    def __init__(self, address, port):
+        self.sock = socket.create_connection((address, port), timeout=30)
+        self.f = self.sock.makefile("rwb")
+        self.command("AUTHENTICATE")
+
+    def command(self, line):
+        self.f.write(line.encode() + b"\r\n")
+        self.f.flush()
+        lines = []
+        while True:
+            reply = self.f.readline().decode().rstrip("\r\n")
+            if not reply:
+                raise IOError("control connection closed")
+            if reply[3:4] == "+":
+                # data reply, terminated by a single "."
+                lines.append(reply[4:])
+                while True:
+                    data = self.f.readline().decode().rstrip("\r\n")
+                    if data == ".":
+                        break
+                    lines.append(data)
+                continue
+            lines.append(reply[4:])
+            if reply[3:4] == " ":
+                if not reply.startswith("250"):
+                    raise IOError("'{}' failed: {}".format(line, reply))
+                return lines
+
+    def getinfo(self, key):
+        lines = self.command("GETINFO " + key)
+        value = []
+        for line in lines:
+            if line.startswith(key + "="):
+                value.append(line[len(key) + 1:])
+            elif line != "OK" and not line.startswith(key):
+                value.append(line)
+        return "\n".join(v for v in value if v)
+
+    def close(self):
+        self.sock.close()
+
+
+class SinkServer(object):
+    """TCP server the workloads talk to through tor.
+
+    Protocol: the client sends "<nbytes>\\n" and receives nbytes bytes.  A
+    connection may carry any number of such requests."""
+
+    CHUNK = b"\0" * 65536
+
+    def __init__(self, address):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind((address, 0))
+        self.sock.listen(64)
+        self.address = self.sock.getsockname()
+        t = threading.Thread(target=self.serve)
+        t.daemon = True
+        t.start()
+
+    def serve(self):
+        while True:
+            conn, _ = self.sock.accept()
+            t = threading.Thread(target=self.handle, args=(conn,))
+            t.daemon = True
+            t.start()
+
+    def handle(self, conn):
+        try:
+            f = conn.makefile("rb")
+            for line in f:
+                remaining = int(line.strip())
+                while remaining > 0:
+                    n = min(remaining, len(self.CHUNK))
+                    conn.sendall(self.CHUNK[:n])
+                    remaining -= n
+        except (IOError, ValueError):
+            pass
+        finally:
+            conn.close()
+
+
+def socks_connect(socks_addr, dest):
+    """Open a SOCKS5 connection to dest via socks_addr; return the socket."""
+    s = socket.create_connection(socks_addr, timeout=120)
+    s.sendall(b"\x05\x01\x00")
+    if s.recv(2) != b"\x05\x00":
+        raise IOError("SOCKS5 handshake refused")
+    s.sendall(b"\x05\x01\x00\x01" + socket.inet_aton(dest[0]) +
+              struct.pack("!H", dest[1]))
+    reply = b""
+    while len(reply) < 10:
+        chunk = s.recv(10 - len(reply))
+        if not chunk:
+            raise IOError("SOCKS5 connection closed")
+        reply += chunk
+    if reply[1:2] != b"\x00":
+        raise IOError("SOCKS5 CONNECT failed with status {}"
+                      .format(reply[1]))
+    return s
+
+
+def recv_exactly(s, nbytes, first_byte_cb=None):
+    received = 0
+    while received < nbytes:
+        data = s.recv(min(1 << 16, nbytes - received))
+        if not data:
+            raise IOError("stream closed after {} of {} bytes"
+                          .format(received, nbytes))
+        if received == 0 and first_byte_cb:
+            first_byte_cb()
+        received += len(data)
+
+
+def run_bulk(socks_addr, sink, nbytes):
+    """Download nbytes over a fresh split circuit.  Return (ttfb, secs)."""
+    start = time.time()
+    s = socks_connect(socks_addr, sink)
+    first = []
+    try:
+        s.sendall("{}\n".format(nbytes).encode())
+        recv_exactly(s, nbytes, lambda: first.append(time.time()))
+    finally:
+        s.close()
+    end = time.time()
+    return first[0] - start, end - start
+
+
+def run_request_response(socks_addr, sink, nrequests, size):
+    """Issue nrequests requests of size bytes over one stream.  Return the
+    per-request latencies."""
+    s = socks_connect(socks_addr, sink)
+    latencies = []
+    try:
+        for _ in range(nrequests):
+            start = time.time()
+            s.sendall("{}\n".format(size).encode())
+            recv_exactly(s, size)
+            latencies.append(time.time() - start)
+    finally:
+        s.close()
+    return latencies
+
+
+def parse_reorder_stats(text):
+    stats = {}
+    for line in text.splitlines():
+        fields = line.split()
+        if not fields:
+            continue
+        stats[fields[0]] = dict((k, int(v)) for k, v in
+                                (f.split("=") for f in fields[1:]))
+    return stats
+
+
+def percentile(values, p):
+    values = sorted(values)
+    k = min(len(values) - 1, int(round((p / 100.0) * (len(values) - 1))))
+    return values[k]
+
+
+class Network(object):
+
+    def __init__(self, args):
+        self.args = args
+        self.tor = os.path.join(args.tor_dir, "src", "app", "tor")
+        self.gencert = os.path.join(args.tor_dir, "src", "tools",
+                                    "tor-gencert")
+        for binary in (self.tor, self.gencert):
+            if not os.access(binary, os.X_OK):
+                fail("cannot find {}".format(binary))
+        self.workdir = tempfile.mkdtemp(prefix="bench-split-")
+        self.auths = [Node(self, i, "auth") for i in range(args.authorities)]
+        self.relays = [Node(self, args.authorities + i, "relay")
+                       for i in range(args.relays)]
+        self.client = Node(self, args.authorities + args.relays, "client")
+        self.nodes = self.auths + self.relays + [self.client]
+        self.netem = False
+
+    def setup(self):
+        for node in self.auths:
+            node.make_authority_keys()
+        for node in self.auths + self.relays:
+            node.make_identity()
+        dirauths = "\n".join(a.dirauth_line() for a in self.auths)
+        shaping = ""
+        if self.args.link_rate:
+            shaping = "TestingORConnBWRate {}\n".format(self.args.link_rate)
+            if self.args.link_burst:
+                shaping += "TestingORConnBWBurst {}\n".format(
+                    self.args.link_burst)
+        for node in self.nodes:
+            node.write_torrc(dirauths, shaping, self.args.strategies[0],
+                             self.args.subcircuits)
+
+    def apply_delay(self):
+        if not self.args.delay_ms:
+            return
+        cmd = ["tc", "qdisc", "add", "dev", "lo", "root", "netem", "delay",
+               "{}ms".format(self.args.delay_ms)]
+        if subprocess.call(cmd, stderr=subprocess.DEVNULL) == 0:
+            self.netem = True
+            log("applied {} ms netem delay on lo".format(self.args.delay_ms))
+        else:
+            log("could not apply netem delay (needs CAP_NET_ADMIN); "
+                "continuing without link delay")
+
+    def start(self):
+        for node in self.nodes:
+            node.start()
+
+    def stop(self):
+        for node in self.nodes:
+            node.stop()
+        if self.netem:
+            subprocess.call(["tc", "qdisc", "del", "dev", "lo", "root"])
+        if not self.args.keep:
+            shutil.rmtree(self.workdir, ignore_errors=True)
+        else:
+            log("kept network state in {}".format(self.workdir))
+
+    def has_exit_consensus(self):
+        """Return true iff the client's consensus lists an Exit relay."""
+        ctrl = Controller(self.client.address, self.client.control_port)
+        status = ctrl.getinfo("ns/all")
+        ctrl.close()
+        return any(line.startswith("s ") and " Exit" in line
+                   for line in status.splitlines())
+
+    def wait_for_bootstrap(self):
+        deadline = time.time() + BOOTSTRAP_TIMEOUT
+        while time.time() < deadline:
+            for node in self.nodes:
+                if node.proc.poll() is not None:
+                    fail("{} exited early (see {}/notice.log)"
+                         .format(node.nick, node.datadir))
+            try:
+                ctrl = Controller(self.client.address,
+                                  self.client.control_port)
+                # split clients do not build preemptive circuits, so we
+                # wait for directory information covering exit paths
+                # instead of a bootstrap progress of 100%
+                ready = ctrl.getinfo("status/enough-dir-info") == "1"
+                ctrl.close()
+                if ready and self.has_exit_consensus():
+                    return
+            except (IOError, socket.error):
+                pass
+            time.sleep(2)
+        fail("client did not bootstrap within {} seconds"
+             .format(BOOTSTRAP_TIMEOUT))
+
+
+def run_strategy(net, ctrl, sink, strategy):
+    args = net.args
+    socks_addr = (net.client.address, net.client.socks_port)
+    ctrl.command("SETCONF SplitStrategy={}".format(strategy))
+    before = parse_reorder_stats(ctrl.getinfo("split/reorder-stats"))
+
+    ttfbs, rates = [], []
+    for _ in range(args.bulk_runs):
+        ttfb, secs = run_bulk(socks_addr, sink, args.bulk_bytes)
+        ttfbs.append(ttfb)
+        rates.append(args.bulk_bytes / secs)
+
+    latencies = run_request_response(socks_addr, sink, args.rr_requests,
+                                     args.rr_bytes)
+
+    after = parse_reorder_stats(ctrl.getinfo("split/reorder-stats"))
+    reorder = dict((k, after.get(strategy, {}).get(k, 0) -
+                    before.get(strategy, {}).get(k, 0))
+                   for k in ("merged", "buffered", "buffered-msec"))
+    reorder["max-depth"] = after.get(strategy, {}).get("max-depth", 0)
+
+    return {
+        "strategy": strategy,
+        "throughput_bytes_per_sec": statistics.median(rates),
+        "ttfb_sec_median": statistics.median(ttfbs),
+        "ttfb_sec_p90": percentile(ttfbs, 90),
+        "rr_latency_sec_median": statistics.median(latencies),
+        "rr_latency_sec_p90": percentile(latencies, 90),
+        "reorder": reorder,
+    }
+
+
+def print_results(results):
+    print("{:<24} {:>10} {:>9} {:>9} {:>9} {:>9} {:>9} {:>8}".format(
+        "strategy", "KiB/s", "ttfb(ms)", "ttfb90", "rr(ms)", "rr90",
+        "reorder%", "maxdep"))
+    for r in results:
+        reorder = r["reorder"]
+        pct = (100.0 * reorder["buffered"] / reorder["merged"]
+               if reorder["merged"] else 0.0)
+        print("{:<24} {:>10.1f} {:>9.1f} {:>9.1f} {:>9.1f} {:>9.1f} "
+              "{:>9.2f} {:>8d}".format(
+                  r["strategy"], r["throughput_bytes_per_sec"] / 1024.0,
+                  r["ttfb_sec_median"] * 1000, r["ttfb_sec_p90"] * 1000,
+                  r["rr_latency_sec_median"] * 1000,
+                  r["rr_latency_sec_p90"] * 1000, pct,
+                  reorder["max-depth"]))
+
+
+def check_gates(args, results):
+    ok = True
+    for r in results:
+        if (args.min_throughput and
+                r["throughput_bytes_per_sec"] < args.min_throughput):
+            log("{}: throughput {:.0f} B/s below gate {} B/s".format(
+                r["strategy"], r["throughput_bytes_per_sec"],
+                args.min_throughput))
+            ok = False
+        if args.max_ttfb_ms and r["ttfb_sec_median"] * 1000 > args.max_ttfb_ms:
+            log("{}: median TTFB {:.1f} ms above gate {} ms".format(
+                r["strategy"], r["ttfb_sec_median"] * 1000,
+                args.max_ttfb_ms))
+            ok = False
+    return ok
+
+
+def parse_args():
+    p = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    p.add_argument("--tor-dir", default=os.environ.get("TOR_DIR", "."),
+                   help="tor build directory (default: $TOR_DIR or .)")
+    p.add_argument("--authorities", type=int, default=3)
+    p.add_argument("--relays", type=int, default=6)
+    p.add_argument("--subcircuits", type=int, default=3)
+    p.add_argument("--strategies", default=",".join(STRATEGIES),
+                   help="comma-separated list of SplitStrategy values")
+    p.add_argument("--link-rate", type=int, default=0,
+                   help="per-link rate in bytes/sec (TestingORConnBWRate)")
+    p.add_argument("--link-burst", type=int, default=0,
+                   help="per-link burst in bytes (TestingORConnBWBurst)")
+    p.add_argument("--delay-ms", type=int, default=0,
+                   help="loopback delay via netem (needs CAP_NET_ADMIN)")
+    p.add_argument("--bulk-bytes", type=int, default=5 << 20)
+    p.add_argument("--bulk-runs", type=int, default=3)
+    p.add_argument("--rr-requests", type=int, default=50)
+    p.add_argument("--rr-bytes", type=int, default=1024)
+    p.add_argument("--min-throughput", type=float, default=0,
+                   help="fail if any strategy is slower (bytes/sec)")
+    p.add_argument("--max-ttfb-ms", type=float, default=0,
+                   help="fail if any strategy's median TTFB is higher")
+    p.add_argument("--json", help="also write results to this file")
+    p.add_argument("--keep", action="store_true",
+                   help="keep the network's data directories")
+    args = p.parse_args()
+    args.strategies = [s for s in args.strategies.split(",") if s]
+    if args.relays < 6:
+        p.error("the benchmark needs at least 6 relays")
+    if args.authorities < 1:
+        p.error("the benchmark needs at least one authority")
+    return args
+
+
+def main():
+    args = parse_args()
+    net = Network(args)
+    results = []
+    try:
+        net.setup()
+        net.apply_delay()
+        log("starting {} authorities, {} relays and a client in {}".format(
+            args.authorities, args.relays, net.workdir))
+        net.start()
+        net.wait_for_bootstrap()
+        log("client bootstrapped")
+
+        sink = SinkServer(net.client.address).address
+        ctrl = Controller(net.client.address, net.client.control_port)
+        for strategy in args.strategies:
+            log("running workloads with SplitStrategy {}".format(strategy))
+            results.append(run_strategy(net, ctrl, sink, strategy))
+        ctrl.close()
+    except (IOError, socket.error, subprocess.CalledProcessError) as e:
+        fail(str(e))
+    finally:
+        net.stop()
+
+    print_results(results)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+    return 0 if check_gates(args, results) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -913,6 +913,7 @@ struct testgroup_t testgroups[] = {
   { "scheduler/", scheduler_tests },
   { "socks/", socks_tests },
   { "shared-random/", sr_tests },
+  { "splitperf/", splitperf_tests },
   { "status/" , status_tests },
   { "storagedir/", storagedir_tests },
   { "subcirc_list/", subcirc_list_tests},
@@ -921,6 +922,7 @@ struct testgroup_t testgroups[] = {
   { "tortls/openssl/", tortls_openssl_tests },
 #endif
   { "tortls/x509/", x509_tests },
+  { "uring/", uring_tests },
   { "util/", util_tests },
   { "util/format/", util_format_tests },
   { "util/logging/", logging_tests },
@@ -255,11 +255,13 @@ extern struct testcase_t routerset_tests[];
 extern struct testcase_t scheduler_tests[];
 extern struct testcase_t storagedir_tests[];
 extern struct testcase_t socks_tests[];
+extern struct testcase_t splitperf_tests[];
 extern struct testcase_t status_tests[];
 extern struct testcase_t subcirc_list_tests[];
 extern struct testcase_t thread_tests[];
 extern struct testcase_t tortls_tests[];
 extern struct testcase_t tortls_openssl_tests[];
+extern struct testcase_t uring_tests[];
 extern struct testcase_t util_tests[];
 extern struct testcase_t util_format_tests[];
 extern struct testcase_t util_process_tests[];
@@ -7,6 +7,7 @@
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/container/buffers.h"
+#include "lib/net/buffers_net.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
@@ -435,6 +436,137 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc(16384);
+  buf_t *buf = NULL;
+  chunk_freelist_t *fl = buf_get_freelist(4096);
+  uint64_t n_hit;
+  char *stats = NULL;
+  int i;
+
+  (void)arg;
+
+  crypto_rand(junk, 16384);
+  tt_assert(fl);
+  tt_ptr_op(buf_get_freelist(5000), OP_EQ, NULL);
+  tt_ptr_op(buf_get_freelist(1<<20), OP_EQ, NULL);
+  buf_shrink_freelists(1);
+  tt_int_op(fl->cur_length, OP_EQ, 0);
+
+  /* Freed chunks go onto the freelist... */
+  buf = buf_new();
+  for (i = 0; i < 4; ++i)
+    buf_add(buf, junk, 4000);
+  tt_int_op(buf_allocation(buf), OP_EQ, 16384);
+  buf_free(buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(fl->cur_length, OP_EQ, 4);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 16384);
+
+  /* ... and come back from it. */
+  n_hit = fl->n_hit;
+  buf = buf_new();
+  buf_add(buf, junk, 4000);
+  tt_int_op(fl->n_hit, OP_EQ, n_hit + 1);
+  tt_int_op(fl->cur_length, OP_EQ, 3);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+
+  /* Trimming keeps a few chunks as slack; freeing all doesn't. */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(fl->cur_length, OP_EQ, 3);
+  tt_int_op(buf_shrink_freelists(1), OP_EQ, 3*4096);
+  tt_int_op(fl->cur_length, OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* Chunks that don't fit on a full freelist are really freed. */
+  buf_free(buf);
+  buf = buf_new();
+  for (i = 0; i < fl->max_length + 10; ++i)
+    buf_add(buf, junk, 4000);
+  buf_free(buf);
+  tt_int_op(fl->cur_length, OP_EQ, fl->max_length);
+  /* They were all freed since the last trim, so this trim keeps them, but
+   * the next one frees the ones that stayed unused. */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ,
+            (size_t)(fl->max_length - fl->slack) * 4096);
+  tt_int_op(fl->cur_length, OP_EQ, fl->slack);
+
+  stats = buf_get_freelist_stats();
+  tt_assert(strstr(stats, "chunk-size=4096 cached=8 "));
+  tt_assert(strstr(stats, "\nother-allocated="));
+
+ done:
+  buf_free(buf);
+  buf_shrink_freelists(1);
+  tor_free(stats);
+  tor_free(junk);
+}
+
+static void
+test_buffer_chunk_arenas(void *arg)
+{
+  char *junk = tor_malloc(16384);
+  buf_t *buf = NULL, *buf2 = NULL;
+  chunk_freelist_t *fl = buf_get_freelist(4096);
+  const char *head;
+  size_t len;
+
+  (void)arg;
+
+  if (buf_set_chunk_arenas(1) < 0)
+    tt_skip();
+  crypto_rand(junk, 16384);
+  buf_shrink_freelists(1);
+
+  /* A 2 MB arena holds 512 4k chunks, so this takes two arenas. */
+  buf = buf_new();
+  while (buf_allocation(buf) < 513*4096)
+    buf_add(buf, junk, 4000);
+  tt_int_op(fl->n_arenas, OP_EQ, 2);
+  tt_assert(buf->head->arena);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 513*4096);
+  buf_assert_ok(buf);
+
+  /* Growing an arena chunk moves its data to a new chunk. */
+  buf_pullup(buf, 6000, &head, &len);
+  tt_int_op(len, OP_EQ, 6000);
+  tt_mem_op(head, OP_EQ, junk, 4000);
+  tt_mem_op(head + 4000, OP_EQ, junk, 2000);
+  tt_assert(buf->head->arena);
+  tt_int_op(buf->head->memlen, OP_GT, 4096);
+  buf_assert_ok(buf);
+
+  buf2 = buf_copy(buf);
+  tt_int_op(buf_datalen(buf2), OP_EQ, buf_datalen(buf));
+  buf_free(buf2);
+
+  /* New chunks come from malloc once arenas are off, but arena chunks stay
+   * where they are until they are freed. */
+  tt_int_op(buf_set_chunk_arenas(0), OP_EQ, 0);
+  buf_shrink_freelists(1);
+  buf2 = buf_new();
+  buf_add(buf2, junk, 4000);
+  tt_ptr_op(buf2->head->arena, OP_EQ, NULL);
+  buf_free(buf2);
+
+  /* Once all of their chunks are free, the arenas go away. */
+  buf_free(buf);
+  tt_int_op(fl->n_arenas, OP_GT, 0);
+  buf_shrink_freelists(1);
+  tt_int_op(fl->n_arenas, OP_EQ, 0);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_set_chunk_arenas(0);
+  buf_free(buf);
+  buf_free(buf2);
+  buf_shrink_freelists(1);
+  tor_free(junk);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -705,6 +837,94 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+static void
+test_buffers_socket_io(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *outbuf = buf_new(), *inbuf = buf_new();
+  const size_t len = 300000;
+  char *data = tor_malloc(len), *got = tor_malloc(len + 5);
+  size_t flushlen, i, received;
+  int reached_eof = 0, socket_error = 0, r;
+
+  (void)arg;
+  crypto_rand(data, len);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  /* Many chunks on the outbuf, and a partly full chunk on the inbuf. */
+  for (i = 0; i < len; i += 1000)
+    buf_add(outbuf, data + i, MIN(1000, len - i));
+  buf_add(inbuf, "hello", 5);
+
+  /* Flush only part of the outbuf. */
+  flushlen = buf_datalen(outbuf);
+  r = buf_flush_to_socket(outbuf, fds[0], 10000, &flushlen);
+  tt_int_op(r, OP_EQ, 10000);
+  tt_uint_op(flushlen, OP_EQ, len - 10000);
+  tt_uint_op(buf_datalen(outbuf), OP_EQ, len - 10000);
+  buf_assert_ok(outbuf);
+
+  /* The read fills up the partly full chunk, and we only keep the new
+   * chunks that we read into. */
+  r = buf_read_from_socket(inbuf, fds[1], 100000, &reached_eof,
+                           &socket_error);
+  tt_int_op(r, OP_EQ, 10000);
+  tt_int_op(reached_eof, OP_EQ, 0);
+  tt_uint_op(buf_datalen(inbuf), OP_EQ, 10005);
+  tt_uint_op(buf_allocation(inbuf), OP_EQ, 4096 + 65536);
+  buf_assert_ok(inbuf);
+  buf_get_bytes(inbuf, got, 10005);
+  tt_mem_op(got, OP_EQ, "hello", 5);
+  tt_mem_op(got + 5, OP_EQ, data, 10000);
+
+  /* Move the rest over. */
+  received = 10000;
+  while (received < len) {
+    r = buf_flush_to_socket(outbuf, fds[0], flushlen, &flushlen);
+    tt_int_op(r, OP_GE, 0);
+    r = buf_read_from_socket(inbuf, fds[1], len, &reached_eof,
+                             &socket_error);
+    tt_int_op(r, OP_GT, 0);
+    received += r;
+    buf_assert_ok(inbuf);
+  }
+  tt_uint_op(received, OP_EQ, len);
+  tt_uint_op(flushlen, OP_EQ, 0);
+  tt_uint_op(buf_datalen(outbuf), OP_EQ, 0);
+  buf_get_bytes(inbuf, got, len - 10000);
+  tt_mem_op(got, OP_EQ, data + 10000, len - 10000);
+
+  /* Nothing to read: no chunks left behind. */
+  r = buf_read_from_socket(inbuf, fds[1], 100000, &reached_eof,
+                           &socket_error);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(reached_eof, OP_EQ, 0);
+  tt_uint_op(buf_allocation(inbuf), OP_EQ, 0);
+  buf_assert_ok(inbuf);
+
+  /* And the end of the stream. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  r = buf_read_from_socket(inbuf, fds[1], 100000, &reached_eof,
+                           &socket_error);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(reached_eof, OP_EQ, 1);
+  tt_uint_op(buf_datalen(inbuf), OP_EQ, 0);
+  buf_assert_ok(inbuf);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(outbuf);
+  buf_free(inbuf);
+  tor_free(data);
+  tor_free(got);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -802,9 +1022,12 @@ struct testcase_t buffer_tests[] = {
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
+  { "chunk_arenas", test_buffer_chunk_arenas, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "socket_io", test_buffers_socket_io, TT_FORK, NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
 
@@ -10,6 +10,7 @@
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
+#include "core/or/circuituse.h"
 #include "feature/hs/hs_circuitmap.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -464,11 +465,112 @@ test_hs_circuitmap_isolation(void *arg)
   circuit_free_(TO_CIRCUIT(circ4));
 }
 
+static int n_marked_for_close = 0;
+
+static void
+mock_circuit_mark_for_close(circuit_t *circ, int reason, int line,
+                            const char *file)
+{
+  (void)reason;
+  (void)line;
+  (void)file;
+  circ->marked_for_close = 1;
+  ++n_marked_for_close;
+}
+
+static void
+test_expiry_lists(void *arg)
+{
+  channel_t *ch1 = new_fake_channel(), *ch2 = new_fake_channel();
+  origin_circuit_t *origin_c = NULL;
+  or_circuit_t *or_c1 = NULL, *or_c2 = NULL, *or_c3 = NULL;
+  smartlist_t *building;
+  time_t now = 1500000000;
+
+  (void) arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close);
+  n_marked_for_close = 0;
+  update_approx_time(now);
+
+  /* Origin circuits are candidates for circuit_expire_building() until they
+   * open, unless their purpose still has a deadline once open. */
+  origin_c = origin_circuit_new();
+  building = circuit_get_build_expiry_list();
+  tt_int_op(smartlist_len(building), OP_EQ, 1);
+  tt_int_op(origin_c->build_expiry_list_idx, OP_EQ, 0);
+  TO_CIRCUIT(origin_c)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  tt_assert(circuit_may_expire_building(TO_CIRCUIT(origin_c)));
+  circuit_set_state(TO_CIRCUIT(origin_c), CIRCUIT_STATE_OPEN);
+  tt_assert(! circuit_may_expire_building(TO_CIRCUIT(origin_c)));
+  circuit_remove_from_build_expiry_list(origin_c);
+  tt_int_op(smartlist_len(building), OP_EQ, 0);
+  tt_int_op(origin_c->build_expiry_list_idx, OP_EQ, -1);
+  TO_CIRCUIT(origin_c)->purpose = CIRCUIT_PURPOSE_C_ESTABLISH_REND;
+  circuit_update_build_expiry_list(TO_CIRCUIT(origin_c));
+  tt_int_op(smartlist_len(building), OP_EQ, 1);
+  circuit_update_build_expiry_list(TO_CIRCUIT(origin_c));
+  tt_int_op(smartlist_len(building), OP_EQ, 1);
+  circuit_free_(TO_CIRCUIT(origin_c));
+  origin_c = NULL;
+  tt_int_op(smartlist_len(building), OP_EQ, 0);
+
+  /* Only circuits from clients get an idle-expiry deadline. */
+  channel_mark_client(ch1);
+  ch1->cmux = tor_malloc(1);
+  ch2->cmux = tor_malloc(1);
+  ch1->timestamp_xmit = now - 10;
+  or_c1 = or_circuit_new(100, ch1);
+  or_c2 = or_circuit_new(101, ch1);
+  or_c3 = or_circuit_new(100, ch2);
+  tt_int_op(or_c1->idle_expiry_idx, OP_GE, 0);
+  tt_int_op(or_c2->idle_expiry_idx, OP_GE, 0);
+  tt_int_op(or_c3->idle_expiry_idx, OP_EQ, -1);
+  tt_i64_op(circuit_get_next_idle_expiry(), OP_EQ, now);
+
+  /* Nothing is idle yet: the next look is when ch1 has been idle for a
+   * minute. */
+  tt_int_op(circuit_expire_old_circuits_serverside(now), OP_EQ, 50);
+  tt_int_op(n_marked_for_close, OP_EQ, 0);
+  tt_i64_op(circuit_get_next_idle_expiry(), OP_EQ, now + 50);
+  tt_ptr_op(circuit_pop_idle_expiry(now + 49), OP_EQ, NULL);
+
+  /* A circuit with a stream on it stays. */
+  or_c2->n_streams = (edge_connection_t *)(void *)"fake stream";
+  tt_int_op(circuit_expire_old_circuits_serverside(now + 50), OP_EQ, 60);
+  tt_int_op(n_marked_for_close, OP_EQ, 1);
+  tt_assert(TO_CIRCUIT(or_c1)->marked_for_close);
+  tt_assert(! TO_CIRCUIT(or_c2)->marked_for_close);
+  tt_int_op(or_c1->idle_expiry_idx, OP_EQ, -1);
+  or_c2->n_streams = NULL;
+  tt_int_op(circuit_expire_old_circuits_serverside(now + 110), OP_EQ, 60);
+  tt_int_op(n_marked_for_close, OP_EQ, 2);
+  tt_i64_op(circuit_get_next_idle_expiry(), OP_EQ, 0);
+
+ done:
+  circuit_free_(TO_CIRCUIT(origin_c));
+  circuit_free_(TO_CIRCUIT(or_c1));
+  circuit_free_(TO_CIRCUIT(or_c2));
+  circuit_free_(TO_CIRCUIT(or_c3));
+  if (ch1)
+    tor_free(ch1->cmux);
+  if (ch2)
+    tor_free(ch2->cmux);
+  tor_free(ch1);
+  tor_free(ch2);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+  UNMOCK(circuit_mark_for_close_);
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
+  { "expiry_lists", test_expiry_lists, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
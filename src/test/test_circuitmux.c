@@ -11,8 +11,11 @@
 #include "core/or/circuitmux_ewma.h"
 #include "core/or/relay.h"
 #include "core/or/scheduler.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
 
+#include "app/config/or_options_st.h"
+#include "core/or/circuit_st.h"
 #include "core/or/destroy_cell_queue_st.h"
 
 #include <math.h>
@@ -81,7 +84,7 @@ test_cmux_destroy_cell_queue(void *arg)
   circuitmux_free(cmux);
   channel_free(ch);
   packed_cell_free(pc);
-  tor_free(dc);
+  destroy_cell_free(dc);
 }
 
 static void
@@ -125,9 +128,171 @@ test_cmux_compute_ticks(void *arg)
   ;
 }
 
+/** Return the logarithm of the EWMA of the cell count of the circuit with
+ * the policy data <b>cdata</b>, measured against the EWMA clock. */
+static double
+cmux_ewma_get_log_count(circuitmux_policy_circ_data_t *cdata)
+{
+  return DOWNCAST(ewma_policy_circ_data_t, cdata)->cell_ewma.log_count;
+}
+
+/** Return the EWMA of the cell count of the circuit with the policy data
+ * <b>cdata</b>, as of now. */
+static double
+cmux_ewma_get_count(circuitmux_policy_circ_data_t *cdata)
+{
+  return exp(cmux_ewma_get_log_count(cdata) - cell_ewma_get_clock());
+}
+
+/** Check that the EWMA policy prefers quiet circuits, that old cells lose
+ * their weight over time, and that a new halflife applies from the moment
+ * it is set on. */
+static void
+test_cmux_ewma_decay(void *arg)
+{
+  const int64_t NS_PER_S = 1000 * 1000 * 1000;
+  const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol = NULL;
+  circuitmux_policy_circ_data_t *cdata_a = NULL, *cdata_b = NULL;
+  circuit_t circ_a, circ_b;
+  or_options_t *options = tor_malloc_zero(sizeof(or_options_t));
+  double count;
+  (void)arg;
+
+  circuitmux_ewma_free_all();
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NS);
+  options->CircuitPriorityHalflife = 30.0;
+  cmux_ewma_set_options(options, NULL);
+
+  cmux = circuitmux_alloc();
+  pol = ewma_policy.alloc_cmux_data(cmux);
+  cdata_a = ewma_policy.alloc_circ_data(cmux, pol, &circ_a,
+                                        CELL_DIRECTION_OUT, 0);
+  cdata_b = ewma_policy.alloc_circ_data(cmux, pol, &circ_b,
+                                        CELL_DIRECTION_OUT, 0);
+  ewma_policy.notify_circ_active(cmux, pol, &circ_a, cdata_a);
+  ewma_policy.notify_circ_active(cmux, pol, &circ_b, cdata_b);
+
+  /* A sends 100 cells, then B is the quieter one until it sends 101. */
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, &circ_a);
+  ewma_policy.notify_xmit_cells(cmux, pol, &circ_a, cdata_a, 100);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, &circ_b);
+  ewma_policy.notify_xmit_cells(cmux, pol, &circ_b, cdata_b, 10);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, &circ_b);
+  tt_double_op(fabs(cmux_ewma_get_count(cdata_a) - 100.0), OP_LT, 1e-6);
+  tt_double_op(fabs(cmux_ewma_get_count(cdata_b) - 10.0), OP_LT, 1e-6);
+
+  /* 100 seconds later, the 100 cells of A count less than the 10 cells that
+   * B sent back then and the 10 that it sends now. */
+  monotime_coarse_set_mock_time_nsec(START_NS + 100 * NS_PER_S);
+  ewma_policy.notify_xmit_cells(cmux, pol, &circ_b, cdata_b, 10);
+  count = 100.0 * pow(0.5, 100.0 / 30.0);
+  tt_double_op(fabs(cmux_ewma_get_count(cdata_a) - count), OP_LT, 1e-6);
+  count = 10.0 * pow(0.5, 100.0 / 30.0) + 10.0;
+  tt_double_op(fabs(cmux_ewma_get_count(cdata_b) - count), OP_LT, 1e-6);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, &circ_a);
+
+  /* With a halflife of 10 seconds from now on, A loses half of its weight
+   * in the next 10 seconds. */
+  count = cmux_ewma_get_count(cdata_a);
+  options->CircuitPriorityHalflife = 10.0;
+  cmux_ewma_set_options(options, NULL);
+  monotime_coarse_set_mock_time_nsec(START_NS + 110 * NS_PER_S);
+  tt_double_op(fabs(cmux_ewma_get_count(cdata_a) - count / 2), OP_LT, 1e-6);
+
+  /* A circuit that goes inactive keeps its count. */
+  ewma_policy.notify_circ_inactive(cmux, pol, &circ_a, cdata_a);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, &circ_b);
+  ewma_policy.notify_circ_active(cmux, pol, &circ_a, cdata_a);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, &circ_a);
+
+ done:
+  if (pol) {
+    ewma_policy.free_circ_data(cmux, pol, &circ_a, cdata_a);
+    ewma_policy.free_circ_data(cmux, pol, &circ_b, cdata_b);
+    ewma_policy.free_cmux_data(cmux, pol);
+  }
+  circuitmux_free(cmux);
+  tor_free(options);
+  monotime_disable_test_mocking();
+}
+
+/** Check that the priority queue of active circuits always yields the
+ * circuit with the lowest EWMA, as circuits send cells and come and go. */
+static void
+test_cmux_ewma_heap(void *arg)
+{
+  const int n_circs = 300;
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol = NULL;
+  circuitmux_policy_circ_data_t **cdata = NULL;
+  circuit_t *circs = NULL;
+  char *active = NULL;
+  int i, j, n_active = 0;
+  (void)arg;
+
+  cmux_ewma_set_options(NULL, NULL);
+  cmux = circuitmux_alloc();
+  pol = ewma_policy.alloc_cmux_data(cmux);
+  circs = tor_calloc(n_circs, sizeof(circuit_t));
+  cdata = tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+  active = tor_malloc_zero(n_circs);
+  for (i = 0; i < n_circs; ++i) {
+    cdata[i] = ewma_policy.alloc_circ_data(cmux, pol, &circs[i],
+                                           CELL_DIRECTION_OUT, 0);
+  }
+
+  for (i = 0; i < 20000; ++i) {
+    int idx = crypto_rand_int(n_circs);
+    circuit_t *circ;
+    double lowest = HUGE_VAL;
+
+    if (active[idx]) {
+      ewma_policy.notify_circ_inactive(cmux, pol, &circs[idx], cdata[idx]);
+      active[idx] = 0;
+      --n_active;
+    } else {
+      ewma_policy.notify_circ_active(cmux, pol, &circs[idx], cdata[idx]);
+      active[idx] = 1;
+      ++n_active;
+    }
+
+    circ = ewma_policy.pick_active_circuit(cmux, pol);
+    if (!n_active) {
+      tt_ptr_op(circ, OP_EQ, NULL);
+      continue;
+    }
+    for (j = 0; j < n_circs; ++j) {
+      if (active[j] && cmux_ewma_get_log_count(cdata[j]) < lowest)
+        lowest = cmux_ewma_get_log_count(cdata[j]);
+    }
+    tt_assert(circ);
+    tt_double_op(cmux_ewma_get_log_count(cdata[circ - circs]), OP_LE, lowest);
+    ewma_policy.notify_xmit_cells(cmux, pol, circ, cdata[circ - circs],
+                                  1 + crypto_rand_int(100));
+  }
+
+ done:
+  for (i = 0; cdata && i < n_circs; ++i) {
+    if (active[i])
+      ewma_policy.notify_circ_inactive(cmux, pol, &circs[i], cdata[i]);
+    ewma_policy.free_circ_data(cmux, pol, &circs[i], cdata[i]);
+  }
+  if (pol)
+    ewma_policy.free_cmux_data(cmux, pol);
+  circuitmux_free(cmux);
+  tor_free(cdata);
+  tor_free(circs);
+  tor_free(active);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
   { "compute_ticks", test_cmux_compute_ticks, TT_FORK, NULL, NULL },
+  { "ewma_decay", test_cmux_ewma_decay, TT_FORK, NULL, NULL },
+  { "ewma_heap", test_cmux_ewma_heap, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -5,6 +5,7 @@
 #define CIRCUITSTATS_PRIVATE
 #define CIRCUITLIST_PRIVATE
 #define CHANNEL_PRIVATE_
+#define STATEFILE_PRIVATE
 
 #include "core/or/or.h"
 #include "test/test.h"
@@ -16,14 +17,20 @@
 #include "core/or/circuitstats.h"
 #include "core/or/circuituse.h"
 #include "core/or/channel.h"
+#include "app/config/statefile.h"
+#include "lib/math/fp.h"
 
 #include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_st.h"
 #include "core/or/extend_info_st.h"
 #include "core/or/origin_circuit_st.h"
+#include "app/config/or_state_st.h"
+
+#include <math.h>
 
 void test_circuitstats_timeout(void *arg);
 void test_circuitstats_hoplen(void *arg);
+void test_circuitstats_split_join(void *arg);
 origin_circuit_t *subtest_fourhop_circuit(struct timeval, int);
 origin_circuit_t *add_opened_threehop(void);
 origin_circuit_t *build_unopened_fourhop(struct timeval);
@@ -196,11 +203,69 @@ test_circuitstats_hoplen(void *arg)
   circuit_build_times_free_timeouts(get_circuit_build_times_mutable());
 }
 
+void
+test_circuitstats_split_join(void *arg)
+{
+  /* Plan:
+   *   1. Scale the general timeout until enough join circuits are seen
+   *   2. Learn a join timeout from the join build times
+   *   3. Save and load the join history through the state file
+   *   4. Abandoned join circuits must not shorten the timeout
+   */
+  or_state_t *state = NULL;
+  double fallback, learned, reloaded;
+  int i;
+  (void)arg;
+
+  circuitbuild_running_unit_tests();
+  circuit_build_times_init(get_circuit_build_times_mutable());
+  state = or_state_new();
+
+  tt_int_op(circuit_build_times_parse_split_join_state(state), OP_EQ, 0);
+  fallback = get_circuit_build_timeout_ms() * (3/6.0);
+  tt_i64_op(tor_lround(get_split_join_build_timeout_ms()), OP_EQ,
+            tor_lround(fallback));
+
+  for (i = 0; i < CBT_SPLIT_JOIN_MIN_CIRCUITS_TO_OBSERVE - 1; i++)
+    circuit_build_times_add_split_join_time(1000 + 50*(i%4));
+  tt_i64_op(tor_lround(get_split_join_build_timeout_ms()), OP_EQ,
+            tor_lround(fallback));
+
+  circuit_build_times_add_split_join_time(2500);
+  learned = get_split_join_build_timeout_ms();
+  tt_double_op(learned, OP_GE, 1000);
+  tt_double_op(learned, OP_LE, 2500);
+  tt_double_op(learned, OP_LT, fallback);
+
+  circuit_build_times_update_split_join_state(state);
+  tt_int_op(state->TotalSplitJoinBuildTimes, OP_EQ,
+            CBT_SPLIT_JOIN_MIN_CIRCUITS_TO_OBSERVE);
+  tt_int_op(state->SplitJoinBuildAbandonedCount, OP_EQ, 0);
+  tt_ptr_op(state->SplitJoinBuildtimeHistogram, OP_NE, NULL);
+
+  tt_int_op(circuit_build_times_parse_split_join_state(state), OP_EQ, 0);
+  reloaded = get_split_join_build_timeout_ms();
+  /* Some accuracy is lost due to histogram conversion */
+  tt_double_op(fabs(reloaded - learned), OP_LT, 2*CBT_BIN_WIDTH);
+
+  for (i = 0; i < 5; i++)
+    circuit_build_times_add_split_join_time(CBT_BUILD_ABANDONED);
+  tt_double_op(get_split_join_build_timeout_ms(), OP_GE, reloaded);
+
+  circuit_build_times_update_split_join_state(state);
+  tt_int_op(state->SplitJoinBuildAbandonedCount, OP_EQ, 5);
+
+ done:
+  or_state_free(state);
+  circuit_build_times_free_timeouts(get_circuit_build_times_mutable());
+}
+
 #define TEST_CIRCUITSTATS(name, flags) \
     { #name, test_##name, (flags), NULL, NULL }
 
 struct testcase_t circuitstats_tests[] = {
   TEST_CIRCUITSTATS(circuitstats_hoplen, TT_FORK),
+  TEST_CIRCUITSTATS(circuitstats_split_join, TT_FORK),
   END_OF_TESTCASES
 };
 
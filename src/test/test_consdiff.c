@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "feature/dircommon/consdiff.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/memarea/memarea.h"
 #include "test/log_test_helpers.h"
 
@@ -310,6 +311,154 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+/* Helper for test_consdiff_myers_changes: check that the lines of <b>sl1</b>
+ * and <b>sl2</b> that aren't marked in <b>changed1</b> and <b>changed2</b>
+ * are the same, in the same order. Return the number of marked lines, or -1
+ * if the unmarked lines differ. */
+static int
+count_changes(const smartlist_t *sl1, const smartlist_t *sl2,
+              bitarray_t *changed1, bitarray_t *changed2)
+{
+  int i1 = 0, i2 = 0, n_changed = 0;
+  const int len1 = smartlist_len(sl1), len2 = smartlist_len(sl2);
+
+  for (;;) {
+    while (i1 < len1 && bitarray_is_set(changed1, i1)) {
+      ++i1;
+      ++n_changed;
+    }
+    while (i2 < len2 && bitarray_is_set(changed2, i2)) {
+      ++i2;
+      ++n_changed;
+    }
+    if (i1 == len1 || i2 == len2)
+      break;
+    if (!lines_eq(smartlist_get(sl1, i1), smartlist_get(sl2, i2)))
+      return -1;
+    ++i1;
+    ++i2;
+  }
+  if (i1 != len1 || i2 != len2)
+    return -1;
+  return n_changed;
+}
+
+static void
+test_consdiff_myers_changes(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *strings = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+  bitarray_t *lcs_changed1 = NULL, *lcs_changed2 = NULL;
+  char *s;
+  memarea_t *area = memarea_new();
+  int iter, i;
+
+  (void)arg;
+
+  /* Random lists over a small alphabet have lots of equally short diffs:
+   * see that we always find one that's as short as the LCS one. */
+  for (iter = 0; iter < 500; ++iter) {
+    for (i = crypto_rand_int(40); i > 0; --i)
+      smartlist_add_asprintf(chunks, "%c\n", 'a' + crypto_rand_int(4));
+    s = smartlist_join_strings(chunks, "", 0, NULL);
+    consensus_split_lines(sl1, s, area);
+    SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+    smartlist_clear(chunks);
+    smartlist_add(strings, s);
+    for (i = crypto_rand_int(40); i > 0; --i)
+      smartlist_add_asprintf(chunks, "%c\n", 'a' + crypto_rand_int(4));
+    s = smartlist_join_strings(chunks, "", 0, NULL);
+    consensus_split_lines(sl2, s, area);
+    SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+    smartlist_clear(chunks);
+    smartlist_add(strings, s);
+
+    changed1 = bitarray_init_zero(smartlist_len(sl1));
+    changed2 = bitarray_init_zero(smartlist_len(sl2));
+    lcs_changed1 = bitarray_init_zero(smartlist_len(sl1));
+    lcs_changed2 = bitarray_init_zero(smartlist_len(sl2));
+
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    myers_changes(sls1, sls2, changed1, changed2);
+    tor_free(sls1);
+    tor_free(sls2);
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes(sls1, sls2, lcs_changed1, lcs_changed2);
+    tor_free(sls1);
+    tor_free(sls2);
+
+    i = count_changes(sl1, sl2, changed1, changed2);
+    tt_int_op(i, OP_GE, 0);
+    tt_int_op(i, OP_EQ, count_changes(sl1, sl2, lcs_changed1, lcs_changed2));
+
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    bitarray_free(lcs_changed1);
+    bitarray_free(lcs_changed2);
+    changed1 = changed2 = lcs_changed1 = lcs_changed2 = NULL;
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+  }
+
+  /* A long list with a few edits, within a slice of each list. */
+  for (i = 0; i < 5000; ++i) {
+    smartlist_add_asprintf(chunks, "%d\n", i);
+  }
+  s = smartlist_join_strings(chunks, "", 0, NULL);
+  consensus_split_lines(sl1, s, area);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_clear(chunks);
+  smartlist_add(strings, s);
+  for (i = 0; i < 5000; ++i) {
+    if (i % 1000 == 500)
+      continue;
+    smartlist_add_asprintf(chunks, "%d\n", i % 700 == 3 ? -i : i);
+    if (i % 900 == 7)
+      smartlist_add_asprintf(chunks, "new %d\n", i);
+  }
+  s = smartlist_join_strings(chunks, "", 0, NULL);
+  consensus_split_lines(sl2, s, area);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_clear(chunks);
+  smartlist_add(strings, s);
+
+  changed1 = bitarray_init_zero(smartlist_len(sl1));
+  changed2 = bitarray_init_zero(smartlist_len(sl2));
+  sls1 = smartlist_slice(sl1, 2, -1);
+  sls2 = smartlist_slice(sl2, 2, smartlist_len(sl2) - 1);
+  myers_changes(sls1, sls2, changed1, changed2);
+  /* The last line of sl1 isn't in the second slice. */
+  bitarray_set(changed1, smartlist_len(sl1) - 1);
+  tt_int_op(smartlist_len(sl2), OP_EQ, 5000 - 5 + 6);
+  bitarray_set(changed2, smartlist_len(sl2) - 1);
+  /* 5 deleted lines, 6 new ones, and 8 changed ones, plus the last line of
+   * each list. */
+  tt_int_op(count_changes(sl1, sl2, changed1, changed2), OP_EQ,
+            5 + 6 + 8*2 + 2);
+
+ done:
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  /* The lines point into these. */
+  SMARTLIST_FOREACH(strings, char *, cp, tor_free(cp));
+  smartlist_free(strings);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  tor_free(sls1);
+  tor_free(sls2);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  bitarray_free(lcs_changed1);
+  bitarray_free(lcs_changed2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -1172,6 +1321,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(myers_changes),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
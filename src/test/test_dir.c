@@ -3381,6 +3381,83 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+/** Return the share of <b>wa</b>'s n*scale units that choose index
+ * <b>idx</b>. */
+static uint64_t
+weighted_alias_mass(const weighted_alias_t *wa, int idx)
+{
+  uint64_t mass = wa->threshold[idx];
+  int i;
+  for (i = 0; i < wa->n; ++i) {
+    if (wa->alias[i] == idx && i != idx)
+      mass += wa->scale - wa->threshold[i];
+  }
+  return mass;
+}
+
+static void
+test_dir_random_weighted_alias(void *testdata)
+{
+  uint64_t vals[10] = {3,1,2,4,6,0,7,5,8,9};
+  uint64_t big[4], zeros[3] = {0,0,0};
+  double dbl[4] = {1e6, 1.0, 3e6, 5e-3};
+  weighted_alias_t *wa = NULL;
+  int histogram[10];
+  const int n = 50000;
+  int i, choice;
+  (void) testdata;
+
+  /* Every index gets exactly its share of the columns. */
+  wa = weighted_alias_new(vals, 10);
+  tt_assert(wa);
+  tt_int_op(wa->n, OP_EQ, 10);
+  tt_u64_op(wa->scale, OP_EQ, 45);
+  for (i = 0; i < 10; ++i) {
+    tt_u64_op(wa->threshold[i], OP_LE, wa->scale);
+    tt_u64_op(weighted_alias_mass(wa, i), OP_EQ, vals[i] * 10);
+  }
+
+  memset(histogram, 0, sizeof(histogram));
+  for (i = 0; i < n; ++i) {
+    choice = weighted_alias_choose(wa);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+  tt_int_op(histogram[5], OP_EQ, 0);
+  for (i = 0; i < 10; ++i) {
+    const double expected = n * vals[i] / 45.0;
+    tt_double_op(fabs(histogram[i] - expected), OP_LE, expected * .15 + 5);
+  }
+  weighted_alias_free(wa);
+
+  /* Large weights get rescaled; tiny nonzero ones can still be chosen. */
+  scale_array_elements_to_u64(big, dbl, 4, NULL);
+  wa = weighted_alias_new(big, 4);
+  tt_assert(wa);
+  tt_u64_op(wa->scale, OP_LT, UINT64_C(1)<<39);
+  tt_u64_op(weighted_alias_mass(wa, 3), OP_GT, 0);
+  tt_u64_op(weighted_alias_mass(wa, 2), OP_GT,
+            weighted_alias_mass(wa, 0) * 2);
+  for (i = 0; i < 4; ++i)
+    tt_u64_op(weighted_alias_mass(wa, i), OP_LE, wa->scale * 4);
+  weighted_alias_free(wa);
+
+  /* A singleton is always chosen. */
+  wa = weighted_alias_new(vals, 1);
+  tt_assert(wa);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(weighted_alias_choose(wa), OP_EQ, 0);
+  weighted_alias_free(wa);
+
+  /* There is nothing to choose from with no weight, or no entries. */
+  tt_ptr_op(weighted_alias_new(zeros, 3), OP_EQ, NULL);
+  tt_ptr_op(weighted_alias_new(vals, 0), OP_EQ, NULL);
+
+ done:
+  weighted_alias_free(wa);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -6374,6 +6451,7 @@ struct testcase_t dir_tests[] = {
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(random_weighted_alias, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -13,6 +13,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircommon/directory.h"
 #include "feature/dircache/dircache.h"
@@ -38,6 +39,9 @@
 #include "feature/dirauth/dirvote.h"
 #include "test/log_test_helpers.h"
 #include "feature/dircommon/voting_schedule.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/encoding/binascii.h"
+#include "lib/net/buffers_net.h"
 
 #include "feature/dircommon/dir_connection_st.h"
 #include "feature/dirclient/dir_server_st.h"
@@ -1903,6 +1907,130 @@ test_dir_handle_get_status_vote_current_consensus_ns(void* data)
     clear_geoip_db();
 }
 
+static void
+mock_connection_mark_for_close_internal_(connection_t *conn,
+                                         int line, const char *file)
+{
+  (void)line;
+  (void)file;
+  conn->marked_for_close = 1;
+}
+
+static void
+mock_connection_stop_writing(connection_t *conn)
+{
+  (void)conn;
+}
+
+static void
+test_dir_handle_get_status_vote_current_consensus_ns_zero_copy(void *data)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+  dir_connection_t *conn = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  networkstatus_t *ns = NULL;
+  buf_t *received = NULL;
+  char *rand_bytes = NULL, *consensus = NULL;
+  char *header = NULL, *comp_body = NULL, *body = NULL;
+  size_t comp_body_used = 0, body_used = 0;
+  uint64_t n_zero_copy;
+  int i, reached_eof = 0, socket_error = 0;
+  /* Big enough that the socket can't take it all at once. */
+  const size_t consensus_len = 512*1024;
+  (void) data;
+
+  dirserv_free_all();
+  MOCK(get_options, mock_get_options);
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+  MOCK(connection_mark_for_close_internal_,
+       mock_connection_mark_for_close_internal_);
+  MOCK(connection_stop_writing, mock_connection_stop_writing);
+  init_mock_options();
+  mock_options->DirCacheZeroCopy = 1;
+  mock_options->BandwidthRate = mock_options->BandwidthBurst = 1<<30;
+  connection_bucket_init();
+
+  rand_bytes = tor_malloc(consensus_len / 2);
+  crypto_rand(rand_bytes, consensus_len / 2);
+  consensus = tor_malloc(consensus_len + 1);
+  base16_encode(consensus, consensus_len + 1, rand_bytes, consensus_len / 2);
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->valid_after = time(NULL) - 1800;
+  ns->fresh_until = time(NULL) - 900;
+  ns->valid_until = time(NULL) - 60;
+  consdiffmgr_add_consensus(consensus, ns);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  conn = new_dir_conn();
+  TO_CONN(conn)->s = fds[0];
+  TO_CONN(conn)->purpose = DIR_PURPOSE_SERVER;
+  n_zero_copy = dirserv_get_n_zero_copy_bytes();
+
+  /* Ask for the deflated consensus, which we serve as it is in the cache,
+   * without compressing on the fly. */
+  tt_int_op(0, OP_EQ, directory_handle_command_get(conn,
+    GET("/tor/status-vote/current/consensus-ns.z"), NULL, 0));
+  /* Only the headers went to the outbuf: the body waits for sendfile(). */
+  tt_int_op(connection_get_outbuf_len(TO_CONN(conn)), OP_LT, 1024);
+  tt_u64_op(connection_dirserv_sendfile_pending(conn), OP_GT, 1024);
+
+  received = buf_new();
+  for (i = 0; i < 10000 && !TO_CONN(conn)->marked_for_close; ++i) {
+    tt_int_op(0, OP_EQ, connection_handle_write(TO_CONN(conn), 0));
+    buf_read_from_socket(received, fds[1], 1<<20, &reached_eof,
+                         &socket_error);
+  }
+  tt_assert(TO_CONN(conn)->marked_for_close);
+  tt_ptr_op(conn->spool, OP_EQ, NULL);
+  buf_read_from_socket(received, fds[1], 1<<20, &reached_eof, &socket_error);
+
+  fetch_from_buf_http(received, &header, MAX_HEADERS_SIZE,
+                      &comp_body, &comp_body_used, consensus_len * 2, 0);
+  tt_assert(header);
+  tt_ptr_op(strstr(header, "HTTP/1.0 200 OK\r\n"), OP_EQ, header);
+  tt_u64_op(dirserv_get_n_zero_copy_bytes() - n_zero_copy, OP_EQ,
+            comp_body_used);
+
+  tt_int_op(0, OP_EQ, tor_uncompress(&body, &body_used,
+                                     comp_body, comp_body_used,
+                                     ZLIB_METHOD, 1, LOG_WARN));
+  tt_int_op(body_used, OP_EQ, consensus_len);
+  tt_str_op(body, OP_EQ, consensus);
+
+ done:
+  UNMOCK(get_options);
+  UNMOCK(connection_write_to_buf_impl_);
+  UNMOCK(connection_mark_for_close_internal_);
+  UNMOCK(connection_stop_writing);
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  else if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(received);
+  networkstatus_vote_free(ns);
+  tor_free(rand_bytes);
+  tor_free(consensus);
+  tor_free(header);
+  tor_free(comp_body);
+  tor_free(body);
+  or_options_free(mock_options); mock_options = NULL;
+  dirserv_free_all();
+#else
+  (void) data;
+  tt_skip();
+ done:
+  ;
+#endif /* defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) */
+}
+
 static void
 test_dir_handle_get_status_vote_current_consensus_ns_busy(void* data)
 {
@@ -2632,6 +2760,7 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(status_vote_current_consensus_too_old, TT_FORK),
   DIR_HANDLE_CMD(status_vote_current_consensus_ns_busy, TT_FORK),
   DIR_HANDLE_CMD(status_vote_current_consensus_ns, TT_FORK),
+  DIR_HANDLE_CMD(status_vote_current_consensus_ns_zero_copy, TT_FORK),
   DIR_HANDLE_CMD(status_vote_current_d_not_found, 0),
   DIR_HANDLE_CMD(status_vote_next_d_not_found, 0),
   DIR_HANDLE_CMD(status_vote_d, 0),
@@ -6,7 +6,10 @@
 #define CIRCUITLIST_PRIVATE
 
 #include "core/or/or.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/dos.h"
+#include "core/or/dos_sketch.h"
 #include "core/or/circuitlist.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/stats/geoip_stats.h"
@@ -65,6 +68,7 @@ test_dos_conn_creation(void *arg)
 
   /* Initialize test data */
   or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
   time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
   tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn.real_addr,
                                           "18.0.0.1"));
@@ -492,11 +496,188 @@ test_known_relay(void *arg)
   UNMOCK(get_param_cc_enabled);
 }
 
+/** Test that the sketch-based accounting blocks clients who open too many
+ *  connections or circuits, without using the geoip cache. */
+static void
+test_dos_sketch_detection(void *arg)
+{
+  (void) arg;
+  unsigned int i;
+  channel_t *chan = NULL;
+  or_connection_t or_conn;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  MOCK(get_param_sketch_enabled, mock_enable_dos_protection);
+  MOCK(channel_get_addr_if_possible,
+       mock_channel_get_addr_if_possible);
+
+  update_approx_time(1281533250); /* 2010-08-11 13:27:30 UTC */
+  chan = tor_malloc_zero(sizeof(channel_t));
+  channel_init(chan);
+  chan->is_client = 1;
+  memset(&or_conn, 0, sizeof(or_conn));
+  tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn.real_addr,
+                                          "18.0.0.1"));
+  tor_addr_t *addr = &or_conn.real_addr;
+
+  dos_init();
+  uint32_t max_concurrent_conns = get_param_conn_max_concurrent_count(NULL);
+  uint32_t max_circuit_count = get_param_cc_circuit_burst(NULL);
+
+  /* Connections are counted even though the address was never noted down
+   * in the geoip cache. */
+  for (i = 0; i < max_concurrent_conns; i++) {
+    dos_new_client_conn(&or_conn, NULL);
+  }
+  tt_assert(or_conn.tracked_in_dos_sketch);
+  tt_assert(!or_conn.tracked_for_dos_mitigation);
+  tt_ptr_op(geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT), OP_EQ,
+            NULL);
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+  dos_new_client_conn(&or_conn, NULL);
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+  dos_close_client_conn(&or_conn);
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+
+  /* The address becomes a heavy hitter halfway through its burst, and gets
+   * marked when it exhausts it, just as with the geoip cache. */
+  for (i = 0; i < max_circuit_count / 2 - 1; i++) {
+    dos_cc_new_create_cell(chan);
+  }
+  tt_ptr_op(dos_sketch_heavy_hitter_get(addr, approx_time()), OP_EQ, NULL);
+  dos_cc_new_create_cell(chan);
+  tt_ptr_op(dos_sketch_heavy_hitter_get(addr, approx_time()), OP_NE, NULL);
+  tt_uint_op(dos_sketch_heavy_hitter_get(addr, approx_time())->circuit_bucket,
+             OP_EQ, max_circuit_count - max_circuit_count / 2);
+  for (i = max_circuit_count / 2; i < max_circuit_count - 1; i++) {
+    dos_cc_new_create_cell(chan);
+  }
+  tt_int_op(DOS_CC_DEFENSE_NONE, OP_EQ, dos_cc_get_defense_type(chan));
+  dos_cc_new_create_cell(chan);
+  tt_int_op(DOS_CC_DEFENSE_REFUSE_CELL, OP_EQ, dos_cc_get_defense_type(chan));
+
+  /* Freeing the sketches forgets the connections counted in them, so that
+   * closing one later doesn't touch the counters of new sketches. */
+  or_conn.base_.magic = OR_CONNECTION_MAGIC;
+  or_conn.base_.type = CONN_TYPE_OR;
+  tor_init_connection_lists();
+  smartlist_add(get_connection_array(), TO_CONN(&or_conn));
+  tt_assert(or_conn.tracked_in_dos_sketch);
+  dos_free_all();
+  tt_assert(!or_conn.tracked_in_dos_sketch);
+  dos_init();
+  dos_sketch_conn_add(addr);
+  dos_close_client_conn(&or_conn);
+  tt_uint_op(dos_sketch_conn_estimate(addr), OP_EQ, 1);
+
+ done:
+  if (get_connection_array())
+    smartlist_remove(get_connection_array(), TO_CONN(&or_conn));
+  tor_free(chan);
+  dos_free_all();
+  UNMOCK(get_param_cc_enabled);
+  UNMOCK(get_param_conn_enabled);
+  UNMOCK(get_param_sketch_enabled);
+  UNMOCK(channel_get_addr_if_possible);
+}
+
+/** Test the sketch estimates and the table of heavy hitters directly. */
+static void
+test_dos_sketch(void *arg)
+{
+  (void) arg;
+  tor_addr_t addr, busy;
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  uint32_t i;
+  int n_over = 0;
+
+  tor_addr_from_ipv4h(&busy, 0x12000001);
+
+  /* Estimates never undercount, even with many more addresses than
+   * counters in a row. */
+  for (i = 0; i < 10; i++) {
+    dos_sketch_conn_add(&busy);
+  }
+  for (i = 0; i < 4 * DOS_SKETCH_WIDTH; i++) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    dos_sketch_conn_add(&addr);
+  }
+  tt_uint_op(dos_sketch_conn_estimate(&busy), OP_GE, 10);
+  for (i = 0; i < 4 * DOS_SKETCH_WIDTH; i++) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    tt_uint_op(dos_sketch_conn_estimate(&addr), OP_GE, 1);
+    dos_sketch_conn_remove(&addr);
+  }
+  /* Once everybody else is gone, the count is exact again. */
+  tt_uint_op(dos_sketch_conn_estimate(&busy), OP_EQ, 10);
+  tor_addr_from_ipv4h(&addr, 0x0b000001);
+  tt_uint_op(dos_sketch_conn_estimate(&addr), OP_EQ, 0);
+  dos_sketch_conn_remove(&addr);
+  tt_uint_op(dos_sketch_conn_estimate(&addr), OP_EQ, 0);
+
+  /* Circuit levels leak at the rate and, with the conservative update,
+   * one circuit each from many addresses barely raises anyone's estimate. */
+  for (i = 0; i < 20; i++) {
+    tt_uint_op(dos_sketch_circ_note(&busy, 3, now), OP_EQ, i + 1);
+  }
+  for (i = 0; i < DOS_SKETCH_WIDTH / 4; i++) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    if (dos_sketch_circ_note(&addr, 3, now) > 1)
+      n_over++;
+  }
+  tt_int_op(n_over, OP_LT, DOS_SKETCH_WIDTH / 100);
+  tt_uint_op(dos_sketch_circ_note(&busy, 3, now + 2), OP_EQ, 20 - 6 + 1);
+  tt_uint_op(dos_sketch_circ_note(&busy, 3, now + 100), OP_EQ, 1);
+
+  /* Heavy hitters keep exact statistics until evicted, and a marked
+   * address is the last to go. */
+  tt_ptr_op(dos_sketch_heavy_hitter_get(&busy, now), OP_EQ, NULL);
+  dos_sketch_heavy_hitter_add(&busy, now)->marked_until_ts = now + 100000;
+  tt_ptr_op(dos_sketch_heavy_hitter_get(&busy, now), OP_NE, NULL);
+  tt_ptr_op(dos_sketch_heavy_hitter_add(&busy, now), OP_EQ,
+            dos_sketch_heavy_hitter_get(&busy, now));
+  tt_int_op(dos_sketch_heavy_hitter_count(), OP_EQ, 1);
+  for (i = 0; i < 4 * DOS_SKETCH_HH_SIZE; i++) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    dos_sketch_heavy_hitter_add(&addr, now + 1 + i);
+  }
+  tt_int_op(dos_sketch_heavy_hitter_count(), OP_LE, DOS_SKETCH_HH_SIZE);
+  tt_ptr_op(dos_sketch_heavy_hitter_get(&busy, now), OP_NE, NULL);
+  tt_i64_op(dos_sketch_heavy_hitter_get(&busy, now)->marked_until_ts, OP_EQ,
+            now + 100000);
+  /* The most recent address is still there; the oldest unmarked one isn't. */
+  tt_ptr_op(dos_sketch_heavy_hitter_get(&addr, now), OP_NE, NULL);
+  tor_addr_from_ipv4h(&addr, 0x0a000000);
+  tt_ptr_op(dos_sketch_heavy_hitter_get(&addr, now), OP_EQ, NULL);
+
+  /* Looking an address up counts as seeing it, so an address that we keep
+   * looking up stays while newer ones come and go. */
+  now += 8 * DOS_SKETCH_HH_SIZE;
+  tor_addr_from_ipv4h(&addr, 0x0b000000);
+  dos_sketch_heavy_hitter_add(&addr, now);
+  for (i = 0; i < 4 * DOS_SKETCH_HH_SIZE; i++) {
+    tor_addr_t other;
+    tt_ptr_op(dos_sketch_heavy_hitter_get(&addr, now + 1 + i), OP_NE, NULL);
+    tor_addr_from_ipv4h(&other, 0x0c000000 + i);
+    dos_sketch_heavy_hitter_add(&other, now + 1 + i);
+  }
+  tt_ptr_op(dos_sketch_heavy_hitter_get(&addr, now), OP_NE, NULL);
+
+ done:
+  dos_sketch_free_all();
+}
+
 struct testcase_t dos_tests[] = {
   { "conn_creation", test_dos_conn_creation, TT_FORK, NULL, NULL },
   { "circuit_creation", test_dos_circuit_creation, TT_FORK, NULL, NULL },
   { "bucket_refill", test_dos_bucket_refill, TT_FORK, NULL, NULL },
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
+  { "sketch_detection", test_dos_sketch_detection, TT_FORK, NULL, NULL },
+  { "sketch", test_dos_sketch, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
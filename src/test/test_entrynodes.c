@@ -22,6 +22,7 @@
 #include "feature/dircommon/directory.h"
 #include "feature/dirclient/dirclient.h"
 #include "feature/client/entrynodes.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/networkstatus.h"
 #include "core/or/policies.h"
@@ -1982,6 +1983,47 @@ test_entry_guard_select_for_circuit_confirmed(void *arg)
   entry_guard_restriction_free(rst);
 }
 
+static void
+test_entry_guard_choose_k_primary_nodes(void *arg)
+{
+  (void)arg;
+  smartlist_t *primaries = NULL, *chosen = NULL, *excluded = NULL;
+
+  primaries = guards_get_usable_primary_nodes();
+  tt_int_op(smartlist_len(primaries), OP_GE, 4);
+
+  // All nodes are in the same /16, so we only get one of them.
+  get_options_mutable()->EnforceDistinctSubnets = 1;
+  chosen = node_sl_choose_k_by_bandwidth(primaries, WEIGHT_FOR_GUARD, 3,
+                                         NULL);
+  tt_int_op(smartlist_len(chosen), OP_EQ, 1);
+  smartlist_free(chosen);
+
+  // Otherwise, we get distinct nodes that are not excluded.
+  get_options_mutable()->EnforceDistinctSubnets = 0;
+  excluded = smartlist_new();
+  smartlist_add(excluded, smartlist_get(primaries, 0));
+  chosen = node_sl_choose_k_by_bandwidth(primaries, WEIGHT_FOR_GUARD, 3,
+                                         excluded);
+  tt_int_op(smartlist_len(chosen), OP_EQ, 3);
+  tt_assert(! smartlist_contains(chosen, smartlist_get(primaries, 0)));
+  SMARTLIST_FOREACH_BEGIN(chosen, const node_t *, node) {
+    tt_assert(smartlist_contains(primaries, node));
+    tt_int_op(smartlist_pos(chosen, node), OP_EQ, node_sl_idx);
+  } SMARTLIST_FOREACH_END(node);
+  smartlist_free(chosen);
+
+  // We get no more nodes than there are.
+  chosen = node_sl_choose_k_by_bandwidth(primaries, WEIGHT_FOR_GUARD,
+                                         smartlist_len(primaries) + 5, NULL);
+  tt_int_op(smartlist_len(chosen), OP_EQ, smartlist_len(primaries));
+
+ done:
+  smartlist_free(primaries);
+  smartlist_free(chosen);
+  smartlist_free(excluded);
+}
+
 static void
 test_entry_guard_select_for_circuit_highlevel_primary(void *arg)
 {
@@ -3082,6 +3124,7 @@ struct testcase_t entrynodes_tests[] = {
 
   BFN_TEST(select_for_circuit_no_confirmed),
   BFN_TEST(select_for_circuit_confirmed),
+  BFN_TEST(choose_k_primary_nodes),
   BFN_TEST(select_for_circuit_highlevel_primary),
   BFN_TEST(select_for_circuit_highlevel_confirm_other),
   BFN_TEST(select_for_circuit_highlevel_primary_retry),
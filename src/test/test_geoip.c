@@ -12,6 +12,7 @@
 #include "app/config/config.h"
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
 
   /* Record odd numbered fake-IPs using ipv6, even numbered fake-IPs
@@ -564,6 +565,117 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+/** IPv4 ranges for test_geoip_lookup_table().  They include adjacent
+ * ranges in one country, gaps, ranges that cross a /16, and ranges at both
+ * ends of the address space. */
+static const struct {
+  uint32_t low, high;
+  const char *cc;
+} lookup_table_ranges[] = {
+  { 0, 255, "aa" },
+  { 256, 65535, "aa" },
+  { 65536, 65600, "bb" },
+  { 131000, 200000, "cc" },
+  { 200001, 200001, "bb" },
+  { 3000000000u, 3000000000u, "dd" },
+  { 4294901760u, 4294967295u, "ee" },
+};
+
+/** Return the country code that lookup_table_ranges gives <b>addr</b>. */
+static const char *
+lookup_table_expected_cc(uint32_t addr)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(lookup_table_ranges); ++i) {
+    if (lookup_table_ranges[i].low <= addr &&
+        addr <= lookup_table_ranges[i].high)
+      return lookup_table_ranges[i].cc;
+  }
+  return "??";
+}
+
+static void
+test_geoip_lookup_table(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip_table"));
+  char *fname6 = tor_strdup(get_fname("geoip6_table"));
+  smartlist_t *lines = smartlist_new();
+  char *content = NULL;
+  struct in6_addr in6;
+  unsigned i;
+  int j;
+
+#define CHECK_IPV4(addr) \
+  tt_str_op(lookup_table_expected_cc(addr), OP_EQ,                        \
+            geoip_get_country_name(geoip_get_country_by_ipv4(addr)))
+#define CHECK_IPV6(addrstr, cc) STMT_BEGIN                                \
+    tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6, (addrstr), &in6));      \
+    tt_str_op((cc), OP_EQ,                                              \
+              geoip_get_country_name(geoip_get_country_by_ipv6(&in6))); \
+  STMT_END
+
+  for (i = 0; i < ARRAY_LENGTH(lookup_table_ranges); ++i) {
+    smartlist_add_asprintf(lines, "%u,%u,%s\n",
+                           lookup_table_ranges[i].low,
+                           lookup_table_ranges[i].high,
+                           lookup_table_ranges[i].cc);
+  }
+  content = smartlist_join_strings(lines, "", 0, NULL);
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, content, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+
+  /* Look just inside and just outside every range... */
+  for (i = 0; i < ARRAY_LENGTH(lookup_table_ranges); ++i) {
+    const uint32_t low = lookup_table_ranges[i].low;
+    const uint32_t high = lookup_table_ranges[i].high;
+    CHECK_IPV4(low);
+    CHECK_IPV4(high);
+    CHECK_IPV4(low - 1);
+    CHECK_IPV4(high + 1);
+  }
+  /* ...and at plenty of other places. */
+  for (j = 0; j < 10000; ++j) {
+    uint32_t addr = (uint32_t)crypto_rand_uint64(UINT64_C(1) << 32);
+    CHECK_IPV4(addr);
+    CHECK_IPV4(addr & 0xffff0000);
+    CHECK_IPV4(addr % 300000);
+  }
+
+  tt_int_op(0, OP_EQ, write_str_to_file(fname6,
+     "::,::ff,AA\n"
+     "2001:db8::,2001:db8:0:ffff:ffff:ffff:ffff:ffff,BB\n"
+     "2001:ffff::,2002:0:ffff:ffff:ffff:ffff:ffff:ffff,CC\n"
+     "ffff::,ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff,DD\n", 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname6, LOG_WARN));
+
+  CHECK_IPV6("::", "aa");
+  CHECK_IPV6("::ff", "aa");
+  CHECK_IPV6("::100", "??");
+  CHECK_IPV6("2001:db7:ffff:ffff:ffff:ffff:ffff:ffff", "??");
+  CHECK_IPV6("2001:db8::", "bb");
+  CHECK_IPV6("2001:db8:0:ffff:ffff:ffff:ffff:ffff", "bb");
+  CHECK_IPV6("2001:db8:1::", "??");
+  CHECK_IPV6("2001:fffe:ffff:ffff:ffff:ffff:ffff:ffff", "??");
+  CHECK_IPV6("2001:ffff::", "cc");
+  CHECK_IPV6("2002::1", "cc");
+  CHECK_IPV6("2002:0:ffff:ffff:ffff:ffff:ffff:ffff", "cc");
+  CHECK_IPV6("2002:1::", "??");
+  CHECK_IPV6("fffe:ffff:ffff:ffff:ffff:ffff:ffff:ffff", "??");
+  CHECK_IPV6("ffff::", "dd");
+  CHECK_IPV6("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", "dd");
+
+#undef CHECK_IPV4
+#undef CHECK_IPV6
+
+ done:
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(content);
+  tor_free(fname);
+  tor_free(fname6);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +687,7 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "lookup_table", test_geoip_lookup_table, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
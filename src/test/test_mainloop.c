@@ -6,11 +6,29 @@
  * \brief Tests for functions closely related to the Tor main loop
  */
 
+#define CONNECTION_PRIVATE
+#define MAINLOOP_PRIVATE
+#define TOR_CHANNEL_INTERNAL_
+
 #include "test/test.h"
 #include "test/log_test_helpers.h"
 
 #include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
+#include "core/or/channel.h"
+#include "core/or/channelpadding.h"
+#include "core/or/channeltls.h"
+#include "core/or/connection_or.h"
+#include "feature/dircommon/directory.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
+#include "trunnel/channelpadding_negotiation.h"
+
+#include "core/or/connection_st.h"
+#include "core/or/or_connection_st.h"
+#include "feature/dircommon/dir_connection_st.h"
 
 static const uint64_t BILLION = 1000000000;
 
@@ -131,12 +149,123 @@ test_mainloop_update_time_jumps(void *arg)
   monotime_disable_test_mocking();
 }
 
+static void
+test_mainloop_housekeeping_dir_deadline(void *arg)
+{
+  dir_connection_t *dirconn = NULL;
+  connection_t *conn;
+  const time_t now = 1500000000;
+  (void)arg;
+
+  tor_init_connection_lists();
+  get_options_mutable()->TestingDirConnectionMaxStall = 300;
+  dirconn = dir_connection_new(AF_INET);
+  conn = TO_CONN(dirconn);
+  conn->state = DIR_CONN_STATE_CLIENT_READING;
+
+  /* A client connection is due when it has read nothing for too long. */
+  conn->purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  conn->timestamp_last_read_allowed = now - 100;
+  conn->timestamp_last_write_allowed = now - 1000;
+  tt_int_op(run_connection_housekeeping(conn, now), OP_EQ, 201);
+  tt_int_op(run_connection_housekeeping(conn, now + 200), OP_EQ, 1);
+  tt_assert(!conn->marked_for_close);
+
+  /* A server connection is due when it has written nothing for too long. */
+  conn->purpose = DIR_PURPOSE_SERVER;
+  tt_int_op(run_connection_housekeeping(conn, now), OP_EQ, 0);
+  tt_assert(conn->marked_for_close);
+
+  /* A marked connection needs no more housekeeping. */
+  conn->timestamp_last_write_allowed = now;
+  tt_int_op(run_connection_housekeeping(conn, now), OP_EQ, 0);
+
+ done:
+  connection_free_minimal(conn);
+}
+
+static void
+test_mainloop_housekeeping_channel_usage(void *arg)
+{
+  or_connection_t *or_conn = NULL;
+  channel_tls_t *tlschan = NULL;
+  channelpadding_negotiate_t *pad_vars = NULL;
+  channel_t *chan;
+  connection_t *conn;
+  const time_t now = 1500000000;
+  (void)arg;
+
+  tor_libevent_postfork();
+  timers_initialize();
+  update_approx_time(now);
+  connection_housekeeping_enabled = 1;
+
+  or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  conn = TO_CONN(or_conn);
+  conn->state = OR_CONN_STATE_OPEN;
+  tlschan = tor_malloc_zero(sizeof(*tlschan));
+  chan = &tlschan->base_;
+  chan->magic = TLS_CHAN_MAGIC;
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->channel_usage = CHANNEL_USED_FOR_FULL_CIRCS;
+  tlschan->conn = or_conn;
+  or_conn->chan = tlschan;
+  tor_init_connection_lists();
+  smartlist_add(connection_array, conn);
+
+  /* Housekeeping decided not to pad the channel, so it isn't due for a
+   * while. */
+  conn->housekeeping_due = 0;
+  connection_schedule_housekeeping(conn, 300);
+  tt_int_op(conn->housekeeping_due, OP_EQ, now + 300);
+
+  /* No change, no reschedule. */
+  channel_set_usage(chan, CHANNEL_USED_FOR_FULL_CIRCS);
+  tt_int_op(conn->housekeeping_due, OP_EQ, now + 300);
+
+  /* Once the channel carries user traffic, we may want to pad it. */
+  channel_set_usage(chan, CHANNEL_USED_FOR_USER_TRAFFIC);
+  tt_int_op(chan->channel_usage, OP_EQ, CHANNEL_USED_FOR_USER_TRAFFIC);
+  tt_int_op(conn->housekeeping_due, OP_EQ, now);
+
+  /* So may negotiating padding, or a new consensus. */
+  conn->housekeeping_due = 0;
+  connection_schedule_housekeeping(conn, 300);
+  chan->padding_enabled = 0;
+  get_options_mutable()->ORPort_set = 1;
+  pad_vars = channelpadding_negotiate_new();
+  channelpadding_negotiate_set_command(pad_vars,
+                                       CHANNELPADDING_COMMAND_START);
+  tt_int_op(channelpadding_update_padding_for_channel(chan, pad_vars),
+            OP_EQ, 1);
+  tt_int_op(conn->housekeeping_due, OP_EQ, now);
+
+  conn->housekeeping_due = 0;
+  connection_schedule_housekeeping(conn, 300);
+  channelpadding_new_consensus_params(NULL);
+  tt_int_op(conn->housekeeping_due, OP_EQ, now);
+
+ done:
+  channelpadding_negotiate_free(pad_vars);
+  if (or_conn) {
+    smartlist_remove(connection_array, TO_CONN(or_conn));
+    or_conn->chan = NULL;
+  }
+  tor_free(tlschan);
+  if (or_conn)
+    connection_free_minimal(TO_CONN(or_conn));
+  connection_housekeeping_enabled = 0;
+  timers_shutdown();
+}
+
 #define MAINLOOP_TEST(name) \
   { #name, test_mainloop_## name , TT_FORK, NULL, NULL }
 
 struct testcase_t mainloop_tests[] = {
   MAINLOOP_TEST(update_time_normal),
   MAINLOOP_TEST(update_time_jumps),
+  MAINLOOP_TEST(housekeeping_dir_deadline),
+  MAINLOOP_TEST(housekeeping_channel_usage),
   END_OF_TESTCASES
 };
 
@@ -354,9 +354,37 @@ test_oom_streambuf(void *arg)
   monotime_disable_test_mocking();
 }
 
+static void
+test_oom_age_buckets(void *arg)
+{
+  uint32_t age;
+  int prev = 0;
+  (void) arg;
+
+  tt_int_op(oom_age_bucket(0), OP_EQ, 0);
+  tt_int_op(oom_age_bucket(1), OP_EQ, 1);
+  tt_int_op(oom_age_bucket(2), OP_EQ, 2);
+  tt_int_op(oom_age_bucket(3), OP_EQ, 3);
+  tt_int_op(oom_age_bucket(4), OP_EQ, 4);
+  tt_int_op(oom_age_bucket(6), OP_EQ, 5);
+  tt_int_op(oom_age_bucket(UINT32_MAX), OP_EQ, 63);
+
+  /* Older items never go into lower buckets. */
+  for (age = 0; age < (1u<<20); age += 1 + age / 64) {
+    int b = oom_age_bucket(age);
+    tt_int_op(b, OP_GE, prev);
+    tt_int_op(b, OP_LE, prev + 1);
+    prev = b;
+  }
+
+ done:
+  ;
+}
+
 struct testcase_t oom_tests[] = {
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
+  { "age_buckets", test_oom_age_buckets, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
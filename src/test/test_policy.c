@@ -8,9 +8,11 @@
 #include "app/config/config.h"
 #include "core/or/policies.h"
 #include "feature/dirparse/policy_parse.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "feature/relay/router.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
+#include "test/log_test_helpers.h"
 
 #include "core/or/addr_policy_st.h"
 #include "core/or/port_cfg_st.h"
@@ -2426,6 +2428,185 @@ test_policies_fascist_firewall_choose_address(void *arg)
   UNMOCK(get_options);
 }
 
+/** Check that <b>cp</b> gives the same result as <b>policy</b> for
+ * <b>addr</b> (or an unknown address, if NULL) on <b>port</b> and on an
+ * unknown port. */
+static int
+compiled_policy_agrees(const smartlist_t *policy,
+                       const compiled_addr_policy_t *cp,
+                       const tor_addr_t *addr, uint16_t port)
+{
+  if (compare_tor_addr_to_addr_policy(addr, port, policy) !=
+      compare_tor_addr_to_compiled_policy(addr, port, cp))
+    return 0;
+  if (addr &&
+      compare_tor_addr_to_addr_policy(addr, 0, policy) !=
+      compare_tor_addr_to_compiled_policy(addr, 0, cp))
+    return 0;
+  return 1;
+}
+
+static void
+test_policies_compiled(void *arg)
+{
+  static const char *exit_policies[] = {
+    "accept *:*",
+    "reject *:*",
+    "reject 10.0.0.0/8:*, accept 10.1.0.0/16:80-443, accept *:22, "
+      "reject *:20-25, accept 192.0.2.128/25:1-1024, accept *6:443, "
+      "reject [2001:db8::]/32:*, accept [2001:db8::1]:80, "
+      "accept *4:8000-8999",
+    "reject 128.0.0.0/1:*, accept 0.0.0.0/1:65535, reject *:1",
+    NULL,
+  };
+  const uint16_t ports[] = { 1, 19, 20, 22, 25, 26, 80, 443, 444, 1024,
+                             1025, 8000, 8999, 9000, 65534, 65535 };
+  smartlist_t *policy = NULL, *policy2 = NULL, *addr_list = NULL;
+  compiled_addr_policy_t *cp = NULL, *cp2 = NULL;
+  config_line_t line;
+  tor_addr_t addr, my_addr, my_addr6;
+  int i, j, k, n_checked = 0, malformed = 0;
+  (void)arg;
+
+  tor_addr_from_ipv4h(&my_addr, 0xc6336401); /* 198.51.100.1 */
+  tor_addr_parse(&my_addr6, "[2001:db8:1::1]");
+  addr_list = smartlist_new();
+  smartlist_add(addr_list, &my_addr);
+  smartlist_add(addr_list, &my_addr6);
+
+  for (i = 0; exit_policies[i]; ++i) {
+    /* Alternate between the default and the reduced exit policy. */
+    const exit_policy_parser_cfg_t flags =
+      EXIT_POLICY_IPV6_ENABLED | EXIT_POLICY_REJECT_PRIVATE |
+      ((i & 1) ? EXIT_POLICY_ADD_REDUCED : EXIT_POLICY_ADD_DEFAULT);
+    memset(&line, 0, sizeof(line));
+    line.key = (char *)"ExitPolicy";
+    line.value = (char *)exit_policies[i];
+    tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &policy,
+                                                   flags, addr_list));
+    cp = addr_policy_compile(policy);
+    tt_ptr_op(cp, OP_NE, NULL);
+
+    /* Equal policies share a compiled policy. */
+    tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &policy2,
+                                                   flags, addr_list));
+    cp2 = addr_policy_compile(policy2);
+    tt_ptr_op(cp2, OP_EQ, cp);
+    compiled_addr_policy_free(cp2);
+    addr_policy_list_free(policy2);
+
+    /* Try the addresses at, just inside and just outside the edges of each
+     * rule, and some random ones. */
+    SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, p) {
+      for (k = 0; k < 4; ++k) {
+        if (tor_addr_family(&p->addr) == AF_INET) {
+          uint32_t a = tor_addr_to_ipv4h(&p->addr);
+          uint32_t host = p->maskbits >= 32 ? 0 :
+            (UINT32_MAX >> p->maskbits);
+          uint32_t net = a & ~host;
+          const uint32_t cases[4] = { net, net + host, net - 1,
+                                      net + host + 1 };
+          tor_addr_from_ipv4h(&addr, cases[k]);
+        } else {
+          uint8_t bytes[16];
+          memcpy(bytes, tor_addr_to_in6_addr8(&p->addr), 16);
+          bytes[15] += (uint8_t)(k - 1);
+          tor_addr_from_ipv6_bytes(&addr, (const char *)bytes);
+        }
+        for (j = 0; j < (int)ARRAY_LENGTH(ports); ++j) {
+          tt_assert(compiled_policy_agrees(policy, cp, &addr, ports[j]));
+          ++n_checked;
+        }
+        tt_assert(compiled_policy_agrees(policy, cp, &addr, p->prt_min));
+        tt_assert(compiled_policy_agrees(policy, cp, &addr, p->prt_max));
+      }
+    } SMARTLIST_FOREACH_END(p);
+    for (k = 0; k < 2000; ++k) {
+      const uint16_t port = 1 + crypto_rand_int(65535);
+      if (k & 1) {
+        tor_addr_from_ipv4h(&addr, (uint32_t)crypto_rand_uint64(
+                                                   UINT64_C(1) << 32));
+      } else {
+        uint8_t bytes[16];
+        crypto_rand((char *)bytes, sizeof(bytes));
+        bytes[0] = 0x20;
+        tor_addr_from_ipv6_bytes(&addr, (const char *)bytes);
+      }
+      tt_assert(compiled_policy_agrees(policy, cp, &addr, port));
+      ++n_checked;
+    }
+    for (j = 0; j < (int)ARRAY_LENGTH(ports); ++j) {
+      tt_assert(compiled_policy_agrees(policy, cp, NULL, ports[j]));
+    }
+    tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+              compare_tor_addr_to_compiled_policy(NULL, 0, cp));
+
+    compiled_addr_policy_free(cp);
+    addr_policy_list_free(policy);
+  }
+  tt_int_op(n_checked, OP_GT, 0);
+
+  /* We don't compile policies that still hold the "private" alias. */
+  policy = smartlist_new();
+  smartlist_add(policy, router_parse_addr_policy_item_from_string(
+                                    "reject private:*", -1, &malformed));
+  tt_assert(((addr_policy_t *)smartlist_get(policy, 0))->is_private);
+  tt_ptr_op(addr_policy_compile(policy), OP_EQ, NULL);
+  tt_ptr_op(addr_policy_compile(NULL), OP_EQ, NULL);
+
+ done:
+  compiled_addr_policy_free(cp);
+  addr_policy_list_free(policy);
+  addr_policy_list_free(policy2);
+  smartlist_free(addr_list);
+}
+
+/** Return a new exit policy that accepts port 80 only. */
+static smartlist_t *
+make_port_80_policy(void)
+{
+  smartlist_t *policy = smartlist_new();
+  int malformed = 0;
+  smartlist_add(policy, router_parse_addr_policy_item_from_string(
+                                    "accept *4:80", -1, &malformed));
+  smartlist_add(policy, router_parse_addr_policy_item_from_string(
+                                    "reject *4:*", -1, &malformed));
+  return policy;
+}
+
+static void
+test_policies_compiled_free_all(void *arg)
+{
+  smartlist_t *policy = NULL;
+  compiled_addr_policy_t *cp;
+  (void)arg;
+
+  policy = make_port_80_policy();
+  cp = addr_policy_compile(policy);
+  tt_assert(cp);
+  addr_policy_list_free(policy);
+
+  /* A compiled policy that is still around at shutdown gets freed, along
+   * with the cached rules that only it refers to. */
+  setup_full_capture_of_logs(LOG_WARN);
+  policies_free_all();
+  expect_single_log_msg_containing(
+                    "Still had 1 compiled address policies at shutdown.");
+  teardown_capture_of_logs();
+
+  /* We can compile it again afterwards. */
+  policy = make_port_80_policy();
+  cp = addr_policy_compile(policy);
+  tt_assert(cp);
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(NULL, 80, cp));
+  compiled_addr_policy_free(cp);
+
+ done:
+  teardown_capture_of_logs();
+  addr_policy_list_free(policy);
+}
+
 #undef TEST_IPV4_ADDR_STR
 #undef TEST_IPV6_ADDR_STR
 #undef TEST_IPV4_OR_PORT
@@ -2441,6 +2622,9 @@ struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
+  { "compiled_free_all", test_policies_compiled_free_all, TT_FORK, NULL,
+    NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
   { "reject_exit_address", test_policies_reject_exit_address, 0, NULL, NULL },
@@ -2,21 +2,34 @@
 /* See LICENSE for licensing information */
 
 #define CIRCUITBUILD_PRIVATE
+#define CONNECTION_PRIVATE
 #define RELAY_PRIVATE
+#define RELAYWORKER_PRIVATE
 #define REPHIST_PRIVATE
 #include "core/or/or.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/channeltls.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/relayworker.h"
+#include "core/or/connection_edge.h"
+#include "core/crypto/relay_crypto.h"
+#include "lib/container/buffers.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "feature/stats/rephist.h"
 #include "core/or/relay.h"
 #include "feature/stats/rephist.h"
 #include "lib/container/order.h"
 /* For init/free stuff */
 #include "core/or/scheduler.h"
+#include "app/config/config.h"
+#include "lib/evloop/workqueue.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
+#include "feature/split/cell_buffer.h"
 
 /* Test suite stuff */
 #include "test/test.h"
@@ -159,6 +172,7 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   channel_t *nchan = NULL, *pchan = NULL;
   or_circuit_t *orcirc = NULL;
   cell_t *cell = NULL;
+  packed_cell_t *packed = NULL, *first = NULL;
   int old_count, new_count;
 
   (void)arg;
@@ -199,6 +213,18 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   new_count = get_mock_scheduler_has_waiting_cells_count();
   tt_int_op(new_count, OP_EQ, old_count + 1);
 
+  /* A packed cell is moved to the queue as it is */
+  packed = packed_cell_copy(cell, nchan->wide_circ_ids);
+  old_count = get_mock_scheduler_has_waiting_cells_count();
+  append_packed_cell_to_circuit_queue(TO_CIRCUIT(orcirc), nchan, packed,
+                                      CELL_DIRECTION_OUT);
+  new_count = get_mock_scheduler_has_waiting_cells_count();
+  tt_int_op(new_count, OP_EQ, old_count + 1);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 2);
+  first = cell_queue_pop(&orcirc->base_.n_chan_cells);
+  tt_mem_op(first->body, OP_EQ, packed->body, CELL_MAX_NETWORK_SIZE);
+  tt_ptr_op(cell_queue_pop(&orcirc->base_.n_chan_cells), OP_EQ, packed);
+
   UNMOCK(scheduler_channel_has_waiting_cells);
 
   /* Get rid of the fake channels */
@@ -212,6 +238,8 @@ test_relay_append_cell_to_circuit_queue(void *arg)
 
  done:
   tor_free(cell);
+  packed_cell_free(first);
+  packed_cell_free(packed);
   if (orcirc) {
     circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
     circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
@@ -225,10 +253,295 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+/** Check that an exit packages several full cells from a stream at once,
+ * and that the origin can decrypt them in order. */
+static void
+test_relay_package_raw_inbuf_batch(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *exitconn = NULL;
+  relay_crypto_t client_crypto;
+  char key_data[CPATH_KEY_MATERIAL_LEN];
+  char data[4 * RELAY_PAYLOAD_SIZE + 100];
+  packed_cell_t *packed = NULL;
+  relay_header_t rh;
+  int i, payload_offset;
+
+  (void)arg;
+  memset(&client_crypto, 0, sizeof(client_crypto));
+
+  nchan = new_fake_channel();
+  tt_assert(nchan);
+  pchan = new_fake_channel();
+  tt_assert(pchan);
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+
+  crypto_rand(key_data, sizeof(key_data));
+  tt_int_op(0, OP_EQ, relay_crypto_init(&orcirc->crypto, key_data,
+                                        sizeof(key_data), 0, 0));
+  tt_int_op(0, OP_EQ, relay_crypto_init(&client_crypto, key_data,
+                                        sizeof(key_data), 0, 0));
+
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->base_.state = EXIT_CONN_STATE_OPEN;
+  exitconn->stream_id = 42;
+  exitconn->package_window = STREAMWINDOW_START;
+  exitconn->on_circuit = TO_CIRCUIT(orcirc);
+  orcirc->n_streams = exitconn;
+
+  crypto_rand(data, sizeof(data));
+  buf_add(exitconn->base_.inbuf, data, sizeof(data));
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  /* four full cells are packaged together, then the partial one */
+  tt_int_op(0, OP_EQ, connection_edge_package_raw_inbuf(exitconn, 1, NULL));
+  tt_int_op(buf_datalen(exitconn->base_.inbuf), OP_EQ, 0);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 5);
+  tt_int_op(orcirc->base_.package_window, OP_EQ, CIRCWINDOW_START_MAX - 5);
+  tt_int_op(exitconn->package_window, OP_EQ, STREAMWINDOW_START - 5);
+
+  UNMOCK(scheduler_channel_has_waiting_cells);
+
+  payload_offset = pchan->wide_circ_ids ? 5 : 3;
+  for (i = 0; i < 5; ++i) {
+    uint8_t *payload;
+    packed = cell_queue_pop(&orcirc->p_chan_cells);
+    tt_assert(packed);
+    payload = (uint8_t *)packed->body + payload_offset;
+    tt_int_op(packed->body[payload_offset - 1], OP_EQ, CELL_RELAY);
+    crypto_cipher_crypt_inplace(client_crypto.b_crypto, (char *)payload,
+                                CELL_PAYLOAD_SIZE);
+    relay_header_unpack(&rh, payload);
+    tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DATA);
+    tt_int_op(rh.stream_id, OP_EQ, 42);
+    tt_int_op(rh.recognized, OP_EQ, 0);
+    tt_int_op(rh.length, OP_EQ, i < 4 ? RELAY_PAYLOAD_SIZE : 100);
+    tt_mem_op(payload + RELAY_HEADER_SIZE, OP_EQ,
+              data + i * RELAY_PAYLOAD_SIZE, rh.length);
+    packed_cell_free(packed);
+  }
+
+  /* Get rid of the fake channels */
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+  channel_mark_for_close(nchan);
+  channel_mark_for_close(pchan);
+  UNMOCK(scheduler_release_channel);
+
+  /* Shut down channels */
+  channel_free_all();
+
+ done:
+  packed_cell_free(packed);
+  if (exitconn)
+    connection_free_minimal(TO_CONN(exitconn));
+  relay_crypto_clear(&client_crypto);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    relay_crypto_clear(&orcirc->crypto);
+  }
+  tor_free(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
+/** Check that the relay crypto workers crypt the cells of a circuit in
+ * order, including the ones we create ourselves. */
+static void
+test_relay_crypto_threads(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  relay_crypto_t client_crypto;
+  char key_data[CPATH_KEY_MATERIAL_LEN];
+  uint8_t plaintext[3][CELL_PAYLOAD_SIZE];
+  packed_cell_t *packed = NULL;
+  relay_header_t rh;
+  cell_t cell;
+  int i, payload_offset;
+
+  (void)arg;
+  memset(&client_crypto, 0, sizeof(client_crypto));
+
+  get_options_mutable()->RelayCryptoThreads = 2;
+  relay_worker_init();
+
+  nchan = new_fake_channel();
+  tt_assert(nchan);
+  pchan = new_fake_channel();
+  tt_assert(pchan);
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+
+  crypto_rand(key_data, sizeof(key_data));
+  tt_int_op(0, OP_EQ, relay_crypto_init(&orcirc->crypto, key_data,
+                                        sizeof(key_data), 0, 0));
+  tt_int_op(0, OP_EQ, relay_crypto_init(&client_crypto, key_data,
+                                        sizeof(key_data), 0, 0));
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  /* three cells to pass on, and one that we send back ourselves */
+  for (i = 0; i < 3; ++i) {
+    crypto_rand((char *)plaintext[i], CELL_PAYLOAD_SIZE);
+    plaintext[i][1] = 0xff; /* not recognized */
+    memset(&cell, 0, sizeof(cell));
+    cell.command = CELL_RELAY;
+    cell.circ_id = orcirc->p_circ_id;
+    memcpy(cell.payload, plaintext[i], CELL_PAYLOAD_SIZE);
+    crypto_cipher_crypt_inplace(client_crypto.f_crypto, (char *)cell.payload,
+                                CELL_PAYLOAD_SIZE);
+    tt_int_op(circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                         CELL_DIRECTION_OUT), OP_EQ, 1);
+  }
+  tt_int_op(0, OP_EQ, relay_send_command_from_edge(0, TO_CIRCUIT(orcirc),
+                                                   RELAY_COMMAND_DROP,
+                                                   NULL, 0, NULL));
+  tt_int_op(orcirc->n_relay_job_cells, OP_EQ, 4);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 0);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 0);
+
+  for (i = 0; i < 10000 && orcirc->relay_jobs_head; ++i) {
+    replyqueue_process(relay_worker_get_replyqueue());
+    tor_sleep_msec(1);
+  }
+  tt_ptr_op(orcirc->relay_jobs_head, OP_EQ, NULL);
+  tt_ptr_op(orcirc->relay_jobs_tail, OP_EQ, NULL);
+  tt_int_op(orcirc->n_relay_job_cells, OP_EQ, 0);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 3);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 1);
+
+  UNMOCK(scheduler_channel_has_waiting_cells);
+
+  payload_offset = nchan->wide_circ_ids ? 5 : 3;
+  for (i = 0; i < 3; ++i) {
+    packed = cell_queue_pop(&orcirc->base_.n_chan_cells);
+    tt_assert(packed);
+    tt_mem_op(packed->body + payload_offset, OP_EQ, plaintext[i],
+              CELL_PAYLOAD_SIZE);
+    packed_cell_free(packed);
+  }
+
+  payload_offset = pchan->wide_circ_ids ? 5 : 3;
+  packed = cell_queue_pop(&orcirc->p_chan_cells);
+  tt_assert(packed);
+  crypto_cipher_crypt_inplace(client_crypto.b_crypto,
+                              packed->body + payload_offset,
+                              CELL_PAYLOAD_SIZE);
+  relay_header_unpack(&rh, (uint8_t *)packed->body + payload_offset);
+  tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DROP);
+  tt_int_op(rh.recognized, OP_EQ, 0);
+  packed_cell_free(packed);
+
+  /* Get rid of the fake channels */
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+  channel_mark_for_close(nchan);
+  channel_mark_for_close(pchan);
+  UNMOCK(scheduler_release_channel);
+
+  /* Shut down channels */
+  channel_free_all();
+
+ done:
+  packed_cell_free(packed);
+  relay_crypto_clear(&client_crypto);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    relay_worker_circ_free(orcirc);
+    relay_crypto_clear(&orcirc->crypto);
+  }
+  tor_free(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
+#ifdef HAVE_MODULE_SPLIT
+/* Pop the next cell from <b>buf</b> the way the merging middle drains it
+ * (packed cells first) and return its first payload byte. */
+static int
+split_cell_buffer_pop_marker(cell_buffer_t *buf)
+{
+  packed_cell_t *packed;
+  buffered_cell_t *buf_cell;
+  int marker = -1;
+
+  if ((packed = cell_buffer_pop_packed(buf))) {
+    marker = (uint8_t) packed->body[CELL_MAX_NETWORK_SIZE - CELL_PAYLOAD_SIZE];
+    packed_cell_free(packed);
+  } else if ((buf_cell = cell_buffer_pop(buf))) {
+    marker = buf_cell->cell.payload[0];
+    buffered_cell_free(buf_cell);
+  }
+  return marker;
+}
+
+static void
+test_relay_split_cell_buffer_order(void *arg)
+{
+  cell_buffer_t *buf = cell_buffer_new();
+  cell_t cell;
+  int i;
+  (void)arg;
+
+  cell_buffer_init(buf);
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+
+  /* packed, then a cell_t (e.g. no channel yet), then packed again */
+  cell.payload[0] = 0;
+  cell_buffer_append_packed_copy(buf, &cell, 1);
+  cell.payload[0] = 1;
+  cell_buffer_append_cell(buf, &cell);
+  cell.payload[0] = 2;
+  cell_buffer_append_packed_copy(buf, &cell, 1);
+  cell.payload[0] = 3;
+  cell_buffer_append_packed_copy(buf, &cell, 1);
+  tt_int_op(buf->num, OP_EQ, 4);
+  tt_int_op(buf->packed.n, OP_EQ, 1);
+
+  for (i = 0; i < 4; ++i)
+    tt_int_op(split_cell_buffer_pop_marker(buf), OP_EQ, i);
+  tt_int_op(buf->num, OP_EQ, 0);
+
+  /* once the cell_t is gone, we store packed cells again */
+  cell.payload[0] = 4;
+  cell_buffer_append_packed_copy(buf, &cell, 1);
+  tt_int_op(buf->packed.n, OP_EQ, 1);
+  tt_int_op(split_cell_buffer_pop_marker(buf), OP_EQ, 4);
+
+ done:
+  cell_buffer_free(buf);
+}
+#endif /* defined(HAVE_MODULE_SPLIT) */
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "package_raw_inbuf_batch", test_relay_package_raw_inbuf_batch,
+    TT_FORK, NULL, NULL },
+  { "crypto_threads", test_relay_crypto_threads,
+    TT_FORK, NULL, NULL },
+#ifdef HAVE_MODULE_SPLIT
+  { "split_cell_buffer_order", test_relay_split_cell_buffer_order,
+    TT_FORK, NULL, NULL },
+#endif
   END_OF_TESTCASES
 };
@@ -182,12 +182,74 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+/* As above, but encrypt several cells from the last hop at once. */
+static void
+test_relaycrypt_inbound_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig[RELAY_CRYPT_MAX_BATCH];
+  cell_t encrypted[RELAY_CRYPT_MAX_BATCH];
+  cell_t *cells[RELAY_CRYPT_MAX_BATCH];
+  int i, j, k, n;
+
+  for (i = 0; i < 20; ++i) {
+    n = 1 + i % RELAY_CRYPT_MAX_BATCH;
+    for (k = 0; k < n; ++k) {
+      crypto_rand((char *)&orig[k], sizeof(orig[k]));
+
+      relay_header_unpack(&rh, orig[k].payload);
+      rh.recognized = 0;
+      memset(rh.integrity, 0, sizeof(rh.integrity));
+      relay_header_pack(orig[k].payload, &rh);
+
+      memcpy(&encrypted[k], &orig[k], sizeof(orig[k]));
+      cells[k] = &encrypted[k];
+    }
+
+    /* Encrypt the cells to the last hop */
+    relay_encrypt_cells_inbound(cells, n, cs->or_circ[2]);
+
+    for (k = 0; k < n; ++k) {
+      crypt_path_t *layer_hint = NULL;
+      char recognized = 0;
+      int r;
+      for (j = 1; j >= 0; --j) {
+        circuit_t* circ = TO_CIRCUIT(cs->or_circ[j]);
+        r = relay_decrypt_cell(&circ,
+                               &encrypted[k],
+                               CELL_DIRECTION_IN,
+                               &layer_hint, &recognized, NULL);
+        tt_int_op(r, OP_EQ, 0);
+        tt_int_op(recognized, OP_EQ, 0);
+      }
+
+      circuit_t* circ = TO_CIRCUIT(cs->origin_circ);
+      r = relay_decrypt_cell(&circ,
+                             &encrypted[k],
+                             CELL_DIRECTION_IN,
+                             &layer_hint, &recognized, NULL);
+      tt_int_op(r, OP_EQ, 0);
+      tt_int_op(recognized, OP_EQ, 1);
+      tt_ptr_op(layer_hint, OP_EQ, cs->origin_circ->cpath->prev);
+
+      tt_mem_op(orig[k].payload, OP_EQ, encrypted[k].payload,
+                CELL_PAYLOAD_SIZE);
+    }
+  }
+ done:
+  ;
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(inbound_batch),
   END_OF_TESTCASES
 };
 
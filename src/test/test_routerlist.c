@@ -17,6 +17,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "feature/control/control.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/directory.h"
@@ -43,10 +44,13 @@
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/node_st.h"
 #include "app/config/or_state_st.h"
+#include "feature/nodelist/routerinfo_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 
 #include "lib/encoding/confline.h"
 #include "lib/container/buffers.h"
+#include "lib/crypt_ops/crypto_format.h"
+#include "lib/evloop/workqueue.h"
 
 #include "test/test.h"
 #include "test/test_dir_common.h"
@@ -435,6 +439,107 @@ test_router_pick_directory_server_impl(void *arg)
   networkstatus_vote_free(con_md);
 }
 
+/** Test that router_choose_random_node_impl() honors its exclusions and
+ * restrictions, whether it draws from the cached node weights or lists
+ * every acceptable node. */
+static void
+test_router_choose_random_node(void *arg)
+{
+  networkstatus_t *con_md = NULL;
+  char *consensus_text_md = NULL;
+  char router_id[3][DIGEST_LEN];
+  char hexid[HEX_DIGEST_LEN+2];
+  node_t *nodes[3];
+  smartlist_t *excluded = smartlist_new();
+  routerset_t *restricted = routerset_new();
+  const node_t *choice;
+  int i, seen[3] = {0, 0, 0};
+  (void)arg;
+
+  MOCK(usable_consensus_flavor, mock_usable_consensus_flavor);
+  mock_usable_consensus_flavor_value = FLAV_MICRODESC;
+  MOCK(get_my_v3_authority_cert, get_my_v3_authority_cert_m);
+  mock_cert = authority_cert_parse_from_string(AUTHORITY_CERT_1, NULL);
+  sr_init(0);
+  UNMOCK(get_my_v3_authority_cert);
+
+  construct_consensus(&consensus_text_md, time(NULL));
+  tt_assert(consensus_text_md);
+  con_md = networkstatus_parse_vote_from_string(consensus_text_md, NULL,
+                                                NS_TYPE_CONSENSUS);
+  tt_assert(con_md);
+  nodelist_set_consensus(con_md);
+
+  memset(router_id[0], TEST_DIR_ROUTER_ID_1, DIGEST_LEN);
+  memset(router_id[1], TEST_DIR_ROUTER_ID_2, DIGEST_LEN);
+  memset(router_id[2], TEST_DIR_ROUTER_ID_3, DIGEST_LEN);
+  for (i = 0; i < 3; ++i) {
+    nodes[i] = node_get_mutable_by_id(router_id[i]);
+    tt_assert(nodes[i]);
+    nodes[i]->is_running = nodes[i]->is_valid = 1;
+    nodes[i]->rs->pv.supports_extend2_cells = 1;
+    nodes[i]->rs->has_bandwidth = 1;
+    nodes[i]->rs->bandwidth_kb = 100;
+    /* The routers the test votes were built from have no ntor keys. */
+    if (nodes[i]->ri) {
+      if (!nodes[i]->ri->onion_curve25519_pkey)
+        nodes[i]->ri->onion_curve25519_pkey =
+          tor_malloc_zero(sizeof(curve25519_public_key_t));
+      crypto_rand((char *)nodes[i]->ri->onion_curve25519_pkey->public_key,
+                  CURVE25519_PUBKEY_LEN);
+    }
+  }
+  node_select_weights_changed();
+
+  /* Every node can be chosen, but never an excluded one. */
+  smartlist_add(excluded, nodes[0]);
+  for (i = 0; i < 300; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_assert(choice == nodes[1] || choice == nodes[2]);
+    seen[choice == nodes[1] ? 1 : 2]++;
+  }
+  tt_int_op(seen[1], OP_GT, 0);
+  tt_int_op(seen[2], OP_GT, 0);
+
+  /* Nodes that aren't running are skipped as well. */
+  nodes[2]->is_running = 0;
+  for (i = 0; i < 50; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_ptr_op(choice, OP_EQ, nodes[1]);
+  }
+  nodes[2]->is_running = 1;
+
+  /* A restricted set limits our choice. */
+  hexid[0] = '$';
+  base16_encode(hexid+1, sizeof(hexid)-1, router_id[2], DIGEST_LEN);
+  tt_int_op(0, OP_EQ, routerset_parse(restricted, hexid, "test"));
+  for (i = 0; i < 50; ++i) {
+    choice = router_choose_random_node_impl(excluded, NULL, restricted, 0);
+    tt_ptr_op(choice, OP_EQ, nodes[2]);
+  }
+
+  /* With nothing acceptable left, we find nothing. */
+  smartlist_add(excluded, nodes[2]);
+  choice = router_choose_random_node_impl(excluded, NULL, restricted, 0);
+  tt_ptr_op(choice, OP_EQ, NULL);
+
+  /* A new consensus replaces the cached weights. */
+  nodelist_set_consensus(con_md);
+  smartlist_clear(excluded);
+  smartlist_add(excluded, nodes[1]);
+  smartlist_add(excluded, nodes[2]);
+  choice = router_choose_random_node(excluded, NULL, 0);
+  tt_ptr_op(choice, OP_EQ, nodes[0]);
+
+ done:
+  UNMOCK(usable_consensus_flavor);
+  smartlist_free(excluded);
+  routerset_free(restricted);
+  tor_free(consensus_text_md);
+  nodelist_free_all();
+  networkstatus_vote_free(con_md);
+}
+
 static or_state_t *dummy_state = NULL;
 static or_state_t *
 get_or_state_replacement(void)
@@ -763,6 +868,235 @@ test_warn_early_consensus(void *arg)
   tor_free(c);
 }
 
+/* A task that mock_cpuworker_queue_work() passed to its threadpool. */
+typedef struct parse_test_task_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} parse_test_task_t;
+
+static threadpool_t *parse_test_pool = NULL;
+static replyqueue_t *parse_test_replyqueue = NULL;
+static int parse_test_n_queued = 0;
+static int parse_test_n_replied = 0;
+
+static void *
+parse_test_state_new(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+parse_test_state_free(void *state)
+{
+  tor_free(state);
+}
+
+static workqueue_reply_t
+parse_test_threadfn(void *state, void *arg)
+{
+  parse_test_task_t *task = arg;
+  return task->fn(state, task->arg);
+}
+
+static void
+parse_test_replyfn(void *arg)
+{
+  parse_test_task_t *task = arg;
+  task->reply_fn(task->arg);
+  tor_free(task);
+  ++parse_test_n_replied;
+}
+
+static int
+mock_cpuworker_get_n_threads(void)
+{
+  return 3;
+}
+
+/* Run the work on a threadpool of our own, since the cpuworkers would need
+ * onion keys. */
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  parse_test_task_t *task = tor_malloc_zero(sizeof(*task));
+  task->fn = fn;
+  task->reply_fn = reply_fn;
+  task->arg = arg;
+  ++parse_test_n_queued;
+  return threadpool_queue_work_priority(parse_test_pool, priority,
+                                        parse_test_threadfn,
+                                        parse_test_replyfn, task);
+}
+
+/** Return a microdesc consensus made of the header and footer of
+ * <b>consensus</b> around <b>n</b> routerstatus entries of our own, some of
+ * which can't be parsed without logging. Set *<b>n_bad_out</b> to the number
+ * of entries that can't be parsed at all. */
+static char *
+make_big_consensus(const char *consensus, int n, int *n_bad_out)
+{
+  smartlist_t *chunks = smartlist_new();
+  const char *end_of_header = strstr(consensus, "\nr ") + 1;
+  const char *footer = strstr(consensus, "\ndirectory-footer") + 1;
+  char *result;
+  int i;
+
+  *n_bad_out = 0;
+  smartlist_add(chunks, tor_strndup(consensus, end_of_header - consensus));
+  for (i = 0; i < n; ++i) {
+    char id[DIGEST_LEN], md[DIGEST256_LEN];
+    char id64[BASE64_DIGEST_LEN+1], md64[BASE64_DIGEST256_LEN+1];
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    crypto_rand(md, sizeof(md));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(chunks,
+                           "r relay%d %s 2019-05-05 05:05:05 10.%d.%d.%d "
+                           "9001 %d\n", i, id64, (i >> 16) & 0xff,
+                           (i >> 8) & 0xff, i & 0xff, (i % 2) ? 0 : 80);
+    if (i % 307 == 5) {
+      /* An IPv4 "a" line, which we ignore. */
+      smartlist_add_asprintf(chunks, "a 10.0.0.%d:9001\n", i & 0xff);
+    } else if (i % 3 == 0) {
+      smartlist_add_asprintf(chunks, "a [2001:db8::%x]:9001\n", i);
+    }
+    smartlist_add_asprintf(chunks, "s Fast%s Running Stable Valid\n",
+                           (i % 5) ? "" : " Guard");
+    /* Entries with a version that we can't parse are kept, with a log
+     * message. */
+    smartlist_add_asprintf(chunks, "v Tor %s\n"
+                           "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 "
+                           "HSIntro=3-4 HSRend=1-2 Link=1-5 LinkAuth=1,3 "
+                           "Microdesc=1-2 Relay=1-2\n"
+                           "w Bandwidth=%d\n",
+                           (i % 503 == 13) ? "0.3.five" : "0.3.5.11", 10 + i);
+    if (i % 211 == 9) {
+      smartlist_add_strdup(chunks, "m notbase64!\n");
+      ++*n_bad_out;
+    } else if (i % 401 == 11) {
+      /* The tokenizer rejects this one. */
+      smartlist_add_asprintf(chunks, "w Bandwidth=%d\nm %s\n", 10 + i, md64);
+      ++*n_bad_out;
+    } else if (i % 101 != 7) {
+      /* Entries without an "m" line are kept, with a log message. */
+      smartlist_add_asprintf(chunks, "m %s\n", md64);
+    }
+  }
+  smartlist_add_strdup(chunks, footer);
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Return the number of captured log messages that contain <b>str</b>. */
+static int
+n_logs_containing(const char *str)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(mock_saved_logs(), const mock_saved_log_entry_t *, ent,
+                    if (strstr(ent->generated_msg, str))
+                      ++n);
+  return n;
+}
+
+/** Make sure that parsing the routerstatus entries of a consensus on the
+ * cpuworkers gives the same result as parsing them on the main thread. */
+static void
+test_routerlist_parse_consensus_in_parallel(void *arg)
+{
+  const int n_entries = 3000;
+  char *consensus_text_md = NULL, *big_consensus = NULL;
+  networkstatus_t *serial = NULL, *parallel = NULL;
+  time_t now = time(NULL);
+  int n_bad = 0, n_tokenize_errors, n_version_errors;
+  (void)arg;
+
+  MOCK(get_my_v3_authority_cert, get_my_v3_authority_cert_m);
+  mock_cert = authority_cert_parse_from_string(AUTHORITY_CERT_1, NULL);
+  sr_init(0);
+  UNMOCK(get_my_v3_authority_cert);
+
+  construct_consensus(&consensus_text_md, now);
+  tt_assert(consensus_text_md);
+  big_consensus = make_big_consensus(consensus_text_md, n_entries, &n_bad);
+  tt_int_op(n_bad, OP_GT, 0);
+
+  setup_capture_of_logs(LOG_INFO);
+  serial = networkstatus_parse_vote_from_string(big_consensus, NULL,
+                                                NS_TYPE_CONSENSUS);
+  n_tokenize_errors = n_logs_containing("too many w elements");
+  n_version_errors = n_logs_containing("Router version '0.3.five'");
+  teardown_capture_of_logs();
+  tt_assert(serial);
+  tt_int_op(n_tokenize_errors, OP_GT, 0);
+  tt_int_op(n_version_errors, OP_GT, 0);
+  tt_int_op(smartlist_len(serial->routerstatus_list), OP_EQ,
+            n_entries - n_bad);
+
+  parse_test_replyqueue = replyqueue_new(0);
+  parse_test_pool = threadpool_new(3, parse_test_replyqueue,
+                                   parse_test_state_new,
+                                   parse_test_state_free, NULL);
+  tt_assert(parse_test_pool);
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  get_options_mutable()->ParallelConsensusParsing = 1;
+
+  setup_capture_of_logs(LOG_INFO);
+  parallel = networkstatus_parse_vote_from_string(big_consensus, NULL,
+                                                  NS_TYPE_CONSENSUS);
+  /* The entries that the workers couldn't parse get logged as usual, and
+   * only once. */
+  expect_log_msg_containing("Error decoding microdescriptor digest");
+  tt_int_op(n_logs_containing("too many w elements"), OP_EQ,
+            n_tokenize_errors);
+  tt_int_op(n_logs_containing("Router version '0.3.five'"), OP_EQ,
+            n_version_errors);
+  teardown_capture_of_logs();
+  tt_assert(parallel);
+  tt_int_op(parse_test_n_queued, OP_EQ, 3);
+
+  /* Same entries, in the same order, with the same contents. */
+  tt_int_op(smartlist_len(parallel->routerstatus_list), OP_EQ,
+            smartlist_len(serial->routerstatus_list));
+  SMARTLIST_FOREACH_BEGIN(serial->routerstatus_list, routerstatus_t *, rs) {
+    const routerstatus_t *rs2 =
+      smartlist_get(parallel->routerstatus_list, rs_sl_idx);
+    tt_mem_op(rs, OP_EQ, rs2, sizeof(routerstatus_t));
+  } SMARTLIST_FOREACH_END(rs);
+  tt_mem_op(&serial->digests, OP_EQ, &parallel->digests,
+            sizeof(serial->digests));
+  tt_mem_op(serial->digest_sha3_as_signed, OP_EQ,
+            parallel->digest_sha3_as_signed, DIGEST256_LEN);
+  tt_int_op(smartlist_len(parallel->voters), OP_EQ,
+            smartlist_len(serial->voters));
+
+  /* The workers hold on to the job until their replies come in. */
+  while (parse_test_n_replied < parse_test_n_queued) {
+    replyqueue_process(parse_test_replyqueue);
+    tor_sleep_msec(1);
+  }
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  networkstatus_vote_free(serial);
+  networkstatus_vote_free(parallel);
+  tor_free(consensus_text_md);
+  tor_free(big_consensus);
+  authority_cert_free(mock_cert);
+  mock_cert = NULL;
+}
+
 #define NODE(name, flags) \
   { #name, test_routerlist_##name, (flags), NULL, NULL }
 #define ROUTER(name,flags) \
@@ -780,6 +1114,8 @@ struct testcase_t routerlist_tests[] = {
   NODE(launch_descriptor_downloads, 0),
   NODE(router_is_already_dir_fetching, TT_FORK),
   ROUTER(pick_directory_server_impl, TT_FORK),
+  ROUTER(choose_random_node, TT_FORK),
+  NODE(parse_consensus_in_parallel, TT_FORK),
   { "directory_guard_fetch_with_no_dirinfo",
     test_directory_guard_fetch_with_no_dirinfo, TT_FORK, NULL, NULL },
   /* These depend on construct_consensus() setting
@@ -1265,6 +1265,90 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+static void
+test_scheduler_kist_estimate(void *arg)
+{
+  socket_table_ent_t ent;
+  monotime_t t0, now;
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  MOCK(get_options, mock_get_options);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 10;
+  mocked_options.KISTSockBufSizeFactor = 1.0;
+  mocked_options.KISTSockInfoMaxAge = 100;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+
+  /* 5 of 10 packets in flight, 2000 bytes not sent yet, 100 msec RTT. */
+  memset(&ent, 0, sizeof(ent));
+  ent.cwnd = 10;
+  ent.unacked = 5;
+  ent.mss = 1000;
+  ent.notsent = 2000;
+  ent.rtt = 100000;
+  monotime_get(&t0);
+  socket_info_take_snapshot(&ent, &t0, 1000);
+  tt_assert(ent.have_snapshot);
+
+  /* Right away, we get what the kernel would say: 5 free packets in the
+   * congestion window and one more window, minus what is queued. */
+  tt_int_op(socket_info_estimate(&ent, &t0, 1000), OP_EQ, 0);
+  tt_u64_op(ent.limit, OP_EQ, 5000 + 10000 - 2000 - 1000);
+
+  /* We wrote 5000 bytes, and the kernel sent 1000 bytes in 10 msec. */
+  ent.written_since_snapshot = 5000;
+  monotime_add_msec(&now, &t0, 10);
+  tt_int_op(socket_info_estimate(&ent, &now, 0), OP_EQ, 0);
+  tt_u64_op(ent.limit, OP_EQ, 20000 - (8000 + 5000 - 1000));
+
+  /* The kernel can't have sent what is still in the outbuf. */
+  ent.written_since_snapshot = 0;
+  monotime_add_msec(&now, &t0, 90);
+  tt_int_op(socket_info_estimate(&ent, &now, 3000), OP_EQ, 0);
+  tt_u64_op(ent.limit, OP_EQ, 20000 - 3000);
+
+  /* At the limit according to the model: ask the kernel. */
+  ent.written_since_snapshot = 20000;
+  monotime_add_msec(&now, &t0, 10);
+  tt_int_op(socket_info_estimate(&ent, &now, 0), OP_EQ, -1);
+  ent.written_since_snapshot = 0;
+
+  /* Too old, or hit the limit: ask the kernel. */
+  monotime_add_msec(&now, &t0, 101);
+  tt_int_op(socket_info_estimate(&ent, &now, 0), OP_EQ, -1);
+  ent.hit_limit = 1;
+  tt_int_op(socket_info_estimate(&ent, &t0, 0), OP_EQ, -1);
+
+  /* A new snapshot starts over. */
+  socket_info_take_snapshot(&ent, &now, 0);
+  tt_assert(!ent.hit_limit);
+  tt_u64_op(ent.written_since_snapshot, OP_EQ, 0);
+  tt_int_op(socket_info_estimate(&ent, &now, 0), OP_EQ, 0);
+
+  /* Nothing to estimate from without TCP information. */
+  ent.cwnd = 0;
+  socket_info_take_snapshot(&ent, &now, 0);
+  tt_assert(!ent.have_snapshot);
+  tt_int_op(socket_info_estimate(&ent, &now, 0), OP_EQ, -1);
+
+  /* Nor if estimating is disabled. */
+  ent.cwnd = 10;
+  socket_info_take_snapshot(&ent, &now, 0);
+  mocked_options.KISTSockInfoMaxAge = 0;
+  the_scheduler->on_new_options();
+  tt_int_op(socket_info_estimate(&ent, &now, 0), OP_EQ, -1);
+
+ done:
+  scheduler_free_all();
+  cleanup_scheduler_options();
+  UNMOCK(get_options);
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1276,6 +1360,7 @@ struct testcase_t scheduler_tests[] = {
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+  { "kist_estimate", test_scheduler_kist_estimate, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
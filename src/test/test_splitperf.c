@@ -0,0 +1,154 @@
+#define MODULE_SPLIT_INTERNAL
+#define TOR_SPLITPERF_PRIVATE
+#include "core/or/or.h"
+#include "test/test.h"
+
+#include "app/config/or_state_st.h"
+#include "feature/split/splitperf.h"
+#include "lib/encoding/confline.h"
+#include "lib/math/fp.h"
+
+static void
+test_splitperf_note(void* arg)
+{
+  const split_perf_entry_t* ent;
+  char digest[DIGEST_LEN];
+  time_t now = 1500000000;
+  (void)arg;
+
+  memset(digest, 'A', DIGEST_LEN);
+  tt_ptr_op(split_perf_get(digest), OP_EQ, NULL);
+
+  split_perf_note(digest, 1000, 100, now);
+  ent = split_perf_get(digest);
+  tt_assert(ent);
+  tt_i64_op(tor_lround(ent->throughput), OP_EQ, 1000);
+  tt_i64_op(tor_lround(ent->rtt_msec), OP_EQ, 100);
+  tt_i64_op(tor_lround(split_perf_get_weight(ent, now)), OP_EQ, 1);
+
+  /* equally weighted average; unknown RTT keeps the old one */
+  split_perf_note(digest, 3000, 0, now);
+  ent = split_perf_get(digest);
+  tt_i64_op(tor_lround(ent->throughput), OP_EQ, 2000);
+  tt_i64_op(tor_lround(ent->rtt_msec), OP_EQ, 100);
+  tt_i64_op(tor_lround(split_perf_get_weight(ent, now)), OP_EQ, 2);
+
+  /* old observations decay with the half-life */
+  tt_i64_op(tor_lround(100 * split_perf_get_weight(ent,
+            now + SPLIT_PERF_HALF_LIFE)), OP_EQ, 100);
+  split_perf_note(digest, 8000, 400, now + SPLIT_PERF_HALF_LIFE);
+  ent = split_perf_get(digest);
+  tt_i64_op(tor_lround(ent->throughput), OP_EQ, 5000);
+  tt_i64_op(tor_lround(ent->rtt_msec), OP_EQ, 250);
+
+  done:
+  split_perf_free_all();
+}
+
+static void
+test_splitperf_bounded(void* arg)
+{
+  char digest[DIGEST_LEN];
+  time_t now = 1500000000;
+  (void)arg;
+
+  /* the first relay has the most observations */
+  memset(digest, 0, DIGEST_LEN);
+  split_perf_note(digest, 1000, 0, now);
+  split_perf_note(digest, 1000, 0, now);
+
+  for (int i = 1; i < SPLIT_PERF_MAX_ENTRIES; i++) {
+    set_uint32(digest, (uint32_t)i);
+    split_perf_note(digest, 1000, 0, now + i);
+  }
+  tt_int_op(split_perf_get_num_entries(), OP_EQ, SPLIT_PERF_MAX_ENTRIES);
+
+  /* adding another relay evicts the one with the lowest decayed weight */
+  set_uint32(digest, (uint32_t)SPLIT_PERF_MAX_ENTRIES);
+  split_perf_note(digest, 1000, 0, now + SPLIT_PERF_MAX_ENTRIES);
+  tt_int_op(split_perf_get_num_entries(), OP_EQ, SPLIT_PERF_MAX_ENTRIES);
+  tt_assert(split_perf_get(digest));
+
+  set_uint32(digest, 0);
+  tt_assert(split_perf_get(digest));
+  set_uint32(digest, 1);
+  tt_ptr_op(split_perf_get(digest), OP_EQ, NULL);
+  set_uint32(digest, 2);
+  tt_assert(split_perf_get(digest));
+
+  done:
+  split_perf_free_all();
+}
+
+static void
+test_splitperf_state(void* arg)
+{
+  or_state_t* state = tor_malloc_zero(sizeof(or_state_t));
+  const split_perf_entry_t* ent;
+  char digest1[DIGEST_LEN], digest2[DIGEST_LEN];
+  char *dup_value = NULL;
+  time_t now = time(NULL);
+  (void)arg;
+
+  memset(digest1, 'A', DIGEST_LEN);
+  memset(digest2, 'B', DIGEST_LEN);
+  split_perf_note(digest1, 12345, 321, now);
+  split_perf_note(digest1, 12345, 321, now);
+  /* too old to be saved */
+  split_perf_note(digest2, 1000, 0, now - 10 * SPLIT_PERF_HALF_LIFE);
+
+  split_perf_update_state(state);
+  tt_assert(state->SplitPathPerf);
+  tt_ptr_op(state->SplitPathPerf->next, OP_EQ, NULL);
+  tt_int_op(split_perf_get_num_entries(), OP_EQ, 1);
+
+  split_perf_free_all();
+  tt_int_op(split_perf_get_num_entries(), OP_EQ, 0);
+
+  tt_int_op(split_perf_parse_state(state), OP_EQ, 0);
+  tt_int_op(split_perf_get_num_entries(), OP_EQ, 1);
+  ent = split_perf_get(digest1);
+  tt_assert(ent);
+  tt_i64_op(tor_lround(ent->throughput), OP_EQ, 12345);
+  tt_i64_op(tor_lround(ent->rtt_msec), OP_EQ, 321);
+  tt_i64_op(tor_lround(ent->weight), OP_EQ, 2);
+  tt_i64_op(ent->last_update, OP_EQ, now);
+  tt_ptr_op(split_perf_get(digest2), OP_EQ, NULL);
+
+  /* later lines for the same relay are ignored */
+  tor_asprintf(&dup_value, "%s 1 1 1 %s", hex_str(digest1, DIGEST_LEN),
+               "2019-01-01T00:00:00");
+  config_line_append(&state->SplitPathPerf, "SplitPathPerf", dup_value);
+  tt_int_op(split_perf_parse_state(state), OP_EQ, 0);
+  tt_int_op(split_perf_get_num_entries(), OP_EQ, 1);
+  ent = split_perf_get(digest1);
+  tt_assert(ent);
+  tt_i64_op(tor_lround(ent->throughput), OP_EQ, 12345);
+
+  /* malformed lines are skipped */
+  config_line_append(&state->SplitPathPerf, "SplitPathPerf", "XYZ 1 2 3");
+  tt_int_op(split_perf_parse_state(state), OP_EQ, -1);
+  tt_int_op(split_perf_get_num_entries(), OP_EQ, 1);
+
+  done:
+  config_free_lines(state->SplitPathPerf);
+  tor_free(state);
+  tor_free(dup_value);
+  split_perf_free_all();
+}
+
+struct testcase_t splitperf_tests[] = {
+   { "note",
+     test_splitperf_note,
+     0, NULL, NULL
+   },
+   { "bounded",
+     test_splitperf_bounded,
+     0, NULL, NULL
+   },
+   { "state",
+     test_splitperf_state,
+     0, NULL, NULL
+   },
+   END_OF_TESTCASES
+};
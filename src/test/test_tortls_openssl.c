@@ -35,6 +35,7 @@ ENABLE_GCC_WARNING(redundant-decls)
 #include "lib/log/log.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/compat_openssl.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/tls/x509.h"
 #include "lib/tls/x509_internal.h"
 #include "lib/tls/tortls.h"
@@ -123,6 +124,144 @@ test_tortls_tor_tls_new(void *data)
   tor_tls_free_all();
 }
 
+/** Open a TCP connection to ourselves over loopback, and store its two ends
+ * in <b>fds</b>. Return 0 on success, -1 on failure. */
+static int
+open_loopback_tcp_pair(tor_socket_t fds[2])
+{
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof(sin);
+  tor_socket_t listener;
+  int r = -1;
+
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(listener))
+    return -1;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&sin, &sin_len) < 0)
+    goto done;
+  fds[0] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(fds[0]) ||
+      connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    goto done;
+  fds[1] = tor_accept_socket(listener, NULL, NULL);
+  if (!SOCKET_OK(fds[1]))
+    goto done;
+  if (set_socket_nonblocking(fds[0]) < 0 ||
+      set_socket_nonblocking(fds[1]) < 0)
+    goto done;
+  r = 0;
+ done:
+  tor_close_socket(listener);
+  if (r < 0) {
+    if (SOCKET_OK(fds[0]))
+      tor_close_socket(fds[0]);
+    if (SOCKET_OK(fds[1]))
+      tor_close_socket(fds[1]);
+    fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  }
+  return r;
+}
+
+static void
+test_tortls_kernel_tls_loopback(void *data)
+{
+  (void) data;
+  MOCK(tor_tls_cert_matches_key, mock_tls_cert_matches_key);
+  crypto_pk_t *key1 = NULL, *key2 = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *client = NULL, *server = NULL;
+  const size_t len = 100000;
+  char *msg = tor_malloc(len), *got = tor_malloc(len);
+  size_t n_written = 0, n_read = 0, raw_read, raw_written;
+  int client_done = 0, server_done = 0, i, r;
+
+  key1 = pk_generate(2);
+  key2 = pk_generate(3);
+  crypto_rand(msg, len);
+
+  /* Kernel TLS is only a hint: whether or not this kernel has the "tls"
+   * module, the connection has to work. */
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER |
+                                 TOR_TLS_CTX_ENABLE_KTLS,
+                                 key1, key2, 86400), OP_EQ, 0);
+  tt_int_op(open_loopback_tcp_pair(fds), OP_EQ, 0);
+  client = tor_tls_new(fds[0], 0);
+  tt_assert(client);
+  fds[0] = TOR_INVALID_SOCKET;
+  server = tor_tls_new(fds[1], 1);
+  tt_assert(server);
+  fds[1] = TOR_INVALID_SOCKET;
+
+  for (i = 0; i < 1000 && !(client_done && server_done); ++i) {
+    if (!client_done) {
+      r = tor_tls_handshake(client);
+      tt_assert(r == TOR_TLS_DONE || r == TOR_TLS_WANTREAD ||
+                r == TOR_TLS_WANTWRITE);
+      client_done = (r == TOR_TLS_DONE);
+    }
+    if (!server_done) {
+      r = tor_tls_handshake(server);
+      tt_assert(r == TOR_TLS_DONE || r == TOR_TLS_WANTREAD ||
+                r == TOR_TLS_WANTWRITE);
+      server_done = (r == TOR_TLS_DONE);
+    }
+  }
+  tt_assert(client_done && server_done);
+  tor_tls_get_n_raw_bytes(client, &raw_read, &raw_written);
+
+  /* Send the message in both directions, in pieces. */
+  for (i = 0; i < 100000 && n_read < len; ++i) {
+    if (n_written < len) {
+      r = tor_tls_write(client, msg + n_written, MIN(len - n_written, 4096));
+      if (r > 0)
+        n_written += r;
+      else
+        tt_assert(r == TOR_TLS_WANTWRITE || r == TOR_TLS_WANTREAD);
+    }
+    r = tor_tls_read(server, got + n_read, len - n_read);
+    if (r > 0)
+      n_read += r;
+    else
+      tt_assert(r == TOR_TLS_WANTWRITE || r == TOR_TLS_WANTREAD);
+  }
+  tt_uint_op(n_read, OP_EQ, len);
+  tt_mem_op(got, OP_EQ, msg, len);
+  tor_tls_get_n_raw_bytes(client, &raw_read, &raw_written);
+  tt_uint_op(raw_written, OP_GE, len);
+  if (tor_tls_uses_kernel_tls(client))
+    tt_uint_op(client->ktls_write_count, OP_GE, len);
+
+  tt_int_op(tor_tls_write(server, "hello", 5), OP_EQ, 5);
+  memset(got, 0, 5);
+  for (i = 0; i < 1000; ++i) {
+    r = tor_tls_read(client, got, 5);
+    if (r != TOR_TLS_WANTREAD)
+      break;
+  }
+  tt_int_op(r, OP_EQ, 5);
+  tt_mem_op(got, OP_EQ, "hello", 5);
+
+ done:
+  UNMOCK(tor_tls_cert_matches_key);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  tor_tls_free(client);
+  tor_tls_free(server);
+  crypto_pk_free(key1);
+  crypto_pk_free(key2);
+  tor_free(msg);
+  tor_free(got);
+  tor_tls_free_all();
+}
+
 #define NS_MODULE tortls
 
 static void
@@ -2203,6 +2342,7 @@ test_tortls_context_init_one(void *ignored)
 
 struct testcase_t tortls_openssl_tests[] = {
   LOCAL_TEST_CASE(tor_tls_new, TT_FORK),
+  LOCAL_TEST_CASE(kernel_tls_loopback, TT_FORK),
   LOCAL_TEST_CASE(get_state_description, TT_FORK),
   LOCAL_TEST_CASE(get_by_ssl, TT_FORK),
   LOCAL_TEST_CASE(allocate_tor_tls_object_ex_data_index, TT_FORK),
@@ -0,0 +1,266 @@
+/* Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_uring.c
+ * \brief Tests for our io_uring wrapper.
+ */
+
+#define CIRCUITLIST_PRIVATE
+#define CONNECTION_PRIVATE
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
+#include "core/or/circuitlist.h"
+#include "lib/container/buffers.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/uring.h"
+#include "lib/net/alertsock.h"
+#include "lib/net/buffers_net.h"
+#include "test/test.h"
+
+#include "core/or/connection_st.h"
+
+#ifdef BUF_SOCKET_IO_VECTORED
+#include <event2/event.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/** Wait until <b>ring</b> has a completion, and store it in
+ * *<b>user_data_out</b> and *<b>result_out</b>.  Return 0 on success, -1
+ * on failure. */
+static int
+wait_for_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                    int *result_out)
+{
+  while (!tor_uring_get_completion(ring, user_data_out, result_out)) {
+    if (tor_uring_wait(ring) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static void
+test_uring_recv_sendmsg(void *arg)
+{
+  tor_socket_t s[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_uring_t *ring = NULL;
+  buf_t *buf = buf_new();
+  struct iovec iov[2];
+  struct msghdr msg;
+  char *space, out[32];
+  size_t len;
+  uint64_t user_data;
+  int res, i, got_recv = 0, got_send = 0;
+  (void)arg;
+
+  ring = tor_uring_new(8);
+  if (!ring)
+    tt_skip();
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, s));
+
+  /* Post the receive request before there is anything to receive. */
+  space = buf_reserve_space(buf, 4096, &len);
+  tt_uint_op(len, OP_EQ, 4096);
+  tt_int_op(0, OP_EQ, tor_uring_prep_recv(ring, s[1], space, len, 1));
+  tt_int_op(1, OP_EQ, tor_uring_submit(ring));
+  tt_uint_op(0, OP_EQ, tor_uring_n_prepared(ring));
+
+  iov[0].iov_base = (char *)"hello ";
+  iov[0].iov_len = 6;
+  iov[1].iov_base = (char *)"world";
+  iov[1].iov_len = 5;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  tt_int_op(0, OP_EQ, tor_uring_prep_sendmsg(ring, s[0], &msg, 2));
+  tt_uint_op(1, OP_EQ, tor_uring_n_prepared(ring));
+
+  for (i = 0; i < 2; ++i) {
+    tt_int_op(0, OP_EQ, wait_for_completion(ring, &user_data, &res));
+    if (user_data == 1)
+      ++got_recv;
+    else if (user_data == 2)
+      ++got_send;
+    tt_int_op(res, OP_EQ, 11);
+  }
+  tt_int_op(got_recv, OP_EQ, 1);
+  tt_int_op(got_send, OP_EQ, 1);
+  tt_int_op(0, OP_EQ, tor_uring_get_completion(ring, &user_data, &res));
+  tt_u64_op(tor_uring_get_n_syscalls(ring), OP_GE, 2);
+
+  buf_commit_space(buf, 11);
+  tt_uint_op(buf_datalen(buf), OP_EQ, 11);
+  tt_int_op(0, OP_EQ, buf_get_bytes(buf, out, 11));
+  tt_mem_op(out, OP_EQ, "hello world", 11);
+
+  /* An EOF completes a receive request with 0 bytes; committing nothing
+   * leaves no empty chunk behind. */
+  space = buf_reserve_space(buf, 4096, &len);
+  tt_int_op(0, OP_EQ, tor_uring_prep_recv(ring, s[1], space, len, 3));
+  tor_close_socket(s[0]);
+  s[0] = TOR_INVALID_SOCKET;
+  tt_int_op(0, OP_EQ, wait_for_completion(ring, &user_data, &res));
+  tt_u64_op(user_data, OP_EQ, 3);
+  tt_int_op(res, OP_EQ, 0);
+  buf_commit_space(buf, 0);
+  tt_uint_op(buf_allocation(buf), OP_EQ, 0);
+
+ done:
+  tor_uring_free(ring);
+  buf_free(buf);
+  if (SOCKET_OK(s[0]))
+    tor_close_socket(s[0]);
+  if (SOCKET_OK(s[1]))
+    tor_close_socket(s[1]);
+}
+
+static void
+test_uring_poll_cancel(void *arg)
+{
+  tor_socket_t s[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_uring_t *ring = NULL;
+  alert_sockets_t efd;
+  uint64_t user_data, count;
+  int res, i, poll_res = 1, cancel_res = 1;
+  (void)arg;
+
+  memset(&efd, 0, sizeof(efd));
+  efd.read_fd = efd.write_fd = TOR_INVALID_SOCKET;
+  ring = tor_uring_new(8);
+  if (!ring)
+    tt_skip();
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, s));
+  tt_int_op(0, OP_EQ, alert_sockets_create(&efd, ASOCKS_NOPIPE2|
+                                           ASOCKS_NOPIPE|ASOCKS_NOSOCKETPAIR));
+  tt_int_op(0, OP_EQ, tor_uring_set_eventfd(ring, efd.read_fd));
+
+  /* Nothing to read: the poll request stays in flight. */
+  tt_int_op(0, OP_EQ, tor_uring_prep_poll(ring, s[1], POLLIN, 1));
+  tt_int_op(1, OP_EQ, tor_uring_submit(ring));
+  tt_int_op(0, OP_EQ, tor_uring_get_completion(ring, &user_data, &res));
+  tt_int_op(-1, OP_EQ, read(efd.read_fd, &count, sizeof(count)));
+
+  tt_int_op(0, OP_EQ, tor_uring_prep_cancel(ring, 1, 2));
+  for (i = 0; i < 2; ++i) {
+    tt_int_op(0, OP_EQ, wait_for_completion(ring, &user_data, &res));
+    if (user_data == 1)
+      poll_res = res;
+    else if (user_data == 2)
+      cancel_res = res;
+  }
+  tt_int_op(poll_res, OP_EQ, -ECANCELED);
+  tt_int_op(cancel_res, OP_EQ, 0);
+  /* The kernel told the eventfd about the completions. */
+  tt_int_op(sizeof(count), OP_EQ, read(efd.read_fd, &count, sizeof(count)));
+  tt_u64_op(count, OP_GE, 1);
+
+  /* A socket that is ready completes the poll request at once. */
+  tt_int_op(0, OP_EQ, tor_uring_prep_poll(ring, s[0], POLLOUT, 3));
+  tt_int_op(0, OP_EQ, wait_for_completion(ring, &user_data, &res));
+  tt_u64_op(user_data, OP_EQ, 3);
+  tt_int_op(res & POLLOUT, OP_EQ, POLLOUT);
+
+ done:
+  tor_uring_free(ring);
+  if (SOCKET_OK(efd.read_fd))
+    alert_sockets_close(&efd);
+  if (SOCKET_OK(s[0]))
+    tor_close_socket(s[0]);
+  if (SOCKET_OK(s[1]))
+    tor_close_socket(s[1]);
+}
+
+/* The OOM handler must not free outbuf chunks that a sendmsg request in
+ * flight points at, and the request's result must not be taken off what
+ * the connection queues afterwards. */
+static void
+test_uring_oom_during_send(void *arg)
+{
+  tor_socket_t s[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  connection_t *conn = NULL;
+  buf_t *got = buf_new();
+  char *data = NULL, tail[100];
+  size_t flushlen;
+  ssize_t n;
+  int i;
+  (void)arg;
+
+  get_options_mutable()->UseIOUring = 1;
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, s));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(s[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(s[1]));
+  /* Fill the socket buffer, so that our sendmsg request has to wait. */
+  data = tor_malloc_zero(4096);
+  while (send(s[0], data, 4096, 0) > 0)
+    ;
+  conn = connection_new(CONN_TYPE_EXIT, AF_UNIX);
+  conn->s = s[0];
+  s[0] = TOR_INVALID_SOCKET;
+  if (!connection_uring_should_manage(conn))
+    tt_skip();
+  connection_uring_attach(conn);
+
+  for (i = 0; i < 16; ++i)
+    buf_add(conn->outbuf, data, 4096);
+  flushlen = buf_datalen(conn->outbuf);
+  tt_int_op(0, OP_EQ, connection_uring_flush(conn, flushlen, &flushlen));
+  /* Hand the request to the kernel. */
+  event_base_loop(tor_libevent_get_base(), EVLOOP_NONBLOCK);
+
+  tt_uint_op(0, OP_EQ, single_conn_free_bytes(conn));
+  tt_uint_op(0, OP_EQ, buf_datalen(conn->outbuf));
+  tt_uint_op(0, OP_EQ, conn->outbuf_flushlen);
+
+  /* Queue something new, and read until all of it arrived. */
+  memset(tail, 'X', sizeof(tail));
+  buf_add(conn->outbuf, tail, sizeof(tail));
+  flushlen = sizeof(tail);
+  for (i = 0; i < 1000 && flushlen; ++i) {
+    while ((n = recv(s[1], data, 4096, 0)) > 0)
+      buf_add(got, data, n);
+    event_base_loop(tor_libevent_get_base(), EVLOOP_NONBLOCK);
+    tt_int_op(connection_uring_flush(conn, flushlen, &flushlen), OP_GE, 0);
+    tt_uint_op(buf_datalen(conn->outbuf), OP_EQ, flushlen);
+  }
+  tt_uint_op(flushlen, OP_EQ, 0);
+  while ((n = recv(s[1], data, 4096, 0)) > 0)
+    buf_add(got, data, n);
+  tt_uint_op(buf_datalen(got), OP_GT, sizeof(tail));
+  buf_drain(got, buf_datalen(got) - sizeof(tail));
+  tt_int_op(0, OP_EQ, buf_get_bytes(got, data, sizeof(tail)));
+  tt_mem_op(data, OP_EQ, tail, sizeof(tail));
+
+ done:
+  if (conn)
+    connection_free_minimal(conn);
+  connection_uring_free_all();
+  get_options_mutable()->UseIOUring = 0;
+  buf_free(got);
+  tor_free(data);
+  if (SOCKET_OK(s[0]))
+    tor_close_socket(s[0]);
+  if (SOCKET_OK(s[1]))
+    tor_close_socket(s[1]);
+}
+
+#define URING_TEST(name, flags) \
+  { #name, test_uring_ ## name, (flags), NULL, NULL }
+
+struct testcase_t uring_tests[] = {
+  URING_TEST(recv_sendmsg, 0),
+  URING_TEST(poll_cancel, 0),
+  URING_TEST(oom_during_send, TT_FORK),
+  END_OF_TESTCASES
+};
+
+#else /* !defined(BUF_SOCKET_IO_VECTORED) */
+
+struct testcase_t uring_tests[] = {
+  END_OF_TESTCASES
+};
+
+#endif /* defined(BUF_SOCKET_IO_VECTORED) */
@@ -21,6 +21,7 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
 #include "lib/memarea/memarea.h"
+#include "lib/memarea/mempool.h"
 #include "lib/process/waitpid.h"
 #include "test/log_test_helpers.h"
 #include "lib/compress/compress.h"
@@ -3859,6 +3860,95 @@ test_util_memarea(void *arg)
   tor_free(malloced_ptr);
 }
 
+static void
+test_util_mempool(void *arg)
+{
+  mp_pool_t *pool = mp_pool_new(100, 16);
+  mp_pool_stats_t stats;
+  smartlist_t *allocated = smartlist_new();
+  size_t chunk_size;
+  int i;
+  char *item;
+  (void)arg;
+
+  mp_pool_get_stats(pool, &stats);
+  tt_uint_op(stats.n_items, OP_EQ, 0);
+  tt_uint_op(stats.n_chunks, OP_EQ, 0);
+
+  /* Items are distinct, aligned, and zeroed on request. */
+  for (i = 0; i < 100; ++i) {
+    item = mp_pool_get_zero(pool);
+    tt_assert(tor_mem_is_zero(item, 100));
+    tt_uint_op(((uintptr_t)item) % sizeof(void*), OP_EQ, 0);
+    memset(item, i, 100);
+    smartlist_add(allocated, item);
+  }
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &stats);
+  tt_uint_op(stats.n_items, OP_EQ, 100);
+  tt_uint_op(stats.n_chunks, OP_EQ, 7);
+  tt_uint_op(stats.n_empty_chunks, OP_EQ, 0);
+  SMARTLIST_FOREACH(allocated, char *, cp, {
+    tt_int_op(cp[0], OP_EQ, (char)cp_sl_idx);
+    tt_int_op(cp[99], OP_EQ, (char)cp_sl_idx);
+  });
+
+  /* Released items are reused before new memory. */
+  item = smartlist_get(allocated, 50);
+  mp_pool_release(item);
+  tt_ptr_op(mp_pool_get(pool), OP_EQ, item);
+  mp_pool_assert_ok(pool);
+
+  /* Releasing everything keeps only a few empty chunks around, besides
+   * the last chunk in use... */
+  SMARTLIST_FOREACH(allocated, char *, cp, mp_pool_release(cp));
+  smartlist_clear(allocated);
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &stats);
+  tt_uint_op(stats.n_items, OP_EQ, 0);
+  tt_uint_op(stats.n_chunks, OP_EQ, MP_POOL_DEFAULT_EMPTY_CHUNKS + 1);
+  tt_uint_op(stats.n_empty_chunks, OP_EQ, MP_POOL_DEFAULT_EMPTY_CHUNKS + 1);
+  tt_uint_op(stats.bytes_unused, OP_GE, stats.n_chunks*16*100);
+  tt_uint_op(stats.bytes_unused, OP_LT, stats.bytes_allocated);
+  chunk_size = stats.bytes_allocated / stats.n_chunks;
+
+  /* ... which are reused ... */
+  item = mp_pool_get(pool);
+  mp_pool_get_stats(pool, &stats);
+  tt_uint_op(stats.n_chunks, OP_EQ, MP_POOL_DEFAULT_EMPTY_CHUNKS + 1);
+  tt_uint_op(stats.n_empty_chunks, OP_EQ, MP_POOL_DEFAULT_EMPTY_CHUNKS);
+  mp_pool_release(item);
+
+  /* ... and can be given back. */
+  tt_uint_op(mp_pool_clean(pool, 1), OP_EQ,
+             MP_POOL_DEFAULT_EMPTY_CHUNKS * chunk_size);
+  mp_pool_assert_ok(pool);
+  tt_uint_op(mp_pool_clean(pool, 0), OP_EQ, chunk_size);
+  tt_uint_op(mp_pool_clean(pool, 0), OP_EQ, 0);
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &stats);
+  tt_uint_op(stats.n_chunks, OP_EQ, 0);
+  tt_uint_op(stats.bytes_allocated, OP_EQ, 0);
+
+  /* Random allocation patterns keep the pool consistent. */
+  for (i = 0; i < 2000; ++i) {
+    if (smartlist_len(allocated) && crypto_rand_int(3) == 0) {
+      int idx = crypto_rand_int(smartlist_len(allocated));
+      mp_pool_release(smartlist_get(allocated, idx));
+      smartlist_del(allocated, idx);
+    } else {
+      smartlist_add(allocated, mp_pool_get(pool));
+    }
+  }
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &stats);
+  tt_uint_op(stats.n_items, OP_EQ, smartlist_len(allocated));
+
+ done:
+  smartlist_free(allocated);
+  mp_pool_destroy(pool);
+}
+
 /** Run unit tests for utility functions to get file names relative to
  * the data directory. */
 static void
@@ -6469,6 +6559,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(gzip_compression_bomb, TT_FORK),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
+  UTIL_TEST(mempool, 0),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_TEST(sscanf, TT_FORK),